@@ -1,9 +1,31 @@
 #include "apcache.h"
 
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log/log.h"
+#include "metrics/metrics.h"
+
+// Size of the APAV_THUMBS_POS frame ending a file with thumbnails.
+#define THUMBS_POS_SIZE (1 + sizeof(uint32_t) + sizeof(uint64_t))
+
+// Write to the buffered writer when there is one, to file otherwise.
+static int apc_write(APCache *apc, const void *data, size_t size) {
+    if (apc->writer) {
+        return apcache_writer_write(apc->writer, data, size) == 0
+                   ? 0
+                   : APCACHE_ERR_IOERROR;
+    }
+    return size == 0 || fwrite(data, size, 1, apc->file) == 1
+               ? 0
+               : APCACHE_ERR_IOERROR;
+}
 
 /// @brief Allocate an apcache frame object.
 /// @param type APAVType
@@ -22,6 +44,7 @@ APFrame *apcache_frame_alloc(APAVType type, unsigned int bsize) {
     frame->type = type;
     frame->bsize = bsize;
     frame->data = data;
+    frame->borrowed = 0;
     return frame;
 }
 
@@ -32,7 +55,7 @@ void apcache_frame_free(APFrame **frame) {
     if (!frame || !(*frame)) {
         return;
     }
-    free((**frame).data);
+    if (!(**frame).borrowed) free((**frame).data);
     free(*frame);
     *frame = NULL;
 }
@@ -49,7 +72,36 @@ APCache *apcache_alloc() {
     apc->width = 0;
     apc->height = 0;
     apc->sample_rate = 0;
+    apc->flags = 0;
+    apc->levels = 1;
+    apc->level = 0;
     apc->file = NULL;
+    apc->writer = NULL;
+    apc->stream = NULL;
+    apc->map = NULL;
+    apc->map_size = 0;
+    apc->map_pos = 0;
+    apc->map_path = NULL;
+    apc->shm = NULL;
+    apc->frame_idx = 0;
+    apc->chunk = NULL;
+    apc->chunk_size = 0;
+    apc->chunk_cap = 0;
+    apc->chunk_ticks = 0;
+    apc->pool = NULL;
+    apc->body = NULL;
+    apc->body_size = 0;
+    apc->body_pos = 0;
+    apc->chunks_eof = 0;
+    for (int i = 0; i < APCACHE_LEVELS_MAX; i++) {
+        apc->level_chunk[i] = NULL;
+        apc->level_chunk_size[i] = 0;
+        apc->level_chunk_cap[i] = 0;
+        apc->level_frame[i] = NULL;
+    }
+    apc->audio_body = NULL;
+    apc->audio_size = 0;
+    apc->audio_pos = 0;
     return apc;
 }
 
@@ -66,21 +118,229 @@ void apcache_free(APCache **apc) {
 
 /// @brief Write meta data to apcache file
 /// @param apc APCache struct with fps, width, height, sample_rate set to target
-/// number,
+/// number, levels too with APCACHE_FLAG_LEVELS in flags,
 ///            file pointed to a opened FILE with mode set to "w",
-///            version set to target version (1).
+///            version set to target version (APCACHE_VERSION).
 /// @return 0 for success, minus number for APCacheErr
 int apcache_create(APCache *apc) {
     if (!apc) return APCACHE_ERR_APCACHE_NULL;
-    if (!apc->file) return APCACHE_ERR_FILE_NOT_EXIST;
+    if (!apc->file && !apc->writer) return APCACHE_ERR_FILE_NOT_EXIST;
     if (apc->version != APCACHE_VERSION) return APCACHE_ERR_UNKNOWN_VERSION;
-    fputs("apcache\n", apc->file);
-    fwrite(&apc->version, sizeof(int32_t), 1, apc->file);
-    fwrite(&apc->fps, sizeof(uint32_t), 1, apc->file);
-    fwrite(&apc->width, sizeof(uint32_t), 1, apc->file);
-    fwrite(&apc->height, sizeof(uint32_t), 1, apc->file);
-    fwrite(&apc->sample_rate, sizeof(uint32_t), 1, apc->file);
-    fflush(apc->file);
+    int levels = (apc->flags & APCACHE_FLAG_LEVELS) != 0;
+    if (levels &&
+        (!(apc->flags & APCACHE_FLAG_CHUNKED) || apc->levels < 2 ||
+         apc->levels > APCACHE_LEVELS_MAX))
+        return APCACHE_ERR_UNKNOWN_FORMAT;
+    uint8_t header[8 + sizeof(int32_t) + 6 * sizeof(uint32_t)];
+    uint8_t *p = header;
+    memcpy(p, "apcache\n", 8);
+    p += 8;
+    memcpy(p, &apc->version, sizeof(int32_t));
+    p += sizeof(int32_t);
+    memcpy(p, &apc->fps, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &apc->width, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &apc->height, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &apc->sample_rate, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &apc->flags, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    if (levels) {
+        memcpy(p, &apc->levels, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+    }
+    return apc_write(apc, header, p - header);
+}
+
+/// @brief Create an apcache file through a buffered writer and write meta
+///        data to it. Frames are written by a background thread, the file
+///        only appears at path once apcache_close succeeds.
+/// @param apc APCache struct with fps, width, height, sample_rate set to target
+/// number, file and writer set to NULL.
+/// @param path Path of the apcache file.
+/// @param flags Bitwise or of APCacheWriterFlag.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_create_file(APCache *apc, const char *path, int flags) {
+    if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    if (!path) return APCACHE_ERR_FILE_NOT_EXIST;
+    apc->writer = apcache_writer_open(path, flags);
+    if (!apc->writer) return APCACHE_ERR_PERMISSION_DENIED;
+    int err = apcache_create(apc);
+    if (err != 0) {
+        apcache_abort(apc);
+    }
+    return err;
+}
+
+// Write a TYPE/SIZE/DATA frame into the file.
+static int write_record(APCache *apc, uint8_t type, const void *data,
+                        uint32_t bsize) {
+    uint8_t head[sizeof(uint8_t) + sizeof(uint32_t)];
+    head[0] = type;
+    memcpy(head + 1, &bsize, sizeof(uint32_t));
+    int err = apc_write(apc, head, sizeof(head));
+    if (err != 0) return err;
+    return apc_write(apc, data, bsize);
+}
+
+// Encode frames gathered in a buffer into a frame of type, whose data is
+// prefix followed by the chunk.
+static int write_chunk(APCache *apc, uint8_t type, const uint8_t *prefix,
+                       uint32_t prefix_size, const uint8_t *frames,
+                       size_t frames_size) {
+    uint8_t *chunk;
+    size_t size;
+    int codec = apc->flags & APCACHE_FLAG_ZLIB ? APCACHE_CHUNK_ZLIB
+                                               : APCACHE_CHUNK_RAW;
+    if (apcache_chunk_encode(frames, frames_size, apc->chunk_ticks, codec,
+                             &chunk, &size) != 0)
+        return APCACHE_ERR_IOERROR;
+    uint8_t head[sizeof(uint8_t) + sizeof(uint32_t)];
+    uint32_t bsize = prefix_size + size;
+    head[0] = type;
+    memcpy(head + 1, &bsize, sizeof(uint32_t));
+    int err = apc_write(apc, head, sizeof(head));
+    if (err == 0 && prefix_size) err = apc_write(apc, prefix, prefix_size);
+    if (err == 0) err = apc_write(apc, chunk, size);
+    free(chunk);
+    return err;
+}
+
+// Number of levels with a chunk being written, 0 without levels.
+static uint32_t chunk_levels(const APCache *apc) {
+    return apc->flags & APCACHE_FLAG_LEVELS ? apc->levels : 0;
+}
+
+// Size of the frames gathered so far, at every level.
+static size_t chunk_pending(const APCache *apc) {
+    size_t size = apc->chunk_size;
+    for (uint32_t i = 0; i < chunk_levels(apc); i++) {
+        size += apc->level_chunk_size[i];
+    }
+    return size;
+}
+
+// Encode the frames gathered so far into an APAV_CHUNK frame, followed by an
+// APAV_LEVEL_CHUNK frame per level for a file with levels.
+static int flush_chunk(APCache *apc) {
+    if (chunk_pending(apc) == 0) return 0;
+    int err = 0;
+    if (apc->chunk_size) {
+        err = write_chunk(apc, APAV_CHUNK, NULL, 0, apc->chunk,
+                          apc->chunk_size);
+    }
+    for (uint32_t i = 0; i < chunk_levels(apc) && err == 0; i++) {
+        uint8_t level = i;
+        err = write_chunk(apc, APAV_LEVEL_CHUNK, &level, sizeof(level),
+                          apc->level_chunk[i], apc->level_chunk_size[i]);
+    }
+    apc->chunk_size = 0;
+    for (uint32_t i = 0; i < chunk_levels(apc); i++) {
+        apc->level_chunk_size[i] = 0;
+    }
+    apc->chunk_ticks = 0;
+    return err;
+}
+
+// Free the buffers of the chunk being written.
+static void free_chunk(APCache *apc) {
+    free(apc->chunk);
+    apc->chunk = NULL;
+    apc->chunk_size = apc->chunk_cap = 0;
+    for (int i = 0; i < APCACHE_LEVELS_MAX; i++) {
+        free(apc->level_chunk[i]);
+        apc->level_chunk[i] = NULL;
+        apc->level_chunk_size[i] = apc->level_chunk_cap[i] = 0;
+        free(apc->level_frame[i]);
+        apc->level_frame[i] = NULL;
+    }
+}
+
+// Whether the chunk being written is complete.
+static int chunk_full(const APCache *apc) {
+    uint32_t ticks = (apc->fps ? apc->fps : 30) * APCACHE_CHUNK_SECONDS;
+    return apc->chunk_ticks >= ticks ||
+           chunk_pending(apc) >= APCACHE_CHUNK_MAX_SIZE;
+}
+
+// Append a TYPE/SIZE/DATA frame to a chunk buffer.
+static int buf_append(uint8_t **buf, size_t *size, size_t *cap, uint8_t type,
+                      const void *data, uint32_t bsize) {
+    size_t need = *size + 5 + (size_t)bsize;
+    if (need > *cap) {
+        size_t c = *cap ? *cap : 64 * 1024;
+        while (c < need) c *= 2;
+        uint8_t *b = realloc(*buf, c);
+        if (!b) return APCACHE_ERR_IOERROR;
+        *buf = b;
+        *cap = c;
+    }
+    uint8_t *p = *buf + *size;
+    p[0] = type;
+    memcpy(p + 1, &bsize, sizeof(uint32_t));
+    if (bsize) memcpy(p + 5, data, bsize);
+    *size = need;
+    return 0;
+}
+
+// Add a frame to the chunks of a file with levels: audio to the audio chunk
+// with an empty audio frame in its place at every level, video derived level
+// by level from the one above.
+static int append_levels(APCache *apc, const APFrame *frame) {
+    int err;
+    const void *data = frame->data;
+    uint32_t bsize = frame->bsize;
+    uint32_t w = apc->width, h = apc->height;
+    if (frame->type == APAV_AUDIO) {
+        err = buf_append(&apc->chunk, &apc->chunk_size, &apc->chunk_cap,
+                         APAV_AUDIO, data, bsize);
+        if (err != 0) return err;
+        bsize = 0;
+    } else if (frame->type == APAV_VIDEO && bsize != (uint64_t)w * h) {
+        return APCACHE_ERR_UNKNOWN_FORMAT;
+    }
+    for (uint32_t i = 0; i < apc->levels; i++) {
+        if (i > 0 && frame->type == APAV_VIDEO) {
+            uint32_t lw = (w + 1) / 2, lh = (h + 1) / 2;
+            if (!apc->level_frame[i]) {
+                apc->level_frame[i] = malloc((size_t)lw * lh);
+                if (!apc->level_frame[i]) return APCACHE_ERR_IOERROR;
+            }
+            apcache_level_reduce(data, w, h, apc->level_frame[i]);
+            data = apc->level_frame[i];
+            w = lw;
+            h = lh;
+            bsize = lw * lh;
+        }
+        err = buf_append(&apc->level_chunk[i], &apc->level_chunk_size[i],
+                         &apc->level_chunk_cap[i], frame->type, data, bsize);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+// Add a frame to the chunk being written. A chunk holding
+// APCACHE_CHUNK_SECONDS of video is written before the next video frame, so
+// every chunk starts with a picture.
+static int append_chunk(APCache *apc, const APFrame *frame) {
+    if (frame->type == APAV_VIDEO && chunk_full(apc)) {
+        int err = flush_chunk(apc);
+        if (err != 0) return err;
+    }
+    int err = apc->flags & APCACHE_FLAG_LEVELS
+                  ? append_levels(apc, frame)
+                  : buf_append(&apc->chunk, &apc->chunk_size, &apc->chunk_cap,
+                               frame->type, frame->data, frame->bsize);
+    if (err != 0) return err;
+    if (frame->type == APAV_VIDEO) {
+        apc->chunk_ticks++;
+    } else if (frame->type == APAV_REPEAT && frame->bsize >= 4) {
+        uint32_t ticks;
+        memcpy(&ticks, frame->data, sizeof(uint32_t));
+        apc->chunk_ticks += ticks;
+    }
     return 0;
 }
 
@@ -90,16 +350,52 @@ int apcache_create(APCache *apc) {
 /// @return 0 for success, minus number for APCacheErr
 int apcache_write_frame(APCache *apc, APFrame *frame) {
     if (!apc) return APCACHE_ERR_APCACHE_NULL;
-    if (!apc->file) return APCACHE_ERR_FILE_NOT_EXIST;
+    if (!apc->file && !apc->writer) return APCACHE_ERR_FILE_NOT_EXIST;
     if (apc->version != APCACHE_VERSION) return APCACHE_ERR_UNKNOWN_VERSION;
     if (!frame) return APCACHE_ERR_FRAME_NOT_EXIST;
-    if (frame->type != APAV_AUDIO && frame->type != APAV_VIDEO)
+    if (frame->type < APAV_AUDIO || frame->type > APAV_REPEAT)
         return APCACHE_ERR_UNKNOWN_FORMAT;
-    uint8_t type = frame->type;
-    fwrite(&type, sizeof(uint8_t), 1, apc->file);
-    fwrite(&frame->bsize, sizeof(uint32_t), 1, apc->file);
-    fwrite(frame->data, frame->bsize, 1, apc->file);
-    fflush(apc->file);
+    if (apc->flags & APCACHE_FLAG_CHUNKED) return append_chunk(apc, frame);
+    return write_record(apc, frame->type, frame->data, frame->bsize);
+}
+
+/// @brief Write the thumbnail track, after every other frame.
+/// @param apc APCache created with APCACHE_FLAG_THUMBS in flags.
+/// @param track Track built by APCacheThumbs.
+/// @param size Size of track (in bytes).
+/// @return 0 for success, minus number for APCacheErr
+int apcache_write_thumbs(APCache *apc, const void *track, size_t size) {
+    if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    if (!(apc->flags & APCACHE_FLAG_THUMBS)) return APCACHE_ERR_NO_THUMBS;
+    if (size > UINT32_MAX) return APCACHE_ERR_UNKNOWN_FORMAT;
+    if (!apc->file && !apc->writer) return APCACHE_ERR_FILE_NOT_EXIST;
+    // The track stays out of chunks, after the last one
+    int err = flush_chunk(apc);
+    if (err != 0) return err;
+    uint64_t offset;
+    if ((err = apcache_tell(apc, &offset)) != 0) return err;
+    if ((err = write_record(apc, APAV_THUMBS, track, size)) != 0) return err;
+    return write_record(apc, APAV_THUMBS_POS, &offset, sizeof(uint64_t));
+}
+
+/// @brief Number of bytes written so far, the offset of the next frame
+///        (of the chunk holding it for a chunked file, a complete chunk is
+///        written first, as the next video frame would).
+/// @param apc APCache being written.
+/// @param offset Set to the offset (in bytes).
+/// @return 0 for success, minus number for APCacheErr of the chunk written
+int apcache_tell(APCache *apc, uint64_t *offset) {
+    *offset = 0;
+    if (chunk_pending(apc) && chunk_full(apc)) {
+        int err = flush_chunk(apc);
+        if (err != 0) return err;
+    }
+    if (apc->writer) {
+        *offset = apcache_writer_tell(apc->writer);
+        return 0;
+    }
+    off_t pos = apc->file ? ftello(apc->file) : -1;
+    if (pos > 0) *offset = pos;
     return 0;
 }
 
@@ -107,7 +403,7 @@ int apcache_write_frame(APCache *apc, APFrame *frame) {
 ///        1. Check whether file exists
 ///        2. Check whether have permission to read
 ///        3. Check whether file content starts with "apcache\n"
-///        4. Check if version number is valid (Only 1 is valid currently)
+///        4. Check if version number is valid (1 to APCACHE_VERSION)
 /// @param filename path to apcache file
 /// @return 0 for success, minus number for APCacheErr
 int is_apcache(char *filename) {
@@ -115,80 +411,399 @@ int is_apcache(char *filename) {
     FILE *fp;
     fp = fopen(filename, "r");
     if (!fp) return APCACHE_ERR_PERMISSION_DENIED;
-    char buf[8 + 1];
-    if (!fgets(buf, 8 + 1, fp)) {
-        return APCACHE_ERR_EOF;
-    }
-    if (strcmp(buf, "apcache\n") != 0) return APCACHE_ERR_UNKNOWN_FORMAT;
+    char magic[8];
     int32_t version;
-    if (fread(&version, sizeof(int32_t), 1, fp) == 0) {
-        return APCACHE_ERR_EOF;
+    int err = 0;
+    if (fread(magic, sizeof(magic), 1, fp) != 1) {
+        err = APCACHE_ERR_EOF;
+    } else if (memcmp(magic, "apcache\n", sizeof(magic)) != 0) {
+        err = APCACHE_ERR_UNKNOWN_FORMAT;
+    } else if (fread(&version, sizeof(int32_t), 1, fp) != 1) {
+        err = APCACHE_ERR_EOF;
+    } else if (version < APCACHE_VERSION_MIN || version > APCACHE_VERSION) {
+        err = APCACHE_ERR_UNKNOWN_VERSION;
     }
-    if (version != APCACHE_VERSION) return APCACHE_ERR_UNKNOWN_VERSION;
     fclose(fp);
+    return err;
+}
+
+/// @brief Whether a path has to be read as a stream: "-" for stdin, a FIFO,
+///        a character device or a socket.
+/// @param filename path to check
+/// @return 1 for stream, 0 otherwise
+int apcache_is_stream_path(const char *filename) {
+    if (!filename) return 0;
+    if (strcmp(filename, "-") == 0) return 1;
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    return S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) ||
+           S_ISSOCK(st.st_mode);
+}
+
+// Read exactly size bytes from the mapped file, opened file or stream.
+static int apc_read(APCache *apc, void *data, size_t size) {
+    if (apc->map) {
+        if (size > apc->map_size - apc->map_pos) return APCACHE_ERR_EOF;
+        memcpy(data, apc->map + apc->map_pos, size);
+        apc->map_pos += size;
+        return 0;
+    }
+    if (apc->stream) {
+        ssize_t n = apcache_stream_read(apc->stream, data, size);
+        if (n < 0) return APCACHE_ERR_IOERROR;
+        return (size_t)n == size ? 0 : APCACHE_ERR_EOF;
+    }
+    return size == 0 || fread(data, size, 1, apc->file) == 1 ? 0
+                                                             : APCACHE_ERR_EOF;
+}
+
+// Sniff the magic string and read meta data.
+static int read_header(APCache *apc) {
+    char magic[8];
+    int err;
+    if ((err = apc_read(apc, magic, sizeof(magic))) != 0) return err;
+    if (memcmp(magic, "apcache\n", sizeof(magic)) != 0)
+        return APCACHE_ERR_UNKNOWN_FORMAT;
+    if ((err = apc_read(apc, &apc->version, sizeof(int32_t))) != 0) return err;
+    if (apc->version < APCACHE_VERSION_MIN || apc->version > APCACHE_VERSION)
+        return APCACHE_ERR_UNKNOWN_VERSION;
+    if ((err = apc_read(apc, &apc->fps, sizeof(uint32_t))) != 0) return err;
+    if ((err = apc_read(apc, &apc->width, sizeof(uint32_t))) != 0) return err;
+    if ((err = apc_read(apc, &apc->height, sizeof(uint32_t))) != 0) return err;
+    if ((err = apc_read(apc, &apc->sample_rate, sizeof(uint32_t))) != 0)
+        return err;
+    apc->flags = 0;
+    apc->levels = 1;
+    if (apc->version < 3) return 0;
+    if ((err = apc_read(apc, &apc->flags, sizeof(uint32_t))) != 0) return err;
+    if (apc->version < 5 || !(apc->flags & APCACHE_FLAG_LEVELS)) return 0;
+    if ((err = apc_read(apc, &apc->levels, sizeof(uint32_t))) != 0) return err;
+    if (!(apc->flags & APCACHE_FLAG_CHUNKED) || apc->levels < 2 ||
+        apc->levels > APCACHE_LEVELS_MAX)
+        return APCACHE_ERR_UNKNOWN_FORMAT;
+    return 0;
+}
+
+// Map a regular file read-only, shared with every process mapping it.
+static int map_file(APCache *apc, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &apc->map_stat) != 0 || !S_ISREG(apc->map_stat.st_mode) ||
+        apc->map_stat.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *map =
+        mmap(NULL, apc->map_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    apc->map_path = strdup(filename);
+    if (!apc->map_path) {
+        munmap(map, apc->map_stat.st_size);
+        return -1;
+    }
+    madvise(map, apc->map_stat.st_size, MADV_SEQUENTIAL);
+    apc->map = map;
+    apc->map_size = apc->map_stat.st_size;
+    apc->map_pos = 0;
+    return 0;
+}
+
+// Attach to the shared frame index of a mapped file, once.
+static int attach_index(APCache *apc) {
+    if (!apc->shm) {
+        apc->shm = apcache_shm_attach(apc->map_path, &apc->map_stat, apc->map,
+                                      apc->map_size, apc->map_pos);
+        if (!apc->shm) return APCACHE_ERR_IOERROR;
+    }
+    return 0;
+}
+
+// Borrow the next frame of a mapped file through the shared frame index.
+static int read_mapped_frame(APCache *apc, APFrame **frame) {
+    int err = attach_index(apc);
+    if (err != 0) return err;
+    if (apc->frame_idx >= apcache_shm_frame_num(apc->shm)) {
+        return APCACHE_ERR_EOF;
+    }
+    uint64_t off = apcache_shm_offsets(apc->shm)[apc->frame_idx++];
+    APFrame *f = (APFrame *)malloc(sizeof(APFrame));
+    if (!f) return APCACHE_ERR_FRAME_NOT_EXIST;
+    f->type = apc->map[off];
+    memcpy(&f->bsize, apc->map + off + 1, sizeof(uint32_t));
+    f->data = (void *)(apc->map + off + 5);
+    f->borrowed = 1;
+    *frame = f;
+    return 0;
+}
+
+/// @brief Start reading a stream path ahead (see apcache_is_stream_path).
+/// @param filename "-" for stdin, or the path of a FIFO or device
+/// @return The pointer to allocated stream, NULL for error
+APCacheStream *apcache_stream_open_path(const char *filename) {
+    int fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO)
+                                        : open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    APCacheStream *s = apcache_stream_open(fd, APCACHE_STREAM_BUF_SIZE);
+    if (!s) close(fd);
+    return s;
+}
+
+/// @brief Whether a stream starts with the "apcache\n" magic string, without
+///        consuming it.
+/// @param s Stream being read ahead
+/// @return 1 for an apcache stream, 0 otherwise, minus number for
+///         APCacheErr
+int apcache_stream_sniff(APCacheStream *s) {
+    char magic[8];
+    ssize_t n = apcache_stream_peek(s, magic, sizeof(magic));
+    if (n < 0) return APCACHE_ERR_IOERROR;
+    return n == sizeof(magic) && memcmp(magic, "apcache\n", sizeof(magic)) == 0;
+}
+
+/// @brief Open an apcache file from a stream being read ahead.
+/// @param s Stream, owned by the APCache from now on (closed on error)
+/// @return 0 for success, minus number for APCacheErr
+int apcache_open_stream(APCacheStream *s, APCache **apcadd) {
+    *apcadd = NULL;
+    APCache *apc = apcache_alloc();
+    if (!apc) {
+        apcache_stream_close(s);
+        return APCACHE_ERR_APCACHE_NULL;
+    }
+    apc->stream = s;
+    int err = read_header(apc);
+    if (err != 0) {
+        apcache_close(apc);
+        apcache_free(&apc);
+        return err;
+    }
+    *apcadd = apc;
     return 0;
 }
 
 /// @brief Open an apcache file in read mode.
-/// @param filename path to apcache file
+///        Regular files are memory mapped and share one frame index with
+///        other processes playing the same file (see apcache_shm.h).
+///        "-", FIFOs and other non-seekable paths are read through a bounded
+///        read-ahead buffer (see apcache_stream.h).
+/// @param filename path to apcache file, "-" for stdin
 /// @return 0 for success, minus number for APCacheErr
 int apcache_open(char *filename, APCache **apcadd) {
     *apcadd = NULL;
     if (!filename) return APCACHE_ERR_FILE_NOT_EXIST;
-    FILE *fp;
-    fp = fopen(filename, "r");
-    if (!fp) return APCACHE_ERR_PERMISSION_DENIED;
+    if (apcache_is_stream_path(filename)) {
+        APCacheStream *s = apcache_stream_open_path(filename);
+        if (!s) return APCACHE_ERR_PERMISSION_DENIED;
+        return apcache_open_stream(s, apcadd);
+    }
     APCache *apc;
     apc = apcache_alloc();
     if (!apc) return APCACHE_ERR_APCACHE_NULL;
-    apc->file = fp;
-    char buf[8 + 1];
-    if (!fgets(buf, 8 + 1, fp)) {
-        fclose(fp);
-        apcache_free(&apc);
-        return APCACHE_ERR_EOF;
+    if (map_file(apc, filename) != 0) {
+        // Fall back to stdio when the file cannot be mapped
+        apc->file = fopen(filename, "r");
+        if (!apc->file) {
+            apcache_free(&apc);
+            return APCACHE_ERR_PERMISSION_DENIED;
+        }
     }
-    if (strcmp(buf, "apcache\n") != 0) {
-        fclose(fp);
+    int err = read_header(apc);
+    if (err != 0) {
+        apcache_close(apc);
         apcache_free(&apc);
-        return APCACHE_ERR_UNKNOWN_FORMAT;
+        return err;
     }
-    int32_t version;
-    if (fread(&version, sizeof(int32_t), 1, fp) == 0) {
-        fclose(fp);
-        apcache_free(&apc);
-        return APCACHE_ERR_EOF;
+    // Only the chunks of one level are read, each faulted in by fill_pool,
+    // so reading ahead through the other levels would be wasted
+    if (apc->map && apc->flags & APCACHE_FLAG_LEVELS) {
+        madvise((void *)apc->map, apc->map_size, MADV_RANDOM);
     }
-    if (version != APCACHE_VERSION) {
-        fclose(fp);
-        apcache_free(&apc);
-        return APCACHE_ERR_UNKNOWN_VERSION;
+    *apcadd = apc;
+    return 0;
+}
+
+/// @brief Pick the resolution level video frames are read at, for a screen.
+/// @param apc Opened APCache.
+/// @param width Width of the screen.
+/// @param height Height of the screen.
+/// @return Level picked.
+int apcache_select_level(APCache *apc, uint32_t width, uint32_t height) {
+    if (!apc || !(apc->flags & APCACHE_FLAG_LEVELS)) return 0;
+    uint32_t w = apc->width, h = apc->height;
+    if (apc->level > 0) {
+        // Picked already, width and height are the level's
+        return apc->level;
     }
-    apc->version = version;
-    if (fread(&apc->fps, sizeof(uint32_t), 1, fp) == 0) {
-        fclose(fp);
-        apcache_free(&apc);
+    apc->level = apcache_level_pick(w, h, apc->levels, width, height);
+    apcache_level_size(w, h, apc->level, &apc->width, &apc->height);
+    return apc->level;
+}
+
+// Read the next TYPE/SIZE/DATA frame of the file.
+static int read_record(APCache *apc, APFrame **frame) {
+    if (apc->map) return read_mapped_frame(apc, frame);
+    if (!apc->file && !apc->stream) return APCACHE_ERR_FILE_NOT_EXIST;
+    uint8_t type;
+    uint32_t bsize;
+    if (apc_read(apc, &type, sizeof(uint8_t)) != 0) {
         return APCACHE_ERR_EOF;
     }
-    if (fread(&apc->width, sizeof(uint32_t), 1, fp) == 0) {
-        fclose(fp);
-        apcache_free(&apc);
+    if (apc_read(apc, &bsize, sizeof(uint32_t)) != 0) {
         return APCACHE_ERR_EOF;
     }
-    if (fread(&apc->height, sizeof(uint32_t), 1, fp) == 0) {
-        fclose(fp);
-        apcache_free(&apc);
-        return APCACHE_ERR_EOF;
+    APFrame *f = apcache_frame_alloc(type, bsize);
+    if (!f) {
+        return APCACHE_ERR_FRAME_NOT_EXIST;
     }
-    if (fread(&apc->sample_rate, sizeof(uint32_t), 1, fp) == 0) {
-        fclose(fp);
-        apcache_free(&apc);
+    if (apc_read(apc, f->data, bsize) != 0) {
+        apcache_frame_free(&f);
         return APCACHE_ERR_EOF;
     }
-    *apcadd = apc;
+    *frame = f;
     return 0;
 }
 
+// Tags of the chunks submitted to the decoding pool
+enum { CHUNK_FRAMES, CHUNK_AUDIO };
+
+// Fault in the pages of a chunk borrowed from the mapped file at once.
+static void prefetch_chunk(const APCache *apc, const APFrame *raw) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t offset = (const uint8_t *)raw->data - apc->map;
+    size_t start = offset / page * page;
+    madvise((void *)(apc->map + start), offset + raw->bsize - start,
+            MADV_WILLNEED);
+}
+
+// Submit chunks to the decoding pool until APCACHE_CHUNK_AHEAD are pending.
+// For a file with levels, those are the audio chunks and the chunks of the
+// level picked, the other levels are skipped.
+static int fill_pool(APCache *apc) {
+    if (!apc->pool) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int workers = cpus < 1 ? 1 : (int)cpus;
+        if (workers > APCACHE_CHUNK_WORKERS_MAX)
+            workers = APCACHE_CHUNK_WORKERS_MAX;
+        apc->pool = apcache_chunk_pool_alloc(workers, APCACHE_CHUNK_AHEAD);
+        if (!apc->pool) return APCACHE_ERR_IOERROR;
+    }
+    while (!apc->chunks_eof &&
+           apcache_chunk_pool_pending(apc->pool) < APCACHE_CHUNK_AHEAD) {
+        APFrame *raw = NULL;
+        int err = read_record(apc, &raw);
+        if (err == APCACHE_ERR_EOF) {
+            apc->chunks_eof = 1;
+            break;
+        }
+        if (err != 0) return err;
+        int levels = (apc->flags & APCACHE_FLAG_LEVELS) != 0;
+        size_t skip = 0;
+        int tag = CHUNK_FRAMES;
+        if (raw->type == APAV_CHUNK) {
+            if (levels) tag = CHUNK_AUDIO;
+        } else if (raw->type == APAV_LEVEL_CHUNK && levels &&
+                   raw->bsize > 0 &&
+                   ((const uint8_t *)raw->data)[0] == apc->level) {
+            skip = 1;
+        } else {
+            // The thumbnail track and its position are not chunked
+            apcache_frame_free(&raw);
+            continue;
+        }
+        if (levels && raw->borrowed) prefetch_chunk(apc, raw);
+        apcache_chunk_pool_submit(apc->pool, (uint8_t *)raw->data + skip,
+                                  raw->bsize - skip,
+                                  raw->borrowed ? NULL : raw->data, tag);
+        raw->data = NULL;
+        apcache_frame_free(&raw);
+    }
+    return 0;
+}
+
+// Take the next TYPE/SIZE/DATA frame of decoded chunk frames, NULL at its
+// end.
+static const uint8_t *next_in_body(const uint8_t *body, size_t size,
+                                   size_t *pos, uint32_t *bsize) {
+    if (size - *pos < 5) return NULL;
+    const uint8_t *p = body + *pos;
+    memcpy(bsize, p + 1, sizeof(uint32_t));
+    if (*bsize > size - *pos - 5) {
+        lwarn("Truncated frame in apcache chunk, skipping its rest");
+        *pos = size;
+        return NULL;
+    }
+    *pos += 5 + (size_t)*bsize;
+    return p;
+}
+
+// Copy the next frame out of the decoded chunks. In a file with levels, an
+// empty audio frame takes the next frame of the last audio chunk.
+static int read_chunked_frame(APCache *apc, APFrame **frame) {
+    while (1) {
+        uint32_t bsize;
+        const uint8_t *p;
+        while ((p = next_in_body(apc->body, apc->body_size, &apc->body_pos,
+                                 &bsize))) {
+            if (p[0] == APAV_AUDIO && bsize == 0 &&
+                apc->flags & APCACHE_FLAG_LEVELS) {
+                // Skipped along with a corrupt audio chunk
+                p = next_in_body(apc->audio_body, apc->audio_size,
+                                 &apc->audio_pos, &bsize);
+                if (!p) continue;
+            }
+            APFrame *f = apcache_frame_alloc(p[0], bsize);
+            if (!f) return APCACHE_ERR_FRAME_NOT_EXIST;
+            memcpy(f->data, p + 5, bsize);
+            *frame = f;
+            return 0;
+        }
+        free(apc->body);
+        apc->body = NULL;
+        apc->body_size = apc->body_pos = 0;
+
+        int err = fill_pool(apc);
+        if (err != 0) return err;
+        int tag;
+        err = apcache_chunk_pool_next(apc->pool, &apc->body, &apc->body_size,
+                                      &tag);
+        if (err < 0) return APCACHE_ERR_EOF;
+        if (tag == CHUNK_AUDIO) {
+            // Read through the empty audio frames of the level chunk after
+            free(apc->audio_body);
+            apc->audio_body = apc->body;
+            apc->audio_size = apc->body_size;
+            apc->audio_pos = 0;
+            apc->body = NULL;
+            apc->body_size = 0;
+        }
+        if (err > 0) {
+            // Playback goes on with the next chunk
+            lwarn("Corrupt apcache chunk skipped");
+            metrics_count(MC_CHUNKS_CORRUPT, 1);
+        }
+    }
+}
+
+// Forget decoded and pending chunks, before reading from elsewhere.
+static void drop_chunks(APCache *apc) {
+    if (apc->pool) apcache_chunk_pool_reset(apc->pool);
+    free(apc->body);
+    apc->body = NULL;
+    apc->body_size = apc->body_pos = 0;
+    free(apc->audio_body);
+    apc->audio_body = NULL;
+    apc->audio_size = apc->audio_pos = 0;
+    apc->chunks_eof = 0;
+}
+
+/// @brief Whether frames read from apc are borrowed from a mapped file.
+/// @param apc Opened APCache.
+/// @return 1 for borrowed, 0 for frames owning their data.
+int apcache_borrows_frames(const APCache *apc) {
+    return apc->map && !(apc->flags & APCACHE_FLAG_CHUNKED);
+}
+
 /// @brief Read a APFrame from APCache
 /// @param apc APCache
 /// @param frame The pointer to a pointer to APFrame
@@ -198,29 +813,192 @@ int apcache_read_frame(APCache *apc, APFrame **frame) {
         apcache_frame_free(frame);
     }
     if (!apc) return APCACHE_ERR_APCACHE_NULL;
-    if (!apc->file) return APCACHE_ERR_FILE_NOT_EXIST;
-    uint8_t type;
+    if (apc->flags & APCACHE_FLAG_CHUNKED) return read_chunked_frame(apc, frame);
+    return read_record(apc, frame);
+}
+
+// Locate the APAV_THUMBS frame from the APAV_THUMBS_POS frame (tail) that
+// ends a file of file_size bytes, and check its head.
+static int locate_thumbs(const uint8_t *tail, uint64_t file_size,
+                         uint64_t *offset) {
     uint32_t bsize;
-    if (fread(&type, sizeof(uint8_t), 1, apc->file) == 0) {
-        return APCACHE_ERR_EOF;
-    }
-    if (fread(&bsize, sizeof(uint32_t), 1, apc->file) == 0) {
-        return APCACHE_ERR_EOF;
-    }
-    APFrame *f = apcache_frame_alloc(type, bsize);
-    if (!f) {
-        return APCACHE_ERR_FRAME_NOT_EXIST;
-    }
-    if (fread(f->data, bsize, 1, apc->file) == 0) {
+    memcpy(&bsize, tail + 1, sizeof(uint32_t));
+    if (tail[0] != APAV_THUMBS_POS || bsize != sizeof(uint64_t))
+        return APCACHE_ERR_NO_THUMBS;
+    memcpy(offset, tail + 5, sizeof(uint64_t));
+    if (*offset > file_size - THUMBS_POS_SIZE - 5) return APCACHE_ERR_NO_THUMBS;
+    return 0;
+}
+
+static int check_thumbs_head(const uint8_t *head, uint64_t offset,
+                             uint64_t file_size, uint32_t *bsize) {
+    memcpy(bsize, head + 1, sizeof(uint32_t));
+    if (head[0] != APAV_THUMBS ||
+        *bsize != file_size - THUMBS_POS_SIZE - offset - 5)
+        return APCACHE_ERR_NO_THUMBS;
+    return 0;
+}
+
+static int read_mapped_thumbs(APCache *apc, APFrame **frame) {
+    uint64_t offset;
+    uint32_t bsize;
+    if (apc->map_size < apc->map_pos + THUMBS_POS_SIZE + 5)
+        return APCACHE_ERR_NO_THUMBS;
+    int err = locate_thumbs(apc->map + apc->map_size - THUMBS_POS_SIZE,
+                            apc->map_size, &offset);
+    if (err != 0) return err;
+    err = check_thumbs_head(apc->map + offset, offset, apc->map_size, &bsize);
+    if (err != 0) return err;
+    APFrame *f = (APFrame *)malloc(sizeof(APFrame));
+    if (!f) return APCACHE_ERR_FRAME_NOT_EXIST;
+    f->type = APAV_THUMBS;
+    f->bsize = bsize;
+    f->data = (void *)(apc->map + offset + 5);
+    f->borrowed = 1;
+    // Fault the whole track in at once instead of page by page
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start = (offset + 5) / page * page;
+    madvise((void *)(apc->map + start), offset + 5 + bsize - start,
+            MADV_WILLNEED);
+    *frame = f;
+    return 0;
+}
+
+// Read the thumbnail track ending a file of file_size bytes.
+static int read_file_track(FILE *file, uint64_t file_size, APFrame **frame) {
+    uint8_t tail[THUMBS_POS_SIZE], head[5];
+    uint64_t offset;
+    uint32_t bsize;
+    if (fseeko(file, file_size - THUMBS_POS_SIZE, SEEK_SET) != 0 ||
+        fread(tail, sizeof(tail), 1, file) != 1)
+        return APCACHE_ERR_IOERROR;
+    int err = locate_thumbs(tail, file_size, &offset);
+    if (err != 0) return err;
+    if (fseeko(file, offset, SEEK_SET) != 0 ||
+        fread(head, sizeof(head), 1, file) != 1)
+        return APCACHE_ERR_IOERROR;
+    if ((err = check_thumbs_head(head, offset, file_size, &bsize)) != 0)
+        return err;
+    APFrame *f = apcache_frame_alloc(APAV_THUMBS, bsize);
+    if (!f) return APCACHE_ERR_FRAME_NOT_EXIST;
+    if (bsize > 0 && fread(f->data, bsize, 1, file) != 1) {
         apcache_frame_free(&f);
-        return APCACHE_ERR_EOF;
+        return APCACHE_ERR_IOERROR;
     }
     *frame = f;
     return 0;
 }
 
+static int read_file_thumbs(APCache *apc, APFrame **frame) {
+    struct stat st;
+    off_t pos = ftello(apc->file);
+    if (pos < 0 || fstat(fileno(apc->file), &st) != 0)
+        return APCACHE_ERR_IOERROR;
+    if ((uint64_t)st.st_size < (uint64_t)pos + THUMBS_POS_SIZE + 5)
+        return APCACHE_ERR_NO_THUMBS;
+    int err = read_file_track(apc->file, st.st_size, frame);
+    // Frames keep being read from where they were
+    if (fseeko(apc->file, pos, SEEK_SET) != 0 && err == 0) {
+        apcache_frame_free(frame);
+        err = APCACHE_ERR_IOERROR;
+    }
+    return err;
+}
+
+/// @brief Read the thumbnail track of an opened file, with one read and
+///        without moving the read position. Borrowed from a mapped file.
+/// @param apc APCache opened from a regular file.
+/// @param frame The pointer to a pointer to APFrame, set to the APAV_THUMBS
+///              frame.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_read_thumbs(APCache *apc, APFrame **frame) {
+    if (*frame) {
+        apcache_frame_free(frame);
+    }
+    if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    if (!(apc->flags & APCACHE_FLAG_THUMBS)) return APCACHE_ERR_NO_THUMBS;
+    if (apc->map) return read_mapped_thumbs(apc, frame);
+    if (!apc->file) return APCACHE_ERR_NOT_SEEKABLE;
+    return read_file_thumbs(apc, frame);
+}
+
+/// @brief Continue reading frames from the frame at a file offset.
+/// @param apc APCache opened from a regular file.
+/// @param offset File offset of a frame, such as a thumbnail's.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_seek(APCache *apc, uint64_t offset) {
+    if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    drop_chunks(apc);
+    if (apc->map) {
+        int err = attach_index(apc);
+        if (err != 0) return err;
+        // Offsets are in file order
+        const uint64_t *offsets = apcache_shm_offsets(apc->shm);
+        uint64_t lo = 0, hi = apcache_shm_frame_num(apc->shm);
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (offsets[mid] < offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == apcache_shm_frame_num(apc->shm) || offsets[lo] != offset)
+            return APCACHE_ERR_FRAME_NOT_EXIST;
+        apc->frame_idx = lo;
+        return 0;
+    }
+    if (!apc->file) return APCACHE_ERR_NOT_SEEKABLE;
+    return fseeko(apc->file, offset, SEEK_SET) == 0 ? 0 : APCACHE_ERR_IOERROR;
+}
+
+/// @brief Close an apcache file.
+///        For a file created by apcache_create_file, flush and fsync it and
+///        rename it onto its final path.
+/// @param apc APCache
+/// @return 0 for success, minus number for APCacheErr
 int apcache_close(APCache *apc) {
     if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    // The last chunk written, then workers stopped before unmapping
+    int chunk_err = chunk_pending(apc) ? flush_chunk(apc) : 0;
+    free_chunk(apc);
+    drop_chunks(apc);
+    apcache_chunk_pool_free(apc->pool);
+    apc->pool = NULL;
+    if (apc->writer) {
+        int err = apcache_writer_close(apc->writer, chunk_err == 0);
+        apc->writer = NULL;
+        return err == 0 && chunk_err == 0 ? 0 : APCACHE_ERR_IOERROR;
+    }
+    if (apc->stream) {
+        apcache_stream_close(apc->stream);
+        apc->stream = NULL;
+        return 0;
+    }
+    if (apc->map) {
+        apcache_shm_detach(apc->shm);
+        apc->shm = NULL;
+        munmap((void *)apc->map, apc->map_size);
+        apc->map = NULL;
+        free(apc->map_path);
+        apc->map_path = NULL;
+        return 0;
+    }
+    if (!apc->file) return APCACHE_ERR_FILE_NOT_EXIST;
     fclose(apc->file);
+    apc->file = NULL;
+    return chunk_err;
+}
+
+/// @brief Close an apcache file created by apcache_create_file and discard
+///        it, leaving nothing at its final path.
+/// @param apc APCache
+/// @return 0 for success, minus number for APCacheErr
+int apcache_abort(APCache *apc) {
+    if (!apc) return APCACHE_ERR_APCACHE_NULL;
+    if (!apc->writer) return apcache_close(apc);
+    free_chunk(apc);
+    apcache_writer_close(apc->writer, 0);
+    apc->writer = NULL;
     return 0;
 }
\ No newline at end of file
@@ -3,8 +3,18 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
-#define APCACHE_VERSION 1
+#include "apcache_chunk.h"
+#include "apcache_levels.h"
+#include "apcache_shm.h"
+#include "apcache_stream.h"
+#include "apcache_thumbs.h"
+#include "apcache_writer.h"
+
+#define APCACHE_VERSION 5
+// Oldest version apcache_open still reads
+#define APCACHE_VERSION_MIN 1
 
 /*
 ||==================================================================================||
@@ -22,6 +32,10 @@
 ||-------------------------------|--------------------------|-----------------------||
 ||          SAMPLE_RATE          |           uint32         |            4          ||
 ||-------------------------------|--------------------------|-----------------------||
+||     FLAGS (since version 3)   |           uint32         |            4          ||
+||-------------------------------|--------------------------|-----------------------||
+||   LEVELS (APCACHE_FLAG_LEVELS)|           uint32         |            4          ||
+||-------------------------------|--------------------------|-----------------------||
 ||          FRAME[0]_TYPE        |           uint8          |            1          ||
 ||-------------------------------|--------------------------|-----------------------||
 ||          FRAME[0]_SIZE        |           uint32         |            4          ||
@@ -50,9 +64,54 @@
 ||-------------------------------|--------------------------|-----------------------||
 ||          FRAME[n]_DATA        |  unsigned char / float   |      FRAME[n]_SIZE    ||
 ||==================================================================================||
+
+FRAME_TYPE is an APAVType. Since version 2, runs of identical video frames
+are stored as the first frame followed by an APAV_REPEAT frame, whose data is
+a uint32 count of extra ticks the previous video frame stays on screen.
+
+Since version 3, a file with APCACHE_FLAG_THUMBS in FLAGS ends with its
+thumbnail track: an APAV_THUMBS frame (see apcache_thumbs.h) followed by an
+APAV_THUMBS_POS frame, whose data is the uint64 file offset of the
+APAV_THUMBS frame. The track is found from the end of the file without
+reading any other frame. Players skip both frames.
+
+Since version 4, a file with APCACHE_FLAG_CHUNKED in FLAGS stores its audio,
+video and repeat frames inside APAV_CHUNK frames of about one second each
+(see apcache_chunk.h), every chunk carrying a CRC32C and optionally zlib
+compressed. Readers decode chunks ahead on worker threads, skip corrupt
+ones, and return the frames inside them as if the file were flat.
+
+Since version 5, a chunked file with APCACHE_FLAG_LEVELS in FLAGS stores
+its video at LEVELS resolutions (see apcache_levels.h). Each period is
+written as an APAV_CHUNK frame holding only the audio frames, followed by
+one APAV_LEVEL_CHUNK frame per level, whose data is a uint8 level number
+followed by a chunk of the video and repeat frames at that level. An empty
+APAV_AUDIO frame in a level chunk stands for the next frame of the audio
+chunk, which keeps audio and video interleaved. A reader decodes the audio
+chunks and the chunks of one level only, so a mapped file only has the
+pages of that level read.
 */
 
-typedef enum { APAV_AUDIO, APAV_VIDEO } APAVType;
+typedef enum {
+    APAV_AUDIO,
+    APAV_VIDEO,
+    APAV_REPEAT,
+    APAV_THUMBS,
+    APAV_THUMBS_POS,
+    APAV_CHUNK,
+    APAV_LEVEL_CHUNK,
+} APAVType;
+
+typedef enum {
+    // the file ends with a thumbnail track
+    APCACHE_FLAG_THUMBS = 1,
+    // frames are stored in checksummed chunks
+    APCACHE_FLAG_CHUNKED = 2,
+    // chunks are written zlib compressed (with APCACHE_FLAG_CHUNKED)
+    APCACHE_FLAG_ZLIB = 4,
+    // video is stored at several resolutions (with APCACHE_FLAG_CHUNKED)
+    APCACHE_FLAG_LEVELS = 8,
+} APCacheFlag;
 
 typedef enum {
     APCACHE_ERR_FILE_NOT_EXIST = -100000,
@@ -62,6 +121,8 @@ typedef enum {
     APCACHE_ERR_FRAME_NOT_EXIST,
     APCACHE_ERR_IOERROR,
     APCACHE_ERR_APCACHE_NULL,
+    APCACHE_ERR_NO_THUMBS,
+    APCACHE_ERR_NOT_SEEKABLE,
     APCACHE_ERR_EOF = -1,
 } APCacheErr;
 
@@ -77,9 +138,66 @@ typedef struct {
     // Sample rate for audio frames
     // When sample_rate is 0, there will be no audio frame in apcache file
     uint32_t sample_rate;
+    // Bitwise or of APCacheFlag, 0 before version 3
+    uint32_t flags;
+    // Number of resolution levels, 1 without APCACHE_FLAG_LEVELS
+    uint32_t levels;
+    // Level of the video frames read, width and height are its size once
+    // picked by apcache_select_level
+    uint32_t level;
     // Opened apcache file
     // NULL for not initialized
     FILE *file;
+    // Buffered writer used instead of file when created by
+    // apcache_create_file
+    // NULL for not initialized
+    APCacheWriter *writer;
+    // Read-ahead buffer used instead of file when reading from a pipe
+    // NULL for not initialized
+    APCacheStream *stream;
+    // Whole file mapped read-only when a regular file is opened by
+    // apcache_open, frames are then borrowed from it instead of copied
+    // NULL for not mapped
+    const uint8_t *map;
+    size_t map_size;
+    // Read position in map while reading meta data
+    size_t map_pos;
+    // Path and stat of the mapped file, key of the shared frame index
+    char *map_path;
+    struct stat map_stat;
+    // Frame index shared with other processes, attached by the first
+    // apcache_read_frame
+    // NULL for not attached
+    APCacheShm *shm;
+    // Index of the next frame to be read from map
+    uint64_t frame_idx;
+    // Chunked files only:
+    // frames of the chunk being written, and its video frame periods
+    uint8_t *chunk;
+    size_t chunk_size;
+    size_t chunk_cap;
+    uint32_t chunk_ticks;
+    // decoding pool started by the first apcache_read_frame
+    APCacheChunkPool *pool;
+    // frames of the decoded chunk being read
+    uint8_t *body;
+    size_t body_size;
+    size_t body_pos;
+    // as a bool value, every chunk of the file was submitted to pool
+    int chunks_eof;
+    // Files with levels only:
+    // frames of the chunk being written at each level, chunk then holds
+    // the audio frames
+    uint8_t *level_chunk[APCACHE_LEVELS_MAX];
+    size_t level_chunk_size[APCACHE_LEVELS_MAX];
+    size_t level_chunk_cap[APCACHE_LEVELS_MAX];
+    // video frame being written at each level below 0
+    uint8_t *level_frame[APCACHE_LEVELS_MAX];
+    // audio frames of the decoded audio chunk, taken by the empty audio
+    // frames of body
+    uint8_t *audio_body;
+    size_t audio_size;
+    size_t audio_pos;
 } APCache;
 
 typedef struct {
@@ -87,10 +205,14 @@ typedef struct {
     APAVType type;
     // Size of data array (in byte)
     uint32_t bsize;
-    // For version 1,
     // when the frame is a video frame, data is an array of type unsigned char;
     // when the frame is an audio frame, data is an array of type float;
+    // when the frame is a repeat frame, data is one uint32 (number of ticks);
+    // when the frame is a thumbnail track, see apcache_thumbs.h;
     void *data;
+    // as a bool value, data points into a mapped apcache file, it stays
+    // valid until the file is closed and must not be freed
+    int borrowed;
 } APFrame;
 
 /// @brief Allocate an apcache frame object.
@@ -117,35 +239,133 @@ void apcache_free(APCache **apc);
 /// @param apc APCache struct with fps, width, height, sample_rate set to target
 /// number,
 ///            file pointed to a opened FILE with mode set to "w",
-///            version set to target version (1).
+///            version set to target version (APCACHE_VERSION).
 /// @return 0 for success, minus number for APCacheErr
 int apcache_create(APCache *apc);
 
+/// @brief Create an apcache file through a buffered writer and write meta
+///        data to it. Frames are written by a background thread, the file
+///        only appears at path once apcache_close succeeds.
+/// @param apc APCache struct with fps, width, height, sample_rate set to target
+/// number, file and writer set to NULL.
+/// @param path Path of the apcache file.
+/// @param flags Bitwise or of APCacheWriterFlag.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_create_file(APCache *apc, const char *path, int flags);
+
 /// @brief Write a frame into apcache file
 /// @param apc The pointer to the APCache object.
 /// @param frame Frame to be written to the file
 /// @return 0 for success, minus number for APCacheErr
 int apcache_write_frame(APCache *apc, APFrame *frame);
 
+/// @brief Write the thumbnail track, after every other frame.
+/// @param apc APCache created with APCACHE_FLAG_THUMBS in flags.
+/// @param track Track built by APCacheThumbs.
+/// @param size Size of track (in bytes).
+/// @return 0 for success, minus number for APCacheErr
+int apcache_write_thumbs(APCache *apc, const void *track, size_t size);
+
+/// @brief Number of bytes written so far, the offset of the next frame
+///        (of the chunk holding it for a chunked file, a complete chunk is
+///        written first, as the next video frame would).
+/// @param apc APCache being written.
+/// @param offset Set to the offset (in bytes).
+/// @return 0 for success, minus number for APCacheErr of the chunk written
+int apcache_tell(APCache *apc, uint64_t *offset);
+
 /// @brief Check whether is an apcache file.
 ///        1. Check whether file exists
 ///        2. Check whether have permission to read
 ///        3. Check whether file content starts with "apcache\n"
-///        4. Check if version number is valid (Only 1 is valid currently)
+///        4. Check if version number is valid (1 to APCACHE_VERSION)
 /// @param filename path to apcache file
 /// @return 0 for success, minus number for APCacheErr
 int is_apcache(char *filename);
 
+/// @brief Whether a path has to be read as a stream: "-" for stdin, a FIFO,
+///        a character device or a socket.
+/// @param filename path to check
+/// @return 1 for stream, 0 otherwise
+int apcache_is_stream_path(const char *filename);
+
+/// @brief Start reading a stream path ahead (see apcache_is_stream_path).
+/// @param filename "-" for stdin, or the path of a FIFO or device
+/// @return The pointer to allocated stream, NULL for error
+APCacheStream *apcache_stream_open_path(const char *filename);
+
+/// @brief Whether a stream starts with the "apcache\n" magic string, without
+///        consuming it. Other streams can still be read from their start,
+///        by libavformat for instance.
+/// @param s Stream being read ahead
+/// @return 1 for an apcache stream, 0 otherwise, minus number for
+///         APCacheErr
+int apcache_stream_sniff(APCacheStream *s);
+
+/// @brief Open an apcache file from a stream being read ahead.
+/// @param s Stream, owned by the APCache from now on (closed on error)
+/// @param apc Set to the opened APCache
+/// @return 0 for success, minus number for APCacheErr
+int apcache_open_stream(APCacheStream *s, APCache **apc);
+
 /// @brief Open an apcache file in read mode.
-/// @param filename path to apcache file
+///        Regular files are memory mapped and share one frame index with
+///        other processes playing the same file (see apcache_shm.h).
+///        "-", FIFOs and other non-seekable paths are read through a bounded
+///        read-ahead buffer (see apcache_stream.h).
+/// @param filename path to apcache file, "-" for stdin
 /// @return 0 for success, minus number for APCacheErr
 int apcache_open(char *filename, APCache **apc);
 
+/// @brief Pick the resolution level video frames are read at, for a screen
+///        (see apcache_level_pick), and set width and height to its size.
+///        Files without levels keep level 0. Call before the first
+///        apcache_read_frame.
+/// @param apc Opened APCache.
+/// @param width Width of the screen.
+/// @param height Height of the screen.
+/// @return Level picked.
+int apcache_select_level(APCache *apc, uint32_t width, uint32_t height);
+
 /// @brief Read a APFrame from APCache
+///        Frames of a mapped file are borrowed (see APFrame.borrowed),
+///        unless it is chunked. Chunks are decoded on worker threads and
+///        corrupt ones are skipped.
 /// @param apc APCache
 /// @param frame The pointer to a pointer to APFrame
 /// @return 0 for success, minus number for APCacheErr
 int apcache_read_frame(APCache *apc, APFrame **frame);
 
+/// @brief Whether frames read from apc are borrowed from a mapped file.
+/// @param apc Opened APCache.
+/// @return 1 for borrowed, 0 for frames owning their data.
+int apcache_borrows_frames(const APCache *apc);
+
+/// @brief Read the thumbnail track of an opened file, with one read and
+///        without moving the read position. Borrowed from a mapped file.
+/// @param apc APCache opened from a regular file.
+/// @param frame The pointer to a pointer to APFrame, set to the APAV_THUMBS
+///              frame.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_read_thumbs(APCache *apc, APFrame **frame);
+
+/// @brief Continue reading frames from the frame at a file offset.
+/// @param apc APCache opened from a regular file.
+/// @param offset File offset of a frame, such as a thumbnail's.
+/// @return 0 for success, minus number for APCacheErr
+int apcache_seek(APCache *apc, uint64_t offset);
+
+/// @brief Close an apcache file.
+///        For a file created by apcache_create_file, flush and fsync it and
+///        rename it onto its final path.
+///        For a mapped file, frames borrowed from it become invalid.
+/// @param apc APCache
+/// @return 0 for success, minus number for APCacheErr
 int apcache_close(APCache *apc);
+
+/// @brief Close an apcache file created by apcache_create_file and discard
+///        it, leaving nothing at its final path.
+/// @param apc APCache
+/// @return 0 for success, minus number for APCacheErr
+int apcache_abort(APCache *apc);
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "apcache_chunk.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "hash.h"
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_DECODING,
+    JOB_DONE,
+    JOB_CORRUPT,
+} JobState;
+
+typedef struct {
+    const uint8_t *chunk;
+    size_t size;
+    void *owned;
+    uint8_t *frames;
+    size_t frames_size;
+    int tag;
+    JobState state;
+} ChunkJob;
+
+struct APCacheChunkPool {
+    pthread_mutex_t lock;
+    // a job was queued, or stopping
+    pthread_cond_t work_cond;
+    // a job was decoded
+    pthread_cond_t done_cond;
+    // ring of ahead jobs, job n in slot n % ahead
+    ChunkJob *jobs;
+    int ahead;
+    // jobs submitted, claimed by a worker and taken back so far
+    uint64_t submitted;
+    uint64_t claimed;
+    uint64_t taken;
+    int stop;
+    pthread_t *threads;
+    int thread_num;
+};
+
+int apcache_chunk_encode(const uint8_t *frames, size_t size, uint32_t ticks,
+                         int codec, uint8_t **out, size_t *out_size) {
+    if (size > UINT32_MAX) return -1;
+    size_t cap = size;
+    if (codec == APCACHE_CHUNK_ZLIB) {
+        uLong bound = compressBound(size);
+        if (bound > cap) cap = bound;
+    }
+    uint8_t *chunk = malloc(APCACHE_CHUNK_HEAD_SIZE + cap);
+    if (!chunk) return -1;
+    uint8_t *payload = chunk + APCACHE_CHUNK_HEAD_SIZE;
+    size_t stored = size;
+    if (codec == APCACHE_CHUNK_ZLIB) {
+        uLongf len = cap;
+        if (compress2(payload, &len, frames, size, Z_BEST_SPEED) != Z_OK ||
+            len >= size) {
+            codec = APCACHE_CHUNK_RAW;
+        } else {
+            stored = len;
+        }
+    }
+    if (codec != APCACHE_CHUNK_ZLIB) {
+        codec = APCACHE_CHUNK_RAW;
+        memcpy(payload, frames, size);
+    }
+    uint32_t raw_size = size;
+    chunk[4] = codec;
+    memcpy(chunk + 5, &ticks, sizeof(uint32_t));
+    memcpy(chunk + 9, &raw_size, sizeof(uint32_t));
+    uint32_t crc = hash_crc32c(0, chunk + 4,
+                               APCACHE_CHUNK_HEAD_SIZE - 4 + stored);
+    memcpy(chunk, &crc, sizeof(uint32_t));
+    *out = chunk;
+    *out_size = APCACHE_CHUNK_HEAD_SIZE + stored;
+    return 0;
+}
+
+int apcache_chunk_decode(const uint8_t *chunk, size_t size, uint8_t **frames,
+                         size_t *frames_size) {
+    if (size < APCACHE_CHUNK_HEAD_SIZE) return -1;
+    uint32_t crc, raw_size;
+    memcpy(&crc, chunk, sizeof(uint32_t));
+    if (hash_crc32c(0, chunk + 4, size - 4) != crc) return -1;
+    memcpy(&raw_size, chunk + 9, sizeof(uint32_t));
+    const uint8_t *payload = chunk + APCACHE_CHUNK_HEAD_SIZE;
+    size_t stored = size - APCACHE_CHUNK_HEAD_SIZE;
+    uint8_t *out = malloc(raw_size ? raw_size : 1);
+    if (!out) return -2;
+    if (chunk[4] == APCACHE_CHUNK_RAW && stored == raw_size) {
+        memcpy(out, payload, raw_size);
+    } else {
+        uLongf len = raw_size;
+        if (chunk[4] != APCACHE_CHUNK_ZLIB ||
+            uncompress(out, &len, payload, stored) != Z_OK || len != raw_size) {
+            free(out);
+            return -2;
+        }
+    }
+    *frames = out;
+    *frames_size = raw_size;
+    return 0;
+}
+
+static void *pool_worker(void *arg) {
+    APCacheChunkPool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->stop && p->claimed == p->submitted) {
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        }
+        if (p->stop) break;
+        ChunkJob *job = &p->jobs[p->claimed++ % p->ahead];
+        job->state = JOB_DECODING;
+        pthread_mutex_unlock(&p->lock);
+
+        int err = apcache_chunk_decode(job->chunk, job->size, &job->frames,
+                                       &job->frames_size);
+        free(job->owned);
+        job->owned = NULL;
+
+        pthread_mutex_lock(&p->lock);
+        job->state = err == 0 ? JOB_DONE : JOB_CORRUPT;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+APCacheChunkPool *apcache_chunk_pool_alloc(int workers, int ahead) {
+    if (workers < 1) workers = 1;
+    if (ahead < 1) ahead = 1;
+    APCacheChunkPool *p = calloc(1, sizeof(APCacheChunkPool));
+    if (!p) return NULL;
+    p->jobs = calloc(ahead, sizeof(ChunkJob));
+    p->threads = calloc(workers, sizeof(pthread_t));
+    if (!p->jobs || !p->threads) {
+        free(p->jobs);
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+    p->ahead = ahead;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&p->threads[i], NULL, pool_worker, p) != 0) break;
+        p->thread_num++;
+    }
+    if (p->thread_num == 0) {
+        apcache_chunk_pool_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+int apcache_chunk_pool_pending(const APCacheChunkPool *p) {
+    // submitted and taken only move on the reader thread
+    return p->submitted - p->taken;
+}
+
+void apcache_chunk_pool_submit(APCacheChunkPool *p, const uint8_t *chunk,
+                               size_t size, void *owned, int tag) {
+    pthread_mutex_lock(&p->lock);
+    ChunkJob *job = &p->jobs[p->submitted++ % p->ahead];
+    job->chunk = chunk;
+    job->size = size;
+    job->owned = owned;
+    job->tag = tag;
+    job->frames = NULL;
+    job->state = JOB_QUEUED;
+    pthread_mutex_unlock(&p->lock);
+    pthread_cond_signal(&p->work_cond);
+}
+
+int apcache_chunk_pool_next(APCacheChunkPool *p, uint8_t **frames,
+                            size_t *frames_size, int *tag) {
+    if (p->taken == p->submitted) return -1;
+    ChunkJob *job = &p->jobs[p->taken % p->ahead];
+    pthread_mutex_lock(&p->lock);
+    while (job->state != JOB_DONE && job->state != JOB_CORRUPT) {
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    }
+    p->taken++;
+    pthread_mutex_unlock(&p->lock);
+    *frames = job->frames;
+    *frames_size = job->frames_size;
+    if (tag) *tag = job->tag;
+    job->frames = NULL;
+    return job->state == JOB_DONE ? 0 : 1;
+}
+
+void apcache_chunk_pool_reset(APCacheChunkPool *p) {
+    uint8_t *frames;
+    size_t size;
+    while (apcache_chunk_pool_next(p, &frames, &size, NULL) >= 0) {
+        free(frames);
+    }
+}
+
+void apcache_chunk_pool_free(APCacheChunkPool *p) {
+    if (!p) return;
+    apcache_chunk_pool_reset(p);
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_mutex_unlock(&p->lock);
+    pthread_cond_broadcast(&p->work_cond);
+    for (int i = 0; i < p->thread_num; i++) pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+    free(p->threads);
+    free(p->jobs);
+    free(p);
+}
@@ -0,0 +1,89 @@
+#ifndef APCACHE_CHUNK_H
+#define APCACHE_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Duration of a chunk (in seconds of video).
+#define APCACHE_CHUNK_SECONDS 1
+// A chunk is closed early when its frames reach this size (in bytes).
+#define APCACHE_CHUNK_MAX_SIZE (16 << 20)
+// Size of the chunk head: CRC32C, CODEC, TICKS and RAW_SIZE.
+#define APCACHE_CHUNK_HEAD_SIZE 13
+// Upper bound of decoding workers.
+#define APCACHE_CHUNK_WORKERS_MAX 4
+// Chunks decoded ahead of the one being read.
+#define APCACHE_CHUNK_AHEAD 8
+
+typedef enum {
+    APCACHE_CHUNK_RAW,
+    APCACHE_CHUNK_ZLIB,
+} APCacheChunkCodec;
+
+// Chunk of a chunked apcache file (the data of an APAV_CHUNK frame):
+//     uint32 CRC32C | uint8 CODEC | uint32 TICKS | uint32 RAW_SIZE | PAYLOAD
+// PAYLOAD holds the TYPE/SIZE/DATA frames of about APCACHE_CHUNK_SECONDS of
+// interleaved audio and video, RAW_SIZE bytes once decoded with CODEC.
+// TICKS counts the video frame periods in it (repeats included).
+// CRC32C covers everything after itself, so a damaged chunk is detected
+// before being decoded and can be skipped.
+
+/// @brief Encode the frames of a chunk.
+/// @param frames TYPE/SIZE/DATA frames.
+/// @param size Size of frames (in bytes).
+/// @param ticks Video frame periods in the chunk.
+/// @param codec APCacheChunkCodec, kept raw when it does not save space.
+/// @param out Set to the malloc()ed chunk.
+/// @param out_size Set to the size of the chunk (in bytes).
+/// @return 0 for success, -1 for error.
+int apcache_chunk_encode(const uint8_t *frames, size_t size, uint32_t ticks,
+                         int codec, uint8_t **out, size_t *out_size);
+
+/// @brief Verify and decode a chunk.
+/// @param chunk Chunk.
+/// @param size Size of chunk (in bytes).
+/// @param frames Set to the malloc()ed TYPE/SIZE/DATA frames.
+/// @param frames_size Set to the size of frames (in bytes).
+/// @return 0 for success, -1 for a bad checksum, -2 for a payload that
+///         does not decode (or allocation error).
+int apcache_chunk_decode(const uint8_t *chunk, size_t size, uint8_t **frames,
+                         size_t *frames_size);
+
+// Decodes chunks on worker threads ahead of the reader, and hands them
+// back in submission order. Owned by one reader thread.
+typedef struct APCacheChunkPool APCacheChunkPool;
+
+/// @brief Start the workers.
+/// @param workers Number of worker threads.
+/// @param ahead Number of chunks that can be pending at once.
+/// @return The pointer to allocated pool, NULL for error.
+APCacheChunkPool *apcache_chunk_pool_alloc(int workers, int ahead);
+
+/// @brief Number of chunks submitted and not taken back yet.
+int apcache_chunk_pool_pending(const APCacheChunkPool *p);
+
+/// @brief Queue a chunk for decoding, pending must be below ahead.
+/// @param p Pool.
+/// @param chunk Chunk, valid until it is taken back.
+/// @param size Size of chunk (in bytes).
+/// @param owned Buffer freed once the chunk is decoded, NULL for none.
+/// @param tag Value handed back with the chunk by apcache_chunk_pool_next.
+void apcache_chunk_pool_submit(APCacheChunkPool *p, const uint8_t *chunk,
+                               size_t size, void *owned, int tag);
+
+/// @brief Take back the oldest pending chunk, waiting for its decoding.
+/// @param p Pool.
+/// @param frames Set to the malloc()ed frames, NULL for a corrupt chunk.
+/// @param frames_size Set to the size of frames (in bytes).
+/// @param tag Set to the tag the chunk was submitted with, unless NULL.
+/// @return 0 for success, 1 for a corrupt chunk, -1 for none pending.
+int apcache_chunk_pool_next(APCacheChunkPool *p, uint8_t **frames,
+                            size_t *frames_size, int *tag);
+
+/// @brief Drop every pending chunk.
+void apcache_chunk_pool_reset(APCacheChunkPool *p);
+
+/// @brief Stop the workers and free the pool.
+void apcache_chunk_pool_free(APCacheChunkPool *p);
+
+#endif
@@ -0,0 +1,44 @@
+#include "apcache_levels.h"
+
+#include <stddef.h>
+
+void apcache_level_size(uint32_t width, uint32_t height, int level,
+                        uint32_t *level_w, uint32_t *level_h) {
+    for (int i = 0; i < level; i++) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+    *level_w = width;
+    *level_h = height;
+}
+
+void apcache_level_reduce(const uint8_t *src, uint32_t width, uint32_t height,
+                          uint8_t *dst) {
+    uint32_t dst_w = (width + 1) / 2, dst_h = (height + 1) / 2;
+    for (uint32_t y = 0; y < dst_h; y++) {
+        const uint8_t *top = src + (size_t)y * 2 * width;
+        // The last row of an odd height is its own pair
+        const uint8_t *bottom = y * 2 + 1 < height ? top + width : top;
+        uint8_t *out = dst + (size_t)y * dst_w;
+        for (uint32_t x = 0; x < width / 2; x++) {
+            out[x] = (top[2 * x] + top[2 * x + 1] + bottom[2 * x] +
+                      bottom[2 * x + 1] + 2) /
+                     4;
+        }
+        if (width % 2) {
+            out[dst_w - 1] = (top[width - 1] + bottom[width - 1] + 1) / 2;
+        }
+    }
+}
+
+int apcache_level_pick(uint32_t width, uint32_t height, int levels,
+                       uint32_t screen_w, uint32_t screen_h) {
+    int pick = 0;
+    for (int i = 1; i < levels; i++) {
+        uint32_t w, h;
+        apcache_level_size(width, height, i, &w, &h);
+        if (w < screen_w || h < screen_h) break;
+        pick = i;
+    }
+    return pick;
+}
@@ -0,0 +1,43 @@
+#ifndef APCACHE_LEVELS_H
+#define APCACHE_LEVELS_H
+
+#include <stdint.h>
+
+// Upper bound of resolution levels in a file, level 0 included.
+#define APCACHE_LEVELS_MAX 5
+
+// Resolution levels of a file with APCACHE_FLAG_LEVELS: level 0 is the
+// WIDTH x HEIGHT of the header, and every further level is derived from the
+// one above by averaging 2x2 blocks, so its size is half the size above
+// rounded up (400x120, 200x60, 100x30...).
+
+/// @brief Size of a level.
+/// @param width Width of level 0.
+/// @param height Height of level 0.
+/// @param level Level.
+/// @param level_w Set to the width of the level.
+/// @param level_h Set to the height of the level.
+void apcache_level_size(uint32_t width, uint32_t height, int level,
+                        uint32_t *level_w, uint32_t *level_h);
+
+/// @brief Derive the next level of a frame.
+/// @param src width x height GRAY8 frame.
+/// @param width Width of src.
+/// @param height Height of src.
+/// @param dst Frame of the next level, half the size of src rounded up.
+void apcache_level_reduce(const uint8_t *src, uint32_t width, uint32_t height,
+                          uint8_t *dst);
+
+/// @brief Pick the level to play on a screen: the smallest one still
+///        covering it, so frames are only ever shrunk, or level 0 when the
+///        screen is larger than every level.
+/// @param width Width of level 0.
+/// @param height Height of level 0.
+/// @param levels Number of levels.
+/// @param screen_w Width of the screen.
+/// @param screen_h Height of the screen.
+/// @return Level.
+int apcache_level_pick(uint32_t width, uint32_t height, int levels,
+                       uint32_t screen_w, uint32_t screen_h);
+
+#endif
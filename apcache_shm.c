@@ -0,0 +1,185 @@
+#include "apcache_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log/log.h"
+
+// "apix", written last when the index is complete
+#define SHM_MAGIC 0x78697061
+
+// Layout of the shared memory segment, guarded by flock() on its fd.
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    // pids of attached readers, 0 for free slot
+    int32_t pids[APCACHE_SHM_MAX_READERS];
+    uint64_t frame_num;
+    uint64_t offsets[];
+} ShmHeader;
+
+struct APCacheShm {
+    char name[64];
+    // -1 for a private index
+    int fd;
+    ShmHeader *hdr;
+    size_t size;
+    // slot in hdr->pids, -1 for not registered
+    int slot;
+};
+
+// Count the complete frame records, and store their offsets when asked.
+static uint64_t scan_frames(const uint8_t *map, size_t map_size, size_t off,
+                            uint64_t *offsets) {
+    uint64_t n = 0;
+    while (off + 5 <= map_size) {
+        uint32_t bsize;
+        memcpy(&bsize, map + off + 1, sizeof(uint32_t));
+        if (bsize > map_size - off - 5) break;
+        if (offsets) offsets[n] = off;
+        n++;
+        off += 5 + (size_t)bsize;
+    }
+    return n;
+}
+
+// FNV-1a over the real path, mtime and size of the file.
+static void shm_name(char *name, size_t len, const char *real,
+                     const struct stat *st) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = real; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+    }
+    uint64_t keys[2] = {(uint64_t)st->st_mtime, (uint64_t)st->st_size};
+    const uint8_t *k = (const uint8_t *)keys;
+    for (size_t i = 0; i < sizeof(keys); i++) {
+        h = (h ^ k[i]) * 0x100000001b3ULL;
+    }
+    snprintf(name, len, "/apcache-%016llx", (unsigned long long)h);
+}
+
+// Forget readers that exited without detaching, return the live ones.
+static int prune_readers(ShmHeader *hdr) {
+    int alive = 0;
+    for (int i = 0; i < APCACHE_SHM_MAX_READERS; i++) {
+        pid_t pid = hdr->pids[i];
+        if (!pid) continue;
+        if (pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH) {
+            hdr->pids[i] = 0;
+            continue;
+        }
+        alive++;
+    }
+    return alive;
+}
+
+static int attach_locked(APCacheShm *s, const uint8_t *map, size_t map_size,
+                         size_t data_off) {
+    struct stat sst;
+    if (fstat(s->fd, &sst) != 0) return -1;
+    uint64_t n = 0;
+    if (sst.st_size == 0) {
+        n = scan_frames(map, map_size, data_off, NULL);
+        s->size = sizeof(ShmHeader) + n * sizeof(uint64_t);
+        if (ftruncate(s->fd, s->size) != 0) return -1;
+    } else {
+        s->size = sst.st_size;
+    }
+    s->hdr = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->hdr == MAP_FAILED) {
+        s->hdr = NULL;
+        return -1;
+    }
+    // New segment, or its builder died half way
+    if (s->hdr->magic != SHM_MAGIC) {
+        if (sst.st_size != 0) n = scan_frames(map, map_size, data_off, NULL);
+        if (s->size != sizeof(ShmHeader) + n * sizeof(uint64_t)) return -1;
+        s->hdr->frame_num = n;
+        scan_frames(map, map_size, data_off, s->hdr->offsets);
+        s->hdr->magic = SHM_MAGIC;
+        ldebug("Built shared frame index %s (%llu frames)", s->name,
+               (unsigned long long)n);
+    }
+    prune_readers(s->hdr);
+    for (int i = 0; i < APCACHE_SHM_MAX_READERS; i++) {
+        if (!s->hdr->pids[i]) {
+            s->hdr->pids[i] = getpid();
+            s->slot = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void unmap_segment(APCacheShm *s) {
+    if (s->hdr) munmap(s->hdr, s->size);
+    s->hdr = NULL;
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+}
+
+APCacheShm *apcache_shm_attach(const char *path, const struct stat *st,
+                               const uint8_t *map, size_t map_size,
+                               size_t data_off) {
+    APCacheShm *s = calloc(1, sizeof(APCacheShm));
+    if (!s) return NULL;
+    s->fd = -1;
+    s->slot = -1;
+    char *real = realpath(path, NULL);
+    if (real) {
+        shm_name(s->name, sizeof(s->name), real, st);
+        free(real);
+        s->fd = shm_open(s->name, O_RDWR | O_CREAT, 0600);
+    }
+    if (s->fd >= 0 && flock(s->fd, LOCK_EX) == 0) {
+        int err = attach_locked(s, map, map_size, data_off);
+        flock(s->fd, LOCK_UN);
+        if (err == 0) return s;
+    }
+    unmap_segment(s);
+    lwarn("Shared frame index unavailable, building a private one (path: %s)",
+          path);
+
+    uint64_t n = scan_frames(map, map_size, data_off, NULL);
+    s->hdr = malloc(sizeof(ShmHeader) + n * sizeof(uint64_t));
+    if (!s->hdr) {
+        free(s);
+        return NULL;
+    }
+    s->hdr->frame_num = n;
+    scan_frames(map, map_size, data_off, s->hdr->offsets);
+    return s;
+}
+
+uint64_t apcache_shm_frame_num(const APCacheShm *shm) {
+    return shm->hdr->frame_num;
+}
+
+const uint64_t *apcache_shm_offsets(const APCacheShm *shm) {
+    return shm->hdr->offsets;
+}
+
+void apcache_shm_detach(APCacheShm *shm) {
+    if (!shm) return;
+    if (shm->fd < 0) {
+        free(shm->hdr);
+        free(shm);
+        return;
+    }
+    flock(shm->fd, LOCK_EX);
+    if (shm->slot >= 0) shm->hdr->pids[shm->slot] = 0;
+    if (prune_readers(shm->hdr) == 0) {
+        ldebug("Removing shared frame index %s", shm->name);
+        shm_unlink(shm->name);
+    }
+    flock(shm->fd, LOCK_UN);
+    unmap_segment(shm);
+    free(shm);
+}
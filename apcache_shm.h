@@ -0,0 +1,42 @@
+#ifndef APCACHE_SHM_H
+#define APCACHE_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Maximum number of processes registered on one shared frame store.
+#define APCACHE_SHM_MAX_READERS 64
+
+// Frame index of a memory mapped apcache file, shared between every player
+// process on the host through a POSIX shared memory segment named after the
+// file's real path, mtime and size. The first reader scans the file and
+// builds the index, later readers attach to it. Frame data itself is never
+// copied: it is read from the mapped file, so every process shares the same
+// page cache pages. The segment is removed when its last reader detaches
+// (readers that died without detaching are pruned).
+// When shared memory is unavailable the index is built privately.
+typedef struct APCacheShm APCacheShm;
+
+/// @brief Attach to (or build) the frame index of a mapped apcache file.
+/// @param path Path of the apcache file.
+/// @param st stat() of the opened file.
+/// @param map Whole file mapped in memory.
+/// @param map_size Size of the mapping (in bytes).
+/// @param data_off Offset of the first frame record.
+/// @return The pointer to allocated store, NULL for error.
+APCacheShm *apcache_shm_attach(const char *path, const struct stat *st,
+                               const uint8_t *map, size_t map_size,
+                               size_t data_off);
+
+/// @brief Number of complete frame records in the file.
+uint64_t apcache_shm_frame_num(const APCacheShm *shm);
+
+/// @brief File offset of each frame record (type byte), frame_num entries.
+const uint64_t *apcache_shm_offsets(const APCacheShm *shm);
+
+/// @brief Detach from the store, removing the segment if this was the last
+///        reader, and free shm.
+void apcache_shm_detach(APCacheShm *shm);
+
+#endif
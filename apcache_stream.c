@@ -0,0 +1,167 @@
+#include "apcache_stream.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Largest single read() issued by the read-ahead thread.
+#define STREAM_READ_CHUNK (1 << 20)
+
+struct APCacheStream {
+    int fd;
+    uint8_t *buf;
+    size_t cap;
+    // read position (consumer)
+    size_t head;
+    // number of buffered bytes
+    size_t len;
+    // as a bool value, fd reached end of file or failed
+    int eof;
+    // 0 or minus errno of the failed read
+    int error;
+    int stopping;
+    pthread_mutex_t lock;
+    // signaled when data is added or eof is reached
+    pthread_cond_t data_cond;
+    // signaled when data is consumed or when stopping
+    pthread_cond_t space_cond;
+    pthread_t thread;
+};
+
+static void *read_ahead(void *arg) {
+    APCacheStream *s = arg;
+    // Only a blocked read() may be cancelled, never a lock holder
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->len == s->cap && !s->stopping) {
+            pthread_cond_wait(&s->space_cond, &s->lock);
+        }
+        if (s->stopping) break;
+        // Largest contiguous free region after the tail
+        size_t tail = (s->head + s->len) % s->cap;
+        size_t room = tail >= s->head && s->len != s->cap ? s->cap - tail
+                                                          : s->head - tail;
+        if (room > STREAM_READ_CHUNK) room = STREAM_READ_CHUNK;
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t n = read(s->fd, s->buf + tail, room);
+        int err = n < 0 ? errno : 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&s->lock);
+        if (n < 0 && err == EINTR) continue;
+        if (n <= 0) {
+            s->eof = 1;
+            s->error = n < 0 ? -err : 0;
+            pthread_cond_broadcast(&s->data_cond);
+            break;
+        }
+        s->len += n;
+        pthread_cond_broadcast(&s->data_cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+APCacheStream *apcache_stream_open(int fd, size_t cap) {
+    if (fd < 0 || cap == 0) return NULL;
+    APCacheStream *s = calloc(1, sizeof(APCacheStream));
+    if (!s) return NULL;
+    s->buf = malloc(cap);
+    if (!s->buf) {
+        free(s);
+        return NULL;
+    }
+    s->fd = fd;
+    s->cap = cap;
+    s->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    s->data_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    s->space_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    if (pthread_create(&s->thread, NULL, read_ahead, s) != 0) {
+        free(s->buf);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+ssize_t apcache_stream_read(APCacheStream *s, void *buf, size_t size) {
+    uint8_t *dst = buf;
+    size_t done = 0;
+    pthread_mutex_lock(&s->lock);
+    while (done < size) {
+        while (s->len == 0 && !s->eof) {
+            pthread_cond_wait(&s->data_cond, &s->lock);
+        }
+        if (s->len == 0) {
+            int err = s->error;
+            pthread_mutex_unlock(&s->lock);
+            return done == 0 && err ? err : (ssize_t)done;
+        }
+        size_t n = size - done;
+        if (n > s->len) n = s->len;
+        if (n > s->cap - s->head) n = s->cap - s->head;
+        memcpy(dst + done, s->buf + s->head, n);
+        s->head = (s->head + n) % s->cap;
+        s->len -= n;
+        done += n;
+        pthread_cond_signal(&s->space_cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+// Copy n buffered bytes from head, with the lock held.
+static void copy_buffered(const APCacheStream *s, uint8_t *dst, size_t n) {
+    size_t first = n < s->cap - s->head ? n : s->cap - s->head;
+    memcpy(dst, s->buf + s->head, first);
+    memcpy(dst + first, s->buf, n - first);
+}
+
+ssize_t apcache_stream_peek(APCacheStream *s, void *buf, size_t size) {
+    if (size > s->cap) size = s->cap;
+    pthread_mutex_lock(&s->lock);
+    while (s->len < size && !s->eof) {
+        pthread_cond_wait(&s->data_cond, &s->lock);
+    }
+    size_t n = size < s->len ? size : s->len;
+    copy_buffered(s, buf, n);
+    int err = s->error;
+    pthread_mutex_unlock(&s->lock);
+    return n == 0 && err ? err : (ssize_t)n;
+}
+
+ssize_t apcache_stream_read_some(APCacheStream *s, void *buf, size_t size) {
+    pthread_mutex_lock(&s->lock);
+    while (s->len == 0 && !s->eof) {
+        pthread_cond_wait(&s->data_cond, &s->lock);
+    }
+    size_t n = size < s->len ? size : s->len;
+    copy_buffered(s, buf, n);
+    s->head = (s->head + n) % s->cap;
+    s->len -= n;
+    int err = s->error;
+    pthread_cond_signal(&s->space_cond);
+    pthread_mutex_unlock(&s->lock);
+    return n == 0 && err ? err : (ssize_t)n;
+}
+
+void apcache_stream_close(APCacheStream *s) {
+    if (!s) return;
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    int eof = s->eof;
+    pthread_cond_signal(&s->space_cond);
+    pthread_mutex_unlock(&s->lock);
+    // The thread may be blocked in read() on a pipe nobody writes to
+    if (!eof) pthread_cancel(s->thread);
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    free(s->buf);
+    free(s);
+}
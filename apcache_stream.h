@@ -0,0 +1,52 @@
+#ifndef APCACHE_STREAM_H
+#define APCACHE_STREAM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Default size of the read-ahead buffer.
+#define APCACHE_STREAM_BUF_SIZE (32 << 20)
+
+// Bounded read-ahead over a non-seekable file descriptor (pipe, FIFO, stdin).
+// A background thread keeps reading into a ring buffer while the player is
+// blocked on audio or video, so the writer at the other end of the pipe
+// never stalls until the buffer is full.
+typedef struct APCacheStream APCacheStream;
+
+/// @brief Start reading ahead from fd.
+/// @param fd Opened file descriptor, owned by the stream from now on.
+/// @param cap Size of the read-ahead buffer (in bytes).
+/// @return The pointer to allocated stream, NULL for error.
+APCacheStream *apcache_stream_open(int fd, size_t cap);
+
+/// @brief Read exactly size bytes, blocking until they are available.
+/// @param s Stream.
+/// @param buf Destination.
+/// @param size Number of bytes to read.
+/// @return Number of bytes read, less than size only at end of stream,
+///         minus number for read error.
+ssize_t apcache_stream_read(APCacheStream *s, void *buf, size_t size);
+
+/// @brief Copy the next size bytes without consuming them, blocking until
+///        they are buffered, so the stream can be sniffed and then read
+///        from the start.
+/// @param s Stream.
+/// @param buf Destination.
+/// @param size Number of bytes to copy, at most the buffer size.
+/// @return Number of bytes copied, less than size only at end of stream,
+///         minus number for read error.
+ssize_t apcache_stream_peek(APCacheStream *s, void *buf, size_t size);
+
+/// @brief Read up to size bytes, blocking only while nothing is buffered.
+/// @param s Stream.
+/// @param buf Destination.
+/// @param size Largest number of bytes to read.
+/// @return Number of bytes read, 0 at end of stream, minus number for read
+///         error.
+ssize_t apcache_stream_read_some(APCacheStream *s, void *buf, size_t size);
+
+/// @brief Stop the read-ahead thread, close fd and free the stream.
+/// @param s Stream.
+void apcache_stream_close(APCacheStream *s);
+
+#endif
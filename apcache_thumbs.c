@@ -0,0 +1,124 @@
+#include "apcache_thumbs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// INTERVAL_MS, WIDTH, HEIGHT and COUNT
+#define THUMBS_HEAD_SIZE (4 * sizeof(uint32_t))
+
+struct APCacheThumbs {
+    // size of the frames
+    uint32_t src_w;
+    uint32_t src_h;
+    uint32_t interval_ms;
+    uint32_t width;
+    uint32_t height;
+    uint32_t count;
+    // head followed by count entries
+    uint8_t *data;
+    size_t size;
+    size_t cap;
+};
+
+static size_t entry_size(uint32_t width, uint32_t height) {
+    return sizeof(uint64_t) + (size_t)width * height;
+}
+
+APCacheThumbs *apcache_thumbs_alloc(uint32_t width, uint32_t height,
+                                    uint32_t interval_ms) {
+    if (width == 0 || height == 0) return NULL;
+    APCacheThumbs *t = calloc(1, sizeof(APCacheThumbs));
+    if (!t) return NULL;
+    t->src_w = width;
+    t->src_h = height;
+    t->interval_ms = interval_ms;
+    t->width = (width + APCACHE_THUMB_SCALE - 1) / APCACHE_THUMB_SCALE;
+    t->height = (height + APCACHE_THUMB_SCALE - 1) / APCACHE_THUMB_SCALE;
+    t->size = THUMBS_HEAD_SIZE;
+    t->cap = THUMBS_HEAD_SIZE + 64 * entry_size(t->width, t->height);
+    if (!(t->data = malloc(t->cap))) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+int apcache_thumbs_add(APCacheThumbs *t, const uint8_t *frame,
+                       uint64_t offset) {
+    size_t esize = entry_size(t->width, t->height);
+    if (t->size + esize > t->cap) {
+        size_t cap = t->cap * 2;
+        uint8_t *data = realloc(t->data, cap);
+        if (!data) return -1;
+        t->data = data;
+        t->cap = cap;
+    }
+    uint8_t *e = t->data + t->size;
+    memcpy(e, &offset, sizeof(uint64_t));
+    uint8_t *px = e + sizeof(uint64_t);
+    // Box average, blocks on the right and bottom edges may be partial
+    for (uint32_t y = 0; y < t->height; y++) {
+        uint32_t y0 = y * APCACHE_THUMB_SCALE;
+        uint32_t y1 = y0 + APCACHE_THUMB_SCALE;
+        if (y1 > t->src_h) y1 = t->src_h;
+        for (uint32_t x = 0; x < t->width; x++) {
+            uint32_t x0 = x * APCACHE_THUMB_SCALE;
+            uint32_t x1 = x0 + APCACHE_THUMB_SCALE;
+            if (x1 > t->src_w) x1 = t->src_w;
+            uint32_t sum = 0;
+            for (uint32_t sy = y0; sy < y1; sy++) {
+                const uint8_t *row = frame + (size_t)sy * t->src_w;
+                for (uint32_t sx = x0; sx < x1; sx++) sum += row[sx];
+            }
+            uint32_t n = (y1 - y0) * (x1 - x0);
+            *px++ = (sum + n / 2) / n;
+        }
+    }
+    t->size += esize;
+    t->count++;
+    return 0;
+}
+
+const void *apcache_thumbs_data(APCacheThumbs *t, size_t *size) {
+    uint32_t head[4] = {t->interval_ms, t->width, t->height, t->count};
+    memcpy(t->data, head, sizeof(head));
+    *size = t->size;
+    return t->data;
+}
+
+void apcache_thumbs_free(APCacheThumbs *t) {
+    if (!t) return;
+    free(t->data);
+    free(t);
+}
+
+int apcache_thumbs_parse(const void *data, size_t size,
+                         APCacheThumbTrack *track) {
+    if (size < THUMBS_HEAD_SIZE) return -1;
+    uint32_t head[4];
+    memcpy(head, data, sizeof(head));
+    track->interval_ms = head[0];
+    track->width = head[1];
+    track->height = head[2];
+    track->count = head[3];
+    track->entries = (const uint8_t *)data + THUMBS_HEAD_SIZE;
+    if (track->interval_ms == 0 || track->width == 0 || track->height == 0)
+        return -1;
+    size_t esize = entry_size(track->width, track->height);
+    if ((size - THUMBS_HEAD_SIZE) / esize < track->count) return -1;
+    return 0;
+}
+
+uint64_t apcache_thumbs_offset(const APCacheThumbTrack *track, uint32_t i) {
+    uint64_t offset;
+    memcpy(&offset,
+           track->entries + i * entry_size(track->width, track->height),
+           sizeof(uint64_t));
+    return offset;
+}
+
+const uint8_t *apcache_thumbs_image(const APCacheThumbTrack *track,
+                                    uint32_t i) {
+    return track->entries + i * entry_size(track->width, track->height) +
+           sizeof(uint64_t);
+}
@@ -0,0 +1,71 @@
+#ifndef APCACHE_THUMBS_H
+#define APCACHE_THUMBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Thumbnails are this many times smaller than frames in each dimension.
+#define APCACHE_THUMB_SCALE 2
+
+// Thumbnail track of an apcache file: a small copy of the frame on screen
+// every few seconds, stored in one record so a scrubber gets every
+// thumbnail with a single sequential read. Each thumbnail carries the file
+// offset of the video record it was taken from, so playback can start there.
+//
+// Layout of the track (the data of an APAV_THUMBS record):
+//     uint32 INTERVAL_MS | uint32 WIDTH | uint32 HEIGHT | uint32 COUNT
+//     COUNT x { uint64 RECORD_OFFSET | uint8 PIXELS[WIDTH * HEIGHT] }
+typedef struct APCacheThumbs APCacheThumbs;
+
+// Read-only view of a stored track.
+typedef struct {
+    // time between two thumbnails (in milliseconds)
+    uint32_t interval_ms;
+    // size of each thumbnail
+    uint32_t width;
+    uint32_t height;
+    uint32_t count;
+    // count entries of offset and pixels
+    const uint8_t *entries;
+} APCacheThumbTrack;
+
+/// @brief Allocate a track builder for frames of one size.
+/// @param width Frame width (in pixels).
+/// @param height Frame height (in pixels).
+/// @param interval_ms Time between two thumbnails (in milliseconds).
+/// @return The pointer to allocated builder, NULL for error.
+APCacheThumbs *apcache_thumbs_alloc(uint32_t width, uint32_t height,
+                                    uint32_t interval_ms);
+
+/// @brief Downscale a frame and append it to the track.
+/// @param t Builder.
+/// @param frame width x height greyscale frame.
+/// @param offset File offset of the video record of the frame.
+/// @return 0 for success, -1 for allocation error.
+int apcache_thumbs_add(APCacheThumbs *t, const uint8_t *frame,
+                       uint64_t offset);
+
+/// @brief Serialized track, owned by t and valid until the next add.
+/// @param t Builder.
+/// @param size Set to the size of the track (in bytes).
+const void *apcache_thumbs_data(APCacheThumbs *t, size_t *size);
+
+/// @brief Free the builder.
+void apcache_thumbs_free(APCacheThumbs *t);
+
+/// @brief Check a stored track and point a view at it.
+/// @param data Track data, must outlive the view.
+/// @param size Size of data (in bytes).
+/// @param track Filled with the view.
+/// @return 0 for success, -1 for a malformed track.
+int apcache_thumbs_parse(const void *data, size_t size,
+                         APCacheThumbTrack *track);
+
+/// @brief File offset of the video record of thumbnail i.
+uint64_t apcache_thumbs_offset(const APCacheThumbTrack *track, uint32_t i);
+
+/// @brief Pixels of thumbnail i, width x height.
+const uint8_t *apcache_thumbs_image(const APCacheThumbTrack *track,
+                                    uint32_t i);
+
+#endif
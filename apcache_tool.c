@@ -0,0 +1,470 @@
+// apcache-tool: inspects and converts apcache files without playing them.
+// Every command streams frames from apcache_read_frame to the writer, so
+// memory stays bounded by a chunk and the write buffers whatever the length
+// of the file; only the thumbnail track (a few bytes per second) is kept
+// until the end.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "apcache.h"
+#include "apcache_thumbs.h"
+#include "args/args.h"
+#include "log/log.h"
+#include "scale.h"
+
+typedef struct {
+    // size of resized frames, 0 for unchanged
+    int width;
+    int height;
+    ScalerMode scaler;
+    // seconds between thumbnails, -1 for the interval of the input
+    int thumb_interval;
+    // APCACHE_FLAG_CHUNKED and APCACHE_FLAG_ZLIB, -1 for the input layout
+    int layout;
+    // resolution levels, -1 for the levels of the input
+    int levels;
+} ToolOptions;
+
+// Output file being written from the frames of one or more inputs.
+typedef struct {
+    APCache *out;
+    int strip_audio;
+    // thumbnail of the frame on screen every thumb_ticks, NULL for none
+    APCacheThumbs *thumbs;
+    uint64_t thumb_ticks;
+    uint64_t ticks;
+    // last video frame written and its file offset
+    uint8_t *last;
+    uint64_t last_off;
+    // resizing, NULL scaler for none
+    Scaler *scaler;
+    size_t src_size;
+    uint8_t *buf;
+} Rewriter;
+
+static void print_usage() {
+    printf(
+        "Usage: apcache-tool info <file>\n\
+       apcache-tool index <file> <output>\n\
+       apcache-tool recompress <file> <output>\n\
+       apcache-tool resize <file> <output> --width <num> --height <num>\n\
+       apcache-tool strip-audio <file> <output>\n\
+       apcache-tool concat <output> <file> <file>...\n\
+                    [--layout <flat | chunked | compress>]\n\
+                    [--thumb-interval <sec>] [--levels <num>]\n\
+                    [--scaler <fast | bilinear | area | bicubic | box>]\n\
+\n\
+       info                 Print the header, duration and frame counts\n\
+       index                Rewrite a file with a thumbnail track, which seeking\n\
+                            and --scrub rely on (version 1 and 2 files have none)\n\
+       recompress           Rewrite a file in another layout (default: compress)\n\
+       resize               Rescale the stored frames to a new size\n\
+       strip-audio          Rewrite a file without its audio frames\n\
+       concat               Join files of the same size, frame and sample rate\n\
+       --layout <flat | chunked | compress>\n\
+                            Layout of the output (default: layout of the input)\n\
+       --thumb-interval <sec>\n\
+                            Seconds between thumbnails of the output, 0 for none\n\
+                            (default: interval of the input, 1 for index)\n\
+       --levels <num>       Resolution levels of a chunked output, 1 for none\n\
+                            (default: levels of the input)\n\
+       --scaler <fast | bilinear | area | bicubic | box>\n\
+                            Scaler used by resize (default: area)\n\
+Outputs are written next to their path and renamed into place once\n\
+complete, so a file can be rewritten onto itself.\n");
+}
+
+static void format_duration(char *buf, size_t len, double s) {
+    unsigned long long ms = s * 1000 + 0.5;
+    snprintf(buf, len, "%llu:%02u:%02u.%03u", ms / 3600000,
+             (unsigned)(ms / 60000 % 60), (unsigned)(ms / 1000 % 60),
+             (unsigned)(ms % 1000));
+}
+
+static int layout_parse(const char *name) {
+    if (strcmp(name, "flat") == 0) return 0;
+    if (strcmp(name, "chunked") == 0) return APCACHE_FLAG_CHUNKED;
+    if (strcmp(name, "compress") == 0)
+        return APCACHE_FLAG_CHUNKED | APCACHE_FLAG_ZLIB;
+    return -1;
+}
+
+static int open_input(const char *path, APCache **apc) {
+    int err = apcache_open((char *)path, apc);
+    if (err != 0) {
+        printf("Unable to open apcache file %s (code: %d)\n", path, err);
+        lerror("Unable to open apcache file %s (code: %d)", path, err);
+    }
+    return err;
+}
+
+// Interval of the thumbnail track of an input (in seconds), 0 for none.
+static int input_thumb_interval(APCache *in) {
+    APFrame *frame = NULL;
+    APCacheThumbTrack track;
+    int interval = 0;
+    if (apcache_read_thumbs(in, &frame) == 0 &&
+        apcache_thumbs_parse(frame->data, frame->bsize, &track) == 0) {
+        interval = (track.interval_ms + 500) / 1000;
+        if (interval < 1) interval = 1;
+    }
+    apcache_frame_free(&frame);
+    return interval;
+}
+
+static void rewriter_free(Rewriter *rw) {
+    apcache_thumbs_free(rw->thumbs);
+    scaler_free(rw->scaler);
+    free(rw->buf);
+    free(rw->last);
+    apcache_free(&rw->out);
+}
+
+// Create the output with the header of in, changed by opt.
+static int rewriter_open(Rewriter *rw, APCache *in, const char *path,
+                         const ToolOptions *opt, int thumb_interval,
+                         int strip_audio) {
+    memset(rw, 0, sizeof(Rewriter));
+    rw->strip_audio = strip_audio;
+    if (!(rw->out = apcache_alloc())) return -2;
+    APCache *out = rw->out;
+    out->fps = in->fps;
+    out->width = opt->width > 0 ? opt->width : in->width;
+    out->height = opt->height > 0 ? opt->height : in->height;
+    out->sample_rate = strip_audio ? 0 : in->sample_rate;
+    out->flags = opt->layout >= 0
+                     ? opt->layout
+                     : in->flags & (APCACHE_FLAG_CHUNKED | APCACHE_FLAG_ZLIB);
+    // Levels are rebuilt from the frames read, which are the ones of level 0
+    int levels = opt->levels > 0 ? opt->levels : (int)in->levels;
+    if (levels > 1 && out->flags & APCACHE_FLAG_CHUNKED) {
+        out->levels = levels < APCACHE_LEVELS_MAX ? levels : APCACHE_LEVELS_MAX;
+        out->flags |= APCACHE_FLAG_LEVELS;
+    }
+    if (out->width != in->width || out->height != in->height) {
+        rw->scaler = scaler_alloc(opt->scaler, in->width, in->height,
+                                  AV_PIX_FMT_GRAY8, out->width, out->height);
+        if (!rw->scaler) return -2;
+        rw->src_size = (size_t)in->width * in->height;
+    }
+    size_t frame_size = (size_t)out->width * out->height;
+    if (!(rw->buf = malloc(frame_size))) return -2;
+    // Thumbnails are taken every so many frames, which needs a frame rate
+    if (thumb_interval > 0 && out->fps > 0) {
+        rw->thumbs = apcache_thumbs_alloc(out->width, out->height,
+                                          thumb_interval * 1000);
+        if (!rw->thumbs || !(rw->last = malloc(frame_size))) return -2;
+        rw->thumb_ticks = (uint64_t)out->fps * thumb_interval;
+        out->flags |= APCACHE_FLAG_THUMBS;
+    }
+    int err = apcache_create_file(out, path, 0);
+    if (err != 0) {
+        printf("Unable to create %s (code: %d)\n", path, err);
+        lerror("Unable to create %s (code: %d)", path, err);
+    }
+    return err;
+}
+
+// Add the thumbnails due in the next n ticks, all showing the last frame.
+static int add_thumbs(Rewriter *rw, uint64_t n) {
+    if (!rw->thumbs) return 0;
+    uint64_t next = (rw->ticks + rw->thumb_ticks - 1) / rw->thumb_ticks *
+                    rw->thumb_ticks;
+    for (; next < rw->ticks + n; next += rw->thumb_ticks) {
+        if (apcache_thumbs_add(rw->thumbs, rw->last, rw->last_off) != 0)
+            return -2;
+    }
+    rw->ticks += n;
+    return 0;
+}
+
+static int rewrite_frame(Rewriter *rw, APFrame *frame) {
+    APCache *out = rw->out;
+    size_t frame_size = (size_t)out->width * out->height;
+    switch (frame->type) {
+    case APAV_AUDIO:
+        if (rw->strip_audio) return 0;
+        return apcache_write_frame(out, frame);
+    case APAV_VIDEO: {
+        APFrame f = *frame;
+        int err;
+        if (rw->scaler) {
+            if (frame->bsize != rw->src_size) return APCACHE_ERR_UNKNOWN_FORMAT;
+            if (scaler_scale_gray(rw->scaler, frame->data, rw->buf) != 0)
+                return -2;
+            f.data = rw->buf;
+            f.bsize = frame_size;
+        }
+        if (rw->thumbs) {
+            if (f.bsize != frame_size) return APCACHE_ERR_UNKNOWN_FORMAT;
+            memcpy(rw->last, f.data, frame_size);
+            if ((err = apcache_tell(out, &rw->last_off)) != 0) return err;
+        }
+        if ((err = apcache_write_frame(out, &f)) != 0) return err;
+        return add_thumbs(rw, 1);
+    }
+    case APAV_REPEAT: {
+        uint32_t ticks;
+        if (frame->bsize < sizeof(uint32_t)) return APCACHE_ERR_UNKNOWN_FORMAT;
+        memcpy(&ticks, frame->data, sizeof(uint32_t));
+        int err = apcache_write_frame(out, frame);
+        if (err != 0) return err;
+        return add_thumbs(rw, ticks);
+    }
+    default:
+        // The thumbnail track of the input is rebuilt, not copied
+        return 0;
+    }
+}
+
+static int rewrite_file(Rewriter *rw, APCache *in) {
+    APFrame *frame = NULL;
+    int err;
+    while ((err = apcache_read_frame(in, &frame)) == 0) {
+        err = rewrite_frame(rw, frame);
+        if (err != 0) break;
+    }
+    apcache_frame_free(&frame);
+    return err == APCACHE_ERR_EOF ? 0 : err;
+}
+
+// Write the thumbnail track and commit the output, or drop it after err.
+static int rewriter_close(Rewriter *rw, int err) {
+    if (err == 0 && rw->thumbs) {
+        size_t size;
+        const void *track = apcache_thumbs_data(rw->thumbs, &size);
+        err = apcache_write_thumbs(rw->out, track, size);
+    }
+    if (err == 0) {
+        err = apcache_close(rw->out);
+    } else if (rw->out) {
+        apcache_abort(rw->out);
+    }
+    rewriter_free(rw);
+    return err;
+}
+
+// Rewrite one input into output with opt.
+static int convert(const char *input, const char *output,
+                   const ToolOptions *opt, int default_interval,
+                   int strip_audio) {
+    APCache *in;
+    int err = open_input(input, &in);
+    if (err != 0) return err;
+    int interval = opt->thumb_interval;
+    if (interval < 0) {
+        interval = input_thumb_interval(in);
+        if (interval == 0) interval = default_interval;
+    }
+    Rewriter rw;
+    err = rewriter_open(&rw, in, output, opt, interval, strip_audio);
+    if (err == 0) err = rewrite_file(&rw, in);
+    err = rewriter_close(&rw, err);
+    if (err != 0) {
+        printf("Unable to rewrite %s into %s (code: %d)\n", input, output,
+               err);
+        lerror("Unable to rewrite %s into %s (code: %d)", input, output, err);
+    }
+    apcache_close(in);
+    apcache_free(&in);
+    return err;
+}
+
+static int cmd_info(const char *path) {
+    APCache *apc;
+    int err = open_input(path, &apc);
+    if (err != 0) return err;
+    APFrame *frame = NULL;
+    APCacheThumbTrack track;
+    uint32_t thumbs = 0, interval_ms = 0;
+    if (apcache_read_thumbs(apc, &frame) == 0 &&
+        apcache_thumbs_parse(frame->data, frame->bsize, &track) == 0) {
+        thumbs = track.count;
+        interval_ms = track.interval_ms;
+    }
+    uint64_t video = 0, repeats = 0, audio = 0, samples = 0;
+    while ((err = apcache_read_frame(apc, &frame)) == 0) {
+        if (frame->type == APAV_VIDEO) {
+            video++;
+        } else if (frame->type == APAV_REPEAT &&
+                   frame->bsize >= sizeof(uint32_t)) {
+            uint32_t ticks;
+            memcpy(&ticks, frame->data, sizeof(uint32_t));
+            repeats += ticks;
+        } else if (frame->type == APAV_AUDIO) {
+            audio++;
+            samples += frame->bsize / (2 * sizeof(float));
+        }
+    }
+    apcache_frame_free(&frame);
+
+    struct stat st;
+    char video_len[32], audio_len[32];
+    format_duration(video_len, sizeof(video_len),
+                    apc->fps ? (double)(video + repeats) / apc->fps : 0);
+    format_duration(audio_len, sizeof(audio_len),
+                    apc->sample_rate ? (double)samples / apc->sample_rate
+                                     : 0);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        printf("file      %s (%.1f MiB)\n", path, st.st_size / 1048576.0);
+    } else {
+        printf("file      %s\n", path);
+    }
+    printf("version   %d, layout: %s%s\n", apc->version,
+           apc->flags & APCACHE_FLAG_ZLIB      ? "compress"
+           : apc->flags & APCACHE_FLAG_CHUNKED ? "chunked"
+                                               : "flat",
+           apc->flags & APCACHE_FLAG_THUMBS ? ", thumbs" : "");
+    if (apc->flags & APCACHE_FLAG_LEVELS) {
+        printf("levels    %u:", apc->levels);
+        for (uint32_t i = 0; i < apc->levels; i++) {
+            uint32_t w, h;
+            apcache_level_size(apc->width, apc->height, i, &w, &h);
+            printf(" %ux%u", w, h);
+        }
+        printf("\n");
+    }
+    printf("video     %ux%u at %u fps, %s, %llu frames + %llu repeats\n",
+           apc->width, apc->height, apc->fps, video_len,
+           (unsigned long long)video, (unsigned long long)repeats);
+    if (apc->sample_rate) {
+        printf("audio     %u Hz stereo, %s, %llu frames\n", apc->sample_rate,
+               audio_len, (unsigned long long)audio);
+    } else {
+        printf("audio     none\n");
+    }
+    if (thumbs) {
+        printf("thumbs    %u every %.1f s\n", thumbs, interval_ms / 1000.0);
+    } else {
+        printf("thumbs    none\n");
+    }
+    apcache_close(apc);
+    apcache_free(&apc);
+    return err == APCACHE_ERR_EOF ? 0 : err;
+}
+
+static int cmd_concat(const char *output, char **inputs, int input_num,
+                      const ToolOptions *opt) {
+    APCache *in;
+    int err = open_input(inputs[0], &in);
+    if (err != 0) return err;
+    int interval = opt->thumb_interval;
+    if (interval < 0) interval = input_thumb_interval(in);
+    Rewriter rw;
+    err = rewriter_open(&rw, in, output, opt, interval, 0);
+    for (int i = 0; err == 0 && i < input_num; i++) {
+        if (i > 0) {
+            apcache_close(in);
+            apcache_free(&in);
+            if ((err = open_input(inputs[i], &in)) != 0) break;
+        }
+        if (in->width != rw.out->width || in->height != rw.out->height ||
+            in->fps != rw.out->fps || in->sample_rate != rw.out->sample_rate) {
+            printf("%s is %ux%u at %u fps and %u Hz, unlike %s\n", inputs[i],
+                   in->width, in->height, in->fps, in->sample_rate,
+                   inputs[0]);
+            err = APCACHE_ERR_UNKNOWN_FORMAT;
+            break;
+        }
+        err = rewrite_file(&rw, in);
+    }
+    err = rewriter_close(&rw, err);
+    if (err != 0) {
+        printf("Unable to concatenate into %s (code: %d)\n", output, err);
+        lerror("Unable to concatenate into %s (code: %d)", output, err);
+    }
+    if (in) {
+        apcache_close(in);
+        apcache_free(&in);
+    }
+    return err;
+}
+
+// Parse the options after the positional arguments.
+static int parse_options(int argc, char *argv[], ToolOptions *opt) {
+    opt->width = 0;
+    opt->height = 0;
+    opt->scaler = SCALER_AREA;
+    opt->thumb_interval = -1;
+    opt->layout = -1;
+    opt->levels = -1;
+
+    arg_list al = new_arg_list();
+    arg_list_add(&al, ARG_TYPE_NUMBER, "width", '\0', "Width of resized frames");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "height", '\0',
+                 "Height of resized frames");
+    arg_list_add(&al, ARG_TYPE_STRING, "scaler", '\0',
+                 "Scaler (fast, bilinear, area, bicubic or box)");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "thumb-interval", '\0',
+                 "Seconds between thumbnails, 0 for none");
+    arg_list_add(&al, ARG_TYPE_STRING, "layout", '\0',
+                 "Layout (flat, chunked or compress)");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "levels", '\0',
+                 "Resolution levels of a chunked output");
+    int err = parse_args(&al, argc, argv);
+    if (err < 0) {
+        printf("Arg error: %d %s\n", err, parse_args_err(err));
+        free_arg_list(&al);
+        return -1;
+    }
+    arg *a;
+    if ((a = arg_list_search(&al, "width"))->set) opt->width = a->value.number;
+    if ((a = arg_list_search(&al, "height"))->set)
+        opt->height = a->value.number;
+    if ((a = arg_list_search(&al, "thumb-interval"))->set)
+        opt->thumb_interval = a->value.number < 0 ? 0 : a->value.number;
+    if ((a = arg_list_search(&al, "levels"))->set)
+        opt->levels = a->value.number < 1 ? 1 : a->value.number;
+    if ((a = arg_list_search(&al, "scaler"))->set) {
+        int mode = scaler_mode_parse(a->value.str);
+        if (mode < 0) {
+            printf("Unknown scaler: %s\n", a->value.str);
+            err = -1;
+        } else {
+            opt->scaler = mode;
+        }
+    }
+    if ((a = arg_list_search(&al, "layout"))->set &&
+        (opt->layout = layout_parse(a->value.str)) < 0) {
+        printf("Unknown layout: %s\n", a->value.str);
+        err = -1;
+    }
+    free_arg_list(&al);
+    return err < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    // Positional arguments come first, options after them
+    int pos = 1;
+    while (pos < argc && strncmp(argv[pos], "--", 2) != 0) pos++;
+    ToolOptions opt;
+    if (pos < 2 || parse_options(argc - pos, argv + pos, &opt) != 0) {
+        print_usage();
+        return -1;
+    }
+    const char *cmd = argv[1];
+    char **args = argv + 2;
+    int arg_num = pos - 2;
+    // Only resize changes the frame size
+    int resize = strcmp(cmd, "resize") == 0;
+    if (!resize) opt.width = opt.height = 0;
+
+    if (strcmp(cmd, "info") == 0 && arg_num == 1) {
+        return cmd_info(args[0]);
+    } else if (strcmp(cmd, "index") == 0 && arg_num == 2) {
+        return convert(args[0], args[1], &opt, 1, 0);
+    } else if (strcmp(cmd, "recompress") == 0 && arg_num == 2) {
+        if (opt.layout < 0) opt.layout = layout_parse("compress");
+        return convert(args[0], args[1], &opt, 0, 0);
+    } else if (resize && arg_num == 2 && opt.width > 0 && opt.height > 0) {
+        return convert(args[0], args[1], &opt, 0, 0);
+    } else if (strcmp(cmd, "strip-audio") == 0 && arg_num == 2) {
+        return convert(args[0], args[1], &opt, 0, 1);
+    } else if (strcmp(cmd, "concat") == 0 && arg_num >= 3) {
+        return cmd_concat(args[0], args + 1, arg_num - 1, &opt);
+    }
+    print_usage();
+    return -1;
+}
@@ -0,0 +1,228 @@
+#include "apcache_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct APCacheWriter {
+    int fd;
+    int flags;
+    char *path;
+    char *tmp_path;
+    uint8_t *bufs[APCACHE_WRITER_BUF_NUM];
+    size_t lens[APCACHE_WRITER_BUF_NUM];
+    // buffer being filled by the producer
+    int cur;
+    // buffers waiting for the flush thread, in order
+    int queue[APCACHE_WRITER_BUF_NUM];
+    int q_head;
+    int q_len;
+    // buffers ready to be filled
+    int free_list[APCACHE_WRITER_BUF_NUM];
+    int free_num;
+    pthread_mutex_t lock;
+    // signaled when a buffer is queued or when stopping
+    pthread_cond_t flush_cond;
+    // signaled when a buffer is released by the flush thread
+    pthread_cond_t free_cond;
+    int stopping;
+    // first error of the flush thread, 0 for none
+    int error;
+    size_t total;
+    pthread_t thread;
+};
+
+static atomic_int tmp_counter = 0;
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *flush_loop(void *arg) {
+    APCacheWriter *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->q_len == 0 && !w->stopping) {
+            pthread_cond_wait(&w->flush_cond, &w->lock);
+        }
+        if (w->q_len == 0) break;
+        int idx = w->queue[w->q_head];
+        w->q_head = (w->q_head + 1) % APCACHE_WRITER_BUF_NUM;
+        w->q_len--;
+        pthread_mutex_unlock(&w->lock);
+
+        int err = write_all(w->fd, w->bufs[idx], w->lens[idx]);
+
+        pthread_mutex_lock(&w->lock);
+        if (err && !w->error) w->error = err;
+        w->lens[idx] = 0;
+        w->free_list[w->free_num++] = idx;
+        pthread_cond_signal(&w->free_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int open_tmp(APCacheWriter *w) {
+    int oflags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (w->flags & APCACHE_WRITER_DIRECT) {
+        w->fd = open(w->tmp_path, oflags | O_DIRECT, 0644);
+        // Some filesystems (tmpfs) reject O_DIRECT
+        if (w->fd >= 0) return 0;
+    }
+#endif
+    w->fd = open(w->tmp_path, oflags, 0644);
+    if (w->fd < 0) return -errno;
+#ifdef F_NOCACHE
+    if (w->flags & APCACHE_WRITER_DIRECT) fcntl(w->fd, F_NOCACHE, 1);
+#endif
+    return 0;
+}
+
+static void writer_free(APCacheWriter *w) {
+    for (int i = 0; i < APCACHE_WRITER_BUF_NUM; i++) {
+        free(w->bufs[i]);
+    }
+    free(w->path);
+    free(w->tmp_path);
+    free(w);
+}
+
+APCacheWriter *apcache_writer_open(const char *path, int flags) {
+    if (!path) return NULL;
+    APCacheWriter *w = calloc(1, sizeof(APCacheWriter));
+    if (!w) return NULL;
+    w->fd = -1;
+    w->flags = flags;
+    w->path = strdup(path);
+    size_t tmp_len = strlen(path) + 64;
+    w->tmp_path = malloc(tmp_len);
+    if (!w->path || !w->tmp_path) {
+        writer_free(w);
+        return NULL;
+    }
+    snprintf(w->tmp_path, tmp_len, "%s.tmp.%d.%d", path, (int)getpid(),
+             atomic_fetch_add(&tmp_counter, 1));
+    for (int i = 0; i < APCACHE_WRITER_BUF_NUM; i++) {
+        if (posix_memalign((void **)&w->bufs[i], APCACHE_WRITER_ALIGN,
+                           APCACHE_WRITER_BUF_SIZE) != 0) {
+            w->bufs[i] = NULL;
+            writer_free(w);
+            return NULL;
+        }
+        w->free_list[i] = i;
+    }
+    w->free_num = APCACHE_WRITER_BUF_NUM;
+    w->cur = w->free_list[--w->free_num];
+    w->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    w->flush_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    w->free_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    if (open_tmp(w) != 0) {
+        writer_free(w);
+        return NULL;
+    }
+    if (pthread_create(&w->thread, NULL, flush_loop, w) != 0) {
+        close(w->fd);
+        unlink(w->tmp_path);
+        writer_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// Hand the current buffer to the flush thread and take a free one.
+static int submit_current(APCacheWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    int tail = (w->q_head + w->q_len) % APCACHE_WRITER_BUF_NUM;
+    w->queue[tail] = w->cur;
+    w->q_len++;
+    pthread_cond_signal(&w->flush_cond);
+    while (w->free_num == 0 && !w->error) {
+        pthread_cond_wait(&w->free_cond, &w->lock);
+    }
+    int err = w->error;
+    if (!err) w->cur = w->free_list[--w->free_num];
+    pthread_mutex_unlock(&w->lock);
+    return err;
+}
+
+int apcache_writer_write(APCacheWriter *w, const void *data, size_t size) {
+    if (!w) return -EINVAL;
+    const uint8_t *p = data;
+    while (size > 0) {
+        size_t room = APCACHE_WRITER_BUF_SIZE - w->lens[w->cur];
+        size_t n = size < room ? size : room;
+        memcpy(w->bufs[w->cur] + w->lens[w->cur], p, n);
+        w->lens[w->cur] += n;
+        w->total += n;
+        p += n;
+        size -= n;
+        if (w->lens[w->cur] == APCACHE_WRITER_BUF_SIZE) {
+            int err = submit_current(w);
+            if (err) return err;
+        }
+    }
+    return 0;
+}
+
+size_t apcache_writer_tell(APCacheWriter *w) { return w ? w->total : 0; }
+
+// fsync the directory holding path so the rename itself is durable.
+static void sync_parent_dir(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) return;
+    int fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+int apcache_writer_close(APCacheWriter *w, int commit) {
+    if (!w) return -EINVAL;
+    pthread_mutex_lock(&w->lock);
+    w->stopping = 1;
+    pthread_cond_signal(&w->flush_cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    int err = w->error;
+    if (!err && commit && w->lens[w->cur] > 0) {
+#ifdef O_DIRECT
+        // The tail is not block-aligned, write it through the page cache
+        int fl = fcntl(w->fd, F_GETFL);
+        if (fl >= 0 && (fl & O_DIRECT)) fcntl(w->fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+        err = write_all(w->fd, w->bufs[w->cur], w->lens[w->cur]);
+    }
+    if (!err && commit && fsync(w->fd) != 0) err = -errno;
+    if (close(w->fd) != 0 && !err) err = -errno;
+    if (!err && commit) {
+        if (rename(w->tmp_path, w->path) != 0) {
+            err = -errno;
+        } else {
+            sync_parent_dir(w->path);
+        }
+    }
+    if (err || !commit) unlink(w->tmp_path);
+    writer_free(w);
+    return err;
+}
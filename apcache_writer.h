@@ -0,0 +1,50 @@
+#ifndef APCACHE_WRITER_H
+#define APCACHE_WRITER_H
+
+#include <stddef.h>
+
+// Size of each write buffer, a multiple of the O_DIRECT alignment.
+#define APCACHE_WRITER_BUF_SIZE (4 << 20)
+// Number of write buffers, one is filled while the others are flushed.
+#define APCACHE_WRITER_BUF_NUM 4
+// Alignment of write buffers and of O_DIRECT writes.
+#define APCACHE_WRITER_ALIGN 4096
+
+typedef enum {
+    // Bypass the page cache (O_DIRECT on Linux, F_NOCACHE on macOS)
+    APCACHE_WRITER_DIRECT = 1,
+} APCacheWriterFlag;
+
+// Buffered file writer with a background flush thread.
+// Data is written to a temporary file next to the target path, which is
+// fsync()ed and renamed onto the target path only when closed with commit,
+// so a crash never leaves a truncated file at the target path.
+typedef struct APCacheWriter APCacheWriter;
+
+/// @brief Create the temporary file and start the flush thread.
+/// @param path Final path of the file.
+/// @param flags Bitwise or of APCacheWriterFlag.
+/// @return The pointer to allocated writer, NULL for error.
+APCacheWriter *apcache_writer_open(const char *path, int flags);
+
+/// @brief Append data. Only blocks when every buffer is waiting for disk.
+/// @param w Writer.
+/// @param data Data to be appended.
+/// @param size Size of data (in bytes).
+/// @return 0 for success, minus number for error (including an earlier
+///         error of the flush thread).
+int apcache_writer_write(APCacheWriter *w, const void *data, size_t size);
+
+/// @brief Number of bytes appended so far.
+/// @param w Writer.
+/// @return Number of bytes.
+size_t apcache_writer_tell(APCacheWriter *w);
+
+/// @brief Flush everything, stop the flush thread and free the writer.
+/// @param w Writer.
+/// @param commit Non-zero to fsync and rename the temporary file onto the
+///               final path, zero to remove the temporary file.
+/// @return 0 for success, minus number for error.
+int apcache_writer_close(APCacheWriter *w, int commit);
+
+#endif
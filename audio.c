@@ -0,0 +1,339 @@
+#include "audio.h"
+
+#include <math.h>
+#include <ncurses.h>
+#include <portaudio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "display.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "resample.h"
+
+struct AudioPlayer {
+    AVCodecContext *cdc;
+    Resampler *resampler;
+    // as a bool value, Pa_Initialize succeeded
+    int pa_init;
+    PaStream *stream;
+    // sample rate of the stream
+    int rate;
+    // audio packets from the demux thread
+    PacketQueue *packets;
+    // subtracted from the audio timestamps (in seconds), so the clock counts
+    // from the start of the video
+    double origin;
+    // time of the first sample of ring (in seconds), set before playing
+    double first_pts;
+    int has_first;
+    // output latency of the device (in seconds)
+    double latency;
+    pthread_t thread;
+    int thread_started;
+    // jitter buffer of cap interleaved stereo samples, written and read
+    // count every sample since the start and only grow
+    float *ring;
+    size_t cap;
+    atomic_size_t written;
+    atomic_size_t read;
+    // as a bool value, the stream is started
+    atomic_int playing;
+    // read count and time (metrics_now_us) of the last callback that
+    // played samples, written by stamp_clock under the clock_seq seqlock
+    atomic_uint clock_seq;
+    atomic_size_t clock_samples;
+    atomic_uint_fast64_t clock_us;
+    // as a bool value, every sample was written to ring
+    atomic_int eof;
+    // counted by the callback since the last flush_counters
+    atomic_uint_fast64_t underruns;
+    atomic_uint_fast64_t overruns;
+    uint64_t total_underruns;
+    uint64_t total_overruns;
+    // time to sleep on a full (or draining) buffer, half a callback
+    useconds_t poll_us;
+};
+
+static void audio_fatal(const char *what, int err) {
+    if (atomic_fetch_and(&ncurses_status, 0)) {
+        endwin();
+    }
+    printf("%s (code: %d)\n", what, err);
+    lfatal(-10, "%s (code: %d)", what, err);
+}
+
+// Record that the sample at read count samples goes to the device now.
+static void stamp_clock(AudioPlayer *p, size_t samples) {
+    unsigned seq = atomic_load_explicit(&p->clock_seq, memory_order_relaxed);
+    atomic_store_explicit(&p->clock_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&p->clock_samples, samples, memory_order_relaxed);
+    atomic_store_explicit(&p->clock_us, metrics_now_us(),
+                          memory_order_relaxed);
+    atomic_store_explicit(&p->clock_seq, seq + 2, memory_order_release);
+}
+
+// Play from the jitter buffer, silence where it runs dry.
+static int audio_callback(const void *input, void *output,
+                          unsigned long frames,
+                          const PaStreamCallbackTimeInfo *time_info,
+                          PaStreamCallbackFlags flags, void *arg) {
+    AudioPlayer *p = arg;
+    float *out = output;
+    size_t r = atomic_load_explicit(&p->read, memory_order_relaxed);
+    size_t avail =
+        atomic_load_explicit(&p->written, memory_order_acquire) - r;
+    size_t n = avail < frames ? avail : frames;
+    // Silence does not move the clock, it keeps running from the last stamp
+    if (n > 0) stamp_clock(p, r);
+    size_t pos = r % p->cap;
+    size_t first = n < p->cap - pos ? n : p->cap - pos;
+    memcpy(out, p->ring + pos * 2, first * 2 * sizeof(float));
+    memcpy(out + first * 2, p->ring, (n - first) * 2 * sizeof(float));
+    atomic_store_explicit(&p->read, r + n, memory_order_release);
+    if (n < frames) {
+        memset(out + n * 2, 0, (frames - n) * 2 * sizeof(float));
+        // Silence after the last sample is the end, not a gap
+        if (!atomic_load(&p->eof)) atomic_fetch_add(&p->underruns, 1);
+    }
+    if (flags & paOutputUnderflow) atomic_fetch_add(&p->underruns, 1);
+    if (flags & paOutputOverflow) atomic_fetch_add(&p->overruns, 1);
+    return paContinue;
+}
+
+// Move the counts of the callback into metrics and the log.
+static void flush_counters(AudioPlayer *p) {
+    uint64_t underruns = atomic_exchange(&p->underruns, 0);
+    uint64_t overruns = atomic_exchange(&p->overruns, 0);
+    if (underruns) {
+        metrics_count(MC_AUDIO_UNDERRUNS, underruns);
+        p->total_underruns += underruns;
+        lwarn("Audio underrun (%llu so far)",
+              (unsigned long long)p->total_underruns);
+    }
+    if (overruns) {
+        metrics_count(MC_AUDIO_OVERRUNS, overruns);
+        p->total_overruns += overruns;
+        lwarn("Audio overrun (%llu so far)",
+              (unsigned long long)p->total_overruns);
+    }
+}
+
+// Called by the audio thread only.
+static void start_playing(AudioPlayer *p) {
+    if (atomic_load(&p->playing)) return;
+    // The clock runs from here until the first callback
+    stamp_clock(p, 0);
+    atomic_store(&p->playing, 1);
+    linfo("Starting audio stream...");
+    Pa_StartStream(p->stream);
+}
+
+// Copy samples into the jitter buffer, waiting for room. Playback starts
+// the first time the buffer is full.
+static void ring_write(AudioPlayer *p, const float *samples, size_t n) {
+    while (n > 0) {
+        size_t w = atomic_load_explicit(&p->written, memory_order_relaxed);
+        size_t space =
+            p->cap - (w - atomic_load_explicit(&p->read, memory_order_acquire));
+        if (space == 0) {
+            start_playing(p);
+            usleep(p->poll_us);
+            continue;
+        }
+        size_t k = n < space ? n : space;
+        size_t pos = w % p->cap;
+        size_t first = k < p->cap - pos ? k : p->cap - pos;
+        memcpy(p->ring + pos * 2, samples, first * 2 * sizeof(float));
+        memcpy(p->ring, samples + first * 2, (k - first) * 2 * sizeof(float));
+        atomic_store_explicit(&p->written, w + k, memory_order_release);
+        samples += k * 2;
+        n -= k;
+    }
+}
+
+// Decode and resample queued packets into the jitter buffer.
+static void *audio_thread(void *arg) {
+    AudioPlayer *p = arg;
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pckt = av_packet_alloc();
+    if (!frame || !pckt) {
+        audio_fatal("Unable to allocate AVFrame or AVPacket for audio", -1);
+    }
+    int got = 1;
+    while (got > 0) {
+        got = packet_queue_get(p->packets, pckt);
+        // Aborted, nothing more is played
+        if (got < 0) break;
+        // The end of the stream drains the decoder
+        int err = avcodec_send_packet(p->cdc, got ? pckt : NULL);
+        av_packet_unref(pckt);
+        if (err < 0) {
+            audio_fatal("Error when supplying raw packet data as input to "
+                        "audio decoder.",
+                        err);
+        }
+        while ((err = avcodec_receive_frame(p->cdc, frame)) == 0) {
+            // The ring starts at the first frame
+            if (!p->has_first) {
+                if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                    p->first_pts = frame->best_effort_timestamp *
+                                       av_q2d(p->packets->time_base) -
+                                   p->origin;
+                }
+                p->has_first = 1;
+            }
+            const float *samples;
+            int nb_samples;
+            METRICS_TIMED(MH_AUDIO_RESAMPLE,
+                          err = resampler_convert(p->resampler, frame,
+                                                  &samples, &nb_samples));
+            if (err != 0) audio_fatal("Error when resampling audio data.", err);
+            ring_write(p, samples, nb_samples);
+            av_frame_unref(frame);
+        }
+        if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
+            audio_fatal("Failed when decoding audio.", err);
+        }
+        flush_counters(p);
+    }
+    av_packet_free(&pckt);
+    av_frame_free(&frame);
+    atomic_store(&p->eof, 1);
+    // Audio shorter than the buffer
+    start_playing(p);
+    return NULL;
+}
+
+// Open the default device at its own rate, so a rate conversion is done
+// once by the resampler picked rather than by the host API, or at the
+// source rate when the device refuses it.
+static int open_stream(AudioPlayer *p) {
+    linfo("Initializing PortAudio...");
+    if (Pa_Initialize() != paNoError) return AUDIO_ERR_INIT;
+    p->pa_init = 1;
+    PaStreamParameters param;
+    param.device = Pa_GetDefaultOutputDevice();
+    if (param.device == paNoDevice) return AUDIO_ERR_NO_DEVICE;
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(param.device);
+    param.sampleFormat = paFloat32;
+    param.channelCount = 2;
+    param.suggestedLatency = info->defaultLowOutputLatency;
+    param.hostApiSpecificStreamInfo = NULL;
+    linfo("Opening audio stream...");
+    p->rate = info->defaultSampleRate;
+    if (p->rate <= 0) p->rate = p->cdc->sample_rate;
+    PaError err = Pa_OpenStream(&p->stream, NULL, &param, p->rate,
+                                AUDIO_BUF_SIZE, paClipOff, audio_callback, p);
+    if (err != paNoError && p->rate != p->cdc->sample_rate) {
+        p->rate = p->cdc->sample_rate;
+        err = Pa_OpenStream(&p->stream, NULL, &param, p->rate, AUDIO_BUF_SIZE,
+                            paClipOff, audio_callback, p);
+    }
+    if (err != paNoError) {
+        p->stream = NULL;
+        return AUDIO_ERR_OPEN_STREAM;
+    }
+    const PaStreamInfo *stream_info = Pa_GetStreamInfo(p->stream);
+    if (stream_info) p->latency = stream_info->outputLatency;
+    return 0;
+}
+
+int audio_player_open(const config *conf, AVCodecContext *cdc,
+                      PacketQueue *packets, double origin,
+                      AudioPlayer **player) {
+    *player = NULL;
+    AudioPlayer *p = calloc(1, sizeof(AudioPlayer));
+    if (!p) return AUDIO_ERR_ALLOC;
+    p->cdc = cdc;
+    p->packets = packets;
+    p->origin = origin;
+    atomic_init(&p->written, 0);
+    atomic_init(&p->read, 0);
+    atomic_init(&p->playing, 0);
+    atomic_init(&p->clock_seq, 0);
+    atomic_init(&p->clock_samples, 0);
+    atomic_init(&p->clock_us, 0);
+    atomic_init(&p->eof, 0);
+    atomic_init(&p->underruns, 0);
+    atomic_init(&p->overruns, 0);
+    int err = open_stream(p);
+    if (err == 0) {
+        p->resampler = resampler_alloc(conf->resampler, cdc->sample_fmt,
+                                       cdc->sample_rate, &cdc->ch_layout,
+                                       p->rate);
+        // At least two callbacks, or the device waits on every write
+        p->cap = (size_t)p->rate * conf->audio_latency_ms / 1000;
+        if (p->cap < 2 * AUDIO_BUF_SIZE) p->cap = 2 * AUDIO_BUF_SIZE;
+        p->poll_us = (useconds_t)(500000.0 * AUDIO_BUF_SIZE / p->rate);
+        p->ring = malloc(p->cap * 2 * sizeof(float));
+        if (!p->resampler || !p->ring) err = AUDIO_ERR_ALLOC;
+    }
+    if (err == 0) {
+        if (pthread_create(&p->thread, NULL, audio_thread, p) != 0) {
+            err = AUDIO_ERR_ALLOC;
+        } else {
+            p->thread_started = 1;
+        }
+    }
+    if (err != 0) {
+        audio_player_free(p);
+        return err;
+    }
+    linfo("Audio: %d Hz to %d Hz (%s path), %zu ms jitter buffer",
+          cdc->sample_rate, p->rate,
+          resample_path_name(resampler_path(p->resampler)),
+          p->cap * 1000 / p->rate);
+    *player = p;
+    return 0;
+}
+
+double audio_player_clock(AudioPlayer *p) {
+    if (!atomic_load(&p->playing)) return NAN;
+    unsigned seq;
+    size_t samples;
+    uint64_t stamp_us;
+    do {
+        seq = atomic_load_explicit(&p->clock_seq, memory_order_acquire);
+        samples =
+            atomic_load_explicit(&p->clock_samples, memory_order_relaxed);
+        stamp_us = atomic_load_explicit(&p->clock_us, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&p->clock_seq, memory_order_relaxed));
+    return p->first_pts + (double)samples / p->rate +
+           (metrics_now_us() - stamp_us) / 1000000.0 - p->latency;
+}
+
+void audio_player_finish(AudioPlayer *p) {
+    if (!p->thread_started) return;
+    pthread_join(p->thread, NULL);
+    p->thread_started = 0;
+    // Let the callback play the buffer out
+    while (atomic_load(&p->read) < atomic_load(&p->written)) {
+        usleep(p->poll_us);
+    }
+    flush_counters(p);
+}
+
+void audio_player_free(AudioPlayer *p) {
+    if (!p) return;
+    if (p->stream) {
+        // Waits for the buffers handed to the device
+        if (atomic_load(&p->playing)) Pa_StopStream(p->stream);
+        Pa_CloseStream(p->stream);
+    }
+    if (p->pa_init) Pa_Terminate();
+    flush_counters(p);
+    linfo("Audio: %llu underruns, %llu overruns",
+          (unsigned long long)p->total_underruns,
+          (unsigned long long)p->total_overruns);
+    resampler_free(p->resampler);
+    free(p->ring);
+    free(p);
+}
@@ -0,0 +1,63 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <libavcodec/avcodec.h>
+
+#include "config.h"
+#include "demux.h"
+
+// Frames per PortAudio callback
+// https://stackoverflow.com/questions/35446049/port-audio-causing-loud-buzzing-50-of-tests
+#define AUDIO_BUF_SIZE 1024
+
+typedef enum {
+    AUDIO_ERR_INIT = -300000,
+    AUDIO_ERR_NO_DEVICE,
+    AUDIO_ERR_OPEN_STREAM,
+    AUDIO_ERR_ALLOC,
+} AudioErr;
+
+// Plays the audio stream of a video on its own thread.
+// The audio thread pulls packets from the audio queue of the Demuxer,
+// decodes and resamples them into a jitter buffer holding
+// --audio-latency-ms of samples. The PortAudio callback plays from the
+// jitter buffer, so a slow video frame no longer holds up the audio
+// device: it only drains the buffer, and the device underruns once the
+// buffer is empty. The samples taken by the callback make the master
+// clock of the video (audio_player_clock). Underruns (the buffer or the device running dry) and overruns
+// reported by the device are counted in metrics and logged at the end.
+typedef struct AudioPlayer AudioPlayer;
+
+/// @brief Open the default output device at its own rate and start the
+///        audio thread. Playback starts once the jitter buffer is full.
+/// @param conf Parsed config (resampler, audio_latency_ms).
+/// @param cdc Opened audio decoder, used by the audio thread only from now
+///        on.
+/// @param packets Audio packet queue, read until its end.
+/// @param origin Start of the video stream (in seconds of the audio
+///        timestamps), the 0 of audio_player_clock.
+/// @param player Set to the player.
+/// @return 0 for success, minus number for AudioErr
+int audio_player_open(const config *conf, AVCodecContext *cdc,
+                      PacketQueue *packets, double origin,
+                      AudioPlayer **player);
+
+/// @brief Presentation time of the audio heard now: the samples taken by
+///        the callback over the device rate, less the output latency.
+///        Between two callbacks and through underruns or the end of the
+///        audio it runs on from the last callback that played samples.
+/// @param p Player.
+/// @return Time in seconds from origin, NAN before the playback starts.
+double audio_player_clock(AudioPlayer *p);
+
+/// @brief Wait until the audio thread reached the end of the packet queue
+///        and the buffered audio is heard.
+/// @param p Player.
+void audio_player_finish(AudioPlayer *p);
+
+/// @brief Stop the device, log the underrun and overrun counts and free the
+///        player.
+/// @param p Player, may be NULL.
+void audio_player_free(AudioPlayer *p);
+
+#endif
@@ -3,34 +3,78 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/error.h>
+#include <libavutil/mem.h>
 
 #include "config.h"
+#include "log/log.h"
+
+// Log an FFmpeg error of what.
+static void log_averror(const char *what, int code) {
+    char err[64];
+    if (av_strerror(code, err, sizeof(err) - 1) < 0) {
+        lerror("%s: unknown AV error (code: 0x%X)", what, code);
+        return;
+    }
+    lerror("%s: %s (code: 0x%X)", what, err, code);
+}
+
+static int read_stream_io(void *opaque, uint8_t *buf, int size) {
+    ssize_t n = apcache_stream_read_some(opaque, buf, size);
+    if (n < 0) return AVERROR(EIO);
+    return n == 0 ? AVERROR_EOF : (int)n;
+}
+
+AVIOContext *alloc_stream_io(APCacheStream *s) {
+    unsigned char *buf = av_malloc(STREAM_IO_BUF_SIZE);
+    if (!buf) return NULL;
+    AVIOContext *io = avio_alloc_context(buf, STREAM_IO_BUF_SIZE, 0, s,
+                                         read_stream_io, NULL, NULL);
+    if (!io) av_free(buf);
+    return io;
+}
+
+void free_stream_io(AVIOContext **io) {
+    if (!*io) return;
+    av_freep(&(*io)->buffer);
+    avio_context_free(io);
+}
 
 int find_codec_context(config *conf, AVFormatContext **p_fmt_ctxt,
                        AVCodecContext **p_a_cdc, AVCodecContext **p_v_cdc,
                        int *p_a_idx, int *p_v_idx) {
     AVFormatContext *fmt_ctxt = NULL;
-    AVCodecContext *a_cdc = NULL, *v_cdc = NULL;
+    AVCodecContext *a_cdc = NULL, *v_cdc = NULL, *cdc = NULL;
     *p_a_idx = *p_v_idx = -1;
+    int ret = -2;
 
+    // A piped video is read through the stream that sniffed it
+    if (conf->input_io) {
+        fmt_ctxt = avformat_alloc_context();
+        if (!fmt_ctxt) {
+            lerror("Unable to allocate AVFormatContext");
+            goto cleanup;
+        }
+        fmt_ctxt->pb = conf->input_io;
+        fmt_ctxt->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
     // Try to open input.
     int err_code = avformat_open_input(&fmt_ctxt, conf->filename, NULL, NULL);
     // Error occurred.
     if (err_code != 0) {
-        print_averror(err_code);
-        return -2;
+        log_averror("Unable to open input", err_code);
+        goto cleanup;
     }
     if (!fmt_ctxt) {
-        printf("AVFormatContext is NULL\n");
-        return -2;
+        lerror("AVFormatContext is NULL");
+        goto cleanup;
     }
 
     // Try to get stream info from input.
     err_code = avformat_find_stream_info(fmt_ctxt, NULL);
     // Handle error.
     if (err_code < 0) {
-        print_averror(err_code);
-        return -2;
+        log_averror("Unable to find stream info", err_code);
+        goto cleanup;
     }
 
     for (int i = 0; i < fmt_ctxt->nb_streams; i++) {
@@ -39,20 +83,19 @@ int find_codec_context(config *conf, AVFormatContext **p_fmt_ctxt,
         if (!codec) {
             continue;
         }
-        AVCodecContext *cdc = NULL;
         cdc = avcodec_alloc_context3(codec);
         if (!cdc) {
-            printf("Unable to allocate AVCodecContext\n");
-            return -2;
+            lerror("Unable to allocate AVCodecContext");
+            goto cleanup;
         }
         int err = avcodec_parameters_to_context(cdc, codec_param);
         if (err < 0) {
-            print_averror(err);
-            return -2;
+            log_averror("Unable to copy codec parameters", err);
+            goto cleanup;
         }
         if (avcodec_open2(cdc, codec, NULL) < 0) {
-            printf("Unable to initialize AVCodecContext\n");
-            return -2;
+            lerror("Unable to initialize AVCodecContext");
+            goto cleanup;
         }
         switch (codec->type) {
             case AVMEDIA_TYPE_VIDEO:
@@ -69,23 +112,32 @@ int find_codec_context(config *conf, AVFormatContext **p_fmt_ctxt,
                 avcodec_free_context(&cdc);
                 break;
         }
+        cdc = NULL;
     }
 
     // Handle excpetions.
     if (!v_cdc) {
-        printf("No video stream track found\n");
-        return -3;
+        lerror("No video stream track found");
+        ret = -3;
+        goto cleanup;
     }
     if (!a_cdc) {
-        printf("No audio stream track found\n");
+        lwarn("No audio stream track found, --no-audio has been set to true");
         conf->no_audio = 1;
-        printf("--no-audio has been set to true\n");
     }
 
     (*p_fmt_ctxt) = fmt_ctxt;
     (*p_a_cdc) = a_cdc;
     (*p_v_cdc) = v_cdc;
     return 0;
+
+cleanup:
+    avcodec_free_context(&cdc);
+    avcodec_free_context(&a_cdc);
+    avcodec_free_context(&v_cdc);
+    avformat_close_input(&fmt_ctxt);
+    *p_a_idx = *p_v_idx = -1;
+    return ret;
 }
 
 void print_averror(int code) {
@@ -7,10 +7,27 @@
 #include <pthread.h>
 #include <stdatomic.h>
 
+#include "apcache_stream.h"
 #include "config.h"
 
+// Size of the buffer libavformat reads a stream through
+#define STREAM_IO_BUF_SIZE 32768
+
 void print_averror(int code);
 
+/// @brief Let libavformat read a stream being read ahead, from its first
+///        buffered byte, e.g. a FIFO sniffed as not an apcache file.
+/// @param s Stream, still owned by the caller and closed after the context.
+/// @return The pointer to allocated context, NULL for error.
+AVIOContext *alloc_stream_io(APCacheStream *s);
+
+/// @brief Free a context of alloc_stream_io and its buffer.
+/// @param io Pointer to the context, may point to NULL.
+void free_stream_io(AVIOContext **io);
+
+/// @brief Open conf->filename and its video and audio decoders. Errors are
+///        logged, not printed, nothing is left allocated on error.
+/// @return 0 for success, -2 for an unreadable input, -3 for no video.
 extern int find_codec_context(config *conf, AVFormatContext **p_fmt_ctxt,
                               AVCodecContext **p_a_cdc,
                               AVCodecContext **p_v_cdc, int *p_a_idx,
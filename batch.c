@@ -0,0 +1,296 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apcache.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "transcode.h"
+
+// Frame size used when neither --width/--height nor a terminal is available
+#define BATCH_DEFAULT_WIDTH 80
+#define BATCH_DEFAULT_HEIGHT 24
+
+typedef enum { JOB_PENDING, JOB_DONE, JOB_SKIPPED, JOB_FAILED } JobState;
+
+typedef struct {
+    char *input;
+    char *output;
+    JobState state;
+    int err;
+    TranscodeStats stats;
+} BatchJob;
+
+typedef struct {
+    BatchJob *jobs;
+    int job_num;
+    atomic_int next;
+    atomic_int finished;
+    int width;
+    int height;
+    int no_audio;
+    int direct_io;
+    int thumb_interval;
+    int chunked;
+    int compress;
+    int levels;
+    ScalerMode scaler;
+    pthread_mutex_t print_lock;
+} BatchQueue;
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int add_path(char ***paths, int *num, int *cap, const char *path) {
+    if (*num == *cap) {
+        int new_cap = *cap ? *cap * 2 : 16;
+        char **p = realloc(*paths, new_cap * sizeof(char *));
+        if (!p) return -1;
+        *paths = p;
+        *cap = new_cap;
+    }
+    if (!((*paths)[*num] = strdup(path))) return -1;
+    (*num)++;
+    return 0;
+}
+
+// List inputs from a directory or a list file.
+// Return the number of paths, minus number for error.
+static int list_inputs(const char *src, char ***paths) {
+    int num = 0, cap = 0;
+    *paths = NULL;
+    struct stat st;
+    if (stat(src, &st) != 0) return -1;
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(src);
+        if (!dir) return -1;
+        struct dirent *ent;
+        char path[4096];
+        while ((ent = readdir(dir))) {
+            if (ent->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/%s", src, ent->d_name);
+            struct stat est;
+            if (stat(path, &est) != 0 || !S_ISREG(est.st_mode)) continue;
+            // Never feed our own output back in
+            int len = strlen(ent->d_name);
+            if (len > 8 && strcmp(ent->d_name + len - 8, ".apcache") == 0)
+                continue;
+            if (add_path(paths, &num, &cap, path) != 0) break;
+        }
+        closedir(dir);
+        qsort(*paths, num, sizeof(char *), cmp_str);
+        return num;
+    }
+    FILE *fp = fopen(src, "r");
+    if (!fp) return -1;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (add_path(paths, &num, &cap, line) != 0) break;
+    }
+    fclose(fp);
+    return num;
+}
+
+// The source extension is kept (a.mp4.apcache), so a.mp4 and a.mkv of one
+// directory do not write into the same file.
+static char *output_path(const char *out_dir, const char *input) {
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    size_t len = strlen(out_dir) + strlen(base) + sizeof("/.apcache");
+    char *out = malloc(len);
+    if (out) snprintf(out, len, "%s/%s.apcache", out_dir, base);
+    return out;
+}
+
+// Index of the job before idx writing the same output, -1 for none.
+static int find_collision(const BatchJob *jobs, int idx) {
+    for (int i = 0; i < idx; i++) {
+        if (jobs[i].output && strcmp(jobs[i].output, jobs[idx].output) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Whether output is a valid apcache file newer than input with the same size.
+static int up_to_date(const char *input, const char *output, int width,
+                      int height) {
+    struct stat in_st, out_st;
+    if (stat(input, &in_st) != 0 || stat(output, &out_st) != 0) return 0;
+    if (out_st.st_mtime < in_st.st_mtime) return 0;
+    APCache *apc = NULL;
+    if (apcache_open((char *)output, &apc) != 0) return 0;
+    int same = apc->width == (uint32_t)width && apc->height == (uint32_t)height;
+    apcache_close(apc);
+    apcache_free(&apc);
+    return same;
+}
+
+static void *batch_worker(void *arg) {
+    BatchQueue *q = arg;
+    int idx;
+    while ((idx = atomic_fetch_add(&q->next, 1)) < q->job_num) {
+        BatchJob *job = &q->jobs[idx];
+        if (up_to_date(job->input, job->output, q->width, q->height)) {
+            job->state = JOB_SKIPPED;
+        } else {
+            TranscodeJob tj = {.input = job->input,
+                               .output = job->output,
+                               .width = q->width,
+                               .height = q->height,
+                               .scaler = q->scaler,
+                               .no_audio = q->no_audio,
+                               .direct_io = q->direct_io,
+                               .thumb_interval = q->thumb_interval,
+                               .chunked = q->chunked,
+                               .compress = q->compress,
+                               .levels = q->levels};
+            job->err = transcode_to_apcache(&tj, &job->stats);
+            job->state = job->err ? JOB_FAILED : JOB_DONE;
+        }
+        int done = atomic_fetch_add(&q->finished, 1) + 1;
+        pthread_mutex_lock(&q->print_lock);
+        switch (job->state) {
+            case JOB_SKIPPED:
+                printf("[%d/%d] up to date  %s\n", done, q->job_num,
+                       job->output);
+                break;
+            case JOB_DONE:
+                printf("[%d/%d] done        %s (%llu frames, %.1fs, %.1f fps)\n",
+                       done, q->job_num, job->output,
+                       (unsigned long long)job->stats.video_frames,
+                       job->stats.seconds,
+                       job->stats.seconds > 0
+                           ? job->stats.video_frames / job->stats.seconds
+                           : 0);
+                break;
+            default:
+                printf("[%d/%d] failed      %s (code: %d)\n", done, q->job_num,
+                       job->input, job->err);
+                break;
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&q->print_lock);
+    }
+    return NULL;
+}
+
+static void batch_frame_size(config *conf, int *width, int *height) {
+    *width = BATCH_DEFAULT_WIDTH;
+    *height = BATCH_DEFAULT_HEIGHT;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1 &&
+        ws.ws_row > 0) {
+        *width = ws.ws_col - 1;
+        *height = ws.ws_row;
+    }
+    if (conf->target_width > 0) *width = conf->target_width;
+    if (conf->target_height > 0) *height = conf->target_height;
+}
+
+int run_batch(config *conf) {
+    char **inputs;
+    int num = list_inputs(conf->filename, &inputs);
+    if (num < 0) {
+        printf("Unable to read batch input list (path: %s)\n", conf->filename);
+        lerror("Unable to read batch input list (path: %s)", conf->filename);
+        return -1;
+    }
+    if (mkdir(conf->batch, 0755) != 0 && errno != EEXIST) {
+        printf("Unable to create output directory (path: %s)\n", conf->batch);
+        lerror("Unable to create output directory (path: %s)", conf->batch);
+        return -2;
+    }
+
+    BatchQueue q;
+    q.jobs = calloc(num ? num : 1, sizeof(BatchJob));
+    atomic_init(&q.next, 0);
+    atomic_init(&q.finished, 0);
+    q.no_audio = conf->no_audio;
+    q.direct_io = conf->direct_io;
+    q.thumb_interval = conf->thumb_interval;
+    q.chunked = conf->chunked;
+    q.compress = conf->compress;
+    q.levels = conf->levels;
+    q.scaler = conf->scaler;
+    q.print_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    batch_frame_size(conf, &q.width, &q.height);
+    // Inputs of one name from different directories of a list would be
+    // transcoded into one file at once, only the first one is converted
+    q.job_num = 0;
+    int collided = 0;
+    for (int i = 0; i < num; i++) {
+        BatchJob *job = &q.jobs[q.job_num];
+        job->input = inputs[i];
+        job->output = output_path(conf->batch, inputs[i]);
+        job->state = JOB_PENDING;
+        int first = job->output ? find_collision(q.jobs, q.job_num) : -1;
+        if (first >= 0) {
+            printf("Skipping %s, %s is written from %s\n", job->input,
+                   job->output, q.jobs[first].input);
+            lwarn("Skipping %s, %s is written from %s", job->input,
+                  job->output, q.jobs[first].input);
+            free(job->input);
+            free(job->output);
+            collided++;
+            continue;
+        }
+        q.job_num++;
+    }
+
+    int workers = conf->jobs;
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (workers > q.job_num) workers = q.job_num;
+    printf("Converting %d file(s) into %s at %dx%d with %d worker(s)\n",
+           q.job_num, conf->batch, q.width, q.height, workers);
+    linfo("Batch: %d inputs, %d workers, %dx%d", q.job_num, workers, q.width,
+          q.height);
+
+    uint64_t start = metrics_now_us();
+    pthread_t *threads = calloc(workers ? workers : 1, sizeof(pthread_t));
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, batch_worker, &q);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (metrics_now_us() - start) / 1e6;
+
+    // Colliding inputs were not converted
+    int done = 0, skipped = 0, failed = collided;
+    uint64_t frames = 0, bytes_out = 0;
+    for (int i = 0; i < q.job_num; i++) {
+        BatchJob *job = &q.jobs[i];
+        if (job->state == JOB_DONE) done++;
+        if (job->state == JOB_SKIPPED) skipped++;
+        if (job->state == JOB_FAILED) failed++;
+        frames += job->stats.video_frames;
+        bytes_out += job->stats.bytes_out;
+        free(job->input);
+        free(job->output);
+    }
+    printf(
+        "Done: %d converted, %d up to date, %d failed in %.1fs\n"
+        "Throughput: %.1f frames/s, %.2f MB/s written\n",
+        done, skipped, failed, seconds, seconds > 0 ? frames / seconds : 0,
+        seconds > 0 ? bytes_out / seconds / (1024 * 1024) : 0);
+    linfo("Batch done: %d converted, %d skipped, %d failed, %.1fs", done,
+          skipped, failed, seconds);
+
+    free(threads);
+    free(q.jobs);
+    free(inputs);
+    return failed;
+}
@@ -0,0 +1,19 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "config.h"
+
+/// @brief Convert every video listed in conf.filename into apcache files
+///        under conf.batch, using conf.jobs worker threads.
+///        conf.filename is either a directory (every regular file in it) or
+///        a text file with one path per line. Each input is written to
+///        <conf.batch>/<file name>.apcache, a listed input whose file name
+///        was already taken is skipped and counted as failed.
+///        Inputs whose apcache file is newer and has the same frame size are
+///        skipped. Never touches ncurses.
+/// @param conf Parsed config.
+/// @return 0 when every job succeeded, number of failed jobs otherwise,
+///         minus number when the input list cannot be read.
+int run_batch(config *conf);
+
+#endif
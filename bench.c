@@ -0,0 +1,217 @@
+#include "bench.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "av.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "render.h"
+#include "resample.h"
+#include "scale.h"
+
+// Frame size used without --width/--height
+#define BENCH_DEFAULT_WIDTH 80
+#define BENCH_DEFAULT_HEIGHT 24
+// Number of decoded frames every scaler runs on
+#define BENCH_FRAMES 300
+// Output rate of the resamplers, the usual device rate
+#define BENCH_AUDIO_RATE 48000
+
+typedef struct {
+    Scaler *scaler;
+    uint64_t time_us;
+    // sum of squared differences to the reference
+    double sse;
+} BenchScaler;
+
+typedef struct {
+    AVFormatContext *fmt_ctxt;
+    AVCodecContext *a_cdc;
+    AVCodecContext *v_cdc;
+    AVPacket *pckt;
+    AVFrame *frame;
+    struct SwsContext *ref_ctxt;
+    uint8_t *ref;
+    uint8_t *out;
+    BenchScaler scalers[SCALER_MODE_NUM];
+    // audio decoded alongside the video frames
+    Resampler *resamplers[RESAMPLER_MODE_NUM];
+    uint64_t resample_us[RESAMPLER_MODE_NUM];
+    uint64_t audio_decode_us;
+    uint64_t audio_samples;
+} BenchCtx;
+
+static void bench_ctx_free(BenchCtx *b) {
+    for (int i = 0; i < SCALER_MODE_NUM; i++) {
+        scaler_free(b->scalers[i].scaler);
+    }
+    for (int i = 0; i < RESAMPLER_MODE_NUM; i++) {
+        resampler_free(b->resamplers[i]);
+    }
+    sws_freeContext(b->ref_ctxt);
+    free(b->ref);
+    free(b->out);
+    av_frame_free(&b->frame);
+    av_packet_free(&b->pckt);
+    avcodec_free_context(&b->a_cdc);
+    avcodec_free_context(&b->v_cdc);
+    avformat_close_input(&b->fmt_ctxt);
+}
+
+// Scale the current frame with the reference and every scaler.
+static int bench_frame(BenchCtx *b, int width, int height) {
+    AVFrame *f = b->frame;
+    uint8_t *ref_data[4] = {b->ref};
+    int ref_linesize[4] = {width};
+    if (sws_scale(b->ref_ctxt, (const uint8_t *const *)f->data, f->linesize,
+                  0, f->height, ref_data, ref_linesize) != height) {
+        return -1;
+    }
+    size_t n = (size_t)width * height;
+    for (int i = 0; i < SCALER_MODE_NUM; i++) {
+        BenchScaler *bs = &b->scalers[i];
+        uint64_t start = metrics_now_us();
+        if (scaler_scale(bs->scaler, f, b->out) != 0) return -1;
+        bs->time_us += metrics_now_us() - start;
+        for (size_t j = 0; j < n; j++) {
+            int d = b->out[j] - b->ref[j];
+            bs->sse += d * d;
+        }
+    }
+    return 0;
+}
+
+// Decode the current audio packet and run every resampler on its frames.
+static int bench_audio(BenchCtx *b) {
+    uint64_t start = metrics_now_us();
+    if (avcodec_send_packet(b->a_cdc, b->pckt) < 0) return -10;
+    while (avcodec_receive_frame(b->a_cdc, b->frame) == 0) {
+        b->audio_decode_us += metrics_now_us() - start;
+        b->audio_samples += b->frame->nb_samples;
+        for (int i = 0; i < RESAMPLER_MODE_NUM; i++) {
+            const float *samples;
+            int nb_samples;
+            start = metrics_now_us();
+            if (resampler_convert(b->resamplers[i], b->frame, &samples,
+                                  &nb_samples) != 0) {
+                return -1;
+            }
+            b->resample_us[i] += metrics_now_us() - start;
+        }
+        av_frame_unref(b->frame);
+        start = metrics_now_us();
+    }
+    b->audio_decode_us += metrics_now_us() - start;
+    return 0;
+}
+
+static int bench(config *conf, BenchCtx *b, int width, int height,
+                 int *frames) {
+    int a_idx = -1, v_idx = -1;
+    if (find_codec_context(conf, &b->fmt_ctxt, &b->a_cdc, &b->v_cdc, &a_idx,
+                           &v_idx) != 0) {
+        return -2;
+    }
+    AVCodecContext *v_cdc = b->v_cdc;
+    b->pckt = av_packet_alloc();
+    b->frame = av_frame_alloc();
+    b->ref = malloc((size_t)width * height);
+    b->out = malloc((size_t)width * height);
+    b->ref_ctxt = sws_getContext(v_cdc->width, v_cdc->height, v_cdc->pix_fmt,
+                                 width, height, AV_PIX_FMT_GRAY8,
+                                 SWS_LANCZOS | SWS_ACCURATE_RND, 0, 0, 0);
+    if (!b->pckt || !b->frame || !b->ref || !b->out || !b->ref_ctxt) {
+        return -2;
+    }
+    for (int i = 0; i < SCALER_MODE_NUM; i++) {
+        b->scalers[i].scaler = scaler_alloc(i, v_cdc->width, v_cdc->height,
+                                            v_cdc->pix_fmt, width, height);
+        if (!b->scalers[i].scaler) return -2;
+    }
+    for (int i = 0; !conf->no_audio && i < RESAMPLER_MODE_NUM; i++) {
+        b->resamplers[i] = resampler_alloc(
+            i, b->a_cdc->sample_fmt, b->a_cdc->sample_rate,
+            &b->a_cdc->ch_layout, BENCH_AUDIO_RATE);
+        if (!b->resamplers[i]) return -2;
+    }
+
+    *frames = 0;
+    while (*frames < BENCH_FRAMES && av_read_frame(b->fmt_ctxt, b->pckt) >= 0) {
+        int err = 0;
+        if (b->pckt->stream_index == v_idx) {
+            err = avcodec_send_packet(v_cdc, b->pckt) < 0 ? -10 : 0;
+            while (err == 0 && *frames < BENCH_FRAMES &&
+                   avcodec_receive_frame(v_cdc, b->frame) == 0) {
+                err = bench_frame(b, width, height);
+                av_frame_unref(b->frame);
+                (*frames)++;
+            }
+        } else if (!conf->no_audio && b->pckt->stream_index == a_idx) {
+            err = bench_audio(b);
+        }
+        av_packet_unref(b->pckt);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+// Audio CPU per second of audio: decoding, then each resampler on top.
+static void report_audio(const BenchCtx *b) {
+    double secs = (double)b->audio_samples / b->a_cdc->sample_rate;
+    double decode_ms = b->audio_decode_us / 1000.0 / secs;
+    printf("\n%.1f s of %d Hz %s audio decoded in %.3f ms/s (%.2f%% CPU), "
+           "to %d Hz\n",
+           secs, b->a_cdc->sample_rate,
+           av_get_sample_fmt_name(b->a_cdc->sample_fmt), decode_ms,
+           decode_ms / 10, BENCH_AUDIO_RATE);
+    printf("%-10s %10s %10s %10s\n", "resampler", "path", "ms/s", "CPU %");
+    for (int i = 0; i < RESAMPLER_MODE_NUM; i++) {
+        double ms = b->resample_us[i] / 1000.0 / secs;
+        printf("%-10s %10s %10.3f %10.2f\n", resampler_mode_name(i),
+               resample_path_name(resampler_path(b->resamplers[i])), ms,
+               ms / 10);
+        linfo("Bench %s resampler: %.3f ms per second of audio",
+              resampler_mode_name(i), ms);
+    }
+}
+
+int run_bench(config *conf) {
+    conf->width =
+        conf->target_width > 0 ? conf->target_width : BENCH_DEFAULT_WIDTH;
+    conf->height =
+        conf->target_height > 0 ? conf->target_height : BENCH_DEFAULT_HEIGHT;
+    int width = render_image_width(conf), height = render_image_height(conf);
+
+    BenchCtx b = {0};
+    int frames = 0;
+    int err = bench(conf, &b, width, height, &frames);
+    if (err != 0 || frames == 0) {
+        printf("Benchmark failed (code: %d, frames: %d)\n", err, frames);
+        lerror("Benchmark failed (code: %d, frames: %d)", err, frames);
+        bench_ctx_free(&b);
+        return err ? err : -2;
+    }
+
+    printf("%d frames of %dx%d scaled to %dx%d, reference: lanczos\n",
+           frames, b.v_cdc->width, b.v_cdc->height, width, height);
+    printf("%-10s %10s %10s %10s\n", "scaler", "ms/frame", "frames/s",
+           "PSNR (dB)");
+    for (int i = 0; i < SCALER_MODE_NUM; i++) {
+        BenchScaler *bs = &b.scalers[i];
+        double ms = bs->time_us / 1000.0 / frames;
+        double mse = bs->sse / ((double)frames * width * height);
+        double psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+        printf("%-10s %10.3f %10.1f %10.2f\n", scaler_mode_name(i), ms,
+               ms > 0 ? 1000 / ms : 0, psnr);
+        linfo("Bench %s: %.3f ms/frame, PSNR %.2f dB", scaler_mode_name(i), ms,
+              psnr);
+    }
+    if (b.audio_samples > 0) report_audio(&b);
+    bench_ctx_free(&b);
+    return 0;
+}
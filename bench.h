@@ -0,0 +1,16 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "config.h"
+
+/// @brief Decode the first frames of conf.filename and run every scaler on
+///        them, printing the time each one takes and its PSNR against a
+///        high quality (Lanczos) reference, then the CPU time the audio
+///        decoder and every resampler take per second of audio. Never
+///        touches ncurses.
+///        The frame size comes from --width/--height and --render.
+/// @param conf Parsed config.
+/// @return 0 for success, minus number for error.
+int run_bench(config *conf);
+
+#endif
@@ -30,6 +30,7 @@ Channel *alloc_channel(int cap) {
     *ch = (Channel){PTHREAD_MUTEX_INITIALIZER,
                     buf,
                     cap,
+                    cap,
                     0,
                     0,
                     0,
@@ -40,6 +41,38 @@ Channel *alloc_channel(int cap) {
     return ch;
 }
 
+/// @brief Change how many elements the channel holds before add_element
+///        blocks. buf keeps its capacity, elements queued above a lowered
+///        limit stay until read.
+/// @param ch Pointer to Channel.
+/// @param limit New limit, clamped to [1, cap].
+/// @return =0: Success
+///         >0: Mutex lock error
+///         <0: ChannelErr error
+int set_channel_limit(Channel *ch, int limit) {
+    // check ch
+    if (!ch) {
+        return CH_ERR_NULLCH;
+    }
+    // clamp limit to [1, cap]
+    if (limit < 1) limit = 1;
+    if (limit > ch->cap) limit = ch->cap;
+    // lock mutex and check err
+    int err = pthread_mutex_lock(&ch->lock);
+    if (err != 0) {
+        return err;
+    }
+    int grown = limit > ch->limit;
+    ch->limit = limit;
+    // unlock mutex lock
+    pthread_mutex_unlock(&ch->lock);
+    // a grown channel may unblock waiting producer
+    if (grown) {
+        pthread_cond_broadcast(&ch->producer_cond);
+    }
+    return 0;
+}
+
 /// @brief Free Channel.
 /// @param ch Pointer to Channel.
 void free_channel(Channel *ch) {
@@ -72,8 +105,8 @@ int add_element(Channel *ch, void *ele) {
     if (ch->len > ch->cap) {
         return CH_ERR_OVERFLOW;
     }
-    // buf full
-    if (ch->len == ch->cap) {
+    // buf full (up to the current limit)
+    while (ch->len >= ch->limit) {
         pthread_cond_wait(&ch->producer_cond, &ch->lock);
     }
     // invalid fill_n
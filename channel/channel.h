@@ -16,6 +16,9 @@ typedef struct {
     void **buf;
     // capacity of buf
     int cap;
+    // number of elements accepted before add_element blocks (1 <= limit <=
+    // cap), changed by set_channel_limit without reallocating buf
+    int limit;
     // number of data of buf
     int len;
     // to where the next data should to filled
@@ -39,6 +42,16 @@ typedef struct {
 /// @return The pointer to allocated on heap.
 extern Channel *alloc_channel(int cap);
 
+/// @brief Change how many elements the channel holds before add_element
+///        blocks. buf keeps its capacity, elements queued above a lowered
+///        limit stay until read.
+/// @param ch Pointer to Channel.
+/// @param limit New limit, clamped to [1, cap].
+/// @return =0: Success
+///         >0: Mutex lock error
+///         <0: ChannelErr error
+extern int set_channel_limit(Channel *ch, int limit);
+
 /// @brief Free Channel.
 /// @param ch Pointer to Channel.
 extern void free_channel(Channel *ch);
@@ -0,0 +1,47 @@
+#include "depth.h"
+
+#include <math.h>
+
+// Weight of a new observation in the moving averages.
+#define DEPTH_EWMA_ALPHA (1.0 / 16)
+// Number of standard deviations of spike to absorb.
+#define DEPTH_SPIKE_SIGMA 4
+// Frame rate assumed when unknown.
+#define DEPTH_DEFAULT_FPS 30
+
+void channel_depth_init(ChannelDepth *d, size_t elem_bytes, int budget_mb,
+                        double fps) {
+    double max = elem_bytes ? (double)budget_mb * 1024 * 1024 / elem_bytes
+                            : CHANNEL_DEPTH_MAX;
+    d->min = CHANNEL_DEPTH_MIN;
+    d->max = max > CHANNEL_DEPTH_MAX ? CHANNEL_DEPTH_MAX : (int)max;
+    if (d->max < d->min) d->max = d->min;
+    d->depth = CHANNEL_DEPTH_INITIAL > d->max ? d->max : CHANNEL_DEPTH_INITIAL;
+    d->frame_us = 1000000.0 / (fps > 0 ? fps : DEPTH_DEFAULT_FPS);
+    d->mean_us = 0;
+    d->var_us = 0;
+    d->shrink_wait = 0;
+}
+
+int channel_depth_observe(ChannelDepth *d, double cost_us) {
+    double delta = cost_us - d->mean_us;
+    d->mean_us += DEPTH_EWMA_ALPHA * delta;
+    d->var_us = (1 - DEPTH_EWMA_ALPHA) *
+                (d->var_us + DEPTH_EWMA_ALPHA * delta * delta);
+
+    double spike = d->mean_us + DEPTH_SPIKE_SIGMA * sqrt(d->var_us);
+    int target = d->min + (int)ceil(spike / d->frame_us);
+    if (target > d->max) target = d->max;
+
+    int old = d->depth;
+    if (target > d->depth) {
+        // Grow at once, the spike may be happening right now
+        d->depth = target;
+        d->shrink_wait = (int)(1000000 / d->frame_us);
+    } else if (target < d->depth && --d->shrink_wait <= 0) {
+        // Shrink by one frame per second of steady decoding
+        d->depth--;
+        d->shrink_wait = (int)(1000000 / d->frame_us);
+    }
+    return d->depth != old;
+}
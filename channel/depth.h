@@ -0,0 +1,46 @@
+#ifndef CHANNEL_DEPTH_H
+#define CHANNEL_DEPTH_H
+
+#include <stddef.h>
+
+// Bounds of the adaptive video channel depth (in frames).
+#define CHANNEL_DEPTH_MIN 2
+#define CHANNEL_DEPTH_MAX 512
+// Depth before any decode time is measured.
+#define CHANNEL_DEPTH_INITIAL 10
+
+// Picks the depth of the video channel from the measured cost of producing
+// a frame (decode + scale). The depth covers a spike of mean + 4 standard
+// deviations of that cost, so slow frames (HEVC keyframes, slow disks) are
+// absorbed by the queue, and stays shallow when the cost is steady.
+// The maximum depth comes from the memory budget.
+typedef struct {
+    // bounds of depth, max derived from the memory budget
+    int min;
+    int max;
+    // current depth
+    int depth;
+    // duration of a frame (in microseconds)
+    double frame_us;
+    // exponentially weighted mean and variance of the frame cost
+    double mean_us;
+    double var_us;
+    // observations left before the depth may shrink again
+    int shrink_wait;
+} ChannelDepth;
+
+/// @brief Initialize depth bounds from a memory budget.
+/// @param d ChannelDepth.
+/// @param elem_bytes Memory held by one queued frame (in bytes).
+/// @param budget_mb Memory budget of the queue (in MiB).
+/// @param fps Frame rate, 0 for unknown.
+void channel_depth_init(ChannelDepth *d, size_t elem_bytes, int budget_mb,
+                        double fps);
+
+/// @brief Record the cost of producing one frame.
+/// @param d ChannelDepth.
+/// @param cost_us Time spent producing the frame (in microseconds).
+/// @return 1 when d->depth changed, 0 otherwise.
+int channel_depth_observe(ChannelDepth *d, double cost_us);
+
+#endif
@@ -18,19 +18,58 @@ static char *str_rev(char *str) {
 static config default_config() {
     config conf;
     conf.cache = NULL;
+    conf.batch = NULL;
+    conf.jobs = 0;
+    conf.serve = NULL;
+    conf.direct_io = 0;
+    conf.thumb_interval = 1;
+    conf.scrub = 0;
+    conf.chunked = 0;
+    conf.compress = 0;
+    conf.levels = 1;
+    conf.target_width = 0;
+    conf.target_height = 0;
     conf.fps = 0;
     conf.filename = NULL;
     conf.help = 0;
     conf.license = 0;
     conf.no_audio = 0;
+    conf.max_buffer_mb = 64;
+    conf.audio_latency_ms = 200;
+    conf.demux_queue_mb = 16;
+    conf.demux_queue_ms = 1000;
+    conf.max_fps = 0;
+    conf.max_fps_auto = 0;
+    conf.bench = 0;
+    conf.verify = 0;
+    conf.scaler = SCALER_FAST;
+    conf.resampler = RESAMPLER_SWR;
     conf.logfile = NULL;
     conf.log_level = LL_WARN;
+    conf.log_async = 0;
+    conf.stats = 0;
+    conf.stats_interval = 0;
+    conf.stats_socket = NULL;
     conf.height = conf.width = 100;
     conf.width--;
     char s[] = " .:-=+*#%%@";
     strcpy(conf.grey_ascii, s);
     conf.grey_ascii_step = (strlen(conf.grey_ascii) - 1) / 255.0;
+    conf.render = RENDER_LUMA;
+    conf.glyphs = NULL;
+    conf.dither = DITHER_NONE;
+    conf.dither_stable = 0;
+    conf.normalize = 0;
+    conf.gamma = 1;
     conf.video_ch = NULL;
+    conf.input_io = NULL;
+    conf.audio = NULL;
+    conf.video_borrowed = 0;
+    conf.frame_width = 0;
+    conf.frame_height = 0;
+    atomic_init(&conf.video_rendered, 0);
+    atomic_init(&conf.frame_us, 0);
+    atomic_init(&conf.render_us, 0);
     conf.audio_ch = NULL;
     conf.video_ch_status.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     conf.video_ch_status.has_data = 0;
@@ -53,13 +92,70 @@ config parse_config(int argc, char *argv[]) {
                  "Show license and author info");
     arg_list_add(&al, ARG_TYPE_STRING, "cache", 'c',
                  "Process video into a cached file");
+    arg_list_add(&al, ARG_TYPE_STRING, "batch", 'b',
+                 "Convert a directory or list of videos into an output "
+                 "directory");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "jobs", 'j',
+                 "Number of batch conversion workers");
+    arg_list_add(&al, ARG_TYPE_STRING, "serve", '\0',
+                 "Stream ASCII frames to clients on a port or Unix socket");
+    arg_list_add(&al, ARG_TYPE_FLAG, "direct-io", '\0',
+                 "Write cache files bypassing the page cache");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "thumb-interval", '\0',
+                 "Seconds between thumbnails in cache files, 0 for none");
+    arg_list_add(&al, ARG_TYPE_FLAG, "scrub", '\0',
+                 "Browse the thumbnails of a cache file");
+    arg_list_add(&al, ARG_TYPE_FLAG, "chunked", '\0',
+                 "Write cache files in checksummed chunks");
+    arg_list_add(&al, ARG_TYPE_FLAG, "compress", '\0',
+                 "Write cache files in compressed chunks");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "levels", '\0',
+                 "Resolution levels stored in cache files");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "width", '\0', "Output width");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "height", '\0', "Output height");
     arg_list_add(&al, ARG_TYPE_FLAG, "no-audio", 'n',
                  "Play video without playing audio");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "max-buffer-mb", '\0',
+                 "Memory budget of the video frame queue");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "audio-latency-ms", '\0',
+                 "Audio decoded ahead of the device");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "demux-queue-mb", '\0',
+                 "Memory budget of the packets read ahead");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "demux-queue-ms", '\0',
+                 "Packets read ahead of each decoder");
+    arg_list_add(&al, ARG_TYPE_STRING, "max-fps", '\0',
+                 "Highest display rate, or auto");
+    arg_list_add(&al, ARG_TYPE_FLAG, "bench", '\0',
+                 "Compare the speed and quality of the scalers");
+    arg_list_add(&al, ARG_TYPE_FLAG, "verify", '\0',
+                 "Check an apcache file for corruption");
+    arg_list_add(&al, ARG_TYPE_STRING, "scaler", '\0',
+                 "Scaler (fast, bilinear, area, bicubic or box)");
+    arg_list_add(&al, ARG_TYPE_STRING, "resampler", '\0',
+                 "Audio resampler (fast, swr or soxr)");
     arg_list_add(&al, ARG_TYPE_STRING, "grayscale", 'g', "Grayscale string");
+    arg_list_add(&al, ARG_TYPE_STRING, "render", '\0',
+                 "Render mode (luma or shape)");
+    arg_list_add(&al, ARG_TYPE_STRING, "dither", '\0',
+                 "Dithering (none, bayer, fs or bluenoise)");
+    arg_list_add(&al, ARG_TYPE_FLAG, "dither-stable", '\0',
+                 "Avoid dithering flicker between frames");
+    arg_list_add(&al, ARG_TYPE_FLAG, "normalize", '\0',
+                 "Stretch the contrast of every frame");
+    arg_list_add(&al, ARG_TYPE_STRING, "gamma", '\0',
+                 "Gamma of the tone curve");
     arg_list_add(&al, ARG_TYPE_FLAG, "reverse", 'r',
                  "Reverse grayscale string");
     arg_list_add(&al, ARG_TYPE_STRING, "log", '\0', "Path to log file");
     arg_list_add(&al, ARG_TYPE_NUMBER, "loglevel", '\0', "Log level");
+    arg_list_add(&al, ARG_TYPE_FLAG, "log-async", '\0',
+                 "Write log lines from a background thread");
+    arg_list_add(&al, ARG_TYPE_FLAG, "stats", '\0',
+                 "Show metrics status line");
+    arg_list_add(&al, ARG_TYPE_NUMBER, "stats-interval", '\0',
+                 "Seconds between metrics dumps into the log");
+    arg_list_add(&al, ARG_TYPE_STRING, "stats-socket", '\0',
+                 "Unix socket serving metrics reports");
 
     int err = parse_args(&al, argc, argv);
     if (err < 0) {
@@ -72,8 +168,70 @@ config parse_config(int argc, char *argv[]) {
     if ((a = arg_list_search(&al, "license"))->set)
         conf.license = a->value.number;
     if ((a = arg_list_search(&al, "cache"))->set) conf.cache = a->value.str;
+    if ((a = arg_list_search(&al, "batch"))->set) conf.batch = a->value.str;
+    if ((a = arg_list_search(&al, "jobs"))->set) conf.jobs = a->value.number;
+    if ((a = arg_list_search(&al, "serve"))->set) conf.serve = a->value.str;
+    if ((a = arg_list_search(&al, "direct-io"))->set)
+        conf.direct_io = a->value.number;
+    if ((a = arg_list_search(&al, "thumb-interval"))->set &&
+        a->value.number >= 0)
+        conf.thumb_interval = a->value.number;
+    if ((a = arg_list_search(&al, "scrub"))->set) conf.scrub = a->value.number;
+    if ((a = arg_list_search(&al, "chunked"))->set)
+        conf.chunked = a->value.number;
+    if ((a = arg_list_search(&al, "compress"))->set)
+        conf.compress = a->value.number;
+    if ((a = arg_list_search(&al, "levels"))->set && a->value.number >= 1)
+        conf.levels = a->value.number;
+    if ((a = arg_list_search(&al, "width"))->set)
+        conf.target_width = a->value.number;
+    if ((a = arg_list_search(&al, "height"))->set)
+        conf.target_height = a->value.number;
     if ((a = arg_list_search(&al, "no-audio"))->set)
         conf.no_audio = a->value.number;
+    if ((a = arg_list_search(&al, "max-buffer-mb"))->set &&
+        a->value.number > 0)
+        conf.max_buffer_mb = a->value.number;
+    if ((a = arg_list_search(&al, "audio-latency-ms"))->set &&
+        a->value.number > 0)
+        conf.audio_latency_ms = a->value.number;
+    if ((a = arg_list_search(&al, "demux-queue-mb"))->set &&
+        a->value.number > 0)
+        conf.demux_queue_mb = a->value.number;
+    if ((a = arg_list_search(&al, "demux-queue-ms"))->set &&
+        a->value.number > 0)
+        conf.demux_queue_ms = a->value.number;
+    if ((a = arg_list_search(&al, "max-fps"))->set) {
+        if (strcmp(a->value.str, "auto") == 0) {
+            conf.max_fps_auto = 1;
+        } else {
+            char *end;
+            conf.max_fps = strtod(a->value.str, &end);
+            if (*end != '\0' || !(conf.max_fps > 0)) {
+                printf("Invalid max fps: %s\n", a->value.str);
+                exit(-1);
+            }
+        }
+    }
+    if ((a = arg_list_search(&al, "bench"))->set) conf.bench = a->value.number;
+    if ((a = arg_list_search(&al, "verify"))->set)
+        conf.verify = a->value.number;
+    if ((a = arg_list_search(&al, "scaler"))->set) {
+        int mode = scaler_mode_parse(a->value.str);
+        if (mode < 0) {
+            printf("Unknown scaler: %s\n", a->value.str);
+            exit(-1);
+        }
+        conf.scaler = mode;
+    }
+    if ((a = arg_list_search(&al, "resampler"))->set) {
+        int mode = resampler_mode_parse(a->value.str);
+        if (mode < 0) {
+            printf("Unknown resampler: %s\n", a->value.str);
+            exit(-1);
+        }
+        conf.resampler = mode;
+    }
     if ((a = arg_list_search(&al, "grayscale"))->set) {
         strncpy(conf.grey_ascii, a->value.str, 256);
         conf.grey_ascii_step = (strlen(conf.grey_ascii) - 1) / 255.0;
@@ -81,9 +239,52 @@ config parse_config(int argc, char *argv[]) {
     conf.grey_ascii[256] = '\0';
     if ((a = arg_list_search(&al, "reverse"))->set && a->value.number)
         str_rev(conf.grey_ascii);
+    if ((a = arg_list_search(&al, "render"))->set) {
+        if (strcmp(a->value.str, "shape") == 0) {
+            conf.render = RENDER_SHAPE;
+        } else if (strcmp(a->value.str, "luma") != 0) {
+            printf("Unknown render mode: %s\n", a->value.str);
+            exit(-1);
+        }
+    }
+    if ((a = arg_list_search(&al, "dither"))->set) {
+        int mode = dither_mode_parse(a->value.str);
+        if (mode < 0) {
+            printf("Unknown dither mode: %s\n", a->value.str);
+            exit(-1);
+        }
+        conf.dither = mode;
+    }
+    if ((a = arg_list_search(&al, "dither-stable"))->set)
+        conf.dither_stable = a->value.number;
+    if ((a = arg_list_search(&al, "normalize"))->set)
+        conf.normalize = a->value.number;
+    if ((a = arg_list_search(&al, "gamma"))->set) {
+        char *end;
+        conf.gamma = strtof(a->value.str, &end);
+        if (*end != '\0' || !(conf.gamma > 0)) {
+            printf("Invalid gamma: %s\n", a->value.str);
+            exit(-1);
+        }
+    }
     if ((a = arg_list_search(&al, "log"))->set) conf.logfile = a->value.str;
     if ((a = arg_list_search(&al, "loglevel"))->set)
         conf.log_level = a->value.number;
+    if ((a = arg_list_search(&al, "log-async"))->set)
+        conf.log_async = a->value.number;
+    if ((a = arg_list_search(&al, "stats"))->set) conf.stats = a->value.number;
+    if ((a = arg_list_search(&al, "stats-interval"))->set)
+        conf.stats_interval = a->value.number;
+    if ((a = arg_list_search(&al, "stats-socket"))->set)
+        conf.stats_socket = a->value.str;
+    // The periodic dump is written to the log file at INFO level
+    if (conf.stats_interval > 0) {
+        if (!conf.logfile) {
+            printf("--stats-interval needs a log file (--log <log file>)\n");
+            exit(-1);
+        }
+        if (conf.log_level > LL_INFO) conf.log_level = LL_INFO;
+    }
 
     free_arg_list(&al);
     return conf;
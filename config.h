@@ -1,10 +1,16 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <libavformat/avformat.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "channel/channel.h"
+#include "dither.h"
+#include "glyph.h"
 #include "log/log.h"
+#include "resample.h"
+#include "scale.h"
 
 typedef struct {
     pthread_mutex_t lock;
@@ -12,6 +18,13 @@ typedef struct {
     pthread_cond_t drain_cond;
 } ChannelStatus;
 
+typedef enum {
+    // one character per pixel, chosen by luminance from grey_ascii
+    RENDER_LUMA,
+    // one character per 2x4 block, chosen by shape (see glyph.h)
+    RENDER_SHAPE,
+} RenderMode;
+
 typedef struct {
     // filename can NOT be NULL or empty
     char *filename;
@@ -21,16 +34,97 @@ typedef struct {
     int license;
     // NULL for argument not supplied
     char *cache;
+    // NULL for argument not supplied
+    // output directory of batch conversion
+    char *batch;
+    // number of batch workers, 0 for one per CPU
+    int jobs;
+    // NULL for argument not supplied
+    // TCP port or Unix socket path to stream ASCII frames on
+    char *serve;
+    // as a bool value, write cache files with O_DIRECT
+    int direct_io;
+    // seconds between two thumbnails in cache files, 0 for none
+    int thumb_interval;
+    // as a bool value, browse the thumbnails of a cache file before playing
+    int scrub;
+    // as a bool value, write cache files in checksummed chunks
+    int chunked;
+    // as a bool value, zlib compress the chunks of cache files
+    int compress;
+    // resolution levels stored in cache files, more than 1 implies chunked
+    int levels;
+    // frame size requested by --width/--height, 0 for terminal size
+    int target_width;
+    int target_height;
     // as a bool value
     int no_audio;
+    // memory budget of the video channel (in MiB)
+    int max_buffer_mb;
+    // audio decoded ahead of the device by the audio thread (in ms)
+    int audio_latency_ms;
+    // memory budget of the packet queues of the demux thread (in MiB)
+    int demux_queue_mb;
+    // packets read ahead of each decoder by the demux thread (in ms)
+    int demux_queue_ms;
+    // highest display rate, 0 for no limit
+    double max_fps;
+    // as a bool value, lower the display rate to what rendering sustains
+    int max_fps_auto;
+    // as a bool value, compare the scalers instead of playing
+    int bench;
+    // as a bool value, check an apcache file instead of playing
+    int verify;
+    ScalerMode scaler;
+    // resampler used when the audio is not stereo float at the device rate
+    ResamplerMode resampler;
     double fps;
     int width;
     int height;
     char grey_ascii[256 + 1];
     float grey_ascii_step;
+    RenderMode render;
+    // lookup table of RENDER_SHAPE, NULL for not built
+    GlyphTable *glyphs;
+    DitherMode dither;
+    // as a bool value, keep dithered pixels on their level across frames
+    int dither_stable;
+    // as a bool value, stretch each frame's contrast to the full ramp
+    int normalize;
+    // gamma of the tone curve, 1 for linear
+    float gamma;
     char *logfile;
     LogLevel log_level;
+    // as a bool value
+    int log_async;
+    // as a bool value, draw a metrics status line over the video
+    int stats;
+    // seconds between two metrics dumps into the log, 0 for no dump
+    int stats_interval;
+    // NULL for no metrics socket
+    char *stats_socket;
+    // reads a piped video for libavformat, NULL to open filename
+    AVIOContext *input_io;
+    // VideoFrame * to play_video, NULL for a repeat tick
     Channel *video_ch;
+    // as a bool value, video_ch frames point into a mapped apcache file,
+    // which must stay open until play_video has drawn them
+    int video_borrowed;
+    // size of video_ch frames, resized to width x height by play_video when
+    // different, 0 for frames of width x height already
+    int frame_width;
+    int frame_height;
+    // number of frames play_video has finished drawing
+    atomic_int video_rendered;
+    // master clock of play_video (audio_player_clock), NULL to pace by
+    // frame_us without audio or by the blocking audio writes of a cache
+    struct AudioPlayer *audio;
+    // interval between two frames drawn by play_video
+    // (in microseconds), 0 for 1 / fps
+    atomic_int frame_us;
+    // moving average of the time play_video spends drawing a frame
+    // (in microseconds), 0 for not measured yet
+    atomic_int render_us;
     Channel *audio_ch;
     ChannelStatus video_ch_status;
 } config;
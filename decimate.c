@@ -0,0 +1,65 @@
+#include "decimate.h"
+
+// Share of the render time budget left for decoding and jitter.
+#define DECIMATE_HEADROOM 0.8
+// Lowest display rate of the automatic mode.
+#define DECIMATE_MIN_FPS 5
+// Relative rate change below which the automatic mode keeps the old rate.
+#define DECIMATE_HYSTERESIS 0.1
+
+static double decimator_limit(const Decimator *d) {
+    return d->max_fps > 0 && d->max_fps < d->src_fps ? d->max_fps
+                                                     : d->src_fps;
+}
+
+void decimator_init(Decimator *d, double src_fps, double max_fps,
+                    int automatic) {
+    d->src_fps = src_fps > 0 ? src_fps : 0;
+    d->max_fps = max_fps;
+    d->automatic = automatic;
+    d->rate = decimator_limit(d);
+    d->next = -1;
+    d->now = 0;
+    d->frames = 0;
+    d->adjust_at = 1;
+}
+
+int decimator_wants(const Decimator *d, double t) {
+    if (d->src_fps == 0 || d->rate >= d->src_fps || d->next < 0 || t < 0) {
+        return 1;
+    }
+    // Half a source frame of slack absorbs timestamp rounding
+    return t >= d->next - 0.5 / d->src_fps;
+}
+
+int decimator_keep(Decimator *d, double t) {
+    if (t < 0) t = d->src_fps > 0 ? d->frames / d->src_fps : 0;
+    d->frames++;
+    d->now = t;
+    if (!decimator_wants(d, t)) return 0;
+    if (d->rate > 0) {
+        d->next = d->next < 0 ? t : d->next;
+        d->next += 1 / d->rate;
+        // After a gap (seek, dropped packets) restart from this frame
+        if (d->next < t) d->next = t + 1 / d->rate;
+    }
+    return 1;
+}
+
+int decimator_observe(Decimator *d, int render_us) {
+    if (!d->automatic || render_us <= 0 || d->src_fps == 0 ||
+        d->now < d->adjust_at) {
+        return 0;
+    }
+    d->adjust_at = d->now + 1;
+    double rate = 1000000.0 * DECIMATE_HEADROOM / render_us;
+    double limit = decimator_limit(d);
+    if (rate < DECIMATE_MIN_FPS) rate = DECIMATE_MIN_FPS;
+    if (rate > limit) rate = limit;
+    double change = rate > d->rate ? rate - d->rate : d->rate - rate;
+    // Always reach the limit, so a fast terminal plays every frame
+    if (change <= d->rate * DECIMATE_HYSTERESIS && rate != limit) return 0;
+    if (rate == d->rate) return 0;
+    d->rate = rate;
+    return 1;
+}
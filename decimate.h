@@ -0,0 +1,60 @@
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+#include <stdint.h>
+
+// Picks the decoded frames that are displayed when the source frame rate
+// is higher than the display rate (--max-fps, or the rate the terminal
+// keeps up with in automatic mode).
+// Frames are kept against a cumulative deadline in source time, so the
+// displayed rate averages the display rate exactly (60 -> 25 fps keeps 5
+// frames out of 12) and does not drift.
+// Times are in seconds of source presentation time, a negative time means
+// unknown and is replaced by the frame count over the source rate.
+typedef struct {
+    double src_fps;
+    // user limit, 0 for none
+    double max_fps;
+    // as a bool value, follow the measured render time
+    int automatic;
+    // current display rate (frames per second)
+    double rate;
+    // source time of the next displayed frame, negative before the first
+    double next;
+    // source time of the last frame passed to decimator_keep
+    double now;
+    // frames passed to decimator_keep
+    uint64_t frames;
+    // source time of the next automatic rate adjustment
+    double adjust_at;
+} Decimator;
+
+/// @brief Initialize a decimator.
+/// @param d Decimator.
+/// @param src_fps Frame rate of the source, 0 for unknown (no decimation).
+/// @param max_fps Highest display rate, 0 for no limit.
+/// @param automatic as a bool value, lower the rate to what rendering
+///        sustains (see decimator_observe).
+void decimator_init(Decimator *d, double src_fps, double max_fps,
+                    int automatic);
+
+/// @brief Whether a frame at time t would be displayed, without recording
+///        it. Used before decoding to skip non-reference frames.
+int decimator_wants(const Decimator *d, double t);
+
+/// @brief Decide whether the next decoded frame is displayed.
+/// @param d Decimator.
+/// @param t Presentation time of the frame (in seconds), negative for
+///        unknown.
+/// @return 1 to display the frame, 0 to drop it.
+int decimator_keep(Decimator *d, double t);
+
+/// @brief Adjust the display rate to the measured render time (automatic
+///        mode only), at most once per second of source time.
+/// @param d Decimator.
+/// @param render_us Time spent drawing one frame (in microseconds), 0 for
+///        not measured yet.
+/// @return 1 when d->rate changed, 0 otherwise.
+int decimator_observe(Decimator *d, int render_us);
+
+#endif
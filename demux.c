@@ -0,0 +1,252 @@
+#include "demux.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "log/log.h"
+
+struct PacketNode {
+    AVPacket *pckt;
+    PacketNode *next;
+};
+
+void packet_queue_init(PacketQueue *q, AVRational time_base) {
+    *q = (PacketQueue){.time_base = time_base};
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+int packet_queue_put(PacketQueue *q, AVPacket *pckt) {
+    PacketNode *node = malloc(sizeof(PacketNode));
+    if (!node) return DEMUX_ERR_ALLOC;
+    node->pckt = av_packet_alloc();
+    if (!node->pckt) {
+        free(node);
+        return DEMUX_ERR_ALLOC;
+    }
+    av_packet_move_ref(node->pckt, pckt);
+    node->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->last) {
+        q->last->next = node;
+    } else {
+        q->first = node;
+    }
+    q->last = node;
+    q->nb_packets++;
+    q->bytes += node->pckt->size + sizeof(PacketNode) + sizeof(AVPacket);
+    q->duration += node->pckt->duration;
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_signal(&q->cond);
+    return 0;
+}
+
+void packet_queue_put_eof(PacketQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->eof = 1;
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_signal(&q->cond);
+}
+
+int packet_queue_get(PacketQueue *q, AVPacket *pckt) {
+    pthread_mutex_lock(&q->lock);
+    while (!q->first && !q->eof && !q->abort) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    if (q->abort || !q->first) {
+        int ret = q->abort ? -1 : 0;
+        pthread_mutex_unlock(&q->lock);
+        return ret;
+    }
+    PacketNode *node = q->first;
+    q->first = node->next;
+    if (!q->first) q->last = NULL;
+    q->nb_packets--;
+    q->bytes -= node->pckt->size + sizeof(PacketNode) + sizeof(AVPacket);
+    q->duration -= node->pckt->duration;
+    pthread_mutex_unlock(&q->lock);
+    av_packet_move_ref(pckt, node->pckt);
+    av_packet_free(&node->pckt);
+    free(node);
+    if (q->get_callback) q->get_callback(q->get_arg);
+    return 1;
+}
+
+void packet_queue_abort(PacketQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->abort = 1;
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_broadcast(&q->cond);
+}
+
+void packet_queue_destroy(PacketQueue *q) {
+    PacketNode *node = q->first;
+    while (node) {
+        PacketNode *next = node->next;
+        av_packet_free(&node->pckt);
+        free(node);
+        node = next;
+    }
+    q->first = q->last = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+// Wake the demux thread, a consumer made room.
+static void demuxer_wake(void *arg) {
+    Demuxer *d = arg;
+    pthread_mutex_lock(&d->lock);
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+void demuxer_init(Demuxer *d, const config *conf, AVFormatContext *fmt_ctxt,
+                  int v_idx, int a_idx) {
+    d->fmt_ctxt = fmt_ctxt;
+    d->v_idx = v_idx;
+    d->a_idx = a_idx;
+    d->max_bytes = (size_t)conf->demux_queue_mb << 20;
+    d->max_duration = conf->demux_queue_ms / 1000.0;
+    packet_queue_init(&d->video, fmt_ctxt->streams[v_idx]->time_base);
+    packet_queue_init(&d->audio, a_idx >= 0
+                                     ? fmt_ctxt->streams[a_idx]->time_base
+                                     : (AVRational){1, 1});
+    d->video.get_callback = d->audio.get_callback = demuxer_wake;
+    d->video.get_arg = d->audio.get_arg = d;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    d->thread_started = 0;
+    atomic_init(&d->abort, 0);
+}
+
+// Whether q holds enough to wait for its consumer. A stream of unknown
+// packet durations counts as enough by the packet count alone.
+static int queue_enough(PacketQueue *q, double max_duration) {
+    pthread_mutex_lock(&q->lock);
+    int enough = q->nb_packets >= PACKET_QUEUE_MIN_PACKETS &&
+                 (q->duration == 0 ||
+                  q->duration * av_q2d(q->time_base) >= max_duration);
+    pthread_mutex_unlock(&q->lock);
+    return enough;
+}
+
+// Whether q alone holds max_duration, whatever its packet count.
+static int queue_over(PacketQueue *q, double max_duration) {
+    pthread_mutex_lock(&q->lock);
+    int over = q->duration > 0 &&
+               q->duration * av_q2d(q->time_base) >= max_duration;
+    pthread_mutex_unlock(&q->lock);
+    return over;
+}
+
+static size_t queue_bytes(PacketQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    size_t bytes = q->bytes;
+    pthread_mutex_unlock(&q->lock);
+    return bytes;
+}
+
+static int queue_empty(PacketQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    int empty = q->nb_packets == 0;
+    pthread_mutex_unlock(&q->lock);
+    return empty;
+}
+
+// Whether reading should pause, called with d->lock held.
+static int queues_full(Demuxer *d) {
+    // An empty audio queue (also while the jitter buffer fills before the
+    // playback starts) is read past max_bytes, or late audio would never
+    // start and the video waiting on its clock would hold the demuxer
+    int audio_starved = d->a_idx >= 0 && queue_empty(&d->audio);
+    if (!audio_starved &&
+        queue_bytes(&d->video) + queue_bytes(&d->audio) > d->max_bytes) {
+        return 1;
+    }
+    // The audio is taken in real time, so the demuxer never waits on the
+    // video decoder for it to drain, and a starved video queue cannot pull
+    // it past max_duration
+    if (d->a_idx >= 0 && queue_over(&d->audio, d->max_duration)) return 1;
+    // The video queue only stops growing while the audio is not starved,
+    // or the audio clock the video waits on would stall
+    if (queue_over(&d->video, d->max_duration) &&
+        (d->a_idx < 0 || queue_enough(&d->audio, d->max_duration))) {
+        return 1;
+    }
+    return queue_enough(&d->video, d->max_duration) &&
+           (d->a_idx < 0 || queue_enough(&d->audio, d->max_duration));
+}
+
+// Wait while the queues are full, up to DEMUX_WAIT_U.
+// @return Whether they were full.
+static int wait_for_room(Demuxer *d) {
+    pthread_mutex_lock(&d->lock);
+    int full = queues_full(d);
+    if (full) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += DEMUX_WAIT_U * 1000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&d->cond, &d->lock, &ts);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return full;
+}
+
+static void *demux_thread(void *arg) {
+    Demuxer *d = arg;
+    AVPacket *pckt = av_packet_alloc();
+    if (!pckt) lerror("Unable to allocate AVPacket for demuxing");
+    while (pckt && !atomic_load(&d->abort)) {
+        if (wait_for_room(d)) continue;
+        int err = av_read_frame(d->fmt_ctxt, pckt);
+        if (err < 0) {
+            if (err != AVERROR_EOF) {
+                lwarn("Error when reading packet, stopping. (code: %d)", err);
+            }
+            break;
+        }
+        if (pckt->stream_index == d->v_idx) {
+            err = packet_queue_put(&d->video, pckt);
+        } else if (pckt->stream_index == d->a_idx) {
+            err = packet_queue_put(&d->audio, pckt);
+        }
+        av_packet_unref(pckt);
+        if (err != 0) {
+            lerror("Unable to queue packet, stopping. (code: %d)", err);
+            break;
+        }
+    }
+    av_packet_free(&pckt);
+    // Both decoders drain what is queued, then see the end
+    packet_queue_put_eof(&d->video);
+    packet_queue_put_eof(&d->audio);
+    return NULL;
+}
+
+int demuxer_start(Demuxer *d) {
+    linfo("Creating demux thread...");
+    if (pthread_create(&d->thread, NULL, demux_thread, d) != 0) {
+        return DEMUX_ERR_THREAD;
+    }
+    d->thread_started = 1;
+    return 0;
+}
+
+void demuxer_destroy(Demuxer *d) {
+    atomic_store(&d->abort, 1);
+    demuxer_wake(d);
+    packet_queue_abort(&d->video);
+    packet_queue_abort(&d->audio);
+    if (d->thread_started) {
+        pthread_join(d->thread, NULL);
+        d->thread_started = 0;
+    }
+    packet_queue_destroy(&d->video);
+    packet_queue_destroy(&d->audio);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+}
@@ -0,0 +1,120 @@
+#ifndef DEMUX_H
+#define DEMUX_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "config.h"
+
+// A stream keeps being read while its queue holds fewer packets, even past
+// --demux-queue-ms, so decoders with large frames are not starved
+#define PACKET_QUEUE_MIN_PACKETS 25
+// Longest wait of the demux thread before checking the queues again (in us)
+#define DEMUX_WAIT_U 10000
+
+typedef enum {
+    DEMUX_ERR_ALLOC = -400000,
+    DEMUX_ERR_THREAD,
+} DemuxErr;
+
+typedef struct PacketNode PacketNode;
+
+// Unbounded FIFO of the packets of one stream, as ffplay's PacketQueue.
+// Puts never block: the demux thread bounds the queues together, so a
+// stream lagging in the file can be read ahead of while the other waits.
+typedef struct {
+    pthread_mutex_t lock;
+    // when the queue is empty, consumer wait for this cond
+    pthread_cond_t cond;
+    PacketNode *first;
+    PacketNode *last;
+    int nb_packets;
+    // bytes of the queued packets, their data and the nodes
+    size_t bytes;
+    // sum of the packet durations, in time_base
+    int64_t duration;
+    AVRational time_base;
+    // as a bool value, no packet will be put any more
+    int eof;
+    // as a bool value, consumer stop waiting
+    int abort;
+    // called (unlocked) after a packet is taken out
+    void (*get_callback)(void *);
+    void *get_arg;
+} PacketQueue;
+
+// Reads the packets of a file on its own thread into one PacketQueue per
+// stream, so each decoder pulls at its own pace and a file with audio far
+// ahead of or behind its video (badly interleaved) no longer stalls the
+// stream that is behind. Reading pauses while the queues together hold
+// more than --demux-queue-mb (unless the audio queue is empty), while the
+// audio queue alone holds --demux-queue-ms (or the video queue does and the
+// audio one has enough), or while every queue holds at least
+// PACKET_QUEUE_MIN_PACKETS packets and --demux-queue-ms of them.
+typedef struct {
+    AVFormatContext *fmt_ctxt;
+    int v_idx;
+    // -1 when the audio is not played
+    int a_idx;
+    PacketQueue video;
+    PacketQueue audio;
+    size_t max_bytes;
+    double max_duration;
+    // the demux thread wait on cond while the queues are full
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int thread_started;
+    atomic_int abort;
+} Demuxer;
+
+/// @brief Initialize a packet queue.
+/// @param q Packet queue.
+/// @param time_base Time base of the packet durations.
+void packet_queue_init(PacketQueue *q, AVRational time_base);
+
+/// @brief Queue a packet, without blocking.
+/// @param q Packet queue.
+/// @param pckt Packet, its data is moved into the queue.
+/// @return 0 for success, DEMUX_ERR_ALLOC for error.
+int packet_queue_put(PacketQueue *q, AVPacket *pckt);
+
+/// @brief Mark the end of the stream, packet_queue_get returns 0 once the
+///        queue is empty.
+void packet_queue_put_eof(PacketQueue *q);
+
+/// @brief Take the next packet, blocking while the queue is empty.
+/// @param q Packet queue.
+/// @param pckt Unreferenced packet, set to the packet taken.
+/// @return 1 for a packet, 0 for the end of the stream, -1 for abort.
+int packet_queue_get(PacketQueue *q, AVPacket *pckt);
+
+/// @brief Wake the consumer, packet_queue_get returns -1 from now on.
+void packet_queue_abort(PacketQueue *q);
+
+/// @brief Free the queued packets and the queue.
+void packet_queue_destroy(PacketQueue *q);
+
+/// @brief Set up the video and (unless a_idx is -1) audio queues of
+///        fmt_ctxt, without reading yet.
+/// @param d Demuxer.
+/// @param conf Parsed config (demux_queue_mb, demux_queue_ms).
+/// @param fmt_ctxt Opened file, read by the demux thread only from
+///        demuxer_start on.
+/// @param v_idx Video stream index.
+/// @param a_idx Audio stream index, -1 to skip the audio packets.
+void demuxer_init(Demuxer *d, const config *conf, AVFormatContext *fmt_ctxt,
+                  int v_idx, int a_idx);
+
+/// @brief Start the demux thread.
+/// @return 0 for success, DEMUX_ERR_THREAD for error.
+int demuxer_start(Demuxer *d);
+
+/// @brief Stop the demux thread (if it still reads), wake the consumers
+///        and free the queued packets.
+/// @param d Demuxer.
+void demuxer_destroy(Demuxer *d);
+
+#endif
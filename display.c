@@ -1,16 +1,27 @@
 #include "display.h"
 
 #include <libavutil/frame.h>
+#include <math.h>
 #include <ncurses.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "audio.h"
 #include "channel/channel.h"
+#include "channel/depth.h"
 #include "config.h"
+#include "decimate.h"
+#include "hash.h"
 #include "log/log.h"
+#include "metrics/metrics.h"
+#include "render.h"
+#include "scale.h"
+#include "scrub.h"
+#include "video_frame.h"
 
 atomic_bool ncurses_status = 0;
 
@@ -18,42 +29,195 @@ atomic_bool ncurses_status = 0;
 
 // https://stackoverflow.com/questions/35446049/port-audio-causing-loud-buzzing-50-of-tests
 #define CACHE_AUDIO_BUF_SIZE 1024
+// Refresh interval of the metrics status line (in microseconds)
+#define STATS_REFRESH_U 500000
+
+int write_audio_stream(PaStream *stream, const void *buf,
+                       unsigned long frames) {
+    int err;
+    METRICS_TIMED(MH_PA_WRITE, err = Pa_WriteStream(stream, buf, frames));
+    if (err == paOutputUnderflowed) {
+        metrics_count(MC_AUDIO_UNDERRUNS, 1);
+    }
+    return err;
+}
+
+// Scaler from the frames of video_ch to the screen, NULL when they match.
+// Box averages when shrinking and repeats pixels (nearest) when growing.
+static Scaler *frame_resizer_alloc(const config *conf) {
+    if (conf->frame_width <= 0 || conf->frame_height <= 0 ||
+        (conf->frame_width == conf->width &&
+         conf->frame_height == conf->height)) {
+        return NULL;
+    }
+    Scaler *s = scaler_alloc(SCALER_BOX, conf->frame_width,
+                             conf->frame_height, AV_PIX_FMT_GRAY8, conf->width,
+                             conf->height);
+    if (!s) {
+        printf("Unable to allocate frame resizer\n");
+        exit(2);
+    }
+    return s;
+}
+
+// Master clock of play_video: the audio heard, or before the audio starts
+// the wall clock since the first frame, CLOCK_START_U late.
+static double video_clock(config *conf, uint64_t start_us, double start_pts) {
+    double clock = audio_player_clock(conf->audio);
+    if (!isnan(clock)) return clock;
+    return start_pts +
+           ((double)(metrics_now_us() - start_us) - CLOCK_START_U) / 1000000;
+}
 
 void *play_video(void *arg) {
     config *conf = (config *)arg;
-    unsigned char *data = NULL;
+    VideoFrame *vf = NULL;
     int err;
 
-    int dur_u = 1000000 / conf->fps;
+    // Display time of the next frame, relative to start (in microseconds)
+    int64_t deadline_u = 0;
+    // Presentation time of the first and the last frame paced by the audio
+    // clock, and when the first one was read
+    double start_pts = 0, last_pts = 0;
+    uint64_t start_us = 0;
+    // as a bool value, the last frame was dropped as late
+    int dropped = 0;
+    // frame dropped as late, drawn by the repeat tick after it if any
+    VideoFrame *undrawn = NULL;
 
     struct timeval start;
     gettimeofday(&start, NULL);
 
-    for (int count = 0;; count++) {
-        if ((err = read_element(conf->video_ch, (void **)&data)) != 0) {
+    MetricsSnapshot stats_prev = metrics_snapshot();
+    char stats_line[256] = "";
+    // Text of the whole frame, filled by render_row
+    size_t screen_size = (size_t)conf->width * conf->height;
+    char *screen = malloc(screen_size);
+    if (!screen) {
+        printf("Unable to allocate screen buffer\n");
+        exit(2);
+    }
+    // Hash of the text on screen, valid when has_screen
+    uint64_t screen_hash = 0;
+    int has_screen = 0;
+    Renderer *renderer = render_alloc(conf);
+    if (!renderer) {
+        printf("Unable to allocate renderer\n");
+        exit(2);
+    }
+    // Resized frames are written to the same buffer each time
+    Scaler *resizer = frame_resizer_alloc(conf);
+    uint8_t *resized = resizer ? malloc(screen_size) : NULL;
+    if (resizer && !resized) {
+        printf("Unable to allocate resize buffer\n");
+        exit(2);
+    }
+
+    while (1) {
+        METRICS_TIMED(MH_CHANNEL_READ,
+                      err = read_element(conf->video_ch, (void **)&vf));
+        if (err != 0) {
             printf("Error reading element(code: %d)\n", err);
             exit(2);
         }
-        if (conf->no_audio) {
+        metrics_count(MC_VIDEO_DEQUEUED, 1);
+        // as a bool value, the audio clock passed the next frame already
+        int late = 0;
+        if (conf->audio) {
+            int dur_u = atomic_load(&conf->frame_us);
+            double dur = (dur_u > 0 ? dur_u : 1000000 / conf->fps) / 1000000.0;
+            // A repeat tick (or a frame of unknown time) follows the last one
+            double pts = vf && vf->pts >= 0 ? vf->pts : last_pts + dur;
+            if (!start_us) {
+                start_us = metrics_now_us();
+                start_pts = pts;
+            }
+            last_pts = pts;
+            double clock;
+            while ((clock = video_clock(conf, start_us, start_pts)) < pts) {
+                double wait_u = (pts - clock) * 1000000;
+                usleep(wait_u < CLOCK_WAIT_U ? (useconds_t)wait_u
+                                             : CLOCK_WAIT_U);
+            }
+            // Every other frame is still drawn, so a video decoded slower
+            // than real time keeps moving
+            late = vf && !dropped && clock - pts > dur;
+            dropped = late;
+            if (late) {
+                metrics_count(MC_FRAMES_DROPPED, 1);
+                video_frame_unref(&undrawn);
+                undrawn = video_frame_ref(vf);
+            }
+        } else if (conf->no_audio) {
             struct timeval now;
             gettimeofday(&now, NULL);
-            int pause_dur_u = dur_u * count -
-                              (now.tv_sec - start.tv_sec) * 1000000 -
-                              (now.tv_usec - start.tv_usec);
+            int64_t pause_dur_u = deadline_u -
+                                  (now.tv_sec - start.tv_sec) * 1000000 -
+                                  (now.tv_usec - start.tv_usec);
             if (pause_dur_u > 0) {
                 usleep(pause_dur_u);
             }
+            // The interval changes when frames are decimated
+            int dur_u = atomic_load(&conf->frame_us);
+            deadline_u += dur_u > 0 ? dur_u : 1000000 / conf->fps;
         }
-        clear();
-        for (int i = 0; i < conf->height; i++) {
-            for (int j = 0; j < conf->width; j++) {
-                addch(conf->grey_ascii[(int)(conf->grey_ascii_step *
-                                             data[i * conf->width + j])]);
+        uint64_t render_start = metrics_now_us();
+        // NULL is a repeat tick, the previous frame stays on screen
+        int drawn = 0;
+        const VideoFrame *shown = late ? NULL : vf ? vf : undrawn;
+        // Frames of another size are resized first, a failed one is skipped
+        const uint8_t *frame = shown ? shown->data : NULL;
+        if (frame && resizer) {
+            frame = scaler_scale_gray(resizer, shown->data, resized) == 0
+                        ? resized
+                        : NULL;
+        }
+        if (frame) {
+            const uint8_t *img = render_prepare(renderer, frame);
+            for (int i = 0; i < conf->height; i++) {
+                render_row(renderer, img, i, screen + i * conf->width);
+            }
+            // Frames quantized to the same characters are not drawn again
+            uint64_t hash = hash_xxh64(screen, screen_size, 0);
+            if (!has_screen || hash != screen_hash) {
+                clear();
+                for (int i = 0; i < conf->height; i++) {
+                    mvaddnstr(i, 0, screen + i * conf->width, conf->width);
+                }
+                screen_hash = hash;
+                has_screen = drawn = 1;
             }
-            addch('\n');
         }
-        refresh();
-        free(data);
+        if (conf->stats && has_screen) {
+            MetricsSnapshot now = metrics_snapshot();
+            if (now.time_us - stats_prev.time_us >= STATS_REFRESH_U) {
+                metrics_format_line(&now, &stats_prev, stats_line,
+                                    sizeof(stats_line));
+                stats_prev = now;
+            }
+            // Restore the video row under a shorter status line
+            if (!drawn) {
+                mvaddnstr(conf->height - 1, 0,
+                          screen + (conf->height - 1) * conf->width,
+                          conf->width);
+            }
+            mvaddnstr(conf->height - 1, 0, stats_line, conf->width);
+        }
+        if (drawn || (conf->stats && has_screen)) refresh();
+        if (drawn) {
+            // Moving average over about 8 frames
+            int cost_us = (int)(metrics_now_us() - render_start);
+            int render_us = atomic_load(&conf->render_us);
+            render_us =
+                render_us ? render_us + (cost_us - render_us) / 8 : cost_us;
+            atomic_store(&conf->render_us, render_us > 0 ? render_us : 1);
+            metrics_count(MC_FRAMES_RENDERED, 1);
+            metrics_count(MC_TTY_BYTES, (conf->width + 1) * conf->height);
+        }
+        // Drawn now, or replaced by a newer frame
+        if (!late) video_frame_unref(&undrawn);
+        video_frame_unref(&vf);
+        atomic_fetch_add(&conf->video_rendered, 1);
     }
 }
 
@@ -138,11 +302,28 @@ void video_add_callback(void *arg) {
     pthread_mutex_unlock(&cs->lock);
 }
 
-int play_from_cache(config conf) {
-    APCache *apc = NULL;
+// Take over the image of a cached video frame into a VideoFrame.
+static VideoFrame *cache_video_frame(const config *conf, APFrame *apf) {
+    // The frame owns a copied image, not a borrowed one
+    VideoFrame *vf = video_frame_alloc(apf->data, conf->frame_width,
+                                       conf->frame_height, -1,
+                                       conf->video_borrowed ? NULL : free,
+                                       apf->data);
+    apf->data = NULL;
+    if (!vf) {
+        if (atomic_fetch_and(&ncurses_status, 0)) {
+            endwin();
+        }
+        printf("Unable to allocate VideoFrame\n");
+        lfatal(-2, "Unable to allocate VideoFrame");
+    }
+    return vf;
+}
+
+int play_from_cache(config conf, APCache *apc) {
     int err;
     linfo("Trying to open the apcache file (path: %s)", conf.filename);
-    if ((err = apcache_open(conf.filename, &apc)) != 0) {
+    if (!apc && (err = apcache_open(conf.filename, &apc)) != 0) {
         if (atomic_fetch_and(&ncurses_status, 0)) {
             endwin();
         }
@@ -153,8 +334,22 @@ int play_from_cache(config conf) {
     if (!conf.no_audio) {
         conf.no_audio = !apc->sample_rate;
     }
-    conf.width = apc->width;
-    conf.height = apc->height;
+    // Frames keep the size they were cached at, play_video resizes them to
+    // the terminal (or --width/--height), from the smallest level covering it
+    if (conf.width > 0 && conf.height > 0) {
+        apcache_select_level(apc, conf.width, conf.height);
+    }
+    conf.frame_width = apc->width;
+    conf.frame_height = apc->height;
+    if (conf.width <= 0 || conf.height <= 0) {
+        conf.width = apc->width;
+        conf.height = apc->height;
+    }
+    // Cached frames hold one sample per cell
+    if (conf.render != RENDER_LUMA) {
+        lwarn("Render mode only applies to live decoding, using luma");
+        conf.render = RENDER_LUMA;
+    }
 
     if (conf.fps == 0 && conf.no_audio) {
         if (atomic_fetch_and(&ncurses_status, 0)) {
@@ -164,6 +359,28 @@ int play_from_cache(config conf) {
         lfatal(-1, "Unknown FPS");
     }
 
+    // Pick the starting point from the thumbnails before opening audio
+    if (conf.scrub) {
+        uint64_t offset;
+        int play = scrub_cache(&conf, apc, &offset);
+        err = play == 1 ? apcache_seek(apc, offset) : play;
+        if (err != 0) {
+            if (atomic_fetch_and(&ncurses_status, 0)) {
+                endwin();
+            }
+            printf("Error when scrubbing apcache file. (code: %d)\n", err);
+            lfatal(-1, "Error when scrubbing apcache file. (code: %d)", err);
+        }
+        if (!play) {
+            if (atomic_fetch_and(&ncurses_status, 0)) {
+                endwin();
+            }
+            apcache_close(apc);
+            apcache_free(&apc);
+            return 0;
+        }
+    }
+
     // PortAudio Stream Params
     PaStreamParameters pa_stm_param;
     // PortAudio Stream
@@ -204,9 +421,24 @@ int play_from_cache(config conf) {
         }
     }
 
+    // Cached frames carry no timestamps, they are decimated by count
+    Decimator decimator;
+    decimator_init(&decimator, conf.fps, conf.max_fps, conf.max_fps_auto);
+    if (decimator.rate > 0) {
+        atomic_store(&conf.frame_us, (int)(1000000 / decimator.rate));
+    }
+
     linfo("Allocate video channel");
-    // Allocate video channel
-    conf.video_ch = alloc_channel(10);
+    // Allocate video channel, sized at runtime within the memory budget
+    ChannelDepth depth;
+    // Borrowed frames are mapped, only queued handles cost memory
+    channel_depth_init(&depth,
+                       apcache_borrows_frames(apc)
+                           ? sizeof(VideoFrame)
+                           : conf.frame_width * conf.frame_height,
+                       conf.max_buffer_mb, decimator.rate);
+    conf.video_ch = alloc_channel(depth.max);
+    set_channel_limit(conf.video_ch, depth.depth);
     conf.video_ch->drain_callback.callback = video_drain_callback;
     conf.video_ch->add_callback.callback = video_add_callback;
     conf.video_ch->drain_callback.arg = &conf.video_ch_status;
@@ -216,24 +448,71 @@ int play_from_cache(config conf) {
 
     int image_count = 0, audio_count = 0;
     APFrame *apf = NULL;
+    // Last frame dropped by the decimator, queued by the first repeat tick
+    // kept after it, so the run shows it rather than the frame before
+    VideoFrame *dropped = NULL;
+
+    // Frames of a mapped file are passed to play_video without copying
+    conf.video_borrowed = apcache_borrows_frames(apc);
 
     linfo("Reading frames from apcache file...");
     // While not the end of file.
-    while ((err = apcache_read_frame(apc, &apf)) == 0) {
+    while (1) {
+        // Cost of a video frame, from file to channel. Only its own read is
+        // counted, not the audio records before it, which wait on the device
+        uint64_t frame_start = metrics_now_us();
+        if ((err = apcache_read_frame(apc, &apf)) != 0) break;
         if (apf->type == APAV_VIDEO) {
-            add_element(conf.video_ch, apf->data);
-            apf->data = NULL;
+            if (!decimator_keep(&decimator, -1)) {
+                metrics_count(MC_FRAMES_DROPPED, 1);
+                video_frame_unref(&dropped);
+                dropped = cache_video_frame(&conf, apf);
+                continue;
+            }
+            video_frame_unref(&dropped);
+            if (decimator_observe(&decimator, atomic_load(&conf.render_us))) {
+                ldebug("Display rate: %.2f fps", decimator.rate);
+                atomic_store(&conf.frame_us, (int)(1000000 / decimator.rate));
+            }
+            if (channel_depth_observe(&depth,
+                                      metrics_now_us() - frame_start)) {
+                ldebug("Video channel depth: %d", depth.depth);
+                set_channel_limit(conf.video_ch, depth.depth);
+            }
+            VideoFrame *vf = cache_video_frame(&conf, apf);
+            METRICS_TIMED(MH_CHANNEL_ADD, add_element(conf.video_ch, vf));
+            metrics_count(MC_VIDEO_QUEUED, 1);
             if (++image_count == 1) {
                 linfo("Creating video thread...");
                 pthread_create(&th_v, NULL, play_video, &conf);
             }
+        } else if (apf->type == APAV_REPEAT && image_count > 0) {
+            if (apf->bsize < sizeof(uint32_t)) {
+                lwarn("Repeat record too short, skipped (size: %u)",
+                      (unsigned)apf->bsize);
+                continue;
+            }
+            uint32_t ticks;
+            memcpy(&ticks, apf->data, sizeof(uint32_t));
+            // Each kept tick holds the previous frame for one more period
+            for (uint32_t i = 0; i < ticks; i++) {
+                if (!decimator_keep(&decimator, -1)) {
+                    metrics_count(MC_FRAMES_DROPPED, 1);
+                    continue;
+                }
+                METRICS_TIMED(MH_CHANNEL_ADD,
+                              add_element(conf.video_ch, dropped));
+                dropped = NULL;
+                image_count++;
+            }
         } else if (apf->type == APAV_AUDIO && !conf.no_audio) {
             if (++audio_count == 1) {
                 linfo("Starting audio stream...");
                 Pa_StartStream(stream);
             }
             // Write data into stream
-            Pa_WriteStream(stream, apf->data, apf->bsize / (2 * sizeof(float)));
+            write_audio_stream(stream, apf->data,
+                               apf->bsize / (2 * sizeof(float)));
         }
     }
     if (err != 0 && err != APCACHE_ERR_EOF) {
@@ -246,11 +525,17 @@ int play_from_cache(config conf) {
         pthread_cond_wait(&conf.video_ch_status.drain_cond,
                           &conf.video_ch_status.lock);
     pthread_mutex_unlock(&conf.video_ch_status.lock);
+    // The last borrowed frame may still be drawn after the channel drained
+    while (conf.video_borrowed &&
+           atomic_load(&conf.video_rendered) < image_count) {
+        usleep(1000);
+    }
     if (atomic_fetch_and(&ncurses_status, 0)) {
         endwin();
     }
     // Free video channel
     free_channel(conf.video_ch);
+    video_frame_unref(&dropped);
     apcache_frame_free(&apf);
     Pa_StopStream(stream);
     // Close PortAudio stream
@@ -18,11 +18,28 @@
 //     unsigned char *data;
 // } APVideoData;
 
+// Longest sleep of play_video waiting for the audio clock (in microseconds)
+#define CLOCK_WAIT_U 10000
+// Longest wait of play_video for the audio to start, before it runs on the
+// wall clock until then (in microseconds)
+#define CLOCK_START_U 1000000
+
 extern atomic_bool ncurses_status;
 
 void *play_video(void *arg);
 
-int play_from_cache(config conf);
+/// @brief Blocking write to a PortAudio stream, recording the blocking time
+///        and output underruns into metrics.
+/// @return PortAudio error code of Pa_WriteStream.
+int write_audio_stream(PaStream *stream, const void *buf,
+                       unsigned long frames);
+
+/// @brief Play an apcache file.
+/// @param conf Parsed config.
+/// @param apc Opened file (e.g. a sniffed stream), freed when done, NULL to
+///        open conf.filename.
+/// @return 0 for success, minus number for error.
+int play_from_cache(config conf, APCache *apc);
 
 // int audio_callback(const void *input, void *output, unsigned long frameCount,
 //                    const PaStreamCallbackTimeInfo *timeInfo,
@@ -0,0 +1,341 @@
+#include "dither.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DITHER_MAX_THREADS 4
+// Error diffusion uses one thread per this many rows at most
+#define DITHER_MIN_ROWS_PER_THREAD 16
+// Pixels diffused between two progress updates of a row
+#define DITHER_FS_CHUNK 32
+// How far (in levels) a value has to leave the range of its previous level
+// before the stable variant lets it change
+#define DITHER_HYSTERESIS 0.3f
+
+static const uint8_t bayer8[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+// Ranks of a 16x16 void-and-cluster blue noise mask (sigma 1.9).
+static const uint8_t bluenoise16[16][16] = {
+    {203, 231, 121, 145, 174,  62, 136, 187, 157,  21, 130,  75,  12,  99,  17,  83},
+    {160,  22,   1, 217,  87, 229,  11,  79,  50, 219, 240, 167, 204, 142,  53, 178},
+    { 93, 242,  68, 189,  44, 117, 165, 236, 101, 195,  30, 118,  45, 188, 253, 115},
+    { 42, 129, 169, 106, 247, 150,  19, 207, 125, 147,  63,  89, 214,   4,  70, 220},
+    {151, 208,  80,  32, 197,  57,  73, 180,  40,   8, 176, 246, 154, 105, 138,  26},
+    { 61, 237,  13, 141, 221,  96, 133, 250, 109,  82, 225, 131,  35, 199, 233, 171},
+    {112, 193,  51, 122, 162,   6, 230,  25, 213, 166, 192,  20,  55,  76,  92,  18},
+    {222,  85, 175, 254,  39, 185,  90, 153,  48,  67,  98, 119, 161, 249, 183, 127},
+    {158,   2, 102,  69, 205, 114,  58, 202, 139,   0, 241, 206, 144,  10, 211,  46},
+    {245, 143, 232,  27, 148,  78, 239, 172, 124, 228,  86,  41, 177,  31, 104,  65},
+    {186,  36, 198, 128, 215,   9,  23, 100,  33, 182, 156,  59, 113, 224, 134,  81},
+    { 15, 116,  60,  91, 164, 248, 135, 194,  74, 218,  14, 252,  72, 196, 235, 163},
+    {209, 170, 226,  43, 107, 181,  54, 234,  47, 120, 103, 140, 173,   5,  49,  94},
+    {251, 137,   7, 191,  71,  16, 152,  84, 168, 200,  28, 210,  88, 123, 149,  24},
+    {108,  77, 155, 243, 212, 126, 111, 223,   3, 146, 244,  56,  38, 190, 216,  64},
+    { 34, 184,  52,  97,  29, 201,  37, 255,  95,  66, 179, 110, 227, 159, 238, 132},
+};
+
+// Ordered dithering works on 32 pixels at a time
+typedef uint8_t v32u8 __attribute__((vector_size(32)));
+
+struct DitherState {
+    DitherMode mode;
+    int stable;
+    int width;
+    int height;
+    float step;
+    int levels;
+    // value standing for each level
+    uint8_t center[256];
+    uint8_t *out;
+    // level of each pixel in the last frame, -1 for none
+    int16_t *prev;
+    // ordered: threshold offset of each pixel of tile rows, added after
+    // subtracting half a level
+    uint8_t *offsets;
+    uint8_t half;
+    int tile;
+    // error diffusion: height + 1 rows of width + 2 accumulated errors
+    float *err;
+    // error diffusion: number of pixels done in each row
+    atomic_int *progress;
+    const uint8_t *in;
+    int nthreads;
+    pthread_t threads[DITHER_MAX_THREADS];
+    pthread_mutex_t lock;
+    // signaled when a frame is ready for the workers, or when stopping
+    pthread_cond_t start_cond;
+    // signaled when the last worker finished its rows
+    pthread_cond_t done_cond;
+    uint64_t gen;
+    int busy;
+    int stopping;
+};
+
+int dither_mode_parse(const char *name) {
+    if (strcmp(name, "none") == 0) return DITHER_NONE;
+    if (strcmp(name, "bayer") == 0) return DITHER_BAYER;
+    if (strcmp(name, "fs") == 0) return DITHER_FS;
+    if (strcmp(name, "bluenoise") == 0) return DITHER_BLUENOISE;
+    return -1;
+}
+
+static int level_of(const DitherState *d, float v) {
+    if (v <= 0) return 0;
+    int k = (int)(v * d->step);
+    return k < d->levels ? k : d->levels - 1;
+}
+
+// Keep the previous level while v stays close to its range.
+static int stable_level(const DitherState *d, float v, int k, int prev) {
+    if (prev < 0 || prev == k) return k;
+    float lv = v * d->step;
+    if (lv > prev - DITHER_HYSTERESIS && lv < prev + 1 + DITHER_HYSTERESIS) {
+        return prev;
+    }
+    return k;
+}
+
+static void ordered_apply(DitherState *d) {
+    int w = d->width;
+    for (int y = 0; y < d->height; y++) {
+        const uint8_t *src = d->in + (size_t)y * w;
+        const uint8_t *off = d->offsets + (size_t)(y % d->tile) * w;
+        uint8_t *dst = d->out + (size_t)y * w;
+        int x = 0;
+        v32u8 half = (v32u8){0} + d->half;
+        for (; x + 32 <= w; x += 32) {
+            v32u8 a, b;
+            memcpy(&a, src + x, sizeof(a));
+            memcpy(&b, off + x, sizeof(b));
+            // Saturating a - half + b: a wrapped difference is larger
+            // than a, a wrapped sum is smaller than the difference
+            v32u8 diff = a - half;
+            diff &= (v32u8)(diff <= a);
+            v32u8 s = diff + b;
+            s |= (v32u8)(s < diff);
+            memcpy(dst + x, &s, sizeof(s));
+        }
+        for (; x < w; x++) {
+            int s = src[x] - d->half + off[x];
+            dst[x] = s < 0 ? 0 : s > 255 ? 255 : s;
+        }
+    }
+    if (!d->stable) return;
+    size_t n = (size_t)w * d->height;
+    for (size_t i = 0; i < n; i++) {
+        int k = stable_level(d, d->out[i], level_of(d, d->out[i]), d->prev[i]);
+        d->prev[i] = k;
+        d->out[i] = d->center[k];
+    }
+}
+
+static void wait_progress(atomic_int *progress, int need) {
+    int spins = 0;
+    while (atomic_load_explicit(progress, memory_order_acquire) < need) {
+        if (++spins > 64) sched_yield();
+    }
+}
+
+// Diffuse one row. Row y reads its errors once row y - 1 is two pixels
+// ahead, and only writes errors of row y + 1 behind its own progress.
+static void fs_row(DitherState *d, int y) {
+    int w = d->width;
+    const float *e = d->err + (size_t)y * (w + 2) + 1;
+    float *en = d->err + (size_t)(y + 1) * (w + 2) + 1;
+    const uint8_t *src = d->in + (size_t)y * w;
+    uint8_t *dst = d->out + (size_t)y * w;
+    int16_t *prev = d->prev + (size_t)y * w;
+    float carry = 0;
+    for (int x0 = 0; x0 < w; x0 += DITHER_FS_CHUNK) {
+        int x1 = x0 + DITHER_FS_CHUNK < w ? x0 + DITHER_FS_CHUNK : w;
+        if (y > 0) wait_progress(&d->progress[y - 1], x1 + 1 < w ? x1 + 1 : w);
+        for (int x = x0; x < x1; x++) {
+            float v = src[x] + e[x] + carry;
+            int k = level_of(d, v);
+            if (d->stable) {
+                k = stable_level(d, v, k, prev[x]);
+                prev[x] = k;
+            }
+            dst[x] = d->center[k];
+            float q = v - d->center[k];
+            carry = q * (7.0f / 16);
+            en[x - 1] += q * (3.0f / 16);
+            en[x] += q * (5.0f / 16);
+            en[x + 1] += q * (1.0f / 16);
+        }
+        atomic_store_explicit(&d->progress[y], x1, memory_order_release);
+    }
+}
+
+static void fs_rows(DitherState *d, int idx) {
+    for (int y = idx; y < d->height; y += d->nthreads) {
+        fs_row(d, y);
+    }
+}
+
+typedef struct {
+    DitherState *d;
+    int idx;
+} DitherWorker;
+
+static void *fs_worker(void *arg) {
+    DitherWorker w = *(DitherWorker *)arg;
+    free(arg);
+    DitherState *d = w.d;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (d->gen == seen && !d->stopping) {
+            pthread_cond_wait(&d->start_cond, &d->lock);
+        }
+        if (d->stopping) break;
+        seen = d->gen;
+        pthread_mutex_unlock(&d->lock);
+        fs_rows(d, w.idx);
+        pthread_mutex_lock(&d->lock);
+        if (--d->busy == 0) pthread_cond_signal(&d->done_cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+static void fs_apply(DitherState *d) {
+    memset(d->err, 0, sizeof(float) * (d->width + 2) * (d->height + 1));
+    for (int y = 0; y < d->height; y++) {
+        atomic_store_explicit(&d->progress[y], 0, memory_order_relaxed);
+    }
+    pthread_mutex_lock(&d->lock);
+    d->gen++;
+    d->busy = d->nthreads - 1;
+    pthread_cond_broadcast(&d->start_cond);
+    pthread_mutex_unlock(&d->lock);
+    // The calling thread takes the first share of rows
+    fs_rows(d, 0);
+    pthread_mutex_lock(&d->lock);
+    while (d->busy > 0) pthread_cond_wait(&d->done_cond, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int init_ordered(DitherState *d) {
+    d->tile = d->mode == DITHER_BAYER ? 8 : 16;
+    d->offsets = malloc((size_t)d->tile * d->width);
+    if (!d->offsets) return -1;
+    float q = 1 / d->step;
+    d->half = q / 2 > 255 ? 255 : (uint8_t)(q / 2 + 0.5f);
+    for (int y = 0; y < d->tile; y++) {
+        for (int x = 0; x < d->width; x++) {
+            int rank = d->mode == DITHER_BAYER ? bayer8[y][x % 8]
+                                               : bluenoise16[y][x % 16];
+            // Threshold in [0, 1) of a level, centred by half, so the mean
+            // of the levels picked matches the value
+            float t = (rank + 0.5f) / (d->tile * d->tile);
+            float off = t * q;
+            d->offsets[(size_t)y * d->width + x] = off > 255 ? 255 : off;
+        }
+    }
+    return 0;
+}
+
+static int init_fs(DitherState *d) {
+    d->err = malloc(sizeof(float) * (d->width + 2) * (d->height + 1));
+    d->progress = malloc(sizeof(atomic_int) * d->height);
+    if (!d->err || !d->progress) return -1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = d->height / DITHER_MIN_ROWS_PER_THREAD;
+    if (n > DITHER_MAX_THREADS) n = DITHER_MAX_THREADS;
+    if (cpus > 0 && n > cpus) n = cpus;
+    d->nthreads = n < 1 ? 1 : n;
+    for (int i = 1; i < d->nthreads; i++) {
+        DitherWorker *w = malloc(sizeof(DitherWorker));
+        if (w) *w = (DitherWorker){d, i};
+        if (!w || pthread_create(&d->threads[i], NULL, fs_worker, w) != 0) {
+            free(w);
+            // Rows are dealt out to the threads that did start
+            d->nthreads = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+DitherState *dither_alloc(DitherMode mode, int stable, int width, int height,
+                          float step) {
+    if (mode == DITHER_NONE || width < 1 || height < 1 || step <= 0) {
+        return NULL;
+    }
+    DitherState *d = calloc(1, sizeof(DitherState));
+    if (!d) return NULL;
+    d->mode = mode;
+    d->stable = stable;
+    d->width = width;
+    d->height = height;
+    d->step = step;
+    d->nthreads = 1;
+    d->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    d->start_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    d->done_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    d->levels = (int)(255 * step) + 1;
+    if (d->levels > 256) d->levels = 256;
+    for (int k = 0; k < d->levels; k++) {
+        // Middle of the level, nudged to where the renderer agrees
+        int c = (int)((k + 0.5f) / step);
+        if (c > 255) c = 255;
+        while (c > 0 && (int)(c * step) > k) c--;
+        while (c < 255 && (int)(c * step) < k) c++;
+        d->center[k] = c;
+    }
+    size_t n = (size_t)width * height;
+    d->out = malloc(n);
+    d->prev = malloc(n * sizeof(int16_t));
+    if (!d->out || !d->prev) {
+        dither_free(d);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) d->prev[i] = -1;
+    int err = mode == DITHER_FS ? init_fs(d) : init_ordered(d);
+    if (err != 0) {
+        dither_free(d);
+        return NULL;
+    }
+    return d;
+}
+
+const uint8_t *dither_apply(DitherState *d, const uint8_t *img) {
+    d->in = img;
+    if (d->mode == DITHER_FS) {
+        fs_apply(d);
+    } else {
+        ordered_apply(d);
+    }
+    return d->out;
+}
+
+void dither_free(DitherState *d) {
+    if (!d) return;
+    pthread_mutex_lock(&d->lock);
+    d->stopping = 1;
+    pthread_cond_broadcast(&d->start_cond);
+    pthread_mutex_unlock(&d->lock);
+    for (int i = 1; i < d->nthreads; i++) {
+        pthread_join(d->threads[i], NULL);
+    }
+    free(d->out);
+    free(d->prev);
+    free(d->offsets);
+    free(d->err);
+    free(d->progress);
+    free(d);
+}
@@ -0,0 +1,50 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdint.h>
+
+typedef enum {
+    DITHER_NONE,
+    // ordered, 8x8 Bayer matrix
+    DITHER_BAYER,
+    // Floyd-Steinberg error diffusion
+    DITHER_FS,
+    // ordered, 16x16 blue noise mask
+    DITHER_BLUENOISE,
+} DitherMode;
+
+// Dithers greyscale images before they are turned into characters, so a
+// short character ramp renders gradients without banding.
+// Values are quantized like render_row does: level = (int)(value * step).
+// Ordered modes add a static threshold pattern (32 pixels per vector
+// operation). Floyd-Steinberg runs rows in a wavefront across threads,
+// each row staying a few pixels behind the one above.
+// The stable variant keeps each pixel on its previous level unless the
+// new value moves clearly away from it, so still areas do not flicker
+// from frame to frame.
+typedef struct DitherState DitherState;
+
+/// @brief Parse a dither mode name (none, bayer, fs, bluenoise).
+/// @return DitherMode, -1 for unknown name.
+int dither_mode_parse(const char *name);
+
+/// @brief Allocate dithering state for images of one size.
+/// @param mode DitherMode, not DITHER_NONE.
+/// @param stable as a bool value, apply temporal hysteresis.
+/// @param width Image width (in pixels).
+/// @param height Image height (in pixels).
+/// @param step Scale from value to level, as used by the renderer.
+/// @return The pointer to allocated state, NULL for error.
+DitherState *dither_alloc(DitherMode mode, int stable, int width, int height,
+                          float step);
+
+/// @brief Dither an image.
+/// @param d DitherState.
+/// @param img width x height greyscale image (not modified).
+/// @return Dithered image, owned by d and valid until the next call.
+const uint8_t *dither_apply(DitherState *d, const uint8_t *img);
+
+/// @brief Stop worker threads and free the state.
+void dither_free(DitherState *d);
+
+#endif
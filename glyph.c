@@ -0,0 +1,164 @@
+#include "glyph.h"
+
+#include <stdlib.h>
+
+// Ink coverage (0-255) of the 2x4 sub-cells of each printable ASCII glyph,
+// row by row, measured on DejaVu Sans Mono rendered into a full cell
+// (advance width x ascender + descender).
+static const uint8_t glyph_coverage[GLYPH_NUM][GLYPH_SAMPLES] = {
+    {  0,   0,   0,   0,   0,   0,   0,   0},  // ' '
+    { 12,  14,  38,  44,  22,  26,   6,   7},  // '!'
+    { 23,  22,  42,  40,   0,   0,   0,   0},  // '"'
+    { 11,  23, 102, 114, 117,  99,  13,   8},  // '#'
+    {  2,  12, 103,  71,  47, 128,  21,  33},  // '$'
+    { 31,   0, 106,  49,  41, 112,   0,  20},  // '%'
+    { 37,  29, 101,  11,  95, 135,  26,  29},  // '&'
+    { 11,  12,  19,  22,   0,   0,   0,   0},  // '\''
+    {  0,  28,  52,  25,  61,  18,   3,  36},  // '('
+    { 28,   1,  19,  56,  12,  65,  36,   5},  // ')'
+    {  8,  10,  79,  82,   4,   6,   0,   0},  // '*'
+    {  0,   0,  24,  27,  81,  83,   0,   0},  // '+'
+    {  0,   0,   0,   0,  16,  21,  37,  11},  // ','
+    {  0,   0,   0,   0,  28,  28,   0,   0},  // '-'
+    {  0,   0,   0,   0,  18,  20,   8,   8},  // '.'
+    {  0,  24,   6,  70,  72,   7,  38,   0},  // '/'
+    { 36,  36,  97,  93,  96,  92,  18,  19},  // '0'
+    { 39,  22,  12,  70,  24,  83,  22,  31},  // '1'
+    { 50,  36,   3,  86,  78,  44,  30,  28},  // '2'
+    { 49,  37,  25,  93,  20,  92,  35,  19},  // '3'
+    {  0,  37,  59,  89,  79, 114,   0,  13},  // '4'
+    { 48,  37,  88,  47,  19,  91,  36,  17},  // '5'
+    { 32,  41, 113,  56,  94,  87,  19,  22},  // '6'
+    { 52,  53,   0,  80,  49,  36,  14,   0},  // '7'
+    { 41,  40,  94,  91,  97,  92,  23,  23},  // '8'
+    { 42,  36,  86,  90,  57, 108,  28,  14},  // '9'
+    {  0,   0,  26,  28,  18,  20,   8,   8},  // ':'
+    {  0,   0,  26,  28,  16,  21,  37,  11},  // ';'
+    {  0,   0,  44,  62,  62,  62,   0,   0},  // '<'
+    {  0,   0,  57,  56,  57,  56,   0,   0},  // '='
+    {  0,   0,  63,  44,  63,  61,   0,   0},  // '>'
+    { 40,  41,   9,  82,  35,  24,   8,   5},  // '?'
+    {  9,  20,  93, 110, 116,  97,  51,  35},  // '@'
+    { 19,  20,  78,  75, 110, 106,  14,  13},  // 'A'
+    { 53,  37, 112,  99,  96,  98,  29,  17},  // 'B'
+    { 29,  49,  89,   2,  93,  19,  11,  32},  // 'C'
+    { 57,  26,  85,  87,  98,  92,  31,   8},  // 'D'
+    { 50,  50, 108,  47,  94,  21,  27,  31},  // 'E'
+    { 46,  53, 104,  46,  85,   0,  13,   0},  // 'F'
+    { 33,  47,  89,  19,  94, 100,  15,  30},  // 'G'
+    { 27,  26, 115, 111,  85,  81,  13,  13},  // 'H'
+    { 47,  47,  39,  43,  53,  57,  27,  27},  // 'I'
+    { 26,  41,   0,  81,  25,  85,  35,  13},  // 'J'
+    { 27,  30, 134,  59,  93,  90,  13,  15},  // 'K'
+    { 27,   0,  85,   0,  94,  22,  26,  33},  // 'L'
+    { 40,  38, 138, 132,  89,  86,  12,  12},  // 'M'
+    { 39,  25, 141,  88,  85, 139,  13,  17},  // 'N'
+    { 38,  38,  88,  84,  93,  88,  20,  20},  // 'O'
+    { 50,  42,  94, 101,  99,  17,  13,   0},  // 'P'
+    { 38,  38,  88,  83,  93,  88,  20,  52},  // 'Q'
+    { 56,  34, 103,  94,  97,  87,  13,  14},  // 'R'
+    { 40,  44, 105,  31,  24, 100,  30,  22},  // 'S'
+    { 64,  63,  39,  44,  39,  44,   6,   7},  // 'T'
+    { 27,  25,  85,  81,  91,  87,  21,  21},  // 'U'
+    { 27,  26,  82,  78,  74,  71,   8,   9},  // 'V'
+    { 26,  24, 111, 108, 123, 117,  14,  13},  // 'W'
+    { 28,  27,  73,  75,  87,  81,  14,  14},  // 'X'
+    { 28,  27,  80,  78,  40,  44,   6,   7},  // 'Y'
+    { 47,  61,   6,  84,  93,  30,  30,  35},  // 'Z'
+    { 26,  32,  61,  16,  61,  16,  35,  34},  // '['
+    { 25,   0,  78,   2,  14,  63,   0,  36},  // '\\'
+    { 30,  27,   9,  65,   9,  65,  32,  37},  // ']'
+    { 21,  22,  48,  46,   0,   0,   0,   0},  // '^'
+    {  0,   0,   0,   0,   0,   0,  67,  66},  // '_'
+    { 35,   5,   1,   5,   0,   0,   0,   0},  // '`'
+    {  0,   0,  46,  66, 104, 121,  27,  22},  // 'a'
+    { 33,   0, 107,  71,  96,  84,  23,  23},  // 'b'
+    {  0,   0,  62,  49,  89,  18,  12,  31},  // 'c'
+    {  0,  31,  73, 103,  89,  92,  23,  24},  // 'd'
+    {  0,   0,  68,  68, 120,  78,  17,  30},  // 'e'
+    {  9,  52,  81,  68,  48,  28,   8,   4},  // 'f'
+    {  0,   0,  73,  79,  92,  95,  58,  78},  // 'g'
+    { 33,   0, 102,  71,  77,  74,  12,  12},  // 'h'
+    { 10,  17,  50,  32,  43,  63,  28,  30},  // 'i'
+    {  1,  26,  37,  48,   3,  70,  52,  44},  // 'j'
+    { 34,   0,  85,  55, 102,  79,  13,  14},  // 'k'
+    { 60,   5,  64,  12,  58,  34,   1,  25},  // 'l'
+    {  0,   0, 100,  91, 100, 106,  16,  17},  // 'm'
+    {  0,   0,  78,  71,  77,  74,  12,  12},  // 'n'
+    {  0,   0,  71,  69,  90,  86,  20,  21},  // 'o'
+    {  0,   0,  83,  71,  97,  84,  77,  23},  // 'p'
+    {  0,   0,  71,  82,  89,  93,  22,  75},  // 'q'
+    {  0,   0,  62,  59,  78,   0,  12,   0},  // 'r'
+    {  0,   0,  68,  40,  56,  89,  29,  20},  // 's'
+    { 16,   1, 108,  46,  71,  24,   3,  25},  // 't'
+    {  0,   0,  53,  50,  85,  90,  23,  23},  // 'u'
+    {  0,   0,  54,  52,  76,  73,   8,   9},  // 'v'
+    {  0,   0,  57,  55, 120, 115,  13,  13},  // 'w'
+    {  0,   0,  58,  55,  75,  74,  14,  13},  // 'x'
+    {  0,   0,  55,  52,  71,  72,  70,  18},  // 'y'
+    {  0,   0,  42,  79,  71,  39,  27,  27},  // 'z'
+    {  5,  48,  39,  41,  71,  31,  14,  60},  // '{'
+    { 14,  16,  33,  38,  33,  38,  31,  36},  // '|'
+    { 48,   7,  36,  42,  27,  73,  59,  16},  // '}'
+    {  0,   0,  14,   2,  45,  56,   0,   0},  // '~'
+};
+
+struct GlyphTable {
+    char lut[1 << (2 * GLYPH_SAMPLES)];
+};
+
+GlyphTable *glyph_table_alloc(void) {
+    GlyphTable *t = malloc(sizeof(GlyphTable));
+    if (!t) return NULL;
+    // Stretch coverage so the densest sub-cell of any glyph is full white
+    int max_cov = 1;
+    for (int g = 0; g < GLYPH_NUM; g++) {
+        for (int k = 0; k < GLYPH_SAMPLES; k++) {
+            if (glyph_coverage[g][k] > max_cov) max_cov = glyph_coverage[g][k];
+        }
+    }
+    int glyphs[GLYPH_NUM][GLYPH_SAMPLES];
+    for (int g = 0; g < GLYPH_NUM; g++) {
+        for (int k = 0; k < GLYPH_SAMPLES; k++) {
+            glyphs[g][k] = glyph_coverage[g][k] * 255 / max_cov;
+        }
+    }
+    for (int key = 0; key < (1 << (2 * GLYPH_SAMPLES)); key++) {
+        int samples[GLYPH_SAMPLES];
+        for (int k = 0; k < GLYPH_SAMPLES; k++) {
+            // Centre of each 2-bit level: 0, 85, 170, 255
+            samples[k] = ((key >> (2 * k)) & 3) * 85;
+        }
+        int best = 0, best_dist = -1;
+        for (int g = 0; g < GLYPH_NUM; g++) {
+            int dist = 0;
+            for (int k = 0; k < GLYPH_SAMPLES; k++) {
+                int d = samples[k] - glyphs[g][k];
+                dist += d * d;
+            }
+            if (best_dist < 0 || dist < best_dist) {
+                best = g;
+                best_dist = dist;
+            }
+        }
+        t->lut[key] = (char)(GLYPH_FIRST + best);
+    }
+    return t;
+}
+
+void glyph_table_free(GlyphTable *t) { free(t); }
+
+void glyph_render_row(const GlyphTable *t, const uint8_t *level,
+                      const uint8_t *sub, int linesize, int width, char *out) {
+    const uint8_t *r0 = sub, *r1 = sub + linesize, *r2 = sub + 2 * linesize,
+                  *r3 = sub + 3 * linesize;
+    for (int j = 0; j < width; j++) {
+        int x = 2 * j;
+        // 2-bit level of each sample, in the order of glyph_coverage
+        unsigned key = level[r0[x]] | level[r0[x + 1]] << 2 |
+                       level[r1[x]] << 4 | level[r1[x + 1]] << 6 |
+                       level[r2[x]] << 8 | level[r2[x + 1]] << 10 |
+                       level[r3[x]] << 12 | level[r3[x + 1]] << 14;
+        out[j] = t->lut[key];
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <stdint.h>
+
+// Sub-cell samples per character cell.
+#define GLYPH_SUB_W 2
+#define GLYPH_SUB_H 4
+#define GLYPH_SAMPLES (GLYPH_SUB_W * GLYPH_SUB_H)
+// Printable ASCII glyphs, from ' ' to '~'.
+#define GLYPH_FIRST ' '
+#define GLYPH_NUM 95
+
+// Lookup table of the shape render mode. Every 2x4 block of samples is
+// quantized to 2 bits per sample, the resulting 16-bit key indexes the
+// glyph whose ink coverage is closest (least squares) to the block.
+typedef struct GlyphTable GlyphTable;
+
+/// @brief Build the lookup table (64 KiB, takes a few tens of ms).
+/// @return The pointer to allocated table, NULL for error.
+GlyphTable *glyph_table_alloc(void);
+
+/// @brief Free the lookup table.
+void glyph_table_free(GlyphTable *t);
+
+/// @brief Pick the glyph of each cell of one text row.
+/// @param t Lookup table.
+/// @param level 2-bit level of each sample value (value >> 6 for linear).
+/// @param sub First of the GLYPH_SUB_H greyscale lines of the row.
+/// @param linesize Distance between two greyscale lines (in bytes).
+/// @param width Number of cells, sub holds GLYPH_SUB_W samples per cell.
+/// @param out width characters.
+void glyph_render_row(const GlyphTable *t, const uint8_t *level,
+                      const uint8_t *sub, int linesize, int width, char *out);
+
+#endif
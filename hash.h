@@ -0,0 +1,25 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief 64-bit xxHash (XXH64) of a buffer, used to spot identical frames.
+/// @param data Buffer.
+/// @param len Size of data (in bytes).
+/// @param seed Seed, 0 by default.
+/// @return Hash value.
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed);
+
+/// @brief CRC-32C (Castagnoli) of a buffer, used to check cache chunks.
+///        Uses the CPU's crc32 instruction when available.
+/// @param crc CRC of the data before this buffer, 0 to start.
+/// @param data Buffer.
+/// @param len Size of data (in bytes).
+/// @return CRC of everything so far.
+uint32_t hash_crc32c(uint32_t crc, const void *data, size_t len);
+
+/// @brief Name of the CRC-32C implementation in use (hardware or software).
+const char *hash_crc32c_impl(void);
+
+#endif
@@ -2,25 +2,88 @@
 
 #include <ncurses.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-static Logger default_logger = {NULL, LL_WARN, 1, 1,
-                                1,    1,       1, PTHREAD_MUTEX_INITIALIZER};
+// Maximum length of one formatted log line, longer lines are truncated.
+#define LOG_LINE_SIZE 512
+// Number of lines in each per-thread ring (power of 2).
+#define LOG_RING_SLOTS 256
+// Maximum number of threads owning a ring.
+// Other threads fall back to synchronous logging.
+#define LOG_MAX_RINGS 64
+// Idle sleep of the background writer (in microseconds).
+#define LOG_WRITER_IDLE_U 5000
+
+static Logger default_logger = {NULL, LL_WARN, 1, 1, 1,
+                                1,    1,       0, PTHREAD_MUTEX_INITIALIZER};
+
+LogLevel logger_default_level = LL_FATAL;
 
 static const char *LogLevelStr[] = {"TRACE", "DEBUG", "INFO",
                                     "WARN",  "ERROR", "FATAL"};
 
+// Single-producer single-consumer ring of formatted lines.
+// The owning thread fills slots at tail, the writer drains them from head.
+typedef struct {
+    atomic_uint head;
+    atomic_uint tail;
+    unsigned short len[LOG_RING_SLOTS];
+    char slot[LOG_RING_SLOTS][LOG_LINE_SIZE];
+} LogRing;
+
+// Cached "[date time]" prefix, rebuilt once per second per thread.
+typedef struct {
+    time_t sec;
+    int flags;
+    int len;
+    char str[32];
+} LogTimeCache;
+
+static struct {
+    atomic_bool running;
+    pthread_t thread;
+    // Held by whoever drains the rings (writer thread or FATAL path)
+    pthread_mutex_t drain_lock;
+    LogRing *rings[LOG_MAX_RINGS];
+    atomic_int ring_num;
+    atomic_ulong dropped;
+} async_state = {.running = 0,
+                 .drain_lock = PTHREAD_MUTEX_INITIALIZER,
+                 .ring_num = 0,
+                 .dropped = 0};
+
+static _Thread_local LogRing *local_ring = NULL;
+// Set when this thread could not get a ring
+static _Thread_local bool local_ring_failed = false;
+static _Thread_local LogTimeCache local_time = {-1, -1, 0, ""};
+
+static void update_level_cache() {
+    logger_default_level =
+        default_logger.file ? default_logger.log_level : LL_FATAL;
+}
+
 void logger_init() {
-    default_logger =
-        (Logger){stderr, LL_WARN, 1, 1, 1, 1, 1, PTHREAD_MUTEX_INITIALIZER};
+    default_logger = (Logger){
+        stderr, LL_WARN, 1, 1, 1, 1, 1, 0, PTHREAD_MUTEX_INITIALIZER};
+    update_level_cache();
 }
 
 Logger logger_get_default() { return default_logger; }
 
-void logger_set_default(const Logger logger) { default_logger = logger; }
+void logger_set_default(const Logger logger) {
+    logger_stop_async();
+    default_logger = logger;
+    update_level_cache();
+    if (default_logger.async && default_logger.file) {
+        logger_start_async();
+    }
+}
 
 extern void logger_log_code(Logger *logger, LogLevel ll, int err_code,
                             char *filename, int linenum, char *fmt, ...) {
@@ -39,56 +102,209 @@ extern void logger_log_code_default(LogLevel ll, int err_code, char *filename,
     va_end(ap);
 }
 
-void logger_log_code_va_list(Logger *logger, LogLevel ll, int err_code,
-                             char *filename, int linenum, char *fmt,
-                             va_list ap) {
-    if (!logger || !logger->file) {
-        return;
-    }
-    if (ll < logger->log_level) {
-        return;
+static const char *time_prefix(Logger *logger, int *len) {
+    int flags = (logger->has_date ? 1 : 0) | (logger->has_time ? 2 : 0);
+    time_t now = time(NULL);
+    if (now == local_time.sec && flags == local_time.flags) {
+        *len = local_time.len;
+        return local_time.str;
     }
-    pthread_mutex_lock(&logger->lock);
-
-    time_t now;
     struct tm now_info;
-    now = time(&now);
     localtime_r(&now, &now_info);
-
-    char buf[32];
+    char *buf = local_time.str;
     int buf_len = 0;
     buf[buf_len++] = '[';
     if (logger->has_date) {
-        sprintf(buf + buf_len, "%04d-%02d-%02d", now_info.tm_year + 1900,
-                now_info.tm_mon + 1, now_info.tm_mday);
-        buf_len += 10;
+        buf_len += strftime(buf + buf_len, sizeof(local_time.str) - buf_len,
+                            "%Y-%m-%d", &now_info);
     }
     if (logger->has_date && logger->has_time) {
         buf[buf_len++] = ' ';
     }
     if (logger->has_time) {
-        sprintf(buf + buf_len, "%02d:%02d:%02d", now_info.tm_hour,
-                now_info.tm_min, now_info.tm_sec);
-        buf_len += 8;
+        buf_len += strftime(buf + buf_len, sizeof(local_time.str) - buf_len,
+                            "%H:%M:%S", &now_info);
     }
     buf[buf_len++] = ']';
-    sprintf(buf + buf_len, " %5s ", LogLevelStr[ll]);
-    buf_len += 7;
-    fwrite(buf, buf_len, 1, logger->file);
+    buf[buf_len] = '\0';
+    local_time.sec = now;
+    local_time.flags = flags;
+    local_time.len = buf_len;
+    *len = buf_len;
+    return buf;
+}
 
-    if (logger->has_filename) {
-        fputs(filename, logger->file);
+// Format a whole log line (with trailing '\n') into buf.
+// Return the length of the line.
+static int format_line(Logger *logger, LogLevel ll, char *filename,
+                       int linenum, char *fmt, va_list ap, char *buf,
+                       int size) {
+    int len;
+    const char *prefix = time_prefix(logger, &len);
+    memcpy(buf, prefix, len);
+    int n = snprintf(buf + len, size - len, " %5s ", LogLevelStr[ll]);
+    if (n > 0) len += n;
+    if (logger->has_filename && len < size) {
         if (logger->has_linenum) {
-            fprintf(logger->file, ":%d", linenum);
+            n = snprintf(buf + len, size - len, "%s:%d", filename, linenum);
+        } else {
+            n = snprintf(buf + len, size - len, "%s", filename);
         }
+        if (n > 0) len += n;
+    }
+    if (len < size) {
+        n = snprintf(buf + len, size - len, ": ");
+        if (n > 0) len += n;
+    }
+    if (len < size) {
+        n = vsnprintf(buf + len, size - len, fmt, ap);
+        if (n > 0) len += n;
+    }
+    // Keep room for '\n' even when truncated
+    if (len > size - 1) len = size - 1;
+    buf[len++] = '\n';
+    return len;
+}
+
+static LogRing *get_ring() {
+    if (local_ring || local_ring_failed) return local_ring;
+    int idx = atomic_fetch_add(&async_state.ring_num, 1);
+    if (idx >= LOG_MAX_RINGS) {
+        local_ring_failed = true;
+        return NULL;
+    }
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        local_ring_failed = true;
+        return NULL;
+    }
+    async_state.rings[idx] = ring;
+    local_ring = ring;
+    return ring;
+}
+
+// Write out every line in all rings.
+// Caller must hold async_state.drain_lock.
+// Return the number of lines written.
+static int drain_rings(FILE *file) {
+    int written = 0;
+    int n = atomic_load(&async_state.ring_num);
+    if (n > LOG_MAX_RINGS) n = LOG_MAX_RINGS;
+    for (int i = 0; i < n; i++) {
+        LogRing *ring = async_state.rings[i];
+        // Registered but not published yet
+        if (!ring) continue;
+        unsigned head =
+            atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned tail =
+            atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            unsigned idx = head % LOG_RING_SLOTS;
+            fwrite(ring->slot[idx], ring->len[idx], 1, file);
+            written++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    unsigned long dropped = atomic_exchange(&async_state.dropped, 0);
+    if (dropped) {
+        fprintf(file, "[log] %lu message(s) dropped (ring full)\n", dropped);
+        written++;
+    }
+    return written;
+}
+
+static void *async_writer(void *_) {
+    while (atomic_load(&async_state.running)) {
+        pthread_mutex_lock(&async_state.drain_lock);
+        int written = drain_rings(default_logger.file);
+        if (written) fflush(default_logger.file);
+        pthread_mutex_unlock(&async_state.drain_lock);
+        if (!written) usleep(LOG_WRITER_IDLE_U);
+    }
+    return NULL;
+}
+
+int logger_start_async() {
+    if (atomic_load(&async_state.running)) return 0;
+    if (!default_logger.file) return -1;
+    atomic_store(&async_state.running, 1);
+    if (pthread_create(&async_state.thread, NULL, async_writer, NULL) != 0) {
+        atomic_store(&async_state.running, 0);
+        return -2;
+    }
+    return 0;
+}
+
+void logger_stop_async() {
+    if (!atomic_exchange(&async_state.running, 0)) return;
+    pthread_join(async_state.thread, NULL);
+    // Write whatever was queued after the last batch
+    pthread_mutex_lock(&async_state.drain_lock);
+    if (drain_rings(default_logger.file)) fflush(default_logger.file);
+    pthread_mutex_unlock(&async_state.drain_lock);
+}
+
+// Queue a line into the calling thread's ring.
+// Return 0 on success, -1 when the caller has to log synchronously.
+static int log_async(Logger *logger, LogLevel ll, char *filename,
+                     int linenum, char *fmt, va_list ap) {
+    LogRing *ring = get_ring();
+    if (!ring) return -1;
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= LOG_RING_SLOTS) {
+        // Never block the caller, count and drop instead
+        atomic_fetch_add(&async_state.dropped, 1);
+        return 0;
+    }
+    unsigned idx = tail % LOG_RING_SLOTS;
+    ring->len[idx] = format_line(logger, ll, filename, linenum, fmt, ap,
+                                 ring->slot[idx], LOG_LINE_SIZE);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+void logger_log_code_va_list(Logger *logger, LogLevel ll, int err_code,
+                             char *filename, int linenum, char *fmt,
+                             va_list ap) {
+    if (!logger) {
+        return;
     }
-    fputs(": ", logger->file);
-    vfprintf(logger->file, fmt, ap);
-    fputc('\n', logger->file);
-    fflush(logger->file);
-    pthread_mutex_unlock(&logger->lock);
     if (ll == LL_FATAL) {
+        if (logger->file) {
+            char line[LOG_LINE_SIZE];
+            int len = format_line(logger, ll, filename, linenum, fmt, ap,
+                                  line, sizeof(line));
+            // Flush queued lines first so the FATAL line is the last one
+            pthread_mutex_lock(&async_state.drain_lock);
+            if (logger == &default_logger &&
+                atomic_load(&async_state.running)) {
+                drain_rings(logger->file);
+            }
+            pthread_mutex_lock(&logger->lock);
+            fwrite(line, len, 1, logger->file);
+            fflush(logger->file);
+            pthread_mutex_unlock(&logger->lock);
+            pthread_mutex_unlock(&async_state.drain_lock);
+        }
         endwin();
         exit(err_code);
     }
-}
\ No newline at end of file
+    if (!logger->file) {
+        return;
+    }
+    if (ll < logger->log_level) {
+        return;
+    }
+    if (logger == &default_logger && atomic_load(&async_state.running) &&
+        log_async(logger, ll, filename, linenum, fmt, ap) == 0) {
+        return;
+    }
+    char line[LOG_LINE_SIZE];
+    int len =
+        format_line(logger, ll, filename, linenum, fmt, ap, line, sizeof(line));
+    pthread_mutex_lock(&logger->lock);
+    fwrite(line, len, 1, logger->file);
+    fflush(logger->file);
+    pthread_mutex_unlock(&logger->lock);
+}
@@ -35,10 +35,20 @@ typedef struct {
     int has_filename;
     // Default: 1
     int has_linenum;
+    // Default: 0
+    // When set on the default logger, lines are formatted into a per-thread
+    // ring and written in batches by a background thread.
+    // FATAL lines are always written synchronously.
+    int async;
 
     pthread_mutex_t lock;
 } Logger;
 
+// Minimum level the default logger writes, checked inline by the macros
+// below before any argument is evaluated.
+// LL_FATAL when the default logger has no file.
+extern LogLevel logger_default_level;
+
 // Initialize default_logger to default value
 extern void logger_init();
 
@@ -46,6 +56,14 @@ extern Logger logger_get_default();
 
 extern void logger_set_default(const Logger logger);
 
+/// @brief Start the background writer of the default logger.
+/// @return 0 for success, minus number for error.
+extern int logger_start_async();
+
+/// @brief Stop the background writer and write out all queued lines.
+///        Safe to call when the writer is not running.
+extern void logger_stop_async();
+
 void logger_log_code_va_list(Logger *logger, LogLevel ll, int err_code,
                              char *filename, int linenum, char *fmt,
                              va_list ap);
@@ -56,13 +74,17 @@ extern void logger_log_code(Logger *logger, LogLevel ll, int err_code,
 extern void logger_log_code_default(LogLevel ll, int err_code, char *filename,
                                     int linenum, char *fmt, ...);
 
-#define logger_log(logger, ll, filename, linenum, fmt, ...)               \
-    logger_log_code(logger, ll, LOG_DEFAULT_CODE, filename, linenum, fmt, \
-                    ##__VA_ARGS__)
-
-#define logger_log_default(ll, filename, linenum, fmt, ...)               \
-    logger_log_code_default(ll, LOG_DEFAULT_CODE, filename, linenum, fmt, \
-                            ##__VA_ARGS__)
+#define logger_log(logger, ll, filename, linenum, fmt, ...)                  \
+    ((ll) >= (logger)->log_level                                             \
+         ? logger_log_code(logger, ll, LOG_DEFAULT_CODE, filename, linenum,  \
+                           fmt, ##__VA_ARGS__)                               \
+         : (void)0)
+
+#define logger_log_default(ll, filename, linenum, fmt, ...)                 \
+    ((ll) >= logger_default_level                                           \
+         ? logger_log_code_default(ll, LOG_DEFAULT_CODE, filename, linenum, \
+                                   fmt, ##__VA_ARGS__)                      \
+         : (void)0)
 
 #define lfatal(err_code, fmt, ...)                                       \
     logger_log_code_default(LL_FATAL, err_code, __FILE__, __LINE__, fmt, \
@@ -4,10 +4,7 @@
 #include <libavutil/error.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
-#include <libswresample/swresample.h>
-#include <libswscale/swscale.h>
 #include <ncurses.h>
-#include <portaudio.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,21 +12,41 @@
 #include <unistd.h>
 
 #include "apcache.h"
+#include "audio.h"
 #include "av.h"
+#include "batch.h"
+#include "bench.h"
 #include "channel/channel.h"
+#include "channel/depth.h"
 #include "config.h"
+#include "decimate.h"
+#include "demux.h"
 #include "display.h"
+#include "glyph.h"
+#include "hash.h"
 #include "log/log.h"
+#include "metrics/metrics.h"
+#include "render.h"
+#include "serve.h"
+#include "transcode.h"
+#include "verify.h"
+#include "video_frame.h"
 
-// https://stackoverflow.com/questions/35446049/port-audio-causing-loud-buzzing-50-of-tests
-#define AUDIO_BUF_SIZE 1024
+// Minimum interval between two progress redraws while caching (in us)
+#define CACHE_PROGRESS_INTERVAL_U 100000
 
 static void print_help();
 static void print_license();
+static int cache_video(config *conf);
+static double stream_time(const AVStream *st, int64_t ts);
 // Handle interrupt (^C)
 static void handle_int(int _);
 static void handle_exit(void);
 
+// Terminal of ncurses when the video is piped into stdin, freed at exit
+static FILE *tty_in = NULL;
+static SCREEN *tty_screen = NULL;
+
 int main(int argc, char *argv[]) {
     // Insucfficient program arguments.
     if (argc < 2) {
@@ -43,16 +60,6 @@ int main(int argc, char *argv[]) {
     // Parse program arguments into config.
     config conf = parse_config(argc, argv);
 
-    // Initialize ncurses window
-    if (!atomic_fetch_or(&ncurses_status, 1)) {
-        initscr();
-    }
-    atexit(handle_exit);
-
-    // Set max x and y
-    getmaxyx(stdscr, conf.height, conf.width);
-    conf.width--;
-
     logger_set_default((Logger){
         .file = conf.logfile ? fopen(conf.logfile, "a") : NULL,
         .has_color = 0,
@@ -61,35 +68,112 @@ int main(int argc, char *argv[]) {
         .has_filename = 1,
         .has_linenum = 1,
         .log_level = conf.log_level,
+        .async = conf.log_async,
         .lock = PTHREAD_MUTEX_INITIALIZER,
     });
 
+    if (metrics_start_reporter(conf.stats_interval, conf.stats_socket) != 0) {
+        lwarn("Unable to start metrics reporter");
+    }
+
+    atexit(handle_exit);
+
     // If --help
     if (conf.help) {
-        if (atomic_fetch_and(&ncurses_status, 0)) {
-            endwin();
-        }
         print_help();
         return 0;
     }
     // If --license
     if (conf.license) {
-        if (atomic_fetch_and(&ncurses_status, 0)) {
-            endwin();
-        }
         print_license();
         return 0;
     }
 
+    // If --batch, convert without a terminal
+    if (conf.batch) {
+        return run_batch(&conf);
+    }
+
+    // If --bench, compare scalers without a terminal
+    if (conf.bench) {
+        return run_bench(&conf);
+    }
+
+    // If --verify, check an apcache file without a terminal
+    if (conf.verify) {
+        return run_verify(&conf);
+    }
+
+    // Shape render mode looks glyphs up in a precomputed table
+    if (conf.render == RENDER_SHAPE && !(conf.glyphs = glyph_table_alloc())) {
+        printf("Unable to build glyph table\n");
+        lerror("Unable to build glyph table");
+        return -2;
+    }
+
+    // If --serve, stream to clients without a terminal
+    if (conf.serve) {
+        return run_serve(&conf);
+    }
+
+    // Initialize ncurses window
+    if (!atomic_fetch_or(&ncurses_status, 1)) {
+        // Keep stdin untouched when the video is piped into it
+        tty_in =
+            strcmp(conf.filename, "-") == 0 ? fopen("/dev/tty", "r") : NULL;
+        if (tty_in) {
+            tty_screen = newterm(NULL, stdout, tty_in);
+        } else {
+            initscr();
+        }
+    }
+
+    // Set max x and y
+    getmaxyx(stdscr, conf.height, conf.width);
+    conf.width--;
+    if (conf.target_width > 0) conf.width = conf.target_width;
+    if (conf.target_height > 0) conf.height = conf.target_height;
+
     linfo("Checking whether is an apcache file... (path: %s)", conf.filename);
-    int fn_len = strlen(conf.filename);
-    if (fn_len > 8) {
-        if (strcmp(conf.filename + fn_len - 8, ".apcache") == 0 &&
-            is_apcache(conf.filename) == 0) {
-            ldebug("File detected as an apcache file");
-            int err = play_from_cache(conf);
-            return err;
+    // A pipe cannot be read twice, it is sniffed through the read-ahead
+    // buffer and a video is decoded from the bytes buffered already
+    APCacheStream *input_stream = NULL;
+    if (apcache_is_stream_path(conf.filename) && !conf.cache) {
+        input_stream = apcache_stream_open_path(conf.filename);
+        int sniff = input_stream ? apcache_stream_sniff(input_stream)
+                                 : APCACHE_ERR_PERMISSION_DENIED;
+        if (sniff == 1) {
+            ldebug("Stream detected as an apcache stream");
+            APCache *apc;
+            int err = apcache_open_stream(input_stream, &apc);
+            if (err != 0) {
+                if (atomic_fetch_and(&ncurses_status, 0)) {
+                    endwin();
+                }
+                printf("Error when opening apcache stream. (code: %d)\n", err);
+                lfatal(-1, "Error when opening apcache stream. (code: %d)",
+                       err);
+            }
+            return play_from_cache(conf, apc);
+        }
+        if (sniff == 0) conf.input_io = alloc_stream_io(input_stream);
+        if (!conf.input_io) {
+            if (atomic_fetch_and(&ncurses_status, 0)) {
+                endwin();
+            }
+            printf("Unable to read %s. (code: %d)\n", conf.filename, sniff);
+            lfatal(-1, "Unable to read %s. (code: %d)", conf.filename, sniff);
         }
+        ldebug("Stream is not an apcache stream, decoding it");
+    } else if (is_apcache(conf.filename) == 0) {
+        ldebug("File detected as an apcache file");
+        int err = play_from_cache(conf, NULL);
+        return err;
+    }
+
+    // If --cache
+    if (conf.cache) {
+        return cache_video(&conf);
     }
 
     // Create Audio and Video Fromat Context.
@@ -104,6 +188,11 @@ int main(int argc, char *argv[]) {
     int err =
         find_codec_context(&conf, &fmt_ctxt, &a_cdc, &v_cdc, &a_idx, &v_idx);
     if (err != 0) {
+        if (atomic_fetch_and(&ncurses_status, 0)) {
+            endwin();
+        }
+        printf("Unable to open %s for playing. (code: %d)\n", conf.filename,
+               err);
         return err;
     }
 
@@ -123,6 +212,16 @@ int main(int argc, char *argv[]) {
         conf.fps = (double)framerate.num / framerate.den;
     }
 
+    // Frames above the display rate are dropped, before decoding if possible
+    Decimator decimator;
+    decimator_init(&decimator, conf.fps, conf.max_fps, conf.max_fps_auto);
+    if (decimator.rate > 0) {
+        atomic_store(&conf.frame_us, (int)(1000000 / decimator.rate));
+    }
+    if (decimator.rate < decimator.src_fps) {
+        linfo("Displaying %.2f of %.2f fps", decimator.rate, conf.fps);
+    }
+
     // Allocate AVPacket
     AVPacket *pckt = av_packet_alloc();
     if (!pckt) {
@@ -141,286 +240,175 @@ int main(int argc, char *argv[]) {
         printf("Unable to allocate AVFrame\n");
         lfatal(-2, "Unable to allocate AVFrame");
     }
-    // Allocate resized greyscale image frame
-    AVFrame *frame_greyscale = av_frame_alloc();
-    if (!frame_greyscale) {
-        if (atomic_fetch_and(&ncurses_status, 0)) {
-            endwin();
-        }
-        printf("Unable to allocate AVFrame for greyscale frame\n");
-        lfatal(-2, "Unable to allocate AVFrame for greyscale frame");
-    }
-    // Initialize some fields in frame_grey
-    frame_greyscale->width = conf.width;
-    frame_greyscale->height = conf.height;
+    // Size of the scaled image, larger than the screen in shape mode
+    int img_w = render_image_width(&conf), img_h = render_image_height(&conf);
     // Allocate image resize context
-    struct SwsContext *sws_ctxt = sws_getContext(
-        v_cdc->width, v_cdc->height, v_cdc->pix_fmt, conf.width, conf.height,
-        AV_PIX_FMT_GRAY8, SWS_FAST_BILINEAR, 0, 0, 0);
-
-    // Allocate resampled audio frame
-    AVFrame *frame_resampled = av_frame_alloc();
-    if (!frame_resampled) {
+    Scaler *scaler = scaler_alloc(conf.scaler, v_cdc->width, v_cdc->height,
+                                  v_cdc->pix_fmt, img_w, img_h);
+    if (!scaler) {
         if (atomic_fetch_and(&ncurses_status, 0)) {
             endwin();
         }
-        printf("Unable to allocate AVFrame for audio frame\n");
-        lfatal(-2, "Unable to allocate AVFrame for audio frame");
+        printf("Unable to allocate %s scaler\n", scaler_mode_name(conf.scaler));
+        lfatal(-2, "Unable to allocate %s scaler",
+               scaler_mode_name(conf.scaler));
     }
-    // Allocate audio resample context
-    SwrContext *resample_ctxt = swr_alloc();
-    if (!resample_ctxt) {
-        if (atomic_fetch_and(&ncurses_status, 0)) {
-            endwin();
-        }
-        printf("Unable to allocate AVAudioResampleContext\n");
-        lfatal(-2, "Unable to allocate AVAudioResampleContext");
-    }
-
-    // PortAudio Stream Params
-    PaStreamParameters pa_stm_param;
-    // PortAudio Stream
-    PaStream *stream;
-
-    ldebug("Need audio and not cache");
-    // If need audio and not cache
-    if (!conf.no_audio && !conf.cache) {
-        linfo("Initializing PortAudio...");
-        // Initialize PortAudio
-        err = Pa_Initialize();
-        if (err != paNoError) {
-            printf("PortAudio init error(code: %d).\n", err);
-            return -20;
-        }
-        linfo("Getting output device...");
-        // Get output device
-        pa_stm_param.device = Pa_GetDefaultOutputDevice();
-        if (pa_stm_param.device == paNoDevice) {
-            printf("Can NOT find audio device.\n");
-            return -20;
-        }
-        // Initialize other fields in pa_stm_param
-        pa_stm_param.sampleFormat = paFloat32;
-        pa_stm_param.channelCount = 2;
-        pa_stm_param.suggestedLatency =
-            Pa_GetDeviceInfo(pa_stm_param.device)->defaultLowOutputLatency;
-        pa_stm_param.hostApiSpecificStreamInfo = NULL;
-        linfo("Opening audio stream...");
-        // Open audio stream
-        err = Pa_OpenStream(&stream, NULL, &pa_stm_param, a_cdc->sample_rate,
-                            AUDIO_BUF_SIZE, paClipOff, NULL, NULL);
-        if (err != paNoError) {
+
+    // Packets read on the demux thread, one queue per stream
+    Demuxer demux;
+    demuxer_init(&demux, &conf, fmt_ctxt, v_idx, conf.no_audio ? -1 : a_idx);
+
+    // Audio decoded and played on its own thread
+    AudioPlayer *audio = NULL;
+    if (!conf.no_audio) {
+        // The video pts count from the start of the video stream
+        err = audio_player_open(&conf, a_cdc, &demux.audio,
+                                -stream_time(fmt_ctxt->streams[v_idx], 0),
+                                &audio);
+        if (err != 0) {
             if (atomic_fetch_and(&ncurses_status, 0)) {
                 endwin();
             }
             printf("Error when opening audio stream. (code %d)\n", err);
             lfatal(-3, "Error when opening audio stream. (code %d)", err);
         }
+        // play_video follows the audio heard
+        conf.audio = audio;
     }
 
-    ldebug("not cache");
-    if (!conf.cache) {
-        linfo("Allocating video channel");
-        // Allocate video channel
-        conf.video_ch = alloc_channel(10);
-        conf.video_ch->drain_callback.callback = video_drain_callback;
-        conf.video_ch->add_callback.callback = video_add_callback;
-        conf.video_ch->drain_callback.arg = &conf.video_ch_status;
-        conf.video_ch->add_callback.arg = &conf.video_ch_status;
+    linfo("Allocating video channel");
+    // Allocate video channel, sized at runtime within the memory budget
+    ChannelDepth depth;
+    int buf_size = av_image_get_buffer_size(AV_PIX_FMT_GRAY8, img_w, img_h, 1);
+    channel_depth_init(&depth, buf_size, conf.max_buffer_mb, decimator.rate);
+    conf.video_ch = alloc_channel(depth.max);
+    set_channel_limit(conf.video_ch, depth.depth);
+    conf.video_ch->drain_callback.callback = video_drain_callback;
+    conf.video_ch->add_callback.callback = video_add_callback;
+    conf.video_ch->drain_callback.arg = &conf.video_ch_status;
+    conf.video_ch->add_callback.arg = &conf.video_ch_status;
+
+    // Scaled images are reused once play_video drops them
+    AVBufferPool *image_pool = av_buffer_pool_init(buf_size, NULL);
+    if (!image_pool) {
+        if (atomic_fetch_and(&ncurses_status, 0)) {
+            endwin();
+        }
+        printf("Unable to allocate image pool\n");
+        lfatal(-2, "Unable to allocate image pool");
     }
 
     // Video thread
     pthread_t th_v;
 
-    APCache *apc = NULL;
+    if (demuxer_start(&demux) != 0) {
+        if (atomic_fetch_and(&ncurses_status, 0)) {
+            endwin();
+        }
+        printf("Unable to create demux thread\n");
+        lfatal(-2, "Unable to create demux thread");
+    }
 
-    ldebug("is cache");
-    if (conf.cache) {
-        apc = apcache_alloc();
-        if (!apc) {
-            if (atomic_fetch_and(&ncurses_status, 0)) {
-                endwin();
-            }
-            printf("Cannot allocate APCache\n");
-            lfatal(-2, "Cannot allocate APCache");
+    ldebug("Ready to play...");
+
+    int image_count = 0;
+    // Hash of the last queued image, valid when has_last
+    uint64_t last_hash = 0;
+    int has_last = 0;
+    // While not the end of the video stream, then once more to drain it
+    int got = 1;
+    while (got > 0) {
+        got = packet_queue_get(&demux.video, pckt);
+        if (got < 0) break;
+        // Cost of the next frame, from packet to scaled image
+        uint64_t frame_start = metrics_now_us();
+        // Non-reference frames that would be dropped are not decoded
+        if (got) {
+            double pckt_t = stream_time(fmt_ctxt->streams[v_idx], pckt->pts);
+            v_cdc->skip_frame = decimator_wants(&decimator, pckt_t)
+                                    ? AVDISCARD_DEFAULT
+                                    : AVDISCARD_NONREF;
         }
-        apc->fps = conf.fps;
-        apc->width = conf.width;
-        apc->height = conf.height;
-        apc->sample_rate = conf.no_audio ? 0 : a_cdc->sample_rate;
-        linfo("Opening cache file in w mode...");
-        apc->file = fopen(conf.cache, "w");
-        if ((err = apcache_create(apc)) != 0) {
+        // Send packet to video decoder, NULL at the end returns the frames
+        // it still holds
+        err = avcodec_send_packet(v_cdc, got ? pckt : NULL);
+        if (err < 0) {
             if (atomic_fetch_and(&ncurses_status, 0)) {
                 endwin();
             }
-            printf("Error when creating apcache file. (code: %d)\n", err);
-            lfatal(-2, "Error when creating apcache file. (code: %d)", err);
+            printf("Error when supplying raw packet data as input to video "
+                   "decoder. (code: %d)\n",
+                   err);
+            lfatal(-10,
+                   "Error when supplying raw packet data as input to video "
+                   "decoder. (code: %d)",
+                   err);
         }
-    }
-
-    ldebug("Ready to play...");
-
-    int image_count = 0, audio_count = 0;
-    // While not the end of file.
-    while (av_read_frame(fmt_ctxt, pckt) >= 0) {
-        // If is video stream.
-        if (pckt->stream_index == v_idx) {
-            // Send packet to video decoder
-            err = avcodec_send_packet(v_cdc, pckt);
-            if (err < 0) {
+        // Read all frames from decoder
+        while (1) {
+            // Receive frame
+            err = avcodec_receive_frame(v_cdc, frame);
+            if (err != 0) {
+                if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+                    break;
+                }
                 if (atomic_fetch_and(&ncurses_status, 0)) {
                     endwin();
                 }
-                printf(
-                    "Error when supplying raw packet data as input to video "
-                    "decoder. (code: %d)\n",
-                    err);
-                lfatal(-10,
-                       "Error when supplying raw packet data as input to video "
-                       "decoder. (code: %d)",
-                       err);
+                printf("Failed when decoding video. (code: %d)\n", err);
+                lfatal(-10, "Failed when decoding video. (code: %d)", err);
             }
-            // Read all frames from decoder
-            while (1) {
-                // Receive frame
-                err = avcodec_receive_frame(v_cdc, frame);
-                if (err != 0) {
-                    if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
-                        break;
-                    }
-                    if (atomic_fetch_and(&ncurses_status, 0)) {
-                        endwin();
-                    }
-                    printf("Failed when decoding video. (code: %d)\n", err);
-                    lfatal(-10, "Failed when decoding video. (code: %d)", err);
-                }
-                int buf_size = av_image_get_buffer_size(
-                    AV_PIX_FMT_GRAY8, conf.width, conf.height, 1);
-                // New buf
-                uint8_t *buf = (uint8_t *)av_malloc(buf_size);
-                // Fill frame_greyscale
-                av_image_fill_arrays(
-                    frame_greyscale->data, frame_greyscale->linesize, buf,
-                    AV_PIX_FMT_GRAY8, conf.width, conf.height, 1);
-                // Scale raw image to target image
-                sws_scale(sws_ctxt, (const uint8_t *const *)frame->data,
-                          frame->linesize, 0, v_cdc->height,
-                          frame_greyscale->data, frame_greyscale->linesize);
-
-                if (conf.cache) {
-                    APFrame apf;
-                    apf.type = APAV_VIDEO;
-                    apf.bsize = buf_size;
-                    apf.data = buf;
-                    if ((err = apcache_write_frame(apc, &apf)) != 0) {
-                        if (atomic_fetch_and(&ncurses_status, 0)) {
-                            endwin();
-                        }
-                        printf(
-                            "Error when writing video frame to cache file. "
-                            "(code: %d)\n",
-                            err);
-                        lfatal(-10,
-                               "Error when writing video frame to cache file. "
-                               "(code: %d)",
-                               err);
-                    }
-                    free(buf);
-                    clear();
-                    printw("Writing frame: %d. (video)\n", image_count);
-                    refresh();
-                } else {
-                    // Add scaled data to video channel
-                    add_element(conf.video_ch, buf);
-                }
-                // Reset the frame fields.
-                av_frame_unref(frame_greyscale);
-                if (++image_count == 1 && !conf.cache) {
-                    linfo("Creating video thread...");
-                    pthread_create(&th_v, NULL, play_video, &conf);
-                }
+            metrics_count(MC_FRAMES_DECODED, 1);
+            double t = stream_time(fmt_ctxt->streams[v_idx],
+                                   frame->best_effort_timestamp);
+            if (!decimator_keep(&decimator, t)) {
+                metrics_count(MC_FRAMES_DROPPED, 1);
+                continue;
             }
-        } else if (!conf.no_audio && pckt->stream_index == a_idx) {
-            // Send packet to audio decoder
-            err = avcodec_send_packet(a_cdc, pckt);
-            if (err < 0) {
+            if (decimator_observe(&decimator, atomic_load(&conf.render_us))) {
+                ldebug("Display rate: %.2f fps", decimator.rate);
+                atomic_store(&conf.frame_us, (int)(1000000 / decimator.rate));
+            }
+            AVBufferRef *image = av_buffer_pool_get(image_pool);
+            if (!image) {
                 if (atomic_fetch_and(&ncurses_status, 0)) {
                     endwin();
                 }
-                printf(
-                    "Error when supplying raw packet data as input to audio "
-                    "decoder. (code: %d)\n",
-                    err);
-                lfatal(-10,
-                       "Error when supplying raw packet data as input to audio "
-                       "decoder. (code: %d)",
-                       err);
+                printf("Unable to allocate image\n");
+                lfatal(-2, "Unable to allocate image");
             }
-            // Read all frames from audio decoder
-            while (1) {
-                // Receive a frame from audio decoder
-                err = avcodec_receive_frame(a_cdc, frame);
-                if (err != 0) {
-                    if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
-                        break;
-                    }
-                    if (atomic_fetch_and(&ncurses_status, 0)) {
-                        endwin();
-                    }
-                    printf("Failed when decoding audio. (code: %d)\n", err);
-                    lfatal(-10, "Failed when decoding audio. (code: %d)", err);
-                }
-                // Unref last frame info (important!)
-                av_frame_unref(frame_resampled);
-                // Initialize some fields in frame_resampled
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-                frame_resampled->channel_layout = AV_CH_LAYOUT_STEREO;
-#pragma clang diagnostic pop
-                frame_resampled->sample_rate = a_cdc->sample_rate;
-                frame_resampled->format = AV_SAMPLE_FMT_FLT;
-                // Resample audio data
-                err = swr_convert_frame(resample_ctxt, frame_resampled, frame);
-                if (err != 0) {
+            // Scale raw image to target image
+            scaler_scale(scaler, frame, image->data);
+            // An image identical to the last one is queued as a repeat
+            uint64_t hash = hash_xxh64(image->data, buf_size, 0);
+            VideoFrame *vf = NULL;
+            if (has_last && hash == last_hash) {
+                av_buffer_unref(&image);
+            } else {
+                vf = video_frame_from_buffer(image, img_w, img_h, t);
+                if (!vf) {
                     if (atomic_fetch_and(&ncurses_status, 0)) {
                         endwin();
                     }
-                    print_averror(err);
-                    lfatal(-10, "Error when resampling audio data. (code: %d)",
-                           err);
-                }
-                if (++audio_count == 1 && !conf.cache) {
-                    linfo("Starting audio stream...");
-                    Pa_StartStream(stream);
-                }
-                if (conf.cache) {
-                    APFrame apf;
-                    apf.type = APAV_AUDIO;
-                    apf.bsize = frame_resampled->nb_samples * 2 * sizeof(float);
-                    apf.data = frame_resampled->data[0];
-                    if ((err = apcache_write_frame(apc, &apf)) != 0) {
-                        if (atomic_fetch_and(&ncurses_status, 0)) {
-                            endwin();
-                        }
-                        printf(
-                            "Error when writing audio frame to cache file. "
-                            "(code: %d)\n",
-                            err);
-                        lfatal(-10,
-                               "Error when writing audio frame to cache file. "
-                               "(code: %d)",
-                               err);
-                    }
-                    clear();
-                    printw("Writing frame: %d. (audio)\n", image_count);
-                    refresh();
-                } else {
-                    // Write data into stream
-                    Pa_WriteStream(stream, frame_resampled->data[0],
-                                   frame_resampled->nb_samples);
+                    printf("Unable to allocate VideoFrame\n");
+                    lfatal(-2, "Unable to allocate VideoFrame");
                 }
             }
+            last_hash = hash;
+            has_last = 1;
+            if (channel_depth_observe(&depth, metrics_now_us() - frame_start)) {
+                ldebug("Video channel depth: %d", depth.depth);
+                set_channel_limit(conf.video_ch, depth.depth);
+            }
+
+            // Add scaled frame to video channel
+            METRICS_TIMED(MH_CHANNEL_ADD, add_element(conf.video_ch, vf));
+            metrics_count(MC_VIDEO_QUEUED, 1);
+            frame_start = metrics_now_us();
+            if (++image_count == 1) {
+                linfo("Creating video thread...");
+                pthread_create(&th_v, NULL, play_video, &conf);
+            }
         }
         // Unref packet
         av_packet_unref(pckt);
@@ -433,6 +421,18 @@ int main(int argc, char *argv[]) {
         pthread_cond_wait(&conf.video_ch_status.drain_cond,
                           &conf.video_ch_status.lock);
     pthread_mutex_unlock(&conf.video_ch_status.lock);
+    // The last frame may still wait for the audio clock after the channel
+    // drained
+    while (audio && atomic_load(&conf.video_rendered) < image_count) {
+        usleep(1000);
+    }
+    // Play the queued audio out, then close PortAudio before the
+    // decoder it uses is freed
+    if (audio) {
+        audio_player_finish(audio);
+        audio_player_free(audio);
+    }
+    demuxer_destroy(&demux);
 
     // Exit ncurses mode
     if (atomic_fetch_and(&ncurses_status, 0)) {
@@ -440,8 +440,6 @@ int main(int argc, char *argv[]) {
     }
     // Free decode frame
     av_frame_free(&frame);
-    // Free greyscale frame
-    av_frame_free(&frame_greyscale);
     // Free packet
     av_packet_free(&pckt);
     // Free audio coDec context
@@ -451,25 +449,78 @@ int main(int argc, char *argv[]) {
     avformat_close_input(&fmt_ctxt);
     // Free format context
     avformat_free_context(fmt_ctxt);
+    // Free the stream a piped video was read from
+    free_stream_io(&conf.input_io);
+    apcache_stream_close(input_stream);
     // Free image scale context
-    sws_freeContext(sws_ctxt);
-    // Free audio resample context
-    swr_free(&resample_ctxt);
+    scaler_free(scaler);
     // Free video channel
     free_channel(conf.video_ch);
-    // Free resampled frame
-    av_frame_free(&frame_resampled);
-    // // To avoid noise at the end of the video
-    // usleep(100000);
-    Pa_StopStream(stream);
-    // Close PortAudio stream
-    Pa_CloseStream(stream);
-    Pa_Terminate();
-    apcache_close(apc);
-    apcache_free(&apc);
+    // Images still held by play_video return to the pool and are freed
+    av_buffer_pool_uninit(&image_pool);
+    metrics_stop_reporter();
+    logger_stop_async();
     if (logger_get_default().file) fclose(logger_get_default().file);
 }
 
+/// @brief Presentation time of a timestamp of st, from the stream start.
+/// @return Time in seconds, -1 for unknown.
+static double stream_time(const AVStream *st, int64_t ts) {
+    if (ts == AV_NOPTS_VALUE) return -1;
+    if (st->start_time != AV_NOPTS_VALUE) ts -= st->start_time;
+    return ts * av_q2d(st->time_base);
+}
+
+typedef struct {
+    uint64_t last_draw_u;
+} CacheProgress;
+
+static void cache_progress(void *arg, uint64_t video_frames,
+                           uint64_t audio_frames) {
+    CacheProgress *p = arg;
+    uint64_t now = metrics_now_us();
+    if (now - p->last_draw_u < CACHE_PROGRESS_INTERVAL_U) return;
+    p->last_draw_u = now;
+    clear();
+    printw("Writing frame: %llu. (video) %llu. (audio)\n",
+           (unsigned long long)video_frames, (unsigned long long)audio_frames);
+    refresh();
+}
+
+/// @brief Process conf->filename into the apcache file conf->cache.
+/// @param conf Parsed config with width and height set.
+/// @return 0 for success, minus number for error.
+static int cache_video(config *conf) {
+    CacheProgress progress = {0};
+    TranscodeJob job = {.input = conf->filename,
+                        .output = conf->cache,
+                        .width = conf->width,
+                        .height = conf->height,
+                        .scaler = conf->scaler,
+                        .no_audio = conf->no_audio,
+                        .direct_io = conf->direct_io,
+                        .thumb_interval = conf->thumb_interval,
+                        .chunked = conf->chunked,
+                        .compress = conf->compress,
+                        .levels = conf->levels,
+                        .progress = cache_progress,
+                        .progress_arg = &progress};
+    TranscodeStats stats;
+    linfo("Caching %s into %s...", conf->filename, conf->cache);
+    int err = transcode_to_apcache(&job, &stats);
+    if (atomic_fetch_and(&ncurses_status, 0)) {
+        endwin();
+    }
+    if (err != 0) {
+        printf("Error when writing cache file. (code: %d)\n", err);
+        return err;
+    }
+    printf("Cached %llu video and %llu audio frames in %.1fs.\n",
+           (unsigned long long)stats.video_frames,
+           (unsigned long long)stats.audio_frames, stats.seconds);
+    return 0;
+}
+
 /// @brief Handle interrupt (^C)
 /// @param _
 void handle_int(int _) {
@@ -486,28 +537,146 @@ void handle_exit() {
     if (atomic_fetch_and(&ncurses_status, 0)) {
         endwin();
     }
+    // Release the terminal opened for stdin playback
+    if (tty_screen) {
+        delscreen(tty_screen);
+        tty_screen = NULL;
+    }
+    if (tty_in) {
+        fclose(tty_in);
+        tty_in = NULL;
+    }
+    // Remove metrics socket
+    metrics_stop_reporter();
+    // Write out queued log lines
+    logger_stop_async();
 }
 
 void print_help() {
     printf(
         "ASCII Player v1.0.2\n\
 A media player that plays video file in ASCII characters.\n\
-Usage: asciiplayer <file> [-h | --help] [-l | --license] [-c | --cache <file>]\n\
+Usage: asciiplayer <file | -> [-h | --help] [-l | --license] [-c | --cache <file>]\n\
+       asciiplayer <dir | list file> [-b | --batch <dir>] [-j | --jobs <num>]\n\
+       asciiplayer <file> --bench\n\
+       asciiplayer <apcache file> --scrub\n\
+       asciiplayer <apcache file> --verify [-j | --jobs <num>]\n\
+       asciiplayer <file> --serve <port | unix socket>\n\
+                          [--width <num>] [--height <num>] [--direct-io]\n\
+                          [--thumb-interval <sec>] [--chunked] [--compress]\n\
+                          [--levels <num>]\n\
                           [-n | —no-audio] [-g | --grayscale <string>] [-r | --reverse]\n\
-                          [--log <log file>] [--loglevel <level num>]\n\
+                          [--max-buffer-mb <num>] [--render <luma | shape>]\n\
+                          [--max-fps <num | auto>]\n\
+                          [--dither <none | bayer | fs | bluenoise>] [--dither-stable]\n\
+                          [--normalize] [--gamma <num>]\n\
+                          [--scaler <fast | bilinear | area | bicubic | box>]\n\
+                          [--resampler <fast | swr | soxr>] [--audio-latency-ms <num>]\n\
+                          [--demux-queue-mb <num>] [--demux-queue-ms <num>]\n\
+                          [--log <log file>] [--loglevel <level num>] [--log-async]\n\
+                          [--stats] [--stats-interval <sec>] [--stats-socket <path>]\n\
 \n\
+       <file | ->           Video or apcache file, apcache is detected by content.\n\
+                            \"-\" or a FIFO plays an apcache stream as it arrives.\n\
+                            example: $ curl -s <URL> | asciiplayer -\n\
        --help -h            Print this help page\n\
        --license -l         Show license and author info\n\
        --cache -c <file>    Process video into a cached file\n\
                             example: $ asciiplayer video.mp4 --cache cached.apcache\n\
+       --batch -b <dir>     Process every video in a directory (or listed in a file,\n\
+                            one path per line) into <dir>, without a terminal.\n\
+                            video.mp4 is written to <dir>/video.mp4.apcache,\n\
+                            up-to-date cache files are skipped.\n\
+                            example: $ asciiplayer videos/ --batch caches/ --jobs 4\n\
+       --jobs -j <num>      Number of parallel batch workers or --verify threads\n\
+                            (default: CPU count)\n\
+       --serve <port | unix socket>\n\
+                            Stream the video as ANSI text to every client connected\n\
+                            to 127.0.0.1:<port> or a Unix socket, without audio.\n\
+                            Slow clients skip frames instead of delaying others.\n\
+                            example: $ asciiplayer video.mp4 --serve 7000\n\
+                                     $ nc 127.0.0.1 7000\n\
+       --bench              Decode the first 300 frames and compare the scalers on\n\
+                            time per frame and PSNR against a Lanczos reference,\n\
+                            and the CPU taken by the audio decoder and resamplers\n\
+       --direct-io          Write cache files bypassing the page cache (O_DIRECT)\n\
+       --thumb-interval <sec>\n\
+                            Seconds between thumbnails stored in cache files for\n\
+                            --scrub, 0 for none (default: 1)\n\
+       --scrub              Flip through the thumbnails of an apcache file, then\n\
+                            play from the one on screen. left/right: one, up/down:\n\
+                            ten, space: flip forward, enter: play, q: quit\n\
+       --chunked            Write cache files in one-second chunks with a CRC32C\n\
+                            each. A damaged chunk is skipped during playback.\n\
+       --compress           Like --chunked, with zlib compressed chunks decoded\n\
+                            ahead of playback by several threads\n\
+       --levels <num>       Also store the video of cache files at half, quarter...\n\
+                            resolution, up to 5 levels in all (implies --chunked).\n\
+                            Playback reads only the level fitting the terminal.\n\
+       --verify             Check every frame boundary of an apcache file and the\n\
+                            CRC32C of its chunks on several threads, then print its\n\
+                            duration, frame counts and any corruption found.\n\
+                            Exits with 1 for a corrupt file.\n\
+       --width <num>        Video width in characters (default: terminal width)\n\
+       --height <num>       Video height in characters (default: terminal height)\n\
        --grayscale -g <string>\n\
                             Grayscale string (default: \" .:-=+*#%%@\")\n\
        --reverse -r         Reverse grayscale string\n\
+       --render <luma | shape>\n\
+                            luma: pick characters by brightness (default)\n\
+                            shape: match 2x4 sub-cell samples against glyph shapes\n\
+                            for sharper edges (live decoding only)\n\
+       --dither <none | bayer | fs | bluenoise>\n\
+                            Dither before picking characters to avoid banding in\n\
+                            gradients: Bayer ordered, Floyd-Steinberg error diffusion\n\
+                            (multi-threaded) or blue noise (default: none)\n\
+       --dither-stable      Keep dithered pixels on their character until the image\n\
+                            really changes, avoiding flicker\n\
+       --normalize          Stretch the contrast of each frame to the whole grayscale\n\
+                            string, smoothed across frames, so dark videos do not\n\
+                            collapse onto the first characters\n\
+       --gamma <num>        Gamma applied before picking characters, above 1\n\
+                            brightens dark areas (default: 1)\n\
+       --scaler <fast | bilinear | area | bicubic | box>\n\
+                            Downscaling filter (default: fast). box averages every\n\
+                            source pixel, fast and free of aliasing for large\n\
+                            reductions such as 1920 to 200 columns\n\
+       --resampler <fast | swr | soxr>\n\
+                            Audio resampler, used when the audio is not stereo float\n\
+                            at the output device rate: fast (short filter), swr\n\
+                            (swresample defaults, default) or soxr (best quality)\n\
+       --audio-latency-ms <num>\n\
+                            Audio decoded ahead of the device by the audio thread,\n\
+                            which rides out slow video frames (default: 200)\n\
+       --demux-queue-mb <num>\n\
+                            Memory budget of the packets read ahead of the audio\n\
+                            and video decoders, exceeded while no audio is queued\n\
+                            (default: 16)\n\
+       --demux-queue-ms <num>\n\
+                            Packets read ahead of each decoder, more video is read\n\
+                            while the audio lags in a badly interleaved file\n\
+                            (default: 1000)\n\
        --no-audio -n        Play video without playing audio\n\
+       --max-buffer-mb <num>\n\
+                            Memory budget of decoded frames queued ahead of the\n\
+                            screen (default: 64). The queue deepens when decoding\n\
+                            time varies and shrinks back when it is steady.\n\
+       --max-fps <num | auto>\n\
+                            Highest display rate. Frames above it are dropped before\n\
+                            scaling, and non-reference frames are not even decoded.\n\
+                            auto: follow the rate the terminal keeps up with\n\
        --log <log file>     Path to log file\n\
        --loglevel <level num>\n\
                             Log level number {TRACE: 0, DEBUG: 1, INFO: 2, WARN: 3,\n\
-                                              ERROR: 4, FATAL: 5}\n");
+                                              ERROR: 4, FATAL: 5}\n\
+       --log-async          Write log lines from a background thread\n\
+       --stats              Show a metrics status line at the bottom of the screen\n\
+       --stats-interval <sec>\n\
+                            Dump metrics into the log file every <sec> seconds,\n\
+                            needs --log and lowers --loglevel to INFO at most\n\
+       --stats-socket <path>\n\
+                            Serve a metrics report to each connection on a Unix socket\n\
+                            example: $ nc -U <path>\n");
 }
 
 void print_license() {
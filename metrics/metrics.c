@@ -0,0 +1,321 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log/log.h"
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+    _Atomic uint64_t max_us;
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+} HistShard;
+
+// Counters owned by a single thread.
+// Only the owner writes, readers may load at any time.
+typedef struct {
+    _Atomic uint64_t counters[MC_COUNTER_NUM];
+    HistShard hists[MH_HIST_NUM];
+} MetricsShard;
+
+static MetricsShard shards[METRICS_MAX_THREADS];
+static atomic_int shard_num = 0;
+// Shared by threads that did not get a private shard
+static MetricsShard overflow_shard;
+static _Thread_local MetricsShard *local_shard = NULL;
+
+static const char *CounterStr[] = {
+    "frames_decoded", "frames_dropped",  "frames_rendered",
+    "video_queued",   "video_dequeued",  "audio_underruns",
+    "audio_overruns", "tty_bytes",       "chunks_corrupt"};
+static const char *HistStr[] = {"channel_add_wait", "channel_read_wait",
+                                "pa_write_wait", "audio_resample"};
+
+static struct {
+    pthread_t thread;
+    int running;
+    int interval_s;
+    int listen_fd;
+    // self-pipe to wake up the reporter when stopping
+    int wake_fd[2];
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} reporter = {.running = 0, .listen_fd = -1, .wake_fd = {-1, -1}};
+
+static MetricsShard *get_shard() {
+    if (local_shard) return local_shard;
+    int idx = atomic_fetch_add(&shard_num, 1);
+    local_shard = idx < METRICS_MAX_THREADS ? &shards[idx] : &overflow_shard;
+    return local_shard;
+}
+
+// Single-writer add, relaxed load + store is enough and avoids a locked op.
+// The overflow shard has several writers and needs a real fetch_add.
+static inline void shard_add(MetricsShard *s, _Atomic uint64_t *v,
+                             uint64_t n) {
+    if (s == &overflow_shard) {
+        atomic_fetch_add_explicit(v, n, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(
+        v, atomic_load_explicit(v, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+void metrics_count(MetricCounter c, uint64_t n) {
+    if (c < 0 || c >= MC_COUNTER_NUM) return;
+    MetricsShard *s = get_shard();
+    shard_add(s, &s->counters[c], n);
+}
+
+void metrics_observe_us(MetricHist h, uint64_t us) {
+    if (h < 0 || h >= MH_HIST_NUM) return;
+    MetricsShard *s = get_shard();
+    HistShard *hs = &s->hists[h];
+    int b = 0;
+    for (uint64_t v = us; v && b < METRICS_HIST_BUCKETS - 1; v >>= 1) b++;
+    shard_add(s, &hs->count, 1);
+    shard_add(s, &hs->sum_us, us);
+    shard_add(s, &hs->buckets[b], 1);
+    uint64_t max = atomic_load_explicit(&hs->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(
+                           &hs->max_us, &max, us, memory_order_relaxed,
+                           memory_order_relaxed)) {
+    }
+}
+
+uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void snapshot_add(MetricsSnapshot *snap, MetricsShard *s) {
+    for (int i = 0; i < MC_COUNTER_NUM; i++) {
+        snap->counters[i] +=
+            atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < MH_HIST_NUM; i++) {
+        MetricsHistogram *h = &snap->hists[i];
+        HistShard *hs = &s->hists[i];
+        h->count += atomic_load_explicit(&hs->count, memory_order_relaxed);
+        h->sum_us += atomic_load_explicit(&hs->sum_us, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&hs->max_us, memory_order_relaxed);
+        if (max > h->max_us) h->max_us = max;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            h->buckets[b] +=
+                atomic_load_explicit(&hs->buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+MetricsSnapshot metrics_snapshot() {
+    MetricsSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.time_us = metrics_now_us();
+    int n = atomic_load(&shard_num);
+    if (n > METRICS_MAX_THREADS) n = METRICS_MAX_THREADS;
+    for (int i = 0; i < n; i++) {
+        snapshot_add(&snap, &shards[i]);
+    }
+    snapshot_add(&snap, &overflow_shard);
+    return snap;
+}
+
+uint64_t metrics_percentile_us(const MetricsHistogram *h, double p) {
+    if (!h || h->count == 0) return 0;
+    uint64_t target = (uint64_t)(p * h->count);
+    if (target >= h->count) target = h->count - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > target) {
+            uint64_t bound = b == 0 ? 1 : (uint64_t)1 << b;
+            if (b == METRICS_HIST_BUCKETS - 1 || bound > h->max_us)
+                return h->max_us;
+            return bound;
+        }
+    }
+    return h->max_us;
+}
+
+static int64_t channel_depth(const MetricsSnapshot *s) {
+    return (int64_t)s->counters[MC_VIDEO_QUEUED] -
+           (int64_t)s->counters[MC_VIDEO_DEQUEUED];
+}
+
+int metrics_format_line(const MetricsSnapshot *s, const MetricsSnapshot *prev,
+                        char *buf, size_t len) {
+    double fps = 0;
+    if (prev && s->time_us > prev->time_us) {
+        fps = (s->counters[MC_FRAMES_RENDERED] -
+               prev->counters[MC_FRAMES_RENDERED]) *
+              1e6 / (s->time_us - prev->time_us);
+    }
+    int n = snprintf(
+        buf, len,
+        "fps %5.1f | dec %llu drop %llu rend %llu | ch %lld | "
+        "rd p99 %lluus | pa p99 %lluus | xrun %llu | tty %lluKB",
+        fps, (unsigned long long)s->counters[MC_FRAMES_DECODED],
+        (unsigned long long)s->counters[MC_FRAMES_DROPPED],
+        (unsigned long long)s->counters[MC_FRAMES_RENDERED],
+        (long long)channel_depth(s),
+        (unsigned long long)metrics_percentile_us(&s->hists[MH_CHANNEL_READ],
+                                                  0.99),
+        (unsigned long long)metrics_percentile_us(&s->hists[MH_PA_WRITE],
+                                                  0.99),
+        (unsigned long long)s->counters[MC_AUDIO_UNDERRUNS],
+        (unsigned long long)(s->counters[MC_TTY_BYTES] / 1024));
+    if (n < 0) return 0;
+    return (size_t)n < len ? n : (int)len - 1;
+}
+
+int metrics_format_report(const MetricsSnapshot *s, char *buf, size_t len) {
+    size_t off = 0;
+#define REPORT_APPEND(...)                                          \
+    do {                                                            \
+        if (off < len) {                                            \
+            int n_ = snprintf(buf + off, len - off, __VA_ARGS__);   \
+            if (n_ > 0) off += n_;                                  \
+        }                                                           \
+    } while (0)
+    for (int i = 0; i < MC_COUNTER_NUM; i++) {
+        REPORT_APPEND("%s %llu\n", CounterStr[i],
+                      (unsigned long long)s->counters[i]);
+    }
+    REPORT_APPEND("video_channel_depth %lld\n", (long long)channel_depth(s));
+    for (int i = 0; i < MH_HIST_NUM; i++) {
+        const MetricsHistogram *h = &s->hists[i];
+        REPORT_APPEND(
+            "%s count %llu avg %lluus p50 %lluus p99 %lluus max %lluus\n",
+            HistStr[i], (unsigned long long)h->count,
+            (unsigned long long)(h->count ? h->sum_us / h->count : 0),
+            (unsigned long long)metrics_percentile_us(h, 0.5),
+            (unsigned long long)metrics_percentile_us(h, 0.99),
+            (unsigned long long)h->max_us);
+    }
+#undef REPORT_APPEND
+    return off < len ? (int)off : (int)len - 1;
+}
+
+static void log_report(const char *title) {
+    MetricsSnapshot s = metrics_snapshot();
+    char buf[2048];
+    metrics_format_report(&s, buf, sizeof(buf));
+    // Log line by line to keep the log file greppable
+    char *save = NULL;
+    for (char *line = strtok_r(buf, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        linfo("%s: %s", title, line);
+    }
+}
+
+static void serve_report(int fd) {
+    MetricsSnapshot s = metrics_snapshot();
+    char buf[2048];
+    int n = metrics_format_report(&s, buf, sizeof(buf));
+    for (int off = 0; off < n;) {
+        ssize_t w = write(fd, buf + off, n - off);
+        if (w <= 0) break;
+        off += w;
+    }
+    close(fd);
+}
+
+static void *reporter_loop(void *_) {
+    uint64_t next = metrics_now_us() + (uint64_t)reporter.interval_s * 1000000;
+    for (;;) {
+        struct pollfd fds[2] = {{reporter.wake_fd[0], POLLIN, 0},
+                                {reporter.listen_fd, POLLIN, 0}};
+        int timeout = -1;
+        if (reporter.interval_s > 0) {
+            uint64_t now = metrics_now_us();
+            timeout = now >= next ? 0 : (int)((next - now) / 1000);
+        }
+        int n = poll(fds, reporter.listen_fd >= 0 ? 2 : 1, timeout);
+        if (n < 0 && errno != EINTR) break;
+        if (fds[0].revents) break;
+        if (reporter.listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+            int cfd = accept(reporter.listen_fd, NULL, NULL);
+            if (cfd >= 0) serve_report(cfd);
+        }
+        if (reporter.interval_s > 0 && metrics_now_us() >= next) {
+            log_report("metrics");
+            next += (uint64_t)reporter.interval_s * 1000000;
+        }
+    }
+    return NULL;
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -2;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // Remove a stale socket left by a previous run
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 4) != 0) {
+        close(fd);
+        return -3;
+    }
+    return fd;
+}
+
+int metrics_start_reporter(int interval_s, const char *socket_path) {
+    if (reporter.running) return 0;
+    if (interval_s <= 0 && !socket_path) return 0;
+    reporter.interval_s = interval_s > 0 ? interval_s : 0;
+    reporter.listen_fd = -1;
+    reporter.socket_path[0] = '\0';
+    if (socket_path) {
+        reporter.listen_fd = open_socket(socket_path);
+        if (reporter.listen_fd < 0) {
+            lerror("Unable to listen on metrics socket (path: %s)",
+                   socket_path);
+            return reporter.listen_fd;
+        }
+        strcpy(reporter.socket_path, socket_path);
+    }
+    if (pipe(reporter.wake_fd) != 0) {
+        if (reporter.listen_fd >= 0) close(reporter.listen_fd);
+        return -4;
+    }
+    if (pthread_create(&reporter.thread, NULL, reporter_loop, NULL) != 0) {
+        close(reporter.wake_fd[0]);
+        close(reporter.wake_fd[1]);
+        if (reporter.listen_fd >= 0) close(reporter.listen_fd);
+        return -5;
+    }
+    reporter.running = 1;
+    return 0;
+}
+
+void metrics_stop_reporter() {
+    if (!reporter.running) return;
+    reporter.running = 0;
+    if (write(reporter.wake_fd[1], "", 1) < 0) {
+        // reporter thread can still be cancelled below
+        pthread_cancel(reporter.thread);
+    }
+    pthread_join(reporter.thread, NULL);
+    close(reporter.wake_fd[0]);
+    close(reporter.wake_fd[1]);
+    if (reporter.listen_fd >= 0) {
+        close(reporter.listen_fd);
+        unlink(reporter.socket_path);
+    }
+    if (reporter.interval_s > 0) log_report("metrics (final)");
+}
@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of threads owning a private shard.
+// Threads registered after that share one atomic overflow shard.
+#define METRICS_MAX_THREADS 32
+// Histogram bucket i counts samples in [2^(i-1), 2^i) microseconds,
+// bucket 0 counts samples below 1us, the last bucket is open-ended.
+#define METRICS_HIST_BUCKETS 24
+
+typedef enum {
+    // Video frames received from the decoder
+    MC_FRAMES_DECODED,
+    // Video frames thrown away before being displayed
+    MC_FRAMES_DROPPED,
+    // Video frames drawn on the terminal
+    MC_FRAMES_RENDERED,
+    // Video frames added to the video channel
+    MC_VIDEO_QUEUED,
+    // Video frames read from the video channel
+    MC_VIDEO_DEQUEUED,
+    // Pa_WriteStream calls or audio callbacks that ran out of samples
+    MC_AUDIO_UNDERRUNS,
+    // Audio callbacks the device reported an output overflow to
+    MC_AUDIO_OVERRUNS,
+    // Bytes submitted to the terminal
+    MC_TTY_BYTES,
+    // Chunks of a cache file skipped for a bad checksum
+    MC_CHUNKS_CORRUPT,
+    MC_COUNTER_NUM,
+} MetricCounter;
+
+typedef enum {
+    // Time blocked in add_element (video channel full)
+    MH_CHANNEL_ADD,
+    // Time blocked in read_element (video channel empty)
+    MH_CHANNEL_READ,
+    // Time blocked in Pa_WriteStream
+    MH_PA_WRITE,
+    // Time converting a decoded audio frame to stereo float
+    MH_AUDIO_RESAMPLE,
+    MH_HIST_NUM,
+} MetricHist;
+
+typedef struct {
+    uint64_t count;
+    // Sum of all samples (in microseconds)
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+} MetricsHistogram;
+
+typedef struct {
+    // Monotonic time the snapshot was taken at (in microseconds)
+    uint64_t time_us;
+    uint64_t counters[MC_COUNTER_NUM];
+    MetricsHistogram hists[MH_HIST_NUM];
+} MetricsSnapshot;
+
+/// @brief Add n to a counter of the calling thread's shard.
+/// @param c Counter to be increased.
+/// @param n Amount to add.
+extern void metrics_count(MetricCounter c, uint64_t n);
+
+/// @brief Record a duration sample in a histogram of the calling thread's
+/// shard.
+/// @param h Target histogram.
+/// @param us Duration in microseconds.
+extern void metrics_observe_us(MetricHist h, uint64_t us);
+
+/// @brief Get current monotonic time.
+/// @return Monotonic time in microseconds.
+extern uint64_t metrics_now_us();
+
+/// @brief Sum all thread shards into a snapshot. Never blocks writers.
+/// @return The snapshot.
+extern MetricsSnapshot metrics_snapshot();
+
+/// @brief Estimate a percentile of a histogram from its buckets.
+/// @param h Histogram in a snapshot.
+/// @param p Percentile in [0, 1].
+/// @return Upper bound of the bucket holding the percentile (microseconds).
+extern uint64_t metrics_percentile_us(const MetricsHistogram *h, double p);
+
+/// @brief Format a snapshot as one short status line.
+/// @param s Current snapshot.
+/// @param prev Previous snapshot used to compute rates (can be NULL).
+/// @param buf Output buffer.
+/// @param len Size of buf (in bytes).
+/// @return Number of characters written (excluding '\0').
+extern int metrics_format_line(const MetricsSnapshot *s,
+                               const MetricsSnapshot *prev, char *buf,
+                               size_t len);
+
+/// @brief Format a snapshot as a full multi-line report.
+/// @param s Snapshot.
+/// @param buf Output buffer.
+/// @param len Size of buf (in bytes).
+/// @return Number of characters written (excluding '\0').
+extern int metrics_format_report(const MetricsSnapshot *s, char *buf,
+                                 size_t len);
+
+/// @brief Start the reporter thread.
+/// @param interval_s Seconds between two dumps into the default logger,
+///                   0 for no periodic dump.
+/// @param socket_path Path of a Unix socket on which each connection
+///                    receives a full report, NULL for no socket.
+/// @return 0 for success, minus number for error.
+extern int metrics_start_reporter(int interval_s, const char *socket_path);
+
+/// @brief Stop the reporter thread, log a final report and remove the socket.
+///        Safe to call when the reporter is not running.
+extern void metrics_stop_reporter();
+
+/// @brief Time a statement and record its duration in a histogram.
+#define METRICS_TIMED(hist, stmt)                                  \
+    do {                                                           \
+        uint64_t metrics_t0_ = metrics_now_us();                   \
+        stmt;                                                      \
+        metrics_observe_us((hist), metrics_now_us() - metrics_t0_); \
+    } while (0)
+
+#endif
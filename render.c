@@ -0,0 +1,108 @@
+#include "render.h"
+
+#include <stdlib.h>
+
+#include "glyph.h"
+#include "log/log.h"
+#include "tone.h"
+
+struct Renderer {
+    const config *conf;
+    // NULL for identity curve
+    ToneState *tone;
+    // NULL for no dithering
+    DitherState *dither;
+    // tone mapped image fed to dither, NULL when not dithering
+    uint8_t *toned;
+    size_t size;
+    // character of each value (luma mode)
+    char ascii[256];
+    // 2-bit sample level of each value (shape mode)
+    uint8_t level[256];
+};
+
+int render_image_width(const config *conf) {
+    return conf->render == RENDER_SHAPE ? conf->width * GLYPH_SUB_W
+                                        : conf->width;
+}
+
+int render_image_height(const config *conf) {
+    return conf->render == RENDER_SHAPE ? conf->height * GLYPH_SUB_H
+                                        : conf->height;
+}
+
+float render_quant_step(const config *conf) {
+    // glyph_render_row keeps the top 2 bits of each sample
+    return conf->render == RENDER_SHAPE ? 1 / 64.0f : conf->grey_ascii_step;
+}
+
+// Fill the per-value tables of render_row through the tone curve.
+static void build_tables(Renderer *r, const uint8_t *lut) {
+    const config *conf = r->conf;
+    for (int v = 0; v < 256; v++) {
+        int t = lut ? lut[v] : v;
+        r->ascii[v] = conf->grey_ascii[(int)(conf->grey_ascii_step * t)];
+        r->level[v] = t >> 6;
+    }
+}
+
+Renderer *render_alloc(const config *conf) {
+    Renderer *r = calloc(1, sizeof(Renderer));
+    if (!r) return NULL;
+    r->conf = conf;
+    r->size = (size_t)render_image_width(conf) * render_image_height(conf);
+    if (conf->normalize || conf->gamma != 1) {
+        r->tone = tone_alloc(conf->normalize, conf->gamma);
+        if (!r->tone) lwarn("Unable to allocate tone curve, tone is off");
+    }
+    if (conf->dither != DITHER_NONE) {
+        r->dither = dither_alloc(conf->dither, conf->dither_stable,
+                                 render_image_width(conf),
+                                 render_image_height(conf),
+                                 render_quant_step(conf));
+        if (r->dither && r->tone && !(r->toned = malloc(r->size))) {
+            dither_free(r->dither);
+            r->dither = NULL;
+        }
+        if (!r->dither) {
+            lwarn("Unable to allocate dithering state, dithering is off");
+        }
+    }
+    // Dithering needs tone mapped values, the tables stay linear then
+    build_tables(r, r->tone && !r->dither ? tone_lut(r->tone) : NULL);
+    return r;
+}
+
+const uint8_t *render_prepare(Renderer *r, const uint8_t *img) {
+    if (r->tone && tone_update(r->tone, img, r->size) && !r->dither) {
+        build_tables(r, tone_lut(r->tone));
+    }
+    if (!r->dither) return img;
+    if (r->tone) {
+        const uint8_t *lut = tone_lut(r->tone);
+        for (size_t i = 0; i < r->size; i++) r->toned[i] = lut[img[i]];
+        img = r->toned;
+    }
+    return dither_apply(r->dither, img);
+}
+
+void render_row(const Renderer *r, const uint8_t *img, int row, char *out) {
+    const config *conf = r->conf;
+    if (conf->render == RENDER_SHAPE) {
+        int linesize = conf->width * GLYPH_SUB_W;
+        glyph_render_row(conf->glyphs, r->level,
+                         img + row * GLYPH_SUB_H * linesize, linesize,
+                         conf->width, out);
+        return;
+    }
+    const uint8_t *line = img + row * conf->width;
+    for (int j = 0; j < conf->width; j++) out[j] = r->ascii[line[j]];
+}
+
+void render_free(Renderer *r) {
+    if (!r) return;
+    tone_free(r->tone);
+    dither_free(r->dither);
+    free(r->toned);
+    free(r);
+}
@@ -0,0 +1,45 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+/// @brief Size of the greyscale image a video frame is scaled to before
+///        being turned into characters (GLYPH_SUB_W x GLYPH_SUB_H samples
+///        per cell in shape mode, one otherwise).
+int render_image_width(const config *conf);
+int render_image_height(const config *conf);
+
+/// @brief Scale from a greyscale value to the level render_row picks
+///        (level = (int)(value * step)).
+float render_quant_step(const config *conf);
+
+// Turns greyscale images into rows of characters: tone curve, dithering,
+// then character lookup. Without dithering the tone curve is folded into
+// the per-value lookup tables of render_row, which are rebuilt only when
+// the curve changes, so no per-pixel pass is added.
+// Owned by one thread.
+typedef struct Renderer Renderer;
+
+/// @brief Allocate a renderer for the current frame size and render mode.
+/// @return The pointer to allocated renderer, NULL for error.
+Renderer *render_alloc(const config *conf);
+
+/// @brief Run the per-frame stages (tone curve update, dithering) on an
+///        image of render_image_width x render_image_height.
+/// @return Image to pass to render_row, img itself or a buffer owned by r
+///         valid until the next call.
+const uint8_t *render_prepare(Renderer *r, const uint8_t *img);
+
+/// @brief Turn one text row of a prepared image into characters.
+/// @param r Renderer.
+/// @param img Image returned by render_prepare.
+/// @param row Text row, 0 to conf->height - 1.
+/// @param out conf->width characters (not null-terminated).
+void render_row(const Renderer *r, const uint8_t *img, int row, char *out);
+
+/// @brief Free the renderer.
+void render_free(Renderer *r);
+
+#endif
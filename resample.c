@@ -0,0 +1,175 @@
+#include "resample.h"
+
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log/log.h"
+
+static const char *const resampler_names[RESAMPLER_MODE_NUM] = {
+    "fast", "swr", "soxr"};
+
+static const char *const path_names[] = {"pass", "interleave", "swr"};
+
+struct Resampler {
+    ResamplerMode mode;
+    ResamplePath path;
+    enum AVSampleFormat src_fmt;
+    int src_rate;
+    AVChannelLayout src_layout;
+    int dst_rate;
+    // RESAMPLE_SWR only
+    SwrContext *swr;
+    // interleaved output, buf_samples stereo samples
+    float *buf;
+    int buf_samples;
+};
+
+int resampler_mode_parse(const char *name) {
+    for (int i = 0; i < RESAMPLER_MODE_NUM; i++) {
+        if (strcmp(name, resampler_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *resampler_mode_name(ResamplerMode mode) {
+    return resampler_names[mode];
+}
+
+const char *resample_path_name(ResamplePath path) { return path_names[path]; }
+
+// Whether a layout is two channels played as left and right.
+static int is_stereo(const AVChannelLayout *layout) {
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+    return av_channel_layout_compare(layout, &stereo) == 0 ||
+           (layout->order == AV_CHANNEL_ORDER_UNSPEC &&
+            layout->nb_channels == 2);
+}
+
+// Allocate and initialize swresample with the filter of mode.
+static int open_swr(Resampler *r, ResamplerMode mode) {
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+    if (swr_alloc_set_opts2(&r->swr, &stereo, AV_SAMPLE_FMT_FLT, r->dst_rate,
+                            &r->src_layout, r->src_fmt, r->src_rate, 0,
+                            NULL) < 0) {
+        return -1;
+    }
+    switch (mode) {
+    case RESAMPLER_FAST:
+        // 8 taps and 64 phases instead of 32 and 1024
+        av_opt_set_int(r->swr, "filter_size", 8, 0);
+        av_opt_set_int(r->swr, "phase_shift", 6, 0);
+        av_opt_set_int(r->swr, "linear_interp", 0, 0);
+        break;
+    case RESAMPLER_SOXR:
+        av_opt_set_int(r->swr, "resampler", SWR_ENGINE_SOXR, 0);
+        av_opt_set_int(r->swr, "precision", 28, 0);
+        break;
+    default:
+        break;
+    }
+    if (swr_init(r->swr) < 0) {
+        swr_free(&r->swr);
+        return -1;
+    }
+    return 0;
+}
+
+// Pick the path for the source format, opening swresample if needed.
+static int configure(Resampler *r) {
+    swr_free(&r->swr);
+    if (r->src_rate == r->dst_rate && is_stereo(&r->src_layout)) {
+        if (r->src_fmt == AV_SAMPLE_FMT_FLT) {
+            r->path = RESAMPLE_PASS;
+            return 0;
+        }
+        if (r->src_fmt == AV_SAMPLE_FMT_FLTP) {
+            r->path = RESAMPLE_INTERLEAVE;
+            return 0;
+        }
+    }
+    r->path = RESAMPLE_SWR;
+    if (open_swr(r, r->mode) == 0) return 0;
+    if (r->mode != RESAMPLER_SOXR) return -1;
+    lwarn("soxr resampler unavailable, using swr");
+    return open_swr(r, RESAMPLER_SWR);
+}
+
+Resampler *resampler_alloc(ResamplerMode mode, enum AVSampleFormat src_fmt,
+                           int src_rate, const AVChannelLayout *src_layout,
+                           int dst_rate) {
+    Resampler *r = calloc(1, sizeof(Resampler));
+    if (!r) return NULL;
+    r->mode = mode;
+    r->src_fmt = src_fmt;
+    r->src_rate = src_rate;
+    r->dst_rate = dst_rate;
+    if (av_channel_layout_copy(&r->src_layout, src_layout) < 0 ||
+        configure(r) != 0) {
+        resampler_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Grow the output buffer to n stereo samples.
+static int reserve(Resampler *r, int n) {
+    if (n <= r->buf_samples) return 0;
+    float *buf = realloc(r->buf, (size_t)n * 2 * sizeof(float));
+    if (!buf) return -1;
+    r->buf = buf;
+    r->buf_samples = n;
+    return 0;
+}
+
+int resampler_convert(Resampler *r, const AVFrame *frame,
+                      const float **samples, int *nb_samples) {
+    if (frame->format != r->src_fmt || frame->sample_rate != r->src_rate ||
+        av_channel_layout_compare(&frame->ch_layout, &r->src_layout) != 0) {
+        r->src_fmt = frame->format;
+        r->src_rate = frame->sample_rate;
+        av_channel_layout_uninit(&r->src_layout);
+        if (av_channel_layout_copy(&r->src_layout, &frame->ch_layout) < 0 ||
+            configure(r) != 0) {
+            return -1;
+        }
+    }
+    int n = frame->nb_samples;
+    if (r->path == RESAMPLE_PASS) {
+        *samples = (const float *)frame->data[0];
+        *nb_samples = n;
+        return 0;
+    }
+    if (r->path == RESAMPLE_INTERLEAVE) {
+        if (reserve(r, n) != 0) return -1;
+        const float *left = (const float *)frame->data[0];
+        const float *right = (const float *)frame->data[1];
+        for (int i = 0; i < n; i++) {
+            r->buf[2 * i] = left[i];
+            r->buf[2 * i + 1] = right[i];
+        }
+        *samples = r->buf;
+        *nb_samples = n;
+        return 0;
+    }
+    int cap = swr_get_out_samples(r->swr, n);
+    if (cap < 0 || reserve(r, cap) != 0) return -1;
+    uint8_t *out = (uint8_t *)r->buf;
+    int got = swr_convert(r->swr, &out, cap,
+                          (const uint8_t **)frame->extended_data, n);
+    if (got < 0) return -1;
+    *samples = r->buf;
+    *nb_samples = got;
+    return 0;
+}
+
+ResamplePath resampler_path(const Resampler *r) { return r->path; }
+
+void resampler_free(Resampler *r) {
+    if (!r) return;
+    swr_free(&r->swr);
+    av_channel_layout_uninit(&r->src_layout);
+    free(r->buf);
+    free(r);
+}
@@ -0,0 +1,77 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+typedef enum {
+    // swresample with a short filter, cheapest
+    RESAMPLER_FAST,
+    // swresample defaults
+    RESAMPLER_SWR,
+    // SoX resampler (when swresample is built with it), best quality
+    RESAMPLER_SOXR,
+} ResamplerMode;
+
+#define RESAMPLER_MODE_NUM (RESAMPLER_SOXR + 1)
+
+typedef enum {
+    // packed stereo float at the output rate, frames are used as they are
+    RESAMPLE_PASS,
+    // planar stereo float at the output rate, channels are interleaved
+    RESAMPLE_INTERLEAVE,
+    // anything else goes through swresample
+    RESAMPLE_SWR,
+} ResamplePath;
+
+// Converts decoded audio frames to the interleaved stereo float samples
+// PortAudio and apcache files take.
+// swresample is configured once, from the source format given at
+// allocation, with the filter of the mode, instead of configuring itself
+// from the first frame. Sources already in stereo float at the output rate
+// (the common AAC/Opus case, planar) skip swresample altogether. A frame in
+// another format than the source (decoders may switch mid-stream)
+// reconfigures the resampler.
+typedef struct Resampler Resampler;
+
+/// @brief Parse a resampler name (fast, swr, soxr).
+/// @return ResamplerMode, -1 for unknown name.
+int resampler_mode_parse(const char *name);
+
+/// @brief Name of a resampler, as accepted by resampler_mode_parse.
+const char *resampler_mode_name(ResamplerMode mode);
+
+/// @brief Name of a resample path (pass, interleave, swr).
+const char *resample_path_name(ResamplePath path);
+
+/// @brief Allocate a resampler from a source format to stereo float.
+/// @param mode ResamplerMode, RESAMPLER_SOXR falls back to RESAMPLER_SWR
+///        when swresample lacks it.
+/// @param src_fmt Sample format of the decoded frames.
+/// @param src_rate Sample rate of the decoded frames.
+/// @param src_layout Channel layout of the decoded frames.
+/// @param dst_rate Sample rate of the output.
+/// @return The pointer to allocated resampler, NULL for error.
+Resampler *resampler_alloc(ResamplerMode mode, enum AVSampleFormat src_fmt,
+                           int src_rate, const AVChannelLayout *src_layout,
+                           int dst_rate);
+
+/// @brief Convert one frame.
+/// @param r Resampler.
+/// @param frame Decoded audio frame.
+/// @param samples Set to the interleaved stereo samples, valid until the
+///        next call (or as long as frame for RESAMPLE_PASS).
+/// @param nb_samples Set to the number of stereo samples, may be 0 while
+///        swresample fills its filter.
+/// @return 0 for success, -1 for error.
+int resampler_convert(Resampler *r, const AVFrame *frame,
+                      const float **samples, int *nb_samples);
+
+/// @brief Path the last frame took.
+ResamplePath resampler_path(const Resampler *r);
+
+/// @brief Free the resampler.
+void resampler_free(Resampler *r);
+
+#endif
@@ -0,0 +1,330 @@
+#include "scale.h"
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fixed point precision of the bilinear weights (in bits).
+#define BILINEAR_BITS 8
+#define BILINEAR_ONE (1 << BILINEAR_BITS)
+
+static const char *const scaler_names[SCALER_MODE_NUM] = {
+    "fast", "bilinear", "area", "bicubic", "box"};
+
+static const int scaler_sws_flags[SCALER_MODE_NUM] = {
+    SWS_FAST_BILINEAR, SWS_BILINEAR, SWS_AREA, SWS_BICUBIC, 0};
+
+typedef enum {
+    // swscale, from the source format or from the luma plane
+    KERNEL_SWS,
+    // average of the covered source pixels
+    KERNEL_BOX,
+    // 2x2 taps around the output pixel center
+    KERNEL_BILINEAR,
+} ScaleKernel;
+
+struct Scaler {
+    ScalerMode mode;
+    ScaleKernel kernel;
+    int src_w;
+    int src_h;
+    enum AVPixelFormat src_fmt;
+    int dst_w;
+    int dst_h;
+    // as a bool value, plane 0 of the source holds 8-bit luma and is read
+    // directly, without converting the frame
+    int luma;
+    // limited range (16-235) luma to full range, and identity
+    uint8_t expand[256];
+    uint8_t identity[256];
+    // scaling context (KERNEL_SWS), or conversion to grey at source size
+    // (KERNEL_BOX without luma plane), NULL otherwise
+    struct SwsContext *sws;
+    // KERNEL_BOX only
+    // source span [start, end) of each output column and row
+    int *col_start;
+    int *col_end;
+    int *row_start;
+    int *row_end;
+    // sums of each source column over the current row span
+    uint32_t *acc;
+    // source converted to grey, NULL when reading plane 0
+    uint8_t *grey;
+    // KERNEL_BILINEAR only
+    // left (top) source tap of each output column (row), and the weight
+    // of the right (bottom) tap in 1/BILINEAR_ONE
+    int *col_tap;
+    int *col_weight;
+    int *row_tap;
+    int *row_weight;
+};
+
+int scaler_mode_parse(const char *name) {
+    for (int i = 0; i < SCALER_MODE_NUM; i++) {
+        if (strcmp(name, scaler_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *scaler_mode_name(ScalerMode mode) { return scaler_names[mode]; }
+
+// Whether plane 0 of fmt holds 8-bit luma, one byte per pixel (planar
+// YUV, NV12/NV21 and grey).
+static int has_luma_plane(enum AVPixelFormat fmt) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    if (!desc || desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL |
+                                AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)) {
+        return 0;
+    }
+    return desc->comp[0].plane == 0 && desc->comp[0].depth == 8 &&
+           desc->comp[0].step == 1 && desc->comp[0].offset == 0;
+}
+
+// Whether the luma of a frame uses the whole 0-255 range.
+static int is_full_range(const AVFrame *frame) {
+    switch (frame->format) {
+        case AV_PIX_FMT_GRAY8:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUVJ444P:
+        case AV_PIX_FMT_YUVJ440P:
+            return 1;
+        default:
+            return frame->color_range == AVCOL_RANGE_JPEG;
+    }
+}
+
+// Split n source pixels into m spans, at least one pixel each.
+static int box_spans(int n, int m, int **start, int **end) {
+    *start = malloc(m * sizeof(int));
+    *end = malloc(m * sizeof(int));
+    if (!*start || !*end) return -1;
+    for (int i = 0; i < m; i++) {
+        (*start)[i] = (int)((int64_t)i * n / m);
+        (*end)[i] = (int)((int64_t)(i + 1) * n / m);
+        if ((*end)[i] <= (*start)[i]) (*end)[i] = (*start)[i] + 1;
+    }
+    return 0;
+}
+
+static int box_init(Scaler *s) {
+    if (box_spans(s->src_w, s->dst_w, &s->col_start, &s->col_end) != 0 ||
+        box_spans(s->src_h, s->dst_h, &s->row_start, &s->row_end) != 0 ||
+        !(s->acc = malloc(s->src_w * sizeof(uint32_t)))) {
+        return -1;
+    }
+    if (s->luma) return 0;
+    s->grey = malloc((size_t)s->src_w * s->src_h);
+    s->sws = sws_getContext(s->src_w, s->src_h, s->src_fmt, s->src_w,
+                            s->src_h, AV_PIX_FMT_GRAY8, SWS_POINT, 0, 0, 0);
+    return s->grey && s->sws ? 0 : -1;
+}
+
+// acc[x] += line[x], restrict lets the compiler vectorize it.
+static void add_line(uint32_t *restrict acc, const uint8_t *restrict line,
+                     int width) {
+    for (int x = 0; x < width; x++) acc[x] += line[x];
+}
+
+static void box_scale(Scaler *s, const uint8_t *src, int linesize,
+                      const uint8_t *range, uint8_t *dst) {
+    for (int oy = 0; oy < s->dst_h; oy++) {
+        // Sum the rows of the span first, a straight pass over each line
+        // that the compiler vectorizes, then the columns once per row
+        uint32_t *acc = s->acc;
+        int width = s->src_w;
+        memset(acc, 0, width * sizeof(uint32_t));
+        for (int y = s->row_start[oy]; y < s->row_end[oy]; y++) {
+            add_line(acc, src + (size_t)y * linesize, width);
+        }
+        int rows = s->row_end[oy] - s->row_start[oy];
+        uint8_t *out = dst + (size_t)oy * s->dst_w;
+        for (int ox = 0; ox < s->dst_w; ox++) {
+            uint32_t sum = 0;
+            for (int x = s->col_start[ox]; x < s->col_end[ox]; x++) {
+                sum += acc[x];
+            }
+            uint32_t n = rows * (s->col_end[ox] - s->col_start[ox]);
+            out[ox] = range[(sum + n / 2) / n];
+        }
+    }
+}
+
+// Left tap and right weight of each of m output pixels over n source
+// pixels, sampling at the output pixel centers.
+static int bilinear_taps(int n, int m, int **tap, int **weight) {
+    *tap = malloc(m * sizeof(int));
+    *weight = malloc(m * sizeof(int));
+    if (!*tap || !*weight) return -1;
+    for (int i = 0; i < m; i++) {
+        double pos = (i + 0.5) * n / m - 0.5;
+        if (pos < 0) pos = 0;
+        if (pos > n - 1) pos = n - 1;
+        int t = (int)pos;
+        // The right tap of the last pixel would be out of bounds
+        if (t == n - 1 && t > 0) t--;
+        (*tap)[i] = t;
+        (*weight)[i] = (int)((pos - t) * BILINEAR_ONE + 0.5);
+    }
+    return 0;
+}
+
+static int bilinear_init(Scaler *s) {
+    if (bilinear_taps(s->src_w, s->dst_w, &s->col_tap, &s->col_weight) != 0 ||
+        bilinear_taps(s->src_h, s->dst_h, &s->row_tap, &s->row_weight) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void bilinear_scale(const Scaler *s, const uint8_t *src, int linesize,
+                           const uint8_t *range, uint8_t *dst) {
+    // Single pixel sources have no second tap
+    int dx = s->src_w > 1, dy = s->src_h > 1 ? linesize : 0;
+    for (int oy = 0; oy < s->dst_h; oy++) {
+        const uint8_t *top = src + (size_t)s->row_tap[oy] * linesize;
+        const uint8_t *bottom = top + dy;
+        int wy = s->row_weight[oy];
+        uint8_t *out = dst + (size_t)oy * s->dst_w;
+        for (int ox = 0; ox < s->dst_w; ox++) {
+            int x = s->col_tap[ox], wx = s->col_weight[ox];
+            int t = top[x] * (BILINEAR_ONE - wx) + top[x + dx] * wx;
+            int b = bottom[x] * (BILINEAR_ONE - wx) + bottom[x + dx] * wx;
+            int v = t * (BILINEAR_ONE - wy) + b * wy;
+            out[ox] = range[(v + (1 << (2 * BILINEAR_BITS - 1))) >>
+                            (2 * BILINEAR_BITS)];
+        }
+    }
+}
+
+Scaler *scaler_alloc(ScalerMode mode, int src_w, int src_h,
+                     enum AVPixelFormat src_fmt, int dst_w, int dst_h) {
+    Scaler *s = calloc(1, sizeof(Scaler));
+    if (!s) return NULL;
+    s->mode = mode;
+    s->src_w = src_w;
+    s->src_h = src_h;
+    s->src_fmt = src_fmt;
+    s->dst_w = dst_w;
+    s->dst_h = dst_h;
+    s->luma = has_luma_plane(src_fmt);
+    for (int v = 0; v < 256; v++) {
+        int e = ((v - 16) * 255 + 109) / 219;
+        s->expand[v] = e < 0 ? 0 : e > 255 ? 255 : e;
+        s->identity[v] = v;
+    }
+
+    // YUV and grey sources skip swscale for the kernels written here
+    if (mode == SCALER_BOX || (mode == SCALER_AREA && s->luma)) {
+        s->kernel = KERNEL_BOX;
+    } else if (mode == SCALER_FAST && s->luma) {
+        s->kernel = KERNEL_BILINEAR;
+    } else {
+        s->kernel = KERNEL_SWS;
+    }
+
+    int err;
+    switch (s->kernel) {
+        case KERNEL_BOX:
+            err = box_init(s);
+            break;
+        case KERNEL_BILINEAR:
+            err = bilinear_init(s);
+            break;
+        default:
+            // Scale the luma plane alone, chroma is never needed
+            s->sws = sws_getContext(src_w, src_h,
+                                    s->luma ? AV_PIX_FMT_GRAY8 : src_fmt,
+                                    dst_w, dst_h, AV_PIX_FMT_GRAY8,
+                                    scaler_sws_flags[mode], 0, 0, 0);
+            err = s->sws ? 0 : -1;
+            break;
+    }
+    if (err != 0) {
+        scaler_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int scaler_scale(Scaler *s, const AVFrame *frame, uint8_t *dst) {
+    const uint8_t *range =
+        s->luma && !is_full_range(frame) ? s->expand : s->identity;
+
+    switch (s->kernel) {
+        case KERNEL_BOX: {
+            if (s->luma) {
+                box_scale(s, frame->data[0], frame->linesize[0], range, dst);
+                return 0;
+            }
+            uint8_t *grey_data[4] = {s->grey};
+            int grey_linesize[4] = {s->src_w};
+            if (sws_scale(s->sws, (const uint8_t *const *)frame->data,
+                          frame->linesize, 0, s->src_h, grey_data,
+                          grey_linesize) != s->src_h) {
+                return -1;
+            }
+            box_scale(s, s->grey, s->src_w, s->identity, dst);
+            return 0;
+        }
+        case KERNEL_BILINEAR:
+            bilinear_scale(s, frame->data[0], frame->linesize[0], range, dst);
+            return 0;
+        default:
+            break;
+    }
+    uint8_t *dst_data[4] = {dst};
+    int dst_linesize[4] = {s->dst_w};
+    if (sws_scale(s->sws, (const uint8_t *const *)frame->data,
+                  frame->linesize, 0, s->src_h, dst_data,
+                  dst_linesize) != s->dst_h) {
+        return -1;
+    }
+    if (range != s->identity) {
+        size_t n = (size_t)s->dst_w * s->dst_h;
+        for (size_t i = 0; i < n; i++) dst[i] = range[dst[i]];
+    }
+    return 0;
+}
+
+int scaler_scale_gray(Scaler *s, const uint8_t *src, uint8_t *dst) {
+    if (s->src_fmt != AV_PIX_FMT_GRAY8) return -1;
+    // Grey is full range, no AVFrame is needed to tell
+    switch (s->kernel) {
+        case KERNEL_BOX:
+            box_scale(s, src, s->src_w, s->identity, dst);
+            return 0;
+        case KERNEL_BILINEAR:
+            bilinear_scale(s, src, s->src_w, s->identity, dst);
+            return 0;
+        default:
+            break;
+    }
+    const uint8_t *src_data[4] = {src};
+    int src_linesize[4] = {s->src_w};
+    uint8_t *dst_data[4] = {dst};
+    int dst_linesize[4] = {s->dst_w};
+    if (sws_scale(s->sws, src_data, src_linesize, 0, s->src_h, dst_data,
+                  dst_linesize) != s->dst_h) {
+        return -1;
+    }
+    return 0;
+}
+
+void scaler_free(Scaler *s) {
+    if (!s) return;
+    sws_freeContext(s->sws);
+    free(s->col_start);
+    free(s->col_end);
+    free(s->row_start);
+    free(s->row_end);
+    free(s->acc);
+    free(s->grey);
+    free(s->col_tap);
+    free(s->col_weight);
+    free(s->row_tap);
+    free(s->row_weight);
+    free(s);
+}
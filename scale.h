@@ -0,0 +1,67 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <stdint.h>
+
+typedef enum {
+    // swscale presets
+    SCALER_FAST,
+    SCALER_BILINEAR,
+    SCALER_AREA,
+    SCALER_BICUBIC,
+    // average of every source pixel covered by the output pixel
+    SCALER_BOX,
+} ScalerMode;
+
+#define SCALER_MODE_NUM (SCALER_BOX + 1)
+
+// Scales decoded video frames down to the greyscale image the renderer
+// works on.
+// Only luma is needed, so YUV, NV12 and grey frames are read from plane 0
+// directly and limited range (16-235) luma is expanded to full range:
+// fast runs a fixed point bilinear kernel and area the box kernel, both
+// without swscale, bilinear and bicubic run swscale on the luma plane
+// alone. RGB and other formats go through swscale's own conversion.
+// The box kernel is meant for large reduction ratios (1920 -> 200): it sums
+// every source pixel once, row by row. Formats without a luma plane are
+// converted to grey at source size first.
+typedef struct Scaler Scaler;
+
+/// @brief Parse a scaler name (fast, bilinear, area, bicubic, box).
+/// @return ScalerMode, -1 for unknown name.
+int scaler_mode_parse(const char *name);
+
+/// @brief Name of a scaler, as accepted by scaler_mode_parse.
+const char *scaler_mode_name(ScalerMode mode);
+
+/// @brief Allocate a scaler between two frame sizes.
+/// @param mode ScalerMode.
+/// @param src_w Width of the decoded frames.
+/// @param src_h Height of the decoded frames.
+/// @param src_fmt Pixel format of the decoded frames.
+/// @param dst_w Width of the greyscale image.
+/// @param dst_h Height of the greyscale image.
+/// @return The pointer to allocated scaler, NULL for error.
+Scaler *scaler_alloc(ScalerMode mode, int src_w, int src_h,
+                     enum AVPixelFormat src_fmt, int dst_w, int dst_h);
+
+/// @brief Scale one frame.
+/// @param s Scaler.
+/// @param frame Decoded frame of the size and format s was allocated for.
+/// @param dst dst_w x dst_h GRAY8 image, rows packed without padding.
+/// @return 0 for success, -1 for error.
+int scaler_scale(Scaler *s, const AVFrame *frame, uint8_t *dst);
+
+/// @brief Scale one packed image, such as a frame of an apcache file.
+/// @param s Scaler allocated with AV_PIX_FMT_GRAY8 as src_fmt.
+/// @param src src_w x src_h GRAY8 image, rows packed without padding.
+/// @param dst dst_w x dst_h GRAY8 image, rows packed without padding.
+/// @return 0 for success, -1 for error.
+int scaler_scale_gray(Scaler *s, const uint8_t *src, uint8_t *dst);
+
+/// @brief Free the scaler.
+void scaler_free(Scaler *s);
+
+#endif
@@ -0,0 +1,138 @@
+#include "scrub.h"
+
+#include <ncurses.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "render.h"
+
+// Nearest neighbour upscale of a thumbnail to the frame size.
+static void upscale(const APCacheThumbTrack *track, const uint8_t *thumb,
+                    const int *xs, int width, int height, uint8_t *img) {
+    for (int y = 0; y < height; y++) {
+        const uint8_t *src =
+            thumb + (size_t)y * track->height / height * track->width;
+        uint8_t *dst = img + (size_t)y * width;
+        for (int x = 0; x < width; x++) dst[x] = src[xs[x]];
+    }
+}
+
+static void format_time(char *buf, size_t len, uint64_t ms) {
+    uint64_t s = ms / 1000;
+    if (s >= 3600) {
+        snprintf(buf, len, "%llu:%02u:%02u", (unsigned long long)(s / 3600),
+                 (unsigned)(s / 60 % 60), (unsigned)(s % 60));
+    } else {
+        snprintf(buf, len, "%u:%02u", (unsigned)(s / 60), (unsigned)(s % 60));
+    }
+}
+
+static void draw(const config *conf, Renderer *r, const uint8_t *img,
+                 char *row, const APCacheThumbTrack *track, int i) {
+    const uint8_t *prepared = render_prepare(r, img);
+    clear();
+    for (int y = 0; y < conf->height; y++) {
+        render_row(r, prepared, y, row);
+        mvaddnstr(y, 0, row, conf->width);
+    }
+    char now[32], end[32], status[256];
+    format_time(now, sizeof(now), (uint64_t)i * track->interval_ms);
+    format_time(end, sizeof(end),
+                (uint64_t)(track->count - 1) * track->interval_ms);
+    snprintf(status, sizeof(status),
+             " %s / %s [%d/%u]  <-/-> 1  up/down %d  space flip  "
+             "enter play  q quit ",
+             now, end, i + 1, track->count, SCRUB_JUMP);
+    mvaddnstr(conf->height - 1, 0, status, conf->width);
+    refresh();
+}
+
+// Run the key loop, return 1 with *i set for playing, 0 for quit.
+static int browse(const config *conf, Renderer *r,
+                  const APCacheThumbTrack *track, const int *xs, uint8_t *img,
+                  char *row, int *i) {
+    int flip = 0;
+    while (1) {
+        upscale(track, apcache_thumbs_image(track, *i), xs, conf->width,
+                conf->height, img);
+        draw(conf, r, img, row, track, *i);
+        timeout(flip ? 1000 / SCRUB_FLIP_RATE : -1);
+        switch (getch()) {
+        case ERR:
+            if (flip) (*i)++;
+            break;
+        case KEY_RIGHT:
+        case 'l':
+            (*i)++;
+            break;
+        case KEY_LEFT:
+        case 'h':
+            (*i)--;
+            break;
+        case KEY_UP:
+        case 'k':
+            *i += SCRUB_JUMP;
+            break;
+        case KEY_DOWN:
+        case 'j':
+            *i -= SCRUB_JUMP;
+            break;
+        case KEY_HOME:
+            *i = 0;
+            break;
+        case KEY_END:
+            *i = track->count - 1;
+            break;
+        case ' ':
+            flip = !flip;
+            break;
+        case '\n':
+        case '\r':
+        case KEY_ENTER:
+            return 1;
+        case 'q':
+            return 0;
+        }
+        if (*i < 0) *i = 0;
+        if (*i >= (int)track->count) {
+            *i = track->count - 1;
+            flip = 0;
+        }
+    }
+}
+
+int scrub_cache(const config *conf, APCache *apc, uint64_t *offset) {
+    APFrame *frame = NULL;
+    APCacheThumbTrack track;
+    int err = apcache_read_thumbs(apc, &frame);
+    if (err != 0) return err;
+    if (apcache_thumbs_parse(frame->data, frame->bsize, &track) != 0 ||
+        track.count == 0) {
+        apcache_frame_free(&frame);
+        return APCACHE_ERR_NO_THUMBS;
+    }
+
+    uint8_t *img = malloc((size_t)conf->width * conf->height);
+    char *row = malloc(conf->width);
+    int *xs = malloc(conf->width * sizeof(int));
+    Renderer *r = render_alloc(conf);
+    err = -1;
+    if (img && row && xs && r) {
+        for (int x = 0; x < conf->width; x++) {
+            xs[x] = (size_t)x * track.width / conf->width;
+        }
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        int i = 0;
+        err = browse(conf, r, &track, xs, img, row, &i);
+        timeout(-1);
+        if (err == 1) *offset = apcache_thumbs_offset(&track, i);
+    }
+    render_free(r);
+    free(xs);
+    free(row);
+    free(img);
+    apcache_frame_free(&frame);
+    return err;
+}
@@ -0,0 +1,28 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <stdint.h>
+
+#include "apcache.h"
+#include "config.h"
+
+// Thumbnails shown per second while flipping.
+#define SCRUB_FLIP_RATE 200
+// Thumbnails skipped by the up and down keys.
+#define SCRUB_JUMP 10
+
+// Scrub mode: flips through the thumbnail track of a cache file, read at
+// once, so finding a scene never reads the frames in between.
+// Keys: left/right (h/l) one thumbnail, up/down (k/j) SCRUB_JUMP,
+// home/end, space flips forward at SCRUB_FLIP_RATE, enter plays from the
+// thumbnail on screen, q quits.
+
+/// @brief Browse the thumbnails of an opened apcache file in the terminal.
+/// @param conf config with the screen size, ncurses started.
+/// @param apc APCache opened from a regular file.
+/// @param offset Set to the file offset to play from when 1 is returned.
+/// @return 1 to play from offset, 0 to quit, minus number for APCacheErr or
+///         -1 for allocation error.
+int scrub_cache(const config *conf, APCache *apc, uint64_t *offset);
+
+#endif
@@ -0,0 +1,452 @@
+#include "serve.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "apcache.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "render.h"
+#include "transcode.h"
+
+#define SERVE_MAX_CLIENTS 256
+// Frame size when --width/--height are not given
+#define SERVE_DEFAULT_WIDTH 80
+#define SERVE_DEFAULT_HEIGHT 24
+// A client accepting no byte for this long is disconnected (in microseconds)
+#define SERVE_STALL_TIMEOUT_U 10000000
+#define SERVE_POLL_MS 100
+
+// Sent once to each new client: clear screen, hide cursor
+static const char serve_greeting[] = "\x1b[2J\x1b[?25l";
+// Sent before disconnecting: show cursor
+static const char serve_farewell[] = "\x1b[?25h\r\n";
+
+// A rendered frame shared by every client sending it.
+typedef struct {
+    atomic_int refs;
+    uint64_t seq;
+    size_t len;
+    char data[];
+} ServeFrame;
+
+typedef struct {
+    int fd;
+    // frame being sent, NULL for idle
+    ServeFrame *frame;
+    size_t off;
+    size_t greeting_off;
+    // seq of the last frame sent (or being sent)
+    uint64_t last_seq;
+    uint64_t last_progress_us;
+} ServeClient;
+
+typedef struct {
+    // frame size and render mode of the served video
+    config *conf;
+    // exact frame rate, a cache file's fps over 1
+    AVRational frame_rate;
+    pthread_mutex_t lock;
+    // producer only, NULL before the first frame
+    Renderer *renderer;
+    // newest frame, guarded by lock
+    ServeFrame *latest;
+    // as a bool value, source finished, guarded by lock
+    int done;
+    // result of the source thread
+    int err;
+    // written by the source thread to wake up the poll loop
+    int wake[2];
+    // producer only
+    uint64_t seq;
+    // frame periods elapsed, repeated frames included
+    uint64_t ticks;
+    uint64_t start_us;
+} Server;
+
+static void frame_ref(ServeFrame *f) { atomic_fetch_add(&f->refs, 1); }
+
+static void frame_unref(ServeFrame *f) {
+    if (f && atomic_fetch_sub(&f->refs, 1) == 1) free(f);
+}
+
+// Turn a greyscale image into cursor-home plus rows of characters.
+static ServeFrame *render_frame(Server *s, const uint8_t *grey) {
+    int width = s->conf->width, height = s->conf->height;
+    grey = render_prepare(s->renderer, grey);
+    size_t len = 3 + (size_t)height * (width + 2) - 2;
+    ServeFrame *f = malloc(sizeof(ServeFrame) + len);
+    if (!f) return NULL;
+    atomic_init(&f->refs, 1);
+    f->len = len;
+    char *p = f->data;
+    memcpy(p, "\x1b[H", 3);
+    p += 3;
+    for (int i = 0; i < height; i++) {
+        render_row(s->renderer, grey, i, p);
+        p += width;
+        if (i != height - 1) {
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+    }
+    return f;
+}
+
+static void wake_loop(Server *s) {
+    char c = 0;
+    // A full pipe already guarantees a wake-up
+    if (write(s->wake[1], &c, 1) < 0 && errno != EAGAIN) {
+        lwarn("Failed to wake up the serve loop (errno: %d)", errno);
+    }
+}
+
+// Pace and publish one frame, replacing the previous one.
+static int publish(Server *s, const uint8_t *grey) {
+    // In whole frame periods, so 30000/1001 fps does not drift
+    uint64_t deadline = s->start_us + s->ticks++ * s->frame_rate.den *
+                                          1000000 / s->frame_rate.num;
+    uint64_t now = metrics_now_us();
+    if (deadline > now) usleep(deadline - now);
+
+    ServeFrame *f = render_frame(s, grey);
+    if (!f) return -1;
+    f->seq = ++s->seq;
+    pthread_mutex_lock(&s->lock);
+    ServeFrame *old = s->latest;
+    s->latest = f;
+    pthread_mutex_unlock(&s->lock);
+    frame_unref(old);
+    metrics_count(MC_FRAMES_RENDERED, 1);
+    wake_loop(s);
+    return 0;
+}
+
+// Keep the current frame for more frame periods, nothing is sent again.
+static void repeat(Server *s, const APFrame *frame) {
+    uint32_t ticks;
+    if (frame->bsize < sizeof(uint32_t)) return;
+    memcpy(&ticks, frame->data, sizeof(uint32_t));
+    metrics_count(MC_FRAMES_DECODED, ticks);
+    s->ticks += ticks;
+}
+
+static int transcode_sink(void *arg, const APCache *meta,
+                          AVRational frame_rate, const APFrame *frame) {
+    Server *s = arg;
+    if (frame->type == APAV_REPEAT && s->seq != 0) repeat(s, frame);
+    if (frame->type != APAV_VIDEO) return 0;
+    metrics_count(MC_FRAMES_DECODED, 1);
+    if (s->seq == 0) {
+        if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+            lerror("Unknown frame rate, unable to pace the stream");
+            return -1;
+        }
+        s->frame_rate = frame_rate;
+        s->start_us = metrics_now_us();
+        if (!(s->renderer = render_alloc(s->conf))) return -1;
+    }
+    return publish(s, frame->data);
+}
+
+static int serve_from_cache(Server *s) {
+    APCache *apc = NULL;
+    int err = apcache_open(s->conf->filename, &apc);
+    if (err != 0) return err;
+    if (apc->fps == 0) {
+        apcache_close(apc);
+        apcache_free(&apc);
+        return TRANSCODE_ERR_UNKNOWN_FPS;
+    }
+    // Frames are served at the size they were cached with
+    s->conf->width = apc->width;
+    s->conf->height = apc->height;
+    if (s->conf->render != RENDER_LUMA) {
+        lwarn("Render mode only applies to live decoding, using luma");
+        s->conf->render = RENDER_LUMA;
+    }
+    linfo("Serving apcache frames of %dx%d", apc->width, apc->height);
+    s->frame_rate = (AVRational){apc->fps, 1};
+    s->start_us = metrics_now_us();
+    APFrame *frame = NULL;
+    if (!(s->renderer = render_alloc(s->conf))) err = -1;
+    while (err == 0 && (err = apcache_read_frame(apc, &frame)) == 0) {
+        if (frame->type == APAV_REPEAT) repeat(s, frame);
+        if (frame->type != APAV_VIDEO) continue;
+        metrics_count(MC_FRAMES_DECODED, 1);
+        if ((err = publish(s, frame->data)) != 0) break;
+    }
+    apcache_frame_free(&frame);
+    apcache_close(apc);
+    apcache_free(&apc);
+    return err == APCACHE_ERR_EOF ? 0 : err;
+}
+
+static void *source_main(void *arg) {
+    Server *s = arg;
+    int err;
+    if (apcache_is_stream_path(s->conf->filename) ||
+        is_apcache(s->conf->filename) == 0) {
+        err = serve_from_cache(s);
+    } else {
+        TranscodeJob job = {
+            .input = s->conf->filename,
+            .width = render_image_width(s->conf),
+            .height = render_image_height(s->conf),
+            .scaler = s->conf->scaler,
+            .no_audio = 1,
+            .sink = transcode_sink,
+            .sink_arg = s,
+        };
+        err = transcode_to_apcache(&job, NULL);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->err = err;
+    s->done = 1;
+    pthread_mutex_unlock(&s->lock);
+    wake_loop(s);
+    return NULL;
+}
+
+static int set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+    return fl < 0 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// Whether addr is a TCP port rather than a Unix socket path.
+static int is_port(const char *addr) {
+    char *end;
+    long port = strtol(addr, &end, 10);
+    return *addr && *end == '\0' && port > 0 && port < 65536;
+}
+
+// Listen on 127.0.0.1:<port> when addr is a number, else on a Unix socket.
+static int serve_listen(const char *addr) {
+    int fd;
+    if (is_port(addr)) {
+        long port = strtol(addr, NULL, 10);
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((uint16_t)port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path)) return -1;
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 16) != 0 || set_nonblock(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send as much as the socket takes, return -1 when the client is gone.
+static int send_some(ServeClient *c, const char *data, size_t len,
+                     size_t *off) {
+    while (*off < len) {
+        ssize_t n = send(c->fd, data + *off, len - *off, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        *off += n;
+        c->last_progress_us = metrics_now_us();
+        metrics_count(MC_TTY_BYTES, n);
+    }
+    return 0;
+}
+
+// Move the client forward: greeting, then the newest frame it has not seen.
+static int client_flush(ServeClient *c, ServeFrame *latest) {
+    if (send_some(c, serve_greeting, sizeof(serve_greeting) - 1,
+                  &c->greeting_off) != 0) {
+        return -1;
+    }
+    if (c->greeting_off < sizeof(serve_greeting) - 1) return 0;
+    for (;;) {
+        if (!c->frame) {
+            if (!latest || latest->seq == c->last_seq) return 0;
+            // Intermediate frames are skipped, every frame is a full screen
+            if (c->last_seq && latest->seq > c->last_seq + 1) {
+                metrics_count(MC_FRAMES_DROPPED, latest->seq - c->last_seq - 1);
+            }
+            frame_ref(latest);
+            c->frame = latest;
+            c->off = 0;
+            c->last_seq = latest->seq;
+        }
+        if (send_some(c, c->frame->data, c->frame->len, &c->off) != 0) {
+            return -1;
+        }
+        if (c->off < c->frame->len) return 0;
+        frame_unref(c->frame);
+        c->frame = NULL;
+    }
+}
+
+static void client_close(ServeClient *c) {
+    size_t off = 0;
+    send_some(c, serve_farewell, sizeof(serve_farewell) - 1, &off);
+    close(c->fd);
+    frame_unref(c->frame);
+    c->frame = NULL;
+}
+
+int run_serve(config *conf) {
+    Server s;
+    memset(&s, 0, sizeof(s));
+    s.conf = conf;
+    s.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    conf->width =
+        conf->target_width > 0 ? conf->target_width : SERVE_DEFAULT_WIDTH;
+    conf->height =
+        conf->target_height > 0 ? conf->target_height : SERVE_DEFAULT_HEIGHT;
+
+    int lfd = serve_listen(conf->serve);
+    if (lfd < 0) {
+        printf("Unable to listen on %s (errno: %d)\n", conf->serve, errno);
+        lerror("Unable to listen on %s (errno: %d)", conf->serve, errno);
+        return -1;
+    }
+    if (pipe(s.wake) != 0 || set_nonblock(s.wake[0]) != 0 ||
+        set_nonblock(s.wake[1]) != 0) {
+        printf("Unable to create serve pipe\n");
+        lerror("Unable to create serve pipe");
+        close(lfd);
+        return -1;
+    }
+    // A client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t th_src;
+    pthread_create(&th_src, NULL, source_main, &s);
+    printf("Serving %s on %s\n", conf->filename, conf->serve);
+    linfo("Serving %s on %s", conf->filename, conf->serve);
+
+    ServeClient clients[SERVE_MAX_CLIENTS];
+    struct pollfd pfds[SERVE_MAX_CLIENTS + 2];
+    int num = 0;
+    for (;;) {
+        pfds[0] = (struct pollfd){.fd = lfd, .events = POLLIN};
+        pfds[1] = (struct pollfd){.fd = s.wake[0], .events = POLLIN};
+        for (int i = 0; i < num; i++) {
+            int pending = clients[i].frame ||
+                          clients[i].greeting_off < sizeof(serve_greeting) - 1;
+            pfds[i + 2] = (struct pollfd){
+                .fd = clients[i].fd,
+                .events = POLLIN | (pending ? POLLOUT : 0)};
+        }
+        poll(pfds, num + 2, SERVE_POLL_MS);
+
+        char drain[256];
+        while (read(s.wake[0], drain, sizeof(drain)) > 0) {
+        }
+        // Input from clients is ignored, a zero read means hang-up
+        for (int i = 0; i < num;) {
+            int gone = 0;
+            if (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = recv(clients[i].fd, drain, sizeof(drain), 0);
+                gone = n == 0 || (n < 0 && errno != EAGAIN &&
+                                  errno != EWOULDBLOCK && errno != EINTR);
+            }
+            if (!gone) {
+                i++;
+                continue;
+            }
+            client_close(&clients[i]);
+            clients[i] = clients[--num];
+            pfds[i + 2] = pfds[num + 2];
+            linfo("Serve client disconnected (%d connected)", num);
+        }
+        if (pfds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                if (num == SERVE_MAX_CLIENTS || set_nonblock(fd) != 0) {
+                    lwarn("Rejecting serve client, %d connected", num);
+                    close(fd);
+                    continue;
+                }
+                memset(&clients[num], 0, sizeof(ServeClient));
+                clients[num].fd = fd;
+                clients[num].last_progress_us = metrics_now_us();
+                num++;
+                linfo("Serve client connected (%d connected)", num);
+            }
+        }
+
+        pthread_mutex_lock(&s.lock);
+        ServeFrame *latest = s.latest;
+        if (latest) frame_ref(latest);
+        int done = s.done;
+        pthread_mutex_unlock(&s.lock);
+
+        uint64_t now = metrics_now_us();
+        int idle = 1;
+        for (int i = 0; i < num;) {
+            ServeClient *c = &clients[i];
+            int gone = client_flush(c, latest) != 0;
+            if (!gone && c->frame &&
+                now - c->last_progress_us > SERVE_STALL_TIMEOUT_U) {
+                lwarn("Dropping stalled serve client");
+                gone = 1;
+            }
+            if (gone) {
+                client_close(c);
+                clients[i] = clients[--num];
+                linfo("Serve client disconnected (%d connected)", num);
+                continue;
+            }
+            if (c->frame || (latest && c->last_seq != latest->seq)) idle = 0;
+            i++;
+        }
+        frame_unref(latest);
+        if (done && idle) break;
+    }
+
+    pthread_join(th_src, NULL);
+    for (int i = 0; i < num; i++) client_close(&clients[i]);
+    frame_unref(s.latest);
+    render_free(s.renderer);
+    close(lfd);
+    close(s.wake[0]);
+    close(s.wake[1]);
+    if (!is_port(conf->serve)) unlink(conf->serve);
+    if (s.err != 0) {
+        printf("Error when serving %s. (code: %d)\n", conf->filename, s.err);
+        lerror("Error when serving %s. (code: %d)", conf->filename, s.err);
+    }
+    return s.err;
+}
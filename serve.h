@@ -0,0 +1,16 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "config.h"
+
+/// @brief Decode conf.filename once and stream it as ANSI text to every
+///        client connected to conf.serve, without a local terminal.
+///        conf.serve is a TCP port (bound to 127.0.0.1) or a Unix socket
+///        path. Each frame is rendered once and shared by all clients,
+///        a client that cannot keep up skips to the newest frame instead
+///        of slowing the others down. Audio is not served.
+/// @param conf Parsed config.
+/// @return 0 for success, minus number for error.
+int run_serve(config *conf);
+
+#endif
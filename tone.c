@@ -0,0 +1,101 @@
+#include "tone.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Share of pixels clipped at each end of the histogram (in 1/1000).
+#define TONE_CLIP_PERMILLE 5
+// Narrowest input range stretched to full scale, so flat frames (fades,
+// black screens) do not turn noise into full contrast.
+#define TONE_MIN_RANGE 48
+// Weight of a new frame in the smoothed end points.
+#define TONE_SMOOTH_ALPHA (1.0f / 8)
+// End point movement (sum of both) treated as a scene cut.
+#define TONE_SCENE_CUT 64
+
+struct ToneState {
+    int normalize;
+    float gamma;
+    // smoothed end points, lo < 0 before the first frame
+    float lo;
+    float hi;
+    // end points the table was built from
+    int lut_lo;
+    int lut_hi;
+    uint8_t lut[256];
+};
+
+static void build_lut(ToneState *t, int lo, int hi) {
+    float range = hi - lo, exp = 1 / t->gamma;
+    for (int v = 0; v < 256; v++) {
+        float x = (v - lo) / range;
+        if (x < 0) x = 0;
+        if (x > 1) x = 1;
+        t->lut[v] = (uint8_t)(powf(x, exp) * 255 + 0.5f);
+    }
+    t->lut_lo = lo;
+    t->lut_hi = hi;
+}
+
+ToneState *tone_alloc(int normalize, float gamma) {
+    ToneState *t = malloc(sizeof(ToneState));
+    if (!t) return NULL;
+    t->normalize = normalize;
+    t->gamma = gamma > 0 ? gamma : 1;
+    t->lo = -1;
+    t->hi = 255;
+    build_lut(t, 0, 255);
+    return t;
+}
+
+int tone_update(ToneState *t, const uint8_t *img, size_t n) {
+    if (!t->normalize || n == 0) return 0;
+
+    // Four partial histograms, so runs of equal pixels do not serialize
+    // on one counter
+    uint32_t hist[4][256] = {0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        hist[0][img[i]]++;
+        hist[1][img[i + 1]]++;
+        hist[2][img[i + 2]]++;
+        hist[3][img[i + 3]]++;
+    }
+    for (; i < n; i++) hist[0][img[i]]++;
+
+    size_t clip = n * TONE_CLIP_PERMILLE / 1000, sum = 0;
+    int lo = 0, hi = 255;
+    for (; lo < 255; lo++) {
+        sum += hist[0][lo] + hist[1][lo] + hist[2][lo] + hist[3][lo];
+        if (sum > clip) break;
+    }
+    for (sum = 0; hi > lo; hi--) {
+        sum += hist[0][hi] + hist[1][hi] + hist[2][hi] + hist[3][hi];
+        if (sum > clip) break;
+    }
+
+    if (t->lo < 0 || fabsf(lo - t->lo) + fabsf(hi - t->hi) > TONE_SCENE_CUT) {
+        t->lo = lo;
+        t->hi = hi;
+    } else {
+        t->lo += TONE_SMOOTH_ALPHA * (lo - t->lo);
+        t->hi += TONE_SMOOTH_ALPHA * (hi - t->hi);
+    }
+
+    int ilo = (int)lrintf(t->lo), ihi = (int)lrintf(t->hi);
+    if (ihi - ilo < TONE_MIN_RANGE) {
+        // Widen around the middle, kept inside 0..255
+        int mid = (ilo + ihi) / 2;
+        ilo = mid - TONE_MIN_RANGE / 2;
+        if (ilo < 0) ilo = 0;
+        if (ilo > 255 - TONE_MIN_RANGE) ilo = 255 - TONE_MIN_RANGE;
+        ihi = ilo + TONE_MIN_RANGE;
+    }
+    if (ilo == t->lut_lo && ihi == t->lut_hi) return 0;
+    build_lut(t, ilo, ihi);
+    return 1;
+}
+
+const uint8_t *tone_lut(const ToneState *t) { return t->lut; }
+
+void tone_free(ToneState *t) { free(t); }
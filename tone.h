@@ -0,0 +1,35 @@
+#ifndef TONE_H
+#define TONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Tone curve applied to greyscale images before they are turned into
+// characters, as a 256-entry lookup table.
+// Normalization stretches the darkest and brightest 0.5% of each frame's
+// histogram to black and white. The end points are smoothed across frames
+// so the brightness does not pump, and follow at once on a scene cut.
+// The curve is rebuilt only when the rounded end points move, so most
+// frames cost one histogram pass.
+typedef struct ToneState ToneState;
+
+/// @brief Allocate a tone curve.
+/// @param normalize as a bool value, stretch contrast from each frame.
+/// @param gamma Gamma of the curve, above 1 brightens dark areas.
+/// @return The pointer to allocated state, NULL for error.
+ToneState *tone_alloc(int normalize, float gamma);
+
+/// @brief Update the curve from the histogram of a frame.
+/// @param t ToneState.
+/// @param img Greyscale image.
+/// @param n Number of pixels of img.
+/// @return 1 when the lookup table changed, 0 otherwise.
+int tone_update(ToneState *t, const uint8_t *img, size_t n);
+
+/// @brief 256-entry lookup table from input to output value.
+const uint8_t *tone_lut(const ToneState *t);
+
+/// @brief Free the tone curve.
+void tone_free(ToneState *t);
+
+#endif
@@ -0,0 +1,277 @@
+#include "transcode.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "apcache.h"
+#include "av.h"
+#include "config.h"
+#include "hash.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "resample.h"
+
+typedef struct {
+    AVFormatContext *fmt_ctxt;
+    AVCodecContext *a_cdc;
+    AVCodecContext *v_cdc;
+    AVPacket *pckt;
+    AVFrame *frame;
+    Scaler *scaler;
+    Resampler *resampler;
+    uint8_t *buf;
+    APCache *apc;
+    // source frame rate, apc->fps truncated
+    AVRational frame_rate;
+    // hash of the last video frame emitted, valid when has_last
+    uint64_t last_hash;
+    int has_last;
+    // ticks the last video frame is repeated for, not emitted yet
+    uint32_t repeats;
+    // NULL for no thumbnail track
+    APCacheThumbs *thumbs;
+    // file offset of the last video frame written
+    uint64_t video_off;
+    // video ticks so far, and between two thumbnails
+    uint64_t ticks;
+    uint64_t thumb_ticks;
+} TranscodeCtx;
+
+static void transcode_ctx_free(TranscodeCtx *t) {
+    av_frame_free(&t->frame);
+    av_packet_free(&t->pckt);
+    avcodec_free_context(&t->a_cdc);
+    avcodec_free_context(&t->v_cdc);
+    avformat_close_input(&t->fmt_ctxt);
+    scaler_free(t->scaler);
+    resampler_free(t->resampler);
+    av_free(t->buf);
+    apcache_thumbs_free(t->thumbs);
+    // An unfinished output is discarded, a finished one was closed already
+    if (t->apc && t->apc->writer) apcache_abort(t->apc);
+    apcache_free(&t->apc);
+}
+
+// Write a frame into the output file or hand it to the sink.
+static int emit_frame(const TranscodeJob *job, TranscodeCtx *t,
+                      const APFrame *apf) {
+    if (job->sink) {
+        return job->sink(job->sink_arg, t->apc, t->frame_rate, apf)
+                   ? TRANSCODE_ERR_WRITE
+                   : 0;
+    }
+    return apcache_write_frame(t->apc, (APFrame *)apf);
+}
+
+// Emit the pending repeat of the last video frame, if any.
+static int flush_repeats(const TranscodeJob *job, TranscodeCtx *t) {
+    if (t->repeats == 0) return 0;
+    APFrame apf;
+    apf.type = APAV_REPEAT;
+    apf.bsize = sizeof(uint32_t);
+    apf.data = &t->repeats;
+    t->repeats = 0;
+    return emit_frame(job, t, &apf);
+}
+
+// Emit a frame, folding video frames identical to the previous one into
+// a repeat record.
+static int emit_dedup(const TranscodeJob *job, TranscodeCtx *t,
+                      const APFrame *apf) {
+    if (apf->type == APAV_VIDEO) {
+        uint64_t hash = hash_xxh64(apf->data, apf->bsize, 0);
+        if (t->has_last && hash == t->last_hash && t->repeats < UINT32_MAX) {
+            t->repeats++;
+            return 0;
+        }
+        t->last_hash = hash;
+        t->has_last = 1;
+    }
+    // Repeats stay in order with audio frames
+    int err = flush_repeats(job, t);
+    if (err != 0) return err;
+    if (apf->type == APAV_VIDEO && !job->sink &&
+        apcache_tell(t->apc, &t->video_off) != 0) {
+        return TRANSCODE_ERR_WRITE;
+    }
+    return emit_frame(job, t, apf);
+}
+
+static int write_video(const TranscodeJob *job, TranscodeCtx *t,
+                       int buf_size) {
+    if (scaler_scale(t->scaler, t->frame, t->buf) != 0) {
+        return TRANSCODE_ERR_DECODE;
+    }
+    APFrame apf;
+    apf.type = APAV_VIDEO;
+    apf.bsize = buf_size;
+    apf.data = t->buf;
+    int err = emit_dedup(job, t, &apf);
+    if (err != 0 || !t->thumbs) return err;
+    // Thumbnail of the frame on screen every thumb_ticks
+    if (t->ticks++ % t->thumb_ticks == 0 &&
+        apcache_thumbs_add(t->thumbs, t->buf, t->video_off) != 0) {
+        return TRANSCODE_ERR_ALLOC;
+    }
+    return 0;
+}
+
+static int write_audio(const TranscodeJob *job, TranscodeCtx *t) {
+    const float *samples;
+    int nb_samples;
+    if (resampler_convert(t->resampler, t->frame, &samples, &nb_samples) !=
+        0) {
+        return TRANSCODE_ERR_RESAMPLE;
+    }
+    APFrame apf;
+    apf.type = APAV_AUDIO;
+    apf.bsize = nb_samples * 2 * sizeof(float);
+    apf.data = (void *)samples;
+    return emit_dedup(job, t, &apf) ? TRANSCODE_ERR_WRITE : 0;
+}
+
+// Send pckt to cdc and write every decoded frame. A NULL pckt drains the
+// frames cdc still holds at the end of the input.
+static int transcode_packet(const TranscodeJob *job, TranscodeCtx *t,
+                            AVCodecContext *cdc, const AVPacket *pckt,
+                            TranscodeStats *stats) {
+    int buf_size =
+        av_image_get_buffer_size(AV_PIX_FMT_GRAY8, job->width, job->height, 1);
+    if (avcodec_send_packet(cdc, pckt) < 0) return TRANSCODE_ERR_DECODE;
+    while (1) {
+        int err = avcodec_receive_frame(cdc, t->frame);
+        if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) return 0;
+        if (err != 0) return TRANSCODE_ERR_DECODE;
+        if (cdc == t->v_cdc) {
+            metrics_count(MC_FRAMES_DECODED, 1);
+            if (write_video(job, t, buf_size) != 0) return TRANSCODE_ERR_WRITE;
+            stats->video_frames++;
+        } else {
+            if ((err = write_audio(job, t)) != 0) return err;
+            stats->audio_frames++;
+        }
+        av_frame_unref(t->frame);
+        if (job->progress) {
+            job->progress(job->progress_arg, stats->video_frames,
+                          stats->audio_frames);
+        }
+    }
+}
+
+static int transcode(const TranscodeJob *job, TranscodeCtx *t,
+                     TranscodeStats *stats) {
+    // find_codec_context reads the input path and may turn no_audio on
+    config conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.filename = (char *)job->input;
+    conf.no_audio = job->no_audio;
+    int a_idx = -1, v_idx = -1;
+    if (find_codec_context(&conf, &t->fmt_ctxt, &t->a_cdc, &t->v_cdc, &a_idx,
+                           &v_idx) != 0) {
+        return TRANSCODE_ERR_OPEN_INPUT;
+    }
+    AVRational framerate = t->fmt_ctxt->streams[v_idx]->avg_frame_rate;
+    if (framerate.num == 0 && conf.no_audio) return TRANSCODE_ERR_UNKNOWN_FPS;
+
+    t->pckt = av_packet_alloc();
+    t->frame = av_frame_alloc();
+    t->buf = av_malloc(av_image_get_buffer_size(AV_PIX_FMT_GRAY8, job->width,
+                                                job->height, 1));
+    t->scaler = scaler_alloc(job->scaler, t->v_cdc->width, t->v_cdc->height,
+                             t->v_cdc->pix_fmt, job->width, job->height);
+    t->apc = apcache_alloc();
+    if (!t->pckt || !t->frame || !t->buf || !t->scaler || !t->apc) {
+        return TRANSCODE_ERR_ALLOC;
+    }
+    // Cache files keep the source rate, so only the sample format and
+    // layout are converted and the resampler filter never runs
+    if (!conf.no_audio) {
+        t->resampler = resampler_alloc(RESAMPLER_SWR, t->a_cdc->sample_fmt,
+                                       t->a_cdc->sample_rate,
+                                       &t->a_cdc->ch_layout,
+                                       t->a_cdc->sample_rate);
+        if (!t->resampler) return TRANSCODE_ERR_ALLOC;
+    }
+
+    t->frame_rate = framerate;
+    t->apc->fps = framerate.den ? (double)framerate.num / framerate.den : 0;
+    t->apc->width = job->width;
+    t->apc->height = job->height;
+    t->apc->sample_rate = conf.no_audio ? 0 : t->a_cdc->sample_rate;
+    // Thumbnails are taken every so many frames, which needs a frame rate
+    if (job->thumb_interval > 0 && !job->sink && t->apc->fps > 0) {
+        t->thumbs = apcache_thumbs_alloc(job->width, job->height,
+                                         job->thumb_interval * 1000);
+        if (!t->thumbs) return TRANSCODE_ERR_ALLOC;
+        t->thumb_ticks = (uint64_t)t->apc->fps * job->thumb_interval;
+        t->apc->flags |= APCACHE_FLAG_THUMBS;
+    }
+    if (job->chunked || job->compress || job->levels > 1) {
+        t->apc->flags |= APCACHE_FLAG_CHUNKED;
+        if (job->compress) t->apc->flags |= APCACHE_FLAG_ZLIB;
+    }
+    if (job->levels > 1) {
+        t->apc->levels = job->levels < APCACHE_LEVELS_MAX ? job->levels
+                                                          : APCACHE_LEVELS_MAX;
+        t->apc->flags |= APCACHE_FLAG_LEVELS;
+    }
+    int err = 0;
+    if (!job->sink) {
+        err = apcache_create_file(t->apc, job->output,
+                                  job->direct_io ? APCACHE_WRITER_DIRECT : 0);
+        if (err != 0) return TRANSCODE_ERR_OPEN_OUTPUT;
+    }
+
+    while (av_read_frame(t->fmt_ctxt, t->pckt) >= 0) {
+        err = 0;
+        if (t->pckt->stream_index == v_idx) {
+            err = transcode_packet(job, t, t->v_cdc, t->pckt, stats);
+        } else if (!conf.no_audio && t->pckt->stream_index == a_idx) {
+            err = transcode_packet(job, t, t->a_cdc, t->pckt, stats);
+        }
+        av_packet_unref(t->pckt);
+        if (err != 0) return err;
+    }
+    // Frames the decoders still hold (reordered or threaded ones)
+    err = transcode_packet(job, t, t->v_cdc, NULL, stats);
+    if (err == 0 && !conf.no_audio) {
+        err = transcode_packet(job, t, t->a_cdc, NULL, stats);
+    }
+    if (err != 0) return err;
+    if (flush_repeats(job, t) != 0) return TRANSCODE_ERR_WRITE;
+    if (job->sink) return 0;
+    if (t->thumbs) {
+        size_t size;
+        const void *track = apcache_thumbs_data(t->thumbs, &size);
+        if (apcache_write_thumbs(t->apc, track, size) != 0)
+            return TRANSCODE_ERR_WRITE;
+    }
+    // Flush, fsync and move the file to its final path
+    return apcache_close(t->apc) == 0 ? 0 : TRANSCODE_ERR_WRITE;
+}
+
+int transcode_to_apcache(const TranscodeJob *job, TranscodeStats *stats) {
+    TranscodeStats local_stats;
+    if (!stats) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+    uint64_t start = metrics_now_us();
+
+    TranscodeCtx t;
+    memset(&t, 0, sizeof(t));
+    int err = transcode(job, &t, stats);
+    transcode_ctx_free(&t);
+
+    if (err != 0) {
+        lerror("Failed to cache %s (code: %d)", job->input, err);
+    } else if (job->output) {
+        struct stat st;
+        if (stat(job->output, &st) == 0) stats->bytes_out = st.st_size;
+    }
+    stats->seconds = (metrics_now_us() - start) / 1e6;
+    return err;
+}
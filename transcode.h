@@ -0,0 +1,88 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <libavutil/avutil.h>
+#include <stdint.h>
+
+#include "apcache.h"
+#include "scale.h"
+
+typedef enum {
+    TRANSCODE_ERR_OPEN_INPUT = -200000,
+    TRANSCODE_ERR_UNKNOWN_FPS,
+    TRANSCODE_ERR_ALLOC,
+    TRANSCODE_ERR_OPEN_OUTPUT,
+    TRANSCODE_ERR_DECODE,
+    TRANSCODE_ERR_RESAMPLE,
+    TRANSCODE_ERR_WRITE,
+} TranscodeErr;
+
+/// @brief Called from the transcoding thread after each written frame.
+/// @param arg TranscodeJob.progress_arg
+/// @param video_frames Number of video frames written so far.
+/// @param audio_frames Number of audio frames written so far.
+typedef void (*TranscodeProgressFn)(void *arg, uint64_t video_frames,
+                                    uint64_t audio_frames);
+
+/// @brief Receives frames instead of an apcache file, called from the
+///        transcoding thread. Identical video frames arrive as APAV_REPEAT
+///        frames, like in the file.
+/// @param arg TranscodeJob.sink_arg
+/// @param meta fps, width, height and sample_rate of the stream.
+/// @param frame_rate Exact frame rate of the source, meta->fps is rounded
+///        down (29.97 fps is 29).
+/// @param frame Frame in apcache layout, only valid during the call.
+/// @return 0 to continue, non-zero to stop transcoding.
+typedef int (*TranscodeSinkFn)(void *arg, const APCache *meta,
+                               AVRational frame_rate, const APFrame *frame);
+
+typedef struct {
+    // Path or URI of the source video
+    const char *input;
+    // Path of the apcache file to be created, NULL when sink is set
+    const char *output;
+    // Size of the stored video frames
+    int width;
+    int height;
+    ScalerMode scaler;
+    // as a bool value, do not store audio frames
+    int no_audio;
+    // as a bool value, write the output bypassing the page cache
+    int direct_io;
+    // seconds between two thumbnails of the thumbnail track, 0 for none
+    int thumb_interval;
+    // as a bool value, store frames in checksummed chunks
+    int chunked;
+    // as a bool value, zlib compress the chunks (implies chunked)
+    int compress;
+    // resolution levels of the video (implies chunked when more than 1)
+    int levels;
+    // NULL for no progress report
+    TranscodeProgressFn progress;
+    void *progress_arg;
+    // NULL for writing into output
+    TranscodeSinkFn sink;
+    void *sink_arg;
+} TranscodeJob;
+
+typedef struct {
+    uint64_t video_frames;
+    uint64_t audio_frames;
+    // Size of the written apcache file (in bytes)
+    uint64_t bytes_out;
+    // Wall-clock time spent (in seconds)
+    double seconds;
+} TranscodeStats;
+
+/// @brief Decode a video and write it into an apcache file (or pass its
+///        frames to job->sink).
+///        Does not touch the terminal and never exits the process,
+///        so several jobs can run in parallel threads.
+///        The output is written to a temporary file and only renamed onto
+///        job->output once complete, nothing is left behind on error.
+/// @param job Job description.
+/// @param stats Filled with statistics of the job (can be NULL).
+/// @return 0 for success, minus number for TranscodeErr or APCacheErr.
+int transcode_to_apcache(const TranscodeJob *job, TranscodeStats *stats);
+
+#endif
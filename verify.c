@@ -0,0 +1,372 @@
+#include "verify.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "apcache.h"
+#include "apcache_chunk.h"
+#include "apcache_thumbs.h"
+#include "hash.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+
+// TYPE and SIZE of a frame
+#define FRAME_HEAD_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+
+typedef struct {
+    uint64_t video;
+    // video frame periods covered by repeat frames
+    uint64_t repeats;
+    uint64_t audio;
+    // stereo samples in audio frames
+    uint64_t samples;
+} FrameCounts;
+
+typedef struct {
+    uint64_t offset;
+    const char *what;
+} Issue;
+
+typedef struct {
+    const APCache *apc;
+    // file offsets of the APAV_CHUNK and APAV_LEVEL_CHUNK frames
+    uint64_t *chunks;
+    size_t chunk_num;
+    size_t chunk_cap;
+    // next chunk to be claimed by a worker
+    atomic_size_t next;
+    uint64_t corrupt_chunks;
+    FrameCounts counts;
+    Issue issues[VERIFY_MAX_ISSUES];
+    uint64_t issue_num;
+    pthread_mutex_t lock;
+} VerifyCtx;
+
+static void add_issue(VerifyCtx *v, uint64_t offset, const char *what) {
+    pthread_mutex_lock(&v->lock);
+    if (v->issue_num < VERIFY_MAX_ISSUES) {
+        v->issues[v->issue_num].offset = offset;
+        v->issues[v->issue_num].what = what;
+    }
+    v->issue_num++;
+    pthread_mutex_unlock(&v->lock);
+}
+
+// Count a frame of the stream, return a description if it is malformed.
+// level is the level of the chunk holding it, -1 outside level chunks. Video
+// and repeats are counted at level 0 only, audio outside level chunks only.
+static const char *count_frame(const APCache *apc, FrameCounts *c, int level,
+                               uint8_t type, const uint8_t *data,
+                               uint32_t bsize) {
+    switch (type) {
+    case APAV_VIDEO: {
+        uint32_t w, h;
+        apcache_level_size(apc->width, apc->height, level > 0 ? level : 0, &w,
+                           &h);
+        if (level <= 0) c->video++;
+        if (bsize != (uint64_t)w * h) return "video frame of unexpected size";
+        return NULL;
+    }
+    case APAV_REPEAT: {
+        if (bsize < sizeof(uint32_t)) return "truncated repeat frame";
+        uint32_t ticks;
+        memcpy(&ticks, data, sizeof(uint32_t));
+        if (level <= 0) c->repeats += ticks;
+        return NULL;
+    }
+    case APAV_AUDIO:
+        // Level chunks only mark where the frames of the audio chunk go
+        if (level >= 0) return bsize ? "audio frame inside a level chunk" : NULL;
+        c->audio++;
+        c->samples += bsize / (2 * sizeof(float));
+        if (apc->sample_rate == 0) return "audio frame in a file without audio";
+        if (bsize % (2 * sizeof(float)) != 0)
+            return "audio frame of unexpected size";
+        return NULL;
+    default:
+        return "unknown frame type";
+    }
+}
+
+// Check the CRC32C of chunks and count their frames until none is left.
+static void *verify_worker(void *arg) {
+    VerifyCtx *v = arg;
+    const APCache *apc = v->apc;
+    FrameCounts counts = {0};
+    uint64_t corrupt = 0;
+    size_t i;
+    while ((i = atomic_fetch_add(&v->next, 1)) < v->chunk_num) {
+        uint64_t off = v->chunks[i];
+        uint32_t bsize;
+        memcpy(&bsize, apc->map + off + 1, sizeof(uint32_t));
+        const uint8_t *chunk = apc->map + off + FRAME_HEAD_SIZE;
+        int level = -1;
+        // A level chunk starts with its level, checked by walk
+        if (apc->map[off] == APAV_LEVEL_CHUNK) {
+            level = chunk[0];
+            chunk++;
+            bsize--;
+        }
+        uint8_t *frames = NULL;
+        size_t size = 0;
+        int err = apcache_chunk_decode(chunk, bsize, &frames, &size);
+        if (err != 0) {
+            corrupt++;
+            add_issue(v, off,
+                      err == -1 ? "chunk checksum mismatch"
+                                : "chunk payload does not decode");
+            continue;
+        }
+        // Frames inside a chunk, counted only once the whole chunk is sound
+        FrameCounts c = {0};
+        const char *what = NULL;
+        size_t pos = 0;
+        while (!what && pos < size) {
+            uint32_t fsize;
+            if (size - pos < FRAME_HEAD_SIZE) {
+                what = "truncated frame inside chunk";
+                break;
+            }
+            memcpy(&fsize, frames + pos + 1, sizeof(uint32_t));
+            if (fsize > size - pos - FRAME_HEAD_SIZE) {
+                what = "truncated frame inside chunk";
+                break;
+            }
+            what = count_frame(apc, &c, level, frames[pos],
+                               frames + pos + FRAME_HEAD_SIZE, fsize);
+            pos += FRAME_HEAD_SIZE + fsize;
+        }
+        free(frames);
+        if (what) {
+            corrupt++;
+            add_issue(v, off, what);
+            continue;
+        }
+        counts.video += c.video;
+        counts.repeats += c.repeats;
+        counts.audio += c.audio;
+        counts.samples += c.samples;
+    }
+    pthread_mutex_lock(&v->lock);
+    v->counts.video += counts.video;
+    v->counts.repeats += counts.repeats;
+    v->counts.audio += counts.audio;
+    v->counts.samples += counts.samples;
+    v->corrupt_chunks += corrupt;
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+static int push_chunk(VerifyCtx *v, uint64_t offset) {
+    if (v->chunk_num == v->chunk_cap) {
+        size_t cap = v->chunk_cap ? v->chunk_cap * 2 : 256;
+        uint64_t *chunks = realloc(v->chunks, cap * sizeof(uint64_t));
+        if (!chunks) return -1;
+        v->chunks = chunks;
+        v->chunk_cap = cap;
+    }
+    v->chunks[v->chunk_num++] = offset;
+    return 0;
+}
+
+// Walk the frame boundaries of the whole file, counting flat frames and
+// collecting chunks. Sets *thumbs to the thumbnails in the track.
+static int walk(VerifyCtx *v, uint32_t *thumbs) {
+    const APCache *apc = v->apc;
+    int chunked = apc->flags & APCACHE_FLAG_CHUNKED;
+    uint64_t thumbs_off = 0;
+    int has_thumbs = 0, has_pos = 0;
+    size_t off = apc->map_pos;
+    while (off < apc->map_size) {
+        uint32_t bsize;
+        if (apc->map_size - off < FRAME_HEAD_SIZE) {
+            add_issue(v, off, "file ends inside a frame head");
+            break;
+        }
+        memcpy(&bsize, apc->map + off + 1, sizeof(uint32_t));
+        if (bsize > apc->map_size - off - FRAME_HEAD_SIZE) {
+            add_issue(v, off, "file ends inside a frame");
+            break;
+        }
+        uint8_t type = apc->map[off];
+        const uint8_t *data = apc->map + off + FRAME_HEAD_SIZE;
+        const char *what = NULL;
+        if (type == APAV_CHUNK) {
+            if (!chunked) what = "chunk in a file without chunks";
+            else if (push_chunk(v, off) != 0) return -2;
+        } else if (type == APAV_LEVEL_CHUNK) {
+            if (!(apc->flags & APCACHE_FLAG_LEVELS))
+                what = "level chunk in a file without levels";
+            else if (bsize == 0 || data[0] >= apc->levels)
+                what = "level chunk of an unknown level";
+            else if (push_chunk(v, off) != 0) return -2;
+        } else if (type == APAV_THUMBS) {
+            APCacheThumbTrack track;
+            if (apcache_thumbs_parse(data, bsize, &track) != 0) {
+                what = "malformed thumbnail track";
+            } else {
+                *thumbs = track.count;
+                thumbs_off = off;
+                has_thumbs = 1;
+            }
+        } else if (type == APAV_THUMBS_POS) {
+            uint64_t pos;
+            has_pos = 1;
+            if (bsize < sizeof(uint64_t)) {
+                what = "truncated thumbnail position";
+            } else {
+                memcpy(&pos, data, sizeof(uint64_t));
+                if (!has_thumbs || pos != thumbs_off)
+                    what = "thumbnail position does not point to the track";
+            }
+        } else if (chunked && type <= APAV_REPEAT) {
+            what = "frame outside a chunk";
+        } else {
+            what = count_frame(apc, &v->counts, -1, type, data, bsize);
+        }
+        if (what) add_issue(v, off, what);
+        off += FRAME_HEAD_SIZE + bsize;
+    }
+    if ((apc->flags & APCACHE_FLAG_THUMBS) && !(has_thumbs && has_pos)) {
+        add_issue(v, apc->map_size, "thumbnail track missing");
+    }
+    return 0;
+}
+
+// Check the chunks on threads, return the number of threads used.
+static int verify_chunks(VerifyCtx *v, int jobs) {
+    if (v->chunk_num == 0) return 0;
+    if (jobs < 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus < 1 ? 1 : (int)cpus;
+    }
+    if ((size_t)jobs > v->chunk_num) jobs = v->chunk_num;
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+    if (threads) {
+        for (; started < jobs; started++) {
+            if (pthread_create(&threads[started], NULL, verify_worker, v) != 0)
+                break;
+        }
+    }
+    // Without any thread, check the chunks here
+    if (started == 0) verify_worker(v);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    return started ? started : 1;
+}
+
+static void format_duration(char *buf, size_t len, double s) {
+    unsigned long long ms = s * 1000 + 0.5;
+    snprintf(buf, len, "%llu:%02u:%02u.%03u", ms / 3600000,
+             (unsigned)(ms / 60000 % 60), (unsigned)(ms / 1000 % 60),
+             (unsigned)(ms % 1000));
+}
+
+static void report(const VerifyCtx *v, uint32_t thumbs, int threads,
+                   uint64_t time_us) {
+    const APCache *apc = v->apc;
+    const FrameCounts *c = &v->counts;
+    char video[32], audio[32];
+    uint64_t ticks = c->video + c->repeats;
+    format_duration(video, sizeof(video),
+                    apc->fps ? (double)ticks / apc->fps : 0);
+    format_duration(audio, sizeof(audio),
+                    apc->sample_rate ? (double)c->samples / apc->sample_rate
+                                     : 0);
+    double mib = apc->map_size / 1048576.0;
+
+    printf("version %d, %ux%u at %u fps, sample rate %u, flags:%s%s%s%s\n",
+           apc->version, apc->width, apc->height, apc->fps, apc->sample_rate,
+           apc->flags & APCACHE_FLAG_CHUNKED ? " chunked" : "",
+           apc->flags & APCACHE_FLAG_ZLIB ? " zlib" : "",
+           apc->flags & APCACHE_FLAG_THUMBS ? " thumbs" : "",
+           apc->flags & APCACHE_FLAG_LEVELS ? " levels" : "");
+    if (apc->flags & APCACHE_FLAG_LEVELS) {
+        printf("levels    %u:", apc->levels);
+        for (uint32_t i = 0; i < apc->levels; i++) {
+            uint32_t w, h;
+            apcache_level_size(apc->width, apc->height, i, &w, &h);
+            printf(" %ux%u", w, h);
+        }
+        printf("\n");
+    }
+    printf("video     %s, %llu frames + %llu repeats\n", video,
+           (unsigned long long)c->video, (unsigned long long)c->repeats);
+    printf("audio     %s, %llu frames\n", audio,
+           (unsigned long long)c->audio);
+    if (apc->flags & APCACHE_FLAG_CHUNKED) {
+        printf("chunks    %zu, %llu corrupt\n", v->chunk_num,
+               (unsigned long long)v->corrupt_chunks);
+    }
+    if (apc->flags & APCACHE_FLAG_THUMBS) printf("thumbs    %u\n", thumbs);
+    printf("checked   %.1f MiB in %.3f s (%.0f MiB/s", mib, time_us / 1e6,
+           time_us ? mib * 1e6 / time_us : 0);
+    if (apc->flags & APCACHE_FLAG_CHUNKED) {
+        printf(", %d threads, %s CRC32C)\n", threads, hash_crc32c_impl());
+    } else {
+        printf(")\n          frames are not checksummed, only their layout is "
+               "checked\n");
+    }
+    for (uint64_t i = 0; i < v->issue_num && i < VERIFY_MAX_ISSUES; i++) {
+        printf("offset %llu: %s\n", (unsigned long long)v->issues[i].offset,
+               v->issues[i].what);
+    }
+    if (v->issue_num > VERIFY_MAX_ISSUES) {
+        printf("... %llu more issues\n",
+               (unsigned long long)(v->issue_num - VERIFY_MAX_ISSUES));
+    }
+    printf("%s\n", v->issue_num ? "CORRUPT" : "OK");
+}
+
+int run_verify(config *conf) {
+    APCache *apc;
+    int err = apcache_open(conf->filename, &apc);
+    if (err != 0) {
+        printf("Unable to open apcache file %s (code: %d)\n", conf->filename,
+               err);
+        lerror("Unable to open apcache file %s (code: %d)", conf->filename,
+               err);
+        return err;
+    }
+    if (!apc->map) {
+        printf("--verify needs a regular apcache file\n");
+        lerror("--verify needs a regular apcache file");
+        apcache_close(apc);
+        apcache_free(&apc);
+        return APCACHE_ERR_NOT_SEEKABLE;
+    }
+
+    VerifyCtx v = {0};
+    v.apc = apc;
+    pthread_mutex_init(&v.lock, NULL);
+    uint32_t thumbs = 0;
+    int threads = 1;
+    uint64_t start = metrics_now_us();
+    // Chunks are read by several threads at once
+    madvise((void *)apc->map, apc->map_size, MADV_WILLNEED);
+    err = walk(&v, &thumbs);
+    if (err == 0) threads = verify_chunks(&v, conf->jobs);
+    uint64_t time_us = metrics_now_us() - start;
+
+    if (err != 0) {
+        printf("Verify failed (code: %d)\n", err);
+        lerror("Verify failed (code: %d)", err);
+    } else {
+        report(&v, thumbs, threads, time_us);
+        linfo("Verify %s: %llu issues, %zu chunks, %llu corrupt",
+              conf->filename, (unsigned long long)v.issue_num, v.chunk_num,
+              (unsigned long long)v.corrupt_chunks);
+        err = v.issue_num ? 1 : 0;
+    }
+    free(v.chunks);
+    pthread_mutex_destroy(&v.lock);
+    apcache_close(apc);
+    apcache_free(&apc);
+    return err;
+}
@@ -0,0 +1,19 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "config.h"
+
+// Issues listed in the report, later ones are only counted.
+#define VERIFY_MAX_ISSUES 16
+
+/// @brief Check the apcache file conf.filename without playing it, and print
+///        its duration, frame counts and any corruption found. Frame
+///        boundaries are checked across the whole file, and the CRC32C of
+///        every chunk of a chunked file is checked on --jobs threads (one
+///        per CPU by default). Never touches ncurses.
+/// @param conf Parsed config.
+/// @return 0 for an intact file, 1 for a corrupt one, minus number for
+///         APCacheErr or -2 for error.
+int run_verify(config *conf);
+
+#endif
@@ -0,0 +1,46 @@
+#include "video_frame.h"
+
+#include <stdlib.h>
+
+VideoFrame *video_frame_alloc(const uint8_t *data, int width, int height,
+                              double pts, VideoFrameRelease release,
+                              void *opaque) {
+    VideoFrame *f = malloc(sizeof(VideoFrame));
+    if (!f) {
+        if (release) release(opaque);
+        return NULL;
+    }
+    f->data = data;
+    f->width = width;
+    f->height = height;
+    f->pts = pts;
+    atomic_init(&f->refs, 1);
+    f->release = release;
+    f->opaque = opaque;
+    return f;
+}
+
+static void release_buffer(void *opaque) {
+    AVBufferRef *buf = opaque;
+    av_buffer_unref(&buf);
+}
+
+VideoFrame *video_frame_from_buffer(AVBufferRef *buf, int width, int height,
+                                    double pts) {
+    return video_frame_alloc(buf->data, width, height, pts, release_buffer,
+                             buf);
+}
+
+VideoFrame *video_frame_ref(VideoFrame *f) {
+    atomic_fetch_add(&f->refs, 1);
+    return f;
+}
+
+void video_frame_unref(VideoFrame **f) {
+    if (!*f) return;
+    if (atomic_fetch_sub(&(*f)->refs, 1) == 1) {
+        if ((*f)->release) (*f)->release((*f)->opaque);
+        free(*f);
+    }
+    *f = NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef VIDEO_FRAME_H
+#define VIDEO_FRAME_H
+
+#include <libavutil/buffer.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Called with the opaque of a frame once its last reference is dropped.
+typedef void (*VideoFrameRelease)(void *opaque);
+
+// A refcounted greyscale image passed through the video channel.
+// The handle owns its pixels through the release callback, so the stage
+// that drops the last reference frees them the way they were allocated
+// (av_buffer_unref for AVBufferRef and pool buffers, free for apcache
+// frames, nothing for frames borrowed from a mapped file) without knowing
+// where they came from. A NULL handle in the channel stays a repeat tick.
+typedef struct {
+    const uint8_t *data;
+    int width;
+    int height;
+    // presentation time in seconds, -1 for unknown
+    double pts;
+    atomic_int refs;
+    // NULL when the pixels are not owned
+    VideoFrameRelease release;
+    void *opaque;
+} VideoFrame;
+
+/// @brief Wrap pixels in a frame holding one reference.
+/// @param data Pixels, width x height bytes.
+/// @param width Image width.
+/// @param height Image height.
+/// @param pts Presentation time in seconds, -1 for unknown.
+/// @param release Called with opaque when the last reference is dropped,
+///        also on error, NULL for none.
+/// @param opaque Argument of release.
+/// @return The pointer to allocated frame, NULL for error.
+VideoFrame *video_frame_alloc(const uint8_t *data, int width, int height,
+                              double pts, VideoFrameRelease release,
+                              void *opaque);
+
+/// @brief Wrap an AVBufferRef (or a buffer of an AVBufferPool), without
+///        copying.
+/// @param buf Buffer, its reference is taken over, also on error.
+/// @param width Image width.
+/// @param height Image height.
+/// @param pts Presentation time in seconds, -1 for unknown.
+/// @return The pointer to allocated frame, NULL for error.
+VideoFrame *video_frame_from_buffer(AVBufferRef *buf, int width, int height,
+                                    double pts);
+
+/// @brief Add a reference.
+/// @return f.
+VideoFrame *video_frame_ref(VideoFrame *f);
+
+/// @brief Drop a reference, releasing the pixels and the frame with the
+///        last one, and set *f to NULL.
+/// @param f Pointer to the frame, may point to NULL.
+void video_frame_unref(VideoFrame **f);
+
+#endif